@@ -0,0 +1,619 @@
+/* Lama SM Bytecode files: reading, accessors and disassembling */
+
+# include "byterun.h"
+
+/* Gets a string from a string table by an index */
+char* get_string (bytefile *f, int pos) {
+  return &f->string_ptr[pos];
+}
+
+/* Gets a name for a public symbol */
+char* get_public_name (bytefile *f, int i) {
+  return get_string (f, f->public_ptr[i*2]);
+}
+
+/* Gets an offset for a publie symbol */
+int get_public_offset (bytefile *f, int i) {
+  return f->public_ptr[i*2+1];
+}
+
+/* Finds an offset of a public symbol by name; returns -1 if not found */
+int find_public (bytefile *f, char *name) {
+  for (int i = 0; i < f->public_symbols_number; i++)
+    if (strcmp (get_public_name (f, i), name) == 0) return get_public_offset (f, i);
+
+  return -1;
+}
+
+/* Gets a name, an index and flags of a global symbol */
+char* get_global_name  (bytefile *f, int i) { return get_string (f, f->global_ptr[i*3]); }
+int   get_global_index (bytefile *f, int i) { return f->global_ptr[i*3+1]; }
+int   get_global_flags (bytefile *f, int i) { return f->global_ptr[i*3+2]; }
+
+/* Gets a name, a code range, an offset of the initialization function,
+   a checksum of the code and the beginnings of the constants, the global
+   map and the line table of a unit */
+char* get_unit_name      (bytefile *f, int u) { return get_string (f, f->unit_ptr[u*UNIT_FIELDS]); }
+int   get_unit_begin     (bytefile *f, int u) { return f->unit_ptr[u*UNIT_FIELDS+1]; }
+int   get_unit_end       (bytefile *f, int u) { return f->unit_ptr[u*UNIT_FIELDS+2]; }
+int   get_unit_init      (bytefile *f, int u) { return f->unit_ptr[u*UNIT_FIELDS+3]; }
+int   get_unit_checksum  (bytefile *f, int u) { return f->unit_ptr[u*UNIT_FIELDS+4]; }
+int   get_unit_constants (bytefile *f, int u) { return f->unit_ptr[u*UNIT_FIELDS+5]; }
+int   get_unit_globals   (bytefile *f, int u) { return f->unit_ptr[u*UNIT_FIELDS+6]; }
+int   get_unit_lines     (bytefile *f, int u) { return f->unit_ptr[u*UNIT_FIELDS+7]; }
+
+/* Gets the end of the part of a section (given by a units table field and
+   the size of the section) which belongs to a unit */
+static int unit_part_end (bytefile *f, int u, int field, int size) {
+  return u == f->units_number - 1 ? size : f->unit_ptr[(u+1)*UNIT_FIELDS+field];
+}
+
+/* Gets the numbers of constants and global map entries of a unit */
+int count_unit_constants (bytefile *f, int u) { return unit_part_end (f, u, 5, f->constants_number) - get_unit_constants (f, u); }
+int count_unit_globals   (bytefile *f, int u) { return unit_part_end (f, u, 6, f->global_map_size) - get_unit_globals (f, u); }
+
+/* Gets a string constant of a unit by its index */
+char* get_constant (bytefile *f, int u, int i) {
+  return get_string (f, f->constant_ptr[get_unit_constants (f, u) + i]);
+}
+
+/* Gets a global area index of a global variable of a unit */
+int get_global (bytefile *f, int u, int i) {
+  return f->global_map_ptr[get_unit_globals (f, u) + i];
+}
+
+/* Finds the unit containing a code offset */
+int unit_of (bytefile *f, int pc) {
+  int u = 0;
+  
+  while (u < f->units_number - 1 && pc >= get_unit_end (f, u)) u++;
+
+  return u;
+}
+
+/* Reads a LEB128-encoded number (signed if sign is nonzero) at *ip not
+   reaching end, and advances *ip; returns 0 if the number is truncated or
+   longer than 5 bytes */
+int read_leb128 (char **ip, char *end, int sign, int *x) {
+  unsigned int  r = 0, s = 0;
+  unsigned char b;
+
+  do {
+    if (*ip >= end || s > 28) return 0;
+    b  = *(*ip)++;
+    r |= (unsigned int) (b & 0x7F) << s;
+    s += 7;
+  }
+  while (b & 0x80);
+
+  if (sign && s < 32 && (b & 0x40)) r |= ~0u << s;
+  *x = (int) r;
+
+  return 1;
+}
+
+/* A position in the line table of a unit: the rest of the table and the
+   current entry */
+typedef struct {
+  char *p, *end;
+  int   offset, line;
+} line_cursor;
+
+/* Starts reading the line table of a unit */
+static void line_start (line_cursor *c, bytefile *f, int u) {
+  c->p      = f->line_ptr + get_unit_lines (f, u);
+  c->end    = f->line_ptr + unit_part_end (f, u, 7, f->lines_size);
+  c->offset = get_unit_begin (f, u);
+  c->line   = 0;
+}
+
+/* Reads the next entry; returns 0 at the end of the table */
+static int line_next (line_cursor *c) {
+  int d, e;
+
+  if (!read_leb128 (&c->p, c->end, 0, &d) || !read_leb128 (&c->p, c->end, 1, &e)) return 0;
+
+  c->offset += d;
+  c->line   += e;
+
+  return 1;
+}
+
+/* Finds the first line of a code range [pc, limit) of a unit; returns 0 if
+   there is none */
+int find_line (bytefile *f, int u, int pc, int limit) {
+  line_cursor c;
+
+  line_start (&c, f, u);
+  
+  while (line_next (&c) && c.offset < limit)
+    if (c.offset >= pc) return c.line;
+
+  return 0;
+}
+
+/* Computes Adler-32 checksum */
+unsigned int adler32 (unsigned char *p, size_t n) {
+  unsigned int a = 1, b = 0;
+
+  while (n > 0) {
+    size_t k = n < 5552 ? n : 5552;
+
+    n -= k;
+    while (k--) {
+      a += *p++;
+      b += a;
+    }
+    a %= 65521;
+    b %= 65521;
+  }
+
+  return (b << 16) | a;
+}
+
+/* Checks that a section [offset, offset+size) lies within a file of a given size */
+static int in_file (int offset, int size, size_t file_size) {
+  return offset >= 0 && size >= 0 && (size_t) offset <= file_size && (size_t) size <= file_size - offset;
+}
+
+/* Maps a binary bytecode file by name, validates its header and unpacks it */
+bytefile* read_file (char *fname) {
+  int              fd = open (fname, O_RDONLY);
+  struct stat      st;
+  char            *m;
+  bytefile_header *h;
+  bytefile        *file;
+  int              i;
+
+  if (fd == -1 || fstat (fd, &st) == -1) {
+    failure ("%s\n", strerror (errno));
+  }
+
+  if (st.st_size < sizeof (bytefile_header)) {
+    failure ("%s: not a bytecode file\n", fname);
+  }
+  
+  if ((m = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+    failure ("%s\n", strerror (errno));
+  }
+
+  close (fd);
+
+  h = (bytefile_header*) m;
+
+  if (h->magic != BYTEFILE_MAGIC) {
+    failure ("%s: not a bytecode file\n", fname);
+  }
+
+  if (h->version != BYTEFILE_VERSION) {
+    failure ("%s: unsupported bytecode version %d (expected %d)\n", fname, h->version, BYTEFILE_VERSION);
+  }
+
+  if (h->global_area_size < 0 ||
+      h->public_symbols_number < 0 ||
+      h->public_symbols_number > (st.st_size >> 3) ||
+      h->global_symbols_number < 0 ||
+      h->global_symbols_number > st.st_size / 12 ||
+      h->units_number < 1 ||
+      h->units_number > st.st_size / (UNIT_FIELDS * sizeof (int)) ||
+      h->constants_number < 0 ||
+      h->constants_number > (st.st_size >> 2) ||
+      h->global_map_size < 0 ||
+      h->global_map_size > (st.st_size >> 2) ||
+      h->code_offset < sizeof (bytefile_header) ||
+      !in_file (h->code_offset, h->code_size, st.st_size) ||
+      h->code_offset + h->code_size != st.st_size ||
+      !in_file (h->public_offset, h->public_symbols_number * 2 * sizeof (int), h->code_offset) ||
+      !in_file (h->global_symbols_offset, h->global_symbols_number * 3 * sizeof (int), h->code_offset) ||
+      !in_file (h->units_offset, h->units_number * UNIT_FIELDS * sizeof (int), h->code_offset) ||
+      !in_file (h->constants_offset, h->constants_number * sizeof (int), h->code_offset) ||
+      !in_file (h->global_map_offset, h->global_map_size * sizeof (int), h->code_offset) ||
+      !in_file (h->lines_offset, h->lines_size, h->code_offset) ||
+      ((h->public_offset | h->global_symbols_offset | h->units_offset | h->constants_offset | h->global_map_offset) & 3) ||
+      !in_file (h->stringtab_offset, h->stringtab_size, h->code_offset) ||
+      (h->stringtab_size > 0 && m[h->stringtab_offset + h->stringtab_size - 1] != 0)) {
+    failure ("%s: malformed bytecode file header\n", fname);
+  }
+
+  if (adler32 ((unsigned char*) m + sizeof (bytefile_header), h->code_offset - sizeof (bytefile_header)) != (unsigned int) h->checksum) {
+    failure ("%s: checksum mismatch\n", fname);
+  }
+  
+  if ((file = (bytefile*) malloc (sizeof (bytefile))) == NULL) {
+    failure ("*** FAILURE: unable to allocate memory.\n");
+  }
+
+  file->string_ptr            = m + h->stringtab_offset;
+  file->public_ptr            = (int*) (m + h->public_offset);
+  file->global_ptr            = (int*) (m + h->global_symbols_offset);
+  file->unit_ptr              = (int*) (m + h->units_offset);
+  file->constant_ptr          = (int*) (m + h->constants_offset);
+  file->global_map_ptr        = (int*) (m + h->global_map_offset);
+  file->line_ptr              = m + h->lines_offset;
+  file->code_ptr              = m + h->code_offset;
+  file->code_size             = h->code_size;
+  file->stringtab_size        = h->stringtab_size;
+  file->global_area_size      = h->global_area_size;
+  file->public_symbols_number = h->public_symbols_number;
+  file->global_symbols_number = h->global_symbols_number;
+  file->units_number          = h->units_number;
+  file->constants_number      = h->constants_number;
+  file->global_map_size       = h->global_map_size;
+  file->lines_size            = h->lines_size;
+  file->stack_needs           = NULL;
+
+  /* The tables refer to the strings, the code and the global area; the
+     units cover the code and divide the constants, the global map and the
+     line table */
+# define IN(x, n) ((x) >= 0 && (x) < (n))
+  
+  for (i = 0; i < file->public_symbols_number; i++)
+    if (!IN (file->public_ptr[i*2], file->stringtab_size) || !IN (get_public_offset (file, i), file->code_size)) {
+      failure ("%s: malformed public symbols table\n", fname);
+    }
+
+  for (i = 0; i < file->global_symbols_number; i++)
+    if (!IN (file->global_ptr[i*3], file->stringtab_size) || !IN (get_global_index (file, i), file->global_area_size)) {
+      failure ("%s: malformed global symbols table\n", fname);
+    }
+
+  for (i = 0; i < file->constants_number; i++)
+    if (!IN (file->constant_ptr[i], file->stringtab_size)) {
+      failure ("%s: malformed constant pool\n", fname);
+    }
+
+  for (i = 0; i < file->global_map_size; i++)
+    if (!IN (file->global_map_ptr[i], file->global_area_size)) {
+      failure ("%s: malformed global map\n", fname);
+    }
+
+  for (i = 0; i < file->units_number; i++) {
+    int b = get_unit_begin (file, i), e = get_unit_end (file, i), init = get_unit_init (file, i);
+    
+    if (!IN (file->unit_ptr[i*UNIT_FIELDS], file->stringtab_size) ||
+        b != (i == 0 ? 0 : get_unit_end (file, i-1)) ||
+        b >= e ||
+        (i == file->units_number - 1 && e != file->code_size) ||
+        (init != -1 && (init < b || init >= e)) ||
+        (i == 0 && (get_unit_constants (file, i) | get_unit_globals (file, i) | get_unit_lines (file, i)) != 0) ||
+        count_unit_constants (file, i) < 0 ||
+        count_unit_globals (file, i) < 0 ||
+        unit_part_end (file, i, 7, file->lines_size) < get_unit_lines (file, i)) {
+      failure ("%s: malformed units table\n", fname);
+    }
+  }
+  
+# undef IN
+  
+  return file;
+}
+
+/* Disassembles the bytecode pool */
+void disassemble (FILE *f, bytefile *bf) {
+  char        *ip     = bf->code_ptr;
+  char        *ops [] = {"+", "-", "*", "/", "%", "<", "<=", ">", ">=", "==", "!=", "&&", "!!"};
+  char        *pats[] = {"=str", "#string", "#array", "#sexp", "#ref", "#val", "#fun"};
+  char        *lds [] = {"LD", "LDA", "ST"};
+  int          u      = 0, line;
+  line_cursor  lc;
+
+  line_start (&lc, bf, u);
+  line = line_next (&lc);
+  
+  do {
+    int  pc = ip - bf->code_ptr;
+    char x  = BYTE,
+         h  = (x & 0xF0) >> 4,
+         l  = x & 0x0F;
+
+    if (pc >= get_unit_end (bf, u) && u < bf->units_number - 1) {
+      line_start (&lc, bf, ++u);
+      line = line_next (&lc);
+    }
+
+    for (; line && lc.offset <= pc; line = line_next (&lc))
+      fprintf (f, "0x%.8x:\tLINE\t%d\n", lc.offset, lc.line);
+    
+    fprintf (f, "0x%.8x:\t", pc);
+    
+    switch (h) {
+    case 15:
+      if (ip == bf->code_ptr + bf->code_size) goto stop;
+      fprintf (f, "<end>");
+      break;
+      
+    /* BINOP */
+    case 0:
+      fprintf (f, "BINOP\t%s", ops[l-1]);
+      break;
+      
+    case 1:
+      switch (l) {
+      case  0:
+        fprintf (f, "CONST\t%d", SINT);
+        break;
+        
+      case  1:
+        fprintf (f, "STRING\t%s", STRING);
+        break;
+          
+      case  2:
+        fprintf (f, "SEXP\t%s ", STRING);
+        fprintf (f, "%d", UINT);
+        break;
+        
+      case  3:
+        fprintf (f, "STI");
+        break;
+        
+      case  4:
+        fprintf (f, "STA");
+        break;
+        
+      case  5:
+        fprintf (f, "JMP\t0x%.8x", INT);
+        break;
+        
+      case  6:
+        fprintf (f, "END");
+        break;
+        
+      case  7:
+        fprintf (f, "RET");
+        break;
+        
+      case  8:
+        fprintf (f, "DROP");
+        break;
+        
+      case  9:
+        fprintf (f, "DUP");
+        break;
+        
+      case 10:
+        fprintf (f, "SWAP");
+        break;
+
+      case 11:
+        fprintf (f, "ELEM");
+        break;
+        
+      default:
+        FAIL;
+      }
+      break;
+      
+    case 2:
+    case 3:
+    case 4:
+      fprintf (f, "%s\t", lds[h-2]);
+      switch (l) {
+      case 0: fprintf (f, "G(%d)", get_global (bf, u, UINT)); break;
+      case 1: fprintf (f, "L(%d)", UINT); break;
+      case 2: fprintf (f, "A(%d)", UINT); break;
+      case 3: fprintf (f, "C(%d)", UINT); break;
+      default: FAIL;
+      }
+      break;
+      
+    case 5:
+      switch (l) {
+      case  0:
+        fprintf (f, "CJMPz\t0x%.8x", INT);
+        break;
+        
+      case  1:
+        fprintf (f, "CJMPnz\t0x%.8x", INT);
+        break;
+        
+      case  2:
+        fprintf (f, "BEGIN\t%d ", UINT);
+        fprintf (f, "%d", UINT);
+        break;
+        
+      case  3:
+        fprintf (f, "CBEGIN\t%d ", UINT);
+        fprintf (f, "%d", UINT);
+        break;
+        
+      case  4:
+        fprintf (f, "CLOSURE\t0x%.8x", INT);
+        {int n = UINT;
+         for (int i = 0; i<n; i++) {
+         int d = UINT;
+         switch (d & 3) {
+           case 0: fprintf (f, "G(%d)", get_global (bf, u, d >> 2)); break;
+           case 1: fprintf (f, "L(%d)", d >> 2); break;
+           case 2: fprintf (f, "A(%d)", d >> 2); break;
+           case 3: fprintf (f, "C(%d)", d >> 2); break;
+         }
+         }
+        };
+        break;
+          
+      case  5:
+        fprintf (f, "CALLC\t%d", UINT);
+        break;
+        
+      case  6:
+        fprintf (f, "CALL\t0x%.8x ", INT);
+        fprintf (f, "%d", UINT);
+        break;
+        
+      case  7:
+        fprintf (f, "TAG\t%s ", STRING);
+        fprintf (f, "%d", UINT);
+        break;
+        
+      case  8:
+        fprintf (f, "ARRAY\t%d", UINT);
+        break;
+        
+      case  9:
+        fprintf (f, "FAIL\t%d ", UINT);
+        fprintf (f, "%d", UINT);
+        break;
+        
+      default:
+        FAIL;
+      }
+      break;
+      
+    case 6:
+      fprintf (f, "PATT\t%s", pats[l]);
+      break;
+
+    case 7: {
+      switch (l) {
+      case 0:
+        fprintf (f, "CALL\tLread");
+        break;
+        
+      case 1:
+        fprintf (f, "CALL\tLwrite");
+        break;
+
+      case 2:
+        fprintf (f, "CALL\tLlength");
+        break;
+
+      case 3:
+        fprintf (f, "CALL\tLstring");
+        break;
+
+      case 4:
+        fprintf (f, "CALL\tBarray\t%d", UINT);
+        break;
+
+      case 5:
+        fprintf (f, "CALL\t%s ", STRING);
+        fprintf (f, "%d", UINT);
+        break;
+
+      case 6:
+        fprintf (f, "CLOSURE\t%s", STRING);
+        break;
+
+      default:
+        FAIL;
+      }
+    }
+    break;
+
+    /* Superinstructions */
+    case 8: {
+# define DESIGNATION                                            \
+      {int d = UINT;                                            \
+       switch (d & 3) {                                         \
+       case 0: fprintf (f, "G(%d)", get_global (bf, u, d >> 2)); break; \
+       case 1: fprintf (f, "L(%d)", d >> 2); break;             \
+       case 2: fprintf (f, "A(%d)", d >> 2); break;             \
+       case 3: fprintf (f, "C(%d)", d >> 2); break;             \
+       }}
+      
+      switch (l) {
+      case 0:
+        fprintf (f, "DUP; TAG\t%s ", STRING);
+        fprintf (f, "%d; ", UINT);
+        fprintf (f, "CJMPnz\t0x%.8x", INT);
+        break;
+        
+      case 1:
+        fprintf (f, "DUP; ARRAY\t%d; ", UINT);
+        fprintf (f, "CJMPnz\t0x%.8x", INT);
+        break;
+        
+      case 2:
+        fprintf (f, "DUP; CONST\t%d; ELEM", SINT);
+        break;
+        
+      case 3:
+        fprintf (f, "DROP; JMP\t0x%.8x", INT);
+        break;
+
+      case 4: {
+        char *op = ops[BYTE-1];
+        
+        fprintf (f, "LD\t");
+        DESIGNATION;
+        fprintf (f, "; CONST\t%d; BINOP\t%s", SINT, op);
+        break;
+      }
+        
+      case 5: {
+        char *op = ops[BYTE-1];
+        
+        fprintf (f, "LD\t");
+        DESIGNATION;
+        fprintf (f, "; LD\t");
+        DESIGNATION;
+        fprintf (f, "; BINOP\t%s", op);
+        break;
+      }
+        
+      case 6:
+        fprintf (f, "BINOP\t%s; ", ops[BYTE-1]);
+        fprintf (f, "CJMPz\t0x%.8x", INT);
+        break;
+        
+      default:
+        FAIL;
+      }
+# undef DESIGNATION
+    }
+    break;
+
+    case 9:
+      fprintf (f, "ST\t");
+      switch (l) {
+      case 0: fprintf (f, "G(%d)", get_global (bf, u, UINT)); break;
+      case 1: fprintf (f, "L(%d)", UINT); break;
+      case 2: fprintf (f, "A(%d)", UINT); break;
+      case 3: fprintf (f, "C(%d)", UINT); break;
+      default: FAIL;
+      }
+      fprintf (f, "; DROP");
+      break;
+      
+    default:
+      FAIL;
+    }
+
+    fprintf (f, "\n");
+  }
+  while (1);
+ stop: fprintf (f, "<end>\n");
+}
+
+/* Dumps the contents of the file */
+void dump_file (FILE *f, bytefile *bf) {
+  int i;
+  
+  fprintf (f, "String table size       : %d\n", bf->stringtab_size);
+  fprintf (f, "Code size               : %d\n", bf->code_size);
+  fprintf (f, "Constant pool size      : %d\n", bf->constants_number);
+  fprintf (f, "Global map size         : %d\n", bf->global_map_size);
+  fprintf (f, "Line table size         : %d\n", bf->lines_size);
+  fprintf (f, "Global area size        : %d\n", bf->global_area_size);
+  fprintf (f, "Number of public symbols: %d\n", bf->public_symbols_number);
+  fprintf (f, "Public symbols          :\n");
+
+  for (i=0; i < bf->public_symbols_number; i++) 
+    fprintf (f, "   0x%.8x: %s\n", get_public_offset (bf, i), get_public_name (bf, i));
+
+  fprintf (f, "Global symbols          :\n");
+
+  for (i=0; i < bf->global_symbols_number; i++)
+    fprintf (f, "   G(%d): %s%s%s\n", get_global_index (bf, i), get_global_name (bf, i),
+             get_global_flags (bf, i) & GLOBAL_PUBLIC ? " public" : "",
+             get_global_flags (bf, i) & GLOBAL_EXTERN ? " extern" : "");
+
+  fprintf (f, "Units                   :\n");
+
+  for (i=0; i < bf->units_number; i++)
+    fprintf (f, "   0x%.8x-0x%.8x: %s (init 0x%.8x)\n",
+             get_unit_begin (bf, i), get_unit_end (bf, i), get_unit_name (bf, i), get_unit_init (bf, i));
+  
+  fprintf (f, "Code:\n");
+  disassemble (f, bf);
+}
@@ -1,301 +1,1131 @@
 /* Lama SM Bytecode interpreter */
 
-# include <string.h>
-# include <stdio.h>
-# include <errno.h>
-# include <malloc.h>
-# include "../runtime/runtime.h"
+# include "byterun.h"
 
 void *__start_custom_data;
 void *__stop_custom_data;
 
-/* The unpacked representation of bytecode file */
+/* The number of executed instructions, when counted */
+static long long dispatches = 0;
+
+/* Profiling. The opcodes (the first bytes of instructions, including the
+   superinstructions) and pairs of adjacent opcodes are counted; for each
+   function (a BEGIN) the calls and the inclusive and self cycles are
+   counted. The cycles are also accumulated in a tree of the call stacks
+   which is dumped in the "collapsed stacks" format of flamegraph tools */
 typedef struct {
-  char *string_ptr;              /* A pointer to the beginning of the string table */
-  int  *public_ptr;              /* A pointer to the beginning of publics table    */
-  char *code_ptr;                /* A pointer to the bytecode itself               */
-  int  *global_ptr;              /* A pointer to the global area                   */
-  int   stringtab_size;          /* The size (in bytes) of the string table        */
-  int   global_area_size;        /* The size (in words) of global area             */
-  int   public_symbols_number;   /* The number of public symbols                   */
-  char  buffer[0];               
-} bytefile;
-
-/* Gets a string from a string table by an index */
-char* get_string (bytefile *f, int pos) {
-  return &f->string_ptr[pos];
+  char              *name;      /* public name, or NULL              */
+  int                offset;    /* the offset of the BEGIN           */
+  int                line;      /* the first line of the body, or 0  */
+  long long          calls;     /* the number of calls               */
+  unsigned long long inclusive; /* the inclusive cycles              */
+  unsigned long long self;      /* the self cycles                   */
+  unsigned long long start;     /* the start of the outermost call   */
+  int                active;    /* the number of active calls        */
+} prof_fun;
+
+typedef struct prof_node {
+  int                fun;       /* the function, or -1 for the root  */
+  unsigned long long cycles;    /* the self cycles in this stack     */
+  struct prof_node  *parent, *child, *sibling;
+} prof_node;
+
+static prof_fun           *prof_funs   = NULL;
+static int                 prof_nfuns  = 0;
+static long long           prof_insns [256];
+static long long           prof_pairs [256][256];
+static int                 prof_prev   = 0xFF;
+static unsigned long long  prof_last   = 0;
+static prof_node           prof_root   = {-1, 0, NULL, NULL, NULL};
+static prof_node          *prof_top    = &prof_root;
+
+/* Reads the time stamp counter */
+static inline unsigned long long cycles (void) {
+  unsigned int lo, hi;
+  
+  asm volatile ("rdtsc" : "=a" (lo), "=d" (hi));
+  
+  return ((unsigned long long) hi << 32) | lo;
 }
 
-/* Gets a name for a public symbol */
-char* get_public_name (bytefile *f, int i) {
-  return get_string (f, f->public_ptr[i*2]);
+/* Attributes the cycles elapsed since the last call to the top stack */
+static inline unsigned long long prof_account (void) {
+  unsigned long long now = cycles ();
+
+  prof_top->cycles += now - prof_last;
+  if (prof_top->fun >= 0) prof_funs[prof_top->fun].self += now - prof_last;
+  prof_last = now;
+
+  return now;
 }
 
-/* Gets an offset for a publie symbol */
-int get_public_offset (bytefile *f, int i) {
-  return f->public_ptr[i*2+1];
+void prof_enter (int f) {
+  unsigned long long now = prof_account ();
+  prof_node *n;
+
+  for (n = prof_top->child; n && n->fun != f; n = n->sibling);
+
+  if (n == NULL) {
+    if ((n = (prof_node*) malloc (sizeof (prof_node))) == NULL) {
+      failure ("*** FAILURE: unable to allocate memory.\n");
+    }
+    
+    n->fun     = f;
+    n->cycles  = 0;
+    n->parent  = prof_top;
+    n->child   = NULL;
+    n->sibling = prof_top->child;
+    prof_top->child = n;
+  }
+
+  prof_top = n;
+  prof_funs[f].calls++;
+  if (prof_funs[f].active++ == 0) prof_funs[f].start = now;
 }
 
-/* Reads a binary bytecode file by name and unpacks it */
-bytefile* read_file (char *fname) {
-  FILE *f = fopen (fname, "rb");
-  long size;
-  bytefile *file;
+void prof_leave (void) {
+  unsigned long long now = prof_account ();
+  prof_fun *f = &prof_funs[prof_top->fun];
 
-  if (f == 0) {
-    failure ("%s\n", strerror (errno));
+  if (--f->active == 0) f->inclusive += now - f->start;
+  prof_top = prof_top->parent;
+}
+
+/* Gets the name of an opcode */
+char* opcode_name (int x) {
+  static char  buf[256][24];
+  static char *ops [] = {"+", "-", "*", "/", "%", "<", "<=", ">", ">=", "==", "!=", "&&", "!!"};
+  static char *pats[] = {"=str", "#string", "#array", "#sexp", "#ref", "#val", "#fun"};
+  static char *ds  [] = {"G", "L", "A", "C"};
+  static char *g1  [] = {"CONST", "STRING", "SEXP", "STI", "STA", "JMP", "END", "RET", "DROP", "DUP", "SWAP", "ELEM"};
+  static char *g5  [] = {"CJMPz", "CJMPnz", "BEGIN", "CBEGIN", "CLOSURE", "CALLC", "CALL", "TAG", "ARRAY", "FAIL", "LINE"};
+  static char *g7  [] = {"CALL Lread", "CALL Lwrite", "CALL Llength", "CALL Lstring", "CALL Barray", "CALL extern", "CLOSURE extern"};
+  static char *g8  [] = {"DUP; TAG; CJMPnz", "DUP; ARRAY; CJMPnz", "DUP; CONST; ELEM", "DROP; JMP",
+                         "LD; CONST; BINOP", "LD; LD; BINOP", "BINOP; CJMPz"};
+  int   h = (x & 0xF0) >> 4, l = x & 0x0F;
+  char *b = buf[x & 0xFF];
+
+  switch (h) {
+  case 0:  if (l >= 1 && l <= 13) sprintf (b, "BINOP %s", ops[l-1]); else sprintf (b, "?"); break;
+  case 1:  sprintf (b, "%s", l < 12 ? g1[l] : "?"); break;
+  case 2:  sprintf (b, "LD %s", l < 4 ? ds[l] : "?"); break;
+  case 3:  sprintf (b, "LDA %s", l < 4 ? ds[l] : "?"); break;
+  case 4:  sprintf (b, "ST %s", l < 4 ? ds[l] : "?"); break;
+  case 5:  sprintf (b, "%s", l < 11 ? g5[l] : "?"); break;
+  case 6:  sprintf (b, "PATT %s", l < 7 ? pats[l] : "?"); break;
+  case 7:  sprintf (b, "%s", l < 7 ? g7[l] : "?"); break;
+  case 8:  sprintf (b, "%s", l < 7 ? g8[l] : "?"); break;
+  case 9:  sprintf (b, "ST %s; DROP", l < 4 ? ds[l] : "?"); break;
+  case 15: sprintf (b, "<end>"); break;
+  default: sprintf (b, "?");
   }
+
+  return b;
+}
+
+/* Gets the name of a profiled function */
+char* prof_fun_name (int f) {
+  static char buf[64];
+
+  if (prof_funs[f].name) return prof_funs[f].name;
+
+  sprintf (buf, "fun@0x%.8x:%d", prof_funs[f].offset, prof_funs[f].line);
   
-  if (fseek (f, 0, SEEK_END) == -1) {
-    failure ("%s\n", strerror (errno));
+  return buf;
+}
+
+static long long *prof_sort_base;
+
+static int prof_compare_counts (const void *x, const void *y) {
+  long long a = prof_sort_base[*(int*) x], b = prof_sort_base[*(int*) y];
+
+  return a < b ? 1 : a > b ? -1 : 0;
+}
+
+static int prof_compare_funs (const void *x, const void *y) {
+  unsigned long long a = prof_funs[*(int*) x].inclusive, b = prof_funs[*(int*) y].inclusive;
+
+  return a < b ? 1 : a > b ? -1 : 0;
+}
+
+/* Dumps the stacks of the subtree of node n with the path p */
+static void prof_dump_stacks (FILE *f, prof_node *n, char *p, int len) {
+  prof_node *c;
+  
+  if (n->fun >= 0) {
+    char *name = prof_fun_name (n->fun);
+    int   k    = strlen (name);
+    
+    if ((p = (char*) realloc (p, len + k + 2)) == NULL) {
+      failure ("*** FAILURE: unable to allocate memory.\n");
+    }
+    
+    if (len > 0) p[len++] = ';';
+    strcpy (&p[len], name);
+    len += k;
+    
+    if (n->cycles) fprintf (f, "%s %llu\n", p, n->cycles);
+  }
+
+  for (c = n->child; c; c = c->sibling) {
+    char *q = (char*) malloc (len + 1);
+
+    if (q == NULL) {
+      failure ("*** FAILURE: unable to allocate memory.\n");
+    }
+    
+    memcpy (q, p, len);
+    q[len] = 0;
+    prof_dump_stacks (f, c, q, len);
   }
 
-  file = (bytefile*) malloc (sizeof(int)*4 + (size = ftell (f)));
+  free (p);
+}
+
+/* Prints the profile into f and the collapsed stacks into the file named
+   stacks */
+void prof_report (FILE *f, char *stacks) {
+  int      *idx = (int*) malloc (256 * 256 * sizeof (int)), i;
+  long long total = 0;
+  FILE     *s;
 
-  if (file == 0) {
+  if (idx == NULL) {
     failure ("*** FAILURE: unable to allocate memory.\n");
   }
+
+  for (i = 0; i < 256; i++) total += prof_insns[i];
+  if (total == 0) total = 1;
   
-  rewind (f);
+  fprintf (f, "Instructions executed: %lld\n\n", dispatches);
+  fprintf (f, "%16s %7s  %s\n", "count", "%", "opcode");
+
+  for (i = 0; i < 256; i++) idx[i] = i;
+  prof_sort_base = prof_insns;
+  qsort (idx, 256, sizeof (int), prof_compare_counts);
+
+  for (i = 0; i < 256 && prof_insns[idx[i]]; i++)
+    fprintf (f, "%16lld %6.2f%%  %s\n", prof_insns[idx[i]], 100.0 * prof_insns[idx[i]] / total, opcode_name (idx[i]));
+
+  fprintf (f, "\n%16s %7s  %s\n", "count", "%", "opcode pair");
+
+  for (i = 0; i < 256 * 256; i++) idx[i] = i;
+  prof_sort_base = &prof_pairs[0][0];
+  qsort (idx, 256 * 256, sizeof (int), prof_compare_counts);
+
+  for (i = 0; i < 50 && prof_sort_base[idx[i]]; i++) {
+    fprintf (f, "%16lld %6.2f%%  %s", prof_sort_base[idx[i]], 100.0 * prof_sort_base[idx[i]] / total, opcode_name (idx[i] >> 8));
+    fprintf (f, " => %s\n", opcode_name (idx[i] & 0xFF));
+  }
+
+  fprintf (f, "\n%12s %20s %20s  %s\n", "calls", "inclusive cycles", "self cycles", "function");
+
+  for (i = 0; i < prof_nfuns; i++) idx[i] = i;
+  qsort (idx, prof_nfuns, sizeof (int), prof_compare_funs);
+
+  for (i = 0; i < prof_nfuns && prof_funs[idx[i]].calls; i++)
+    fprintf (f, "%12lld %20llu %20llu  %s\n",
+             prof_funs[idx[i]].calls, prof_funs[idx[i]].inclusive, prof_funs[idx[i]].self,
+             prof_fun_name (idx[i]));
+
+  free (idx);
 
-  if (size != fread (&file->stringtab_size, 1, size, f)) {
+  if ((s = fopen (stacks, "w")) == NULL) {
     failure ("%s\n", strerror (errno));
   }
   
-  fclose (f);
-  
-  file->string_ptr  = &file->buffer [file->public_symbols_number * 2 * sizeof(int)];
-  file->public_ptr  = (int*) file->buffer;
-  file->code_ptr    = &file->string_ptr [file->stringtab_size];
-  file->global_ptr  = (int*) malloc (file->global_area_size * sizeof (int));
-  
-  return file;
+  prof_dump_stacks (s, &prof_root, NULL, 0);
+  fclose (s);
+}
+
+/* The threaded code of the program being run: the reserved area and its
+   used part */
+void **code_begin, **code_end, **code_top;
+
+/* The program being run, the handlers of the instructions, the mapping of
+   bytecode offsets into threaded code indices, the loaded units and the
+   mode of running */
+bytefile  *program;
+void     **handlers;
+int       *offsets;
+char      *loaded;
+int        run_mode;
+
+/* The number of calls which makes a function hot in the JIT mode */
+int jit_threshold = JIT_THRESHOLD;
+
+/* The bounds of the interpreter stack */
+size_t *stack_end;
+
+/* The top of the interpreter stack for the GC (the end of its root region);
+   the stack pointer itself stays in a local variable of interpret, and is
+   stored here only before the instructions which can allocate or call out */
+size_t *stack_top;
+
+/* Resolves an external symbol in the runtime */
+void* resolve (char *name) {
+  static void *self = NULL;
+  void        *f;
+
+  if (self == NULL && (self = dlopen (NULL, RTLD_NOW)) == NULL) {
+    failure ("%s\n", dlerror ());
+  }
+
+  if ((f = dlsym (self, name)) == NULL) {
+    failure ("undefined external symbol '%s'\n", name);
+  }
+
+  return f;
 }
 
-/* Disassembles the bytecode pool */
-void disassemble (FILE *f, bytefile *bf) {
+/* Translates the bytecode of a unit into the threaded code starting from
+   index n, the first function of the unit having the profiling number funs;
+   returns the index past the translated code. When out is NULL only
+   computes the mapping of bytecode offsets into threaded code indices, and
+   the size of the threaded code and collects the functions for profiling.
+   When counting or profiling each instruction is prefixed with a counting
+   or profiling one. The calls of extern functions defined in the bytecode
+   become direct calls; the references to the functions of other units
+   which are not loaded yet become lazy instructions, loading the units on
+   first execution */
+int translate (bytefile *bf, int u, void **out, int n, int funs, int mode) {
   
-# define INT    (ip += sizeof (int), *(int*)(ip - sizeof (int)))
-# define BYTE   *ip++
-# define STRING get_string (bf, INT)
-# define FAIL   failure ("ERROR: invalid opcode %d-%d\n", h, l)
+# define EMIT(x)  do {void *e = (void*) (size_t) (x); if (out) out[n] = e; n++;} while (0)
+# define TARGET   {int l = INT; EMIT (out ? &out[offsets[l]] : NULL);}
+# define VAR(d, i) ((d) == 0 ? get_global (bf, u, i) : (i))
+# define DESIGNATION {int d = UINT; EMIT (d & 3); EMIT (VAR (d & 3, d >> 2));}
+# define LOCAL(t) (t >= get_unit_begin (bf, u) && t < get_unit_end (bf, u))
+# define ENTRY(t) (out ? &out[offsets[t]] : NULL)
+# define CALL(t)  if (LOCAL (t) || loaded[unit_of (bf, t)]) {EMIT (handlers[I_CALL]); EMIT (ENTRY (t));} \
+                  else {EMIT (handlers[I_CALL_LAZY]); EMIT (t);}
   
-  char *ip     = bf->code_ptr;
-  char *ops [] = {"+", "-", "*", "/", "%", "<", "<=", ">", ">=", "==", "!=", "&&", "!!"};
-  char *pats[] = {"=str", "#string", "#array", "#sexp", "#ref", "#val", "#fun"};
-  char *lds [] = {"LD", "LDA", "ST"};
+  char *ip   = bf->code_ptr + get_unit_begin (bf, u);
+
   do {
     char x = BYTE,
          h = (x & 0xF0) >> 4,
          l = x & 0x0F;
 
-    fprintf (f, "0x%.8x:\t", ip-bf->code_ptr-1);
+    offsets[ip - bf->code_ptr - 1] = n;
+
+    if (mode == COUNT)   EMIT (handlers[I_COUNT]);
+    if (mode == PROFILE) {EMIT (handlers[I_PROFILE]); EMIT (x & 0xFF);}
+    if (mode == JIT && (x == 0x52 || x == 0x53)) {
+      EMIT (handlers[I_HOT]); EMIT (jit_threshold > 0 ? jit_threshold : 1); EMIT (ip - bf->code_ptr - 1);
+    }
     
+    if (mode == PROFILE) {
+      if (x == 0x52 || x == 0x53) {
+        if (out == NULL) {
+          if ((prof_funs = (prof_fun*) realloc (prof_funs, (funs + 1) * sizeof (prof_fun))) == NULL) {
+            failure ("*** FAILURE: unable to allocate memory.\n");
+          }
+          
+          memset (&prof_funs[funs], 0, sizeof (prof_fun));
+          prof_funs[funs].offset = ip - bf->code_ptr - 1;
+          
+          for (int i = 0; i < bf->public_symbols_number; i++)
+            if (get_public_offset (bf, i) == prof_funs[funs].offset)
+              prof_funs[funs].name = get_public_name (bf, i);
+
+          prof_funs[funs].line = find_line (bf, u, prof_funs[funs].offset, get_unit_end (bf, u));
+          prof_nfuns = funs + 1;
+        }
+        
+        EMIT (handlers[I_ENTER]); EMIT (funs++);
+      }
+      else if (x == 0x16 || x == 0x17) EMIT (handlers[I_LEAVE]);
+    }
+
     switch (h) {
     case 15:
-      goto stop;
-      
-    /* BINOP */
+      EMIT (handlers[I_STOP]);
+      return n;
+
     case 0:
-      fprintf (f, "BINOP\t%s", ops[l-1]);
+      if (l < 1 || l > 13) FAIL;
+      EMIT (handlers[BINOP_INSN (l, 0)]);
       break;
-      
+
     case 1:
       switch (l) {
-      case  0:
-        fprintf (f, "CONST\t%d", INT);
+      case  0: EMIT (handlers[I_CONST]); EMIT (BOX (SINT)); break;
+      case  1: EMIT (handlers[I_STRING]); EMIT (STRING); break;
+      case  2: {
+        char *t = STRING;
+        EMIT (handlers[I_SEXP]); EMIT (UINT); EMIT (LtagHash (t));
         break;
-        
-      case  1:
-        fprintf (f, "STRING\t%s", STRING);
-        break;
-          
-      case  2:
-        fprintf (f, "SEXP\t%s ", STRING);
-        fprintf (f, "%d", INT);
-        break;
-        
-      case  3:
-        fprintf (f, "STI");
-        break;
-        
-      case  4:
-        fprintf (f, "STA");
-        break;
-        
-      case  5:
-        fprintf (f, "JMP\t0x%.8x", INT);
-        break;
-        
-      case  6:
-        fprintf (f, "END");
-        break;
-        
-      case  7:
-        fprintf (f, "RET");
-        break;
-        
-      case  8:
-        fprintf (f, "DROP");
-        break;
-        
-      case  9:
-        fprintf (f, "DUP");
-        break;
-        
-      case 10:
-        fprintf (f, "SWAP");
-        break;
-
-      case 11:
-        fprintf (f, "ELEM");
-        break;
-        
-      default:
-        FAIL;
+      }
+      case  3: EMIT (handlers[I_STI]); break;
+      case  4: EMIT (handlers[I_STA]); break;
+      case  5: EMIT (handlers[I_JMP]); TARGET; break;
+      case  6: 
+      case  7: EMIT (handlers[I_END]); break;
+      case  8: EMIT (handlers[I_DROP]); break;
+      case  9: EMIT (handlers[I_DUP]); break;
+      case 10: EMIT (handlers[I_SWAP]); break;
+      case 11: EMIT (handlers[I_ELEM]); break;
+      default: FAIL;
       }
       break;
-      
+
     case 2:
     case 3:
     case 4:
-      fprintf (f, "%s\t", lds[h-2]);
-      switch (l) {
-      case 0: fprintf (f, "G(%d)", INT); break;
-      case 1: fprintf (f, "L(%d)", INT); break;
-      case 2: fprintf (f, "A(%d)", INT); break;
-      case 3: fprintf (f, "C(%d)", INT); break;
-      default: FAIL;
-      }
+      if (l > 3) FAIL;
+      EMIT (handlers[I_LD_G + (h-2)*4 + l]); EMIT (VAR (l, UINT));
       break;
-      
+
     case 5:
       switch (l) {
-      case  0:
-        fprintf (f, "CJMPz\t0x%.8x", INT);
-        break;
-        
-      case  1:
-        fprintf (f, "CJMPnz\t0x%.8x", INT);
-        break;
-        
+      case  0: EMIT (handlers[I_CJMPZ]); TARGET; break;
+      case  1: EMIT (handlers[I_CJMPNZ]); TARGET; break;
       case  2:
-        fprintf (f, "BEGIN\t%d ", INT);
-        fprintf (f, "%d", INT);
-        break;
-        
-      case  3:
-        fprintf (f, "CBEGIN\t%d ", INT);
-        fprintf (f, "%d", INT);
-        break;
-        
-      case  4:
-        fprintf (f, "CLOSURE\t0x%.8x", INT);
-        {int n = INT;
-         for (int i = 0; i<n; i++) {
-         switch (BYTE) {
-           case 0: fprintf (f, "G(%d)", INT); break;
-           case 1: fprintf (f, "L(%d)", INT); break;
-           case 2: fprintf (f, "A(%d)", INT); break;
-           case 3: fprintf (f, "C(%d)", INT); break;
-           default: FAIL;
-         }
-         }
-        };
-        break;
-          
-      case  5:
-        fprintf (f, "CALLC\t%d", INT);
-        break;
-        
-      case  6:
-        fprintf (f, "CALL\t0x%.8x ", INT);
-        fprintf (f, "%d", INT);
-        break;
-        
-      case  7:
-        fprintf (f, "TAG\t%s ", STRING);
-        fprintf (f, "%d", INT);
+      case  3: {
+        int b = ip - bf->code_ptr - 1;
+        EMIT (handlers[I_BEGIN]); EMIT (UINT); EMIT (UINT); EMIT (bf->stack_needs[b]);
         break;
+      }
+      case  4: {
+        int k;
         
-      case  8:
-        fprintf (f, "ARRAY\t%d", INT);
+        EMIT (handlers[I_CLOSURE]); TARGET; EMIT (k = UINT);
+        for (int i = 0; i<k; i++) DESIGNATION;
         break;
-        
-      case  9:
-        fprintf (f, "FAIL\t%d", INT);
-        fprintf (f, "%d", INT);
+      }
+      case  5: EMIT (handlers[I_CALLC]); EMIT (UINT); break;
+      case  6: {
+        int t = INT;
+
+        CALL (t);
+        EMIT (UINT);
         break;
-        
-      case 10:
-        fprintf (f, "LINE\t%d", INT);
+      }
+      case  7: {
+        char *t = STRING;
+        EMIT (handlers[I_TAG]); EMIT (LtagHash (t)); EMIT (BOX (UINT));
         break;
-
-      default:
-        FAIL;
+      }
+      case  8: EMIT (handlers[I_ARRAY]); EMIT (BOX (UINT)); break;
+      case  9: EMIT (handlers[I_FAIL]); EMIT (BOX (UINT)); EMIT (BOX (UINT)); break;
+      default: FAIL;
       }
       break;
-      
+
     case 6:
-      fprintf (f, "PATT\t%s", pats[l]);
+      if (l > 6) FAIL;
+      EMIT (handlers[I_PATT_STR + l]);
       break;
 
-    case 7: {
+    case 7:
       switch (l) {
-      case 0:
-        fprintf (f, "CALL\tLread");
-        break;
-        
-      case 1:
-        fprintf (f, "CALL\tLwrite");
-        break;
+      case  0: EMIT (handlers[I_READ]); break;
+      case  1: EMIT (handlers[I_WRITE]); break;
+      case  2: EMIT (handlers[I_LENGTH]); break;
+      case  3: EMIT (handlers[I_TOSTRING]); break;
+      case  4: EMIT (handlers[I_BARRAY]); EMIT (UINT); break;
+      case  5: {
+        char *f = STRING;
+        int   t = find_public (bf, f);
 
-      case 2:
-        fprintf (f, "CALL\tLlength");
+        if (t < 0) {EMIT (handlers[I_EXTERN_CALL]); EMIT (resolve (f));}
+        else CALL (t);
+        EMIT (UINT);
         break;
+      }
+      case  6: {
+        char *f = STRING;
+        int   t = find_public (bf, f);
 
-      case 3:
-        fprintf (f, "CALL\tLstring");
+        if (t < 0) {EMIT (handlers[I_EXTERN_CLOSURE]); EMIT (resolve (f));}
+        else if (LOCAL (t) || loaded[unit_of (bf, t)]) {EMIT (handlers[I_EXTERN_CLOSURE]); EMIT (ENTRY (t));}
+        else {EMIT (handlers[I_CLOSURE_LAZY]); EMIT (t);}
         break;
+      }
+      default: FAIL;
+      }
+      break;
 
-      case 4:
-        fprintf (f, "CALL\tBarray\t%d", INT);
+    case 8:
+      switch (l) {
+      case  0: {
+        char *t = STRING;
+        EMIT (handlers[I_TAG_JNZ]); EMIT (LtagHash (t)); EMIT (BOX (UINT)); TARGET;
         break;
-
-      default:
-        FAIL;
       }
-    }
-    break;
-      
+      case  1: EMIT (handlers[I_ARRAY_JNZ]); EMIT (BOX (UINT)); TARGET; break;
+      case  2: EMIT (handlers[I_DUP_ELEM]); EMIT (BOX (SINT)); break;
+      case  3: EMIT (handlers[I_DROP_JMP]); TARGET; break;
+      case  4:
+      case  5:
+      case  6: {
+        int op = BYTE;
+        if (op < 1 || op > 13) FAIL;
+        EMIT (handlers[BINOP_INSN (op, l-3)]);
+        switch (l) {
+        case 4: DESIGNATION; EMIT (BOX (SINT)); break;
+        case 5: DESIGNATION; DESIGNATION; break;
+        case 6: TARGET; break;
+        }
+        break;
+      }
+      default: FAIL;
+      }
+      break;
+
+    case 9:
+      if (l > 3) FAIL;
+      EMIT (handlers[I_ST_G_DROP + l]); EMIT (VAR (l, UINT));
+      break;
+
     default:
       FAIL;
     }
+  }
+  while (ip < bf->code_ptr + get_unit_end (bf, u));
+
+  failure ("ERROR: unterminated bytecode\n");
+  return n;
+  
+# undef CALL
+# undef ENTRY
+# undef LOCAL
+# undef DESIGNATION
+# undef VAR
+# undef TARGET
+# undef EMIT
+}
+
+/* Loads a unit: verifies it and translates it into the threaded code
+   area; returns the entry of its initialization function or NULL if the
+   unit is already loaded or has no initialization */
+void** load_unit (int u) {
+  int n, funs = prof_nfuns, init;
+
+  if (loaded[u]) return NULL;
+
+  verify (program, u);
+  
+  n = translate (program, u, NULL, code_top - code_begin, funs, run_mode);
+
+  if (code_begin + n > code_end) {
+    failure ("ERROR: the threaded code area is exhausted\n");
+  }
+
+  translate (program, u, code_begin, code_top - code_begin, funs, run_mode);
+
+  code_top  = code_begin + n;
+  loaded[u] = 1;
+  init      = get_unit_init (program, u);
+  
+  return init < 0 ? NULL : &code_begin[offsets[init]];
+}
+
+/* Makes a piece of threaded code which drops the top of the stack and
+   continues at ip */
+void** trampoline (void **ip) {
+  void **t = code_top;
+
+  if (code_top + 3 > code_end) {
+    failure ("ERROR: the threaded code area is exhausted\n");
+  }
+
+  t[0] = handlers[I_DROP];
+  t[1] = handlers[I_JMP];
+  t[2] = ip;
+  code_top += 3;
+
+  return t;
+}
+
+/* Calls a C function f with n arguments args[0], ..., args[n-1] */
+size_t call_with_args (void *f, int n, size_t *args) {
+  size_t r;
+  int    c = n;
+  size_t *a = args;
+  
+  asm volatile ("movl  %%esp, %%edi\n\t"
+                "1:\n\t"
+                "testl %%ecx, %%ecx\n\t"
+                "jz    2f\n\t"
+                "decl  %%ecx\n\t"
+                "pushl (%%edx,%%ecx,4)\n\t"
+                "jmp   1b\n"
+                "2:\n\t"
+                "call  *%%esi\n\t"
+                "movl  %%edi, %%esp"
+                : "=a" (r), "+c" (c), "+d" (a)
+                : "S" (f)
+                : "edi", "memory", "cc");
+
+  return r;
+}
+
+/* Runs the threaded code starting from ip; the stack holds the globals (the
+   first nglobals words) and then the frames. The live part of the stack is
+   registered as a GC root region. When called with ip equal to NULL fills
+   the handlers table */
+void interpret (void **ip, size_t *stack, int nglobals, char *fname, void ***handlers) {
+  
+# define INSN_LABEL(x) &&L_##x,
+# define NEXT          goto **ip++
+# define OPND          ((size_t) *ip++)
+# define SYNC          stack_top = sp
+# define PATT(f)       SYNC; sp[-1] = (size_t) f ((void*) sp[-1]); NEXT
+# define LOCATION(d,i) (d == 0 ? &globals[i] : d == 1 ? &fp[i] : d == 2 ? &args[i] : &((size_t*) fp[-2])[i+1])
+# define ARITH(op)     BOX (UNBOX (x) op UNBOX (y))
+# define CMP(op)       BOX ((int) x op (int) y)
+# define E_ADD         ARITH (+)
+# define E_SUB         ARITH (-)
+# define E_MUL         ARITH (*)
+# define E_DIV         ARITH (/)
+# define E_MOD         ARITH (%)
+# define E_LT          CMP (<)
+# define E_LE          CMP (<=)
+# define E_GT          CMP (>)
+# define E_GE          CMP (>=)
+# define E_EQ          CMP (==)
+# define E_NE          CMP (!=)
+# define E_AND         BOX (UNBOX (x) != 0 && UNBOX (y) != 0)
+# define E_OR          BOX ((UNBOX (x) | UNBOX (y)) != 0)
+# define BINOP_HANDLERS(o, _)                                           \
+ L_##o:                                                                 \
+  y = *--sp; x = sp[-1]; sp[-1] = E_##o;                                \
+  NEXT;                                                                 \
+ L_##o##_LC:                                                            \
+  i = OPND; x = *LOCATION (i, OPND); y = OPND; *sp++ = E_##o;           \
+  NEXT;                                                                 \
+ L_##o##_LL:                                                            \
+  i = OPND; x = *LOCATION (i, OPND); i = OPND; y = *LOCATION (i, OPND); \
+  *sp++ = E_##o;                                                        \
+  NEXT;                                                                 \
+ L_##o##_JZ:                                                            \
+  y = *--sp; x = *--sp;                                                 \
+  if (UNBOX (E_##o) == 0) ip = (void**) *ip; else ip++;                 \
+  NEXT;
+  
+  static void *labels [] = {FOR_INSNS(INSN_LABEL)};
+  static void *stop   [] = {&&L_STOP};
+  size_t *globals = stack, *sp, *fp = NULL, *args = NULL, *regs[2], x, y;
+  int     n, i;
+
+  if (ip == NULL) {
+    *handlers = labels;
+    return;
+  }
+
+  sp = stack_top = globals;
+  push_root_region ((void**) stack, (void***) &stack_top);
+
+  for (; sp < globals + nglobals; sp++) *sp = BOX (0);
+
+  /* The frame of the main function: two (dummy) arguments and a header
+     which returns into the stop instruction */
+  *sp++ = BOX (0);
+  *sp++ = BOX (0);
+  *sp++ = (size_t) stop;
+  *sp++ = (size_t) fp;
+  *sp++ = (size_t) args;
+  *sp++ = BOX (0);
+  *sp++ = BOX (2);
+  
+  NEXT;
+
+ FOR_BINOPS(BINOP_HANDLERS, _)
+
+ L_CONST:
+  *sp++ = OPND;
+  NEXT;
+
+ L_STRING:
+  SYNC;
+  x = (size_t) Bstring (*ip++);
+  *sp++ = x;
+  NEXT;
+
+ L_SEXP:
+  /* Bsexp (BOX(n+1), v_0, ..., v_{n-1}, tag) */
+  SYNC;
+  n = OPND;
+  memmove (sp-n+1, sp-n, n * sizeof (size_t));
+  sp[-n] = BOX (n+1);
+  sp[1]  = OPND;
+  x = call_with_args (Bsexp, n+2, sp-n);
+  sp -= n;
+  *sp++ = x;
+  NEXT;
+
+ L_STI:
+  y = *--sp;
+  * (size_t*) sp[-1] = y;
+  sp[-1] = y;
+  NEXT;
+  
+ L_STA:
+  SYNC;
+  x = (size_t) Bsta ((void*) sp[-1], sp[-2], (void*) sp[-3]);
+  sp -= 2;
+  sp[-1] = x;
+  NEXT;
+
+ L_JMP:
+  ip = (void**) *ip;
+  NEXT;
+
+ L_END:
+  x  = sp[-1];
+  sp = fp - FRAME;
+  ip   = (void**)  sp[0];
+  fp   = (size_t*) sp[1];
+  args = (size_t*) sp[2];
+  sp  -= UNBOX (sp[4]);
+  *sp++ = x;
+  NEXT;
+
+ L_DROP:
+  sp--;
+  NEXT;
+
+ L_DUP:
+  sp[0] = sp[-1];
+  sp++;
+  NEXT;
+
+ L_SWAP:
+  x = sp[-1];
+  sp[-1] = sp[-2];
+  sp[-2] = x;
+  NEXT;
+
+ L_ELEM:
+  SYNC;
+  x = (size_t) Belem ((void*) sp[-2], sp[-1]);
+  sp--;
+  sp[-1] = x;
+  NEXT;
+
+ L_LD_G: *sp++ = globals[OPND]; NEXT;
+ L_LD_L: *sp++ = fp[OPND]; NEXT;
+ L_LD_A: *sp++ = args[OPND]; NEXT;
+ L_LD_C: *sp++ = ((size_t*) fp[-2])[OPND+1]; NEXT;
+
+ L_LDA_G: x = (size_t) &globals[OPND]; goto lda;
+ L_LDA_L: x = (size_t) &fp[OPND]; goto lda;
+ L_LDA_A: x = (size_t) &args[OPND]; goto lda;
+ L_LDA_C: x = (size_t) &((size_t*) fp[-2])[OPND+1];
+ lda:
+  *sp++ = x;
+  *sp++ = x;
+  NEXT;
+
+ L_ST_G: globals[OPND] = sp[-1]; NEXT;
+ L_ST_L: fp[OPND] = sp[-1]; NEXT;
+ L_ST_A: args[OPND] = sp[-1]; NEXT;
+ L_ST_C: ((size_t*) fp[-2])[OPND+1] = sp[-1]; NEXT;
+
+ L_CJMPZ:
+  if (UNBOX (*--sp) == 0) ip = (void**) *ip; else ip++;
+  NEXT;
+
+ L_CJMPNZ:
+  if (UNBOX (*--sp) != 0) ip = (void**) *ip; else ip++;
+  NEXT;
+
+ L_BEGIN:
+  n  = OPND;
+  fp = sp;
+  args = fp - FRAME - n;
+  n  = OPND;
+  if (sp + n + OPND >= stack_end) {
+    failure ("stack overflow\n");
+  }
+  for (i = 0; i<n; i++) *sp++ = BOX (0);
+  NEXT;
+
+ L_CLOSURE:
+  /* Bclosure (BOX(n), entry, v_0, ..., v_{n-1}) */
+  SYNC;
+  sp[1] = OPND;
+  n = OPND;
+  sp[0] = BOX (n);
+  for (i = 0; i<n; i++) {
+    int d = OPND, j = OPND;
+    sp[i+2] = *LOCATION(d, j);
+  }
+  x = call_with_args (Bclosure, n+2, sp);
+  *sp++ = x;
+  NEXT;
 
-    fprintf (f, "\n");
+ L_CALLC:
+  n = OPND;
+  x = sp[-n-1];
+  if (((void***) x)[0] >= code_begin && ((void***) x)[0] < code_end) {
+    sp[0] = (size_t) ip;
+    sp[1] = (size_t) fp;
+    sp[2] = (size_t) args;
+    sp[3] = x;
+    sp[4] = BOX (n+1);
+    sp += FRAME;
+    ip = ((void***) x)[0];
+    NEXT;
   }
-  while (1);
- stop: fprintf (f, "<end>\n");
+  /* a closure of a runtime function */
+  SYNC;
+  x = call_with_args (((void**) x)[0], n, sp-n);
+  sp -= n+1;
+  *sp++ = x;
+  NEXT;
+
+ L_CALL:
+  x  = OPND;
+  n  = OPND;
+  sp[0] = (size_t) ip;
+  sp[1] = (size_t) fp;
+  sp[2] = (size_t) args;
+  sp[3] = BOX (0);
+  sp[4] = BOX (n);
+  sp += FRAME;
+  ip = (void**) x;
+  NEXT;
+
+ L_TAG:
+  SYNC;
+  x = OPND;
+  y = OPND;
+  sp[-1] = Btag ((void*) sp[-1], x, y);
+  NEXT;
+
+ L_ARRAY:
+  SYNC;
+  sp[-1] = Barray_patt ((void*) sp[-1], OPND);
+  NEXT;
+
+ L_FAIL:
+  SYNC;
+  x = OPND;
+  y = OPND;
+  Bmatch_failure ((void*) sp[-1], fname, x, y);
+  NEXT;
+
+ L_PATT_STR:
+  SYNC;
+  x = Bstring_patt ((void*) sp[-2], (void*) sp[-1]);
+  sp--;
+  sp[-1] = x;
+  NEXT;
+
+ L_PATT_STRING:   PATT (Bstring_tag_patt);
+ L_PATT_ARRAY:    PATT (Barray_tag_patt);
+ L_PATT_SEXP:     PATT (Bsexp_tag_patt);
+ L_PATT_BOXED:    PATT (Bboxed_patt);
+ L_PATT_UNBOXED:  PATT (Bunboxed_patt);
+ L_PATT_CLOSURE:  PATT (Bclosure_tag_patt);
+
+ L_READ:
+  SYNC;
+  x = Lread ();
+  *sp++ = x;
+  NEXT;
+
+ L_WRITE:
+  SYNC;
+  sp[-1] = Lwrite (sp[-1]);
+  NEXT;
+
+ L_LENGTH:
+  SYNC;
+  sp[-1] = Llength ((void*) sp[-1]);
+  NEXT;
+
+ L_TOSTRING:
+  SYNC;
+  sp[-1] = (size_t) Lstring ((void*) sp[-1]);
+  NEXT;
+
+ L_BARRAY:
+  /* Barray (BOX(n), v_0, ..., v_{n-1}) */
+  SYNC;
+  n = OPND;
+  memmove (sp-n+1, sp-n, n * sizeof (size_t));
+  sp[-n] = BOX (n);
+  x = call_with_args (Barray, n+1, sp-n);
+  sp -= n;
+  *sp++ = x;
+  NEXT;
+
+ L_EXTERN_CALL:
+  SYNC;
+  x = OPND;
+  n = OPND;
+  x = call_with_args ((void*) x, n, sp-n);
+  sp -= n;
+  *sp++ = x;
+  NEXT;
+
+ L_EXTERN_CLOSURE:
+  SYNC;
+  x = (size_t) Bclosure (BOX (0), *ip++);
+  *sp++ = x;
+  NEXT;
+
+ L_CALL_LAZY:
+  /* The first execution of a call of a function from a unit which was not
+     loaded yet: loads the unit and turns the instruction into a direct
+     call */
+  SYNC;
+  i  = OPND;
+  ip -= 2;
+  x  = (size_t) load_unit (unit_of (program, i));
+  ip[0] = labels[I_CALL];
+  ip[1] = &code_begin[offsets[i]];
+  goto init;
+
+ L_CLOSURE_LAZY:
+  /* The same for a closure of such a function */
+  SYNC;
+  i  = OPND;
+  ip -= 2;
+  x  = (size_t) load_unit (unit_of (program, i));
+  ip[0] = labels[I_EXTERN_CLOSURE];
+  ip[1] = &code_begin[offsets[i]];
+
+ init:
+  /* Runs the initialization of the unit just loaded (if any), which then
+     returns to the patched instruction */
+  if (x == 0) NEXT;
+  sp[0] = (size_t) trampoline (ip);
+  sp[1] = (size_t) fp;
+  sp[2] = (size_t) args;
+  sp[3] = BOX (0);
+  sp[4] = BOX (0);
+  sp += FRAME;
+  ip = (void**) x;
+  NEXT;
+
+ L_TAG_JNZ:
+  SYNC;
+  x = OPND;
+  y = OPND;
+  if (UNBOX (Btag ((void*) sp[-1], x, y))) ip = (void**) *ip; else ip++;
+  NEXT;
+
+ L_ARRAY_JNZ:
+  SYNC;
+  x = OPND;
+  if (UNBOX (Barray_patt ((void*) sp[-1], x))) ip = (void**) *ip; else ip++;
+  NEXT;
+
+ L_DUP_ELEM:
+  SYNC;
+  x = (size_t) Belem ((void*) sp[-1], OPND);
+  *sp++ = x;
+  NEXT;
+
+ L_DROP_JMP:
+  sp--;
+  ip = (void**) *ip;
+  NEXT;
+  
+ L_ST_G_DROP: globals[OPND] = *--sp; NEXT;
+ L_ST_L_DROP: fp[OPND] = *--sp; NEXT;
+ L_ST_A_DROP: args[OPND] = *--sp; NEXT;
+ L_ST_C_DROP: ((size_t*) fp[-2])[OPND+1] = *--sp; NEXT;
+
+ L_COUNT:
+  dispatches++;
+  NEXT;
+
+ L_PROFILE:
+  dispatches++;
+  x = OPND;
+  prof_insns[x]++;
+  prof_pairs[prof_prev][x]++;
+  prof_prev = x;
+  NEXT;
+
+ L_ENTER:
+  prof_enter (OPND);
+  NEXT;
+
+ L_LEAVE:
+  prof_leave ();
+  NEXT;
+
+ L_HOT:
+  /* Counts the calls of a function in the JIT mode; the call which makes
+     the function hot compiles it and turns the instruction into the entry
+     of the native code (or into a jump to the threaded code if the native
+     code area is exhausted) */
+  x = (size_t) ip[0] - 1;
+  if (x > 0) {ip[0] = (void*) x; ip += 2; NEXT;}
+  x = (size_t) jit_compile ((int) ip[1]);
+  if (x != 0) {ip[-1] = labels[I_NATIVE]; ip[0] = (void*) x;}
+  else {ip[-1] = labels[I_JMP]; ip[0] = ip + 2;}
+  ip--;
+  NEXT;
+
+ L_NATIVE:
+  regs[0] = fp;
+  regs[1] = args;
+  stack_top = sp;
+  ip   = jit_enter (*ip, &stack_top, regs);
+  sp   = stack_top;
+  fp   = regs[0];
+  args = regs[1];
+  NEXT;
+  
+ L_STOP:
+  pop_root_region ((void**) stack);
+  return;
+
+# undef BINOP_HANDLERS
+# undef E_OR
+# undef E_AND
+# undef E_NE
+# undef E_EQ
+# undef E_GE
+# undef E_GT
+# undef E_LE
+# undef E_LT
+# undef E_MOD
+# undef E_DIV
+# undef E_MUL
+# undef E_SUB
+# undef E_ADD
+# undef CMP
+# undef ARITH
+# undef LOCATION
+# undef PATT
+# undef SYNC
+# undef OPND
+# undef NEXT
+# undef INSN_LABEL
 }
 
-/* Dumps the contents of the file */
-void dump_file (FILE *f, bytefile *bf) {
-  int i;
+/* Translates and runs the bytecode file in a given mode; the units are
+   loaded lazily starting from the one with the main function */
+void run (bytefile *bf, char *fname, int mode) {
+  size_t *stack = (size_t*) malloc (VM_STACK_SIZE * sizeof (size_t));
+  int     entry = find_public (bf, "main");
+
+  program  = bf;
+  run_mode = mode;
+  offsets  = (int*) malloc (bf->code_size * sizeof (int));
+  loaded   = (char*) calloc (bf->units_number, 1);
   
-  fprintf (f, "String table size       : %d\n", bf->stringtab_size);
-  fprintf (f, "Global area size        : %d\n", bf->global_area_size);
-  fprintf (f, "Number of public symbols: %d\n", bf->public_symbols_number);
-  fprintf (f, "Public symbols          :\n");
+  if (offsets == NULL || loaded == NULL || stack == NULL) {
+    failure ("*** FAILURE: unable to allocate memory.\n");
+  }
 
-  for (i=0; i < bf->public_symbols_number; i++) 
-    fprintf (f, "   0x%.8x: %s\n", get_public_offset (bf, i), get_public_name (bf, i));
+  if (entry < 0) {
+    failure ("ERROR: no main function in '%s'\n", fname);
+  }
+  
+  if (bf->global_area_size + 2 + FRAME >= VM_STACK_SIZE) {
+    failure ("ERROR: the global area is too large\n");
+  }
+
+  code_begin = (void**) mmap (NULL, VM_CODE_SIZE * sizeof (void*), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+  if (code_begin == MAP_FAILED) {
+    failure ("%s\n", strerror (errno));
+  }
+  
+  code_top   = code_begin;
+  code_end   = code_begin + VM_CODE_SIZE;
+  stack_end  = stack + VM_STACK_SIZE;
+
+  interpret (NULL, NULL, 0, NULL, &handlers);
+
+  if (mode == JIT) {
+    jit_globals = stack;
+    jit_fname   = fname;
+    jit_init ();
+  }
+  
+  load_unit (unit_of (bf, entry));
+  
+  prof_last = cycles ();
+      
+  interpret (&code_begin[offsets[entry]], stack, bf->global_area_size, fname, NULL);
+
+  switch (mode) {
+  case COUNT:
+    fprintf (stderr, "Instructions executed: %lld\n", dispatches);
+    break;
 
-  fprintf (f, "Code:\n");
-  disassemble (f, bf);
+  case PROFILE: {
+    char *stacks = (char*) malloc (strlen (fname) + 8);
+
+    if (stacks == NULL) {
+      failure ("*** FAILURE: unable to allocate memory.\n");
+    }
+        
+    sprintf (stacks, "%s.stacks", fname);
+    prof_report (stderr, stacks);
+    free (stacks);
+    break;
+  }
+  }
 }
 
 int main (int argc, char* argv[]) {
-  bytefile *f = read_file (argv[1]);
-  dump_file (stdout, f);
+  bytefile *f;
+  int       mode = RUN;
+
+  if (argc == 3 && strcmp (argv[1], "-d") == 0) {
+    dump_file (stdout, read_file (argv[2]));
+    return 0;
+  }
+
+  if (argc > 3 && strcmp (argv[1], "-l") == 0) {
+    link_files (argv[2], argc-3, &argv[3]);
+    return 0;
+  }
+
+  if (argc == 4 && strcmp (argv[1], "-C") == 0) {
+    translate_c (argv[2], argv[3]);
+    return 0;
+  }
+
+  if (argc > 1 && (strcmp (argv[1], "-c") == 0 || strcmp (argv[1], "-p") == 0)) {
+    mode = argv[1][1] == 'c' ? COUNT : PROFILE;
+    argc--;
+    argv++;
+  }
+  else if (argc > 1 && strncmp (argv[1], "-j", 2) == 0) {
+    char *e;
+    
+    mode = JIT;
+    if (argv[1][2] != 0) {
+      jit_threshold = strtol (&argv[1][2], &e, 10);
+      if (*e != 0 || jit_threshold < 0) failure ("ERROR: invalid JIT threshold '%s'\n", &argv[1][2]);
+    }
+    argc--;
+    argv++;
+  }
+  
+  if (argc < 2) {
+    failure ("Usage: byterun [-d | -c | -p | -j[<n>]] <bytecode file> <arguments>\n"
+             "       byterun -l <output file> <bytecode file>...\n"
+             "       byterun -C <output file> <bytecode file>\n"
+             "  -d --- disassemble the bytecode file\n"
+             "  -l --- link the bytecode files (e.g. the units of stdlib compiled\n"
+             "         with 'lamac -bc' and a program) into one; the units of the\n"
+             "         linked file are loaded on first call\n"
+             "  -C --- translate the bytecode file into a C program to be compiled\n"
+             "         with the runtime (e.g. 'gcc -O2 -m32 <output file> runtime.a')\n"
+             "  -c --- report the number of executed instructions\n"
+             "  -p --- profile; the report is printed to stderr, the collapsed\n"
+             "         stacks (for flamegraph tools) are written into <bytecode file>.stacks\n"
+             "  -j --- compile a function into native code on its n-th call (100 by\n"
+             "         default; 0 compiles every function on its first call)\n");
+  }
+
+  __gc_init ();
+  set_args (argc-1, &argv[1]);
+  
+  f = read_file (argv[1]);
+  run (f, argv[1], mode);
+  
   return 0;
 }
@@ -0,0 +1,302 @@
+/* Lama SM Bytecode interpreter: the declarations shared by the interpreter
+   (byterun.c), the reader and the disassembler of bytecode files
+   (bytefile.c), the verifier (verify.c), the JIT (jit.c), the linker
+   (link.c) and the translator into C (translate_c.c) */
+
+# ifndef __BYTERUN__
+# define __BYTERUN__
+
+# include <string.h>
+# include <stdio.h>
+# include <errno.h>
+# include <malloc.h>
+# include <dlfcn.h>
+# include <fcntl.h>
+# include <unistd.h>
+# include <sys/stat.h>
+# include "../runtime/runtime.h"
+
+# define UNBOXED(x)  (((int) (x)) &  0x0001)
+# define UNBOX(x)    (((int) (x)) >> 1)
+# define BOX(x)      ((((int) (x)) << 1) | 0x0001)
+
+/* Runtime entries used by the interpreter */
+extern void  __gc_init         ();
+extern void  push_root_region  (void**, void***);
+extern void  pop_root_region   (void**);
+extern void  set_args          (int argc, char *argv[]);
+extern int   LtagHash          (char*);
+extern int   Lread             ();
+extern int   Lwrite            (int);
+extern int   Llength           (void*);
+extern void* Lstring           (void*);
+extern void* Bstring           (void*);
+extern void* Belem             (void*, int);
+extern void* Bsta              (void*, int, void*);
+extern void* Barray            (int, ...);
+extern void* Bsexp             (int, ...);
+extern void* Bclosure          (int, void*, ...);
+extern int   Btag              (void*, int, int);
+extern int   Barray_patt       (void*, int);
+extern int   Bstring_patt      (void*, void*);
+extern int   Bstring_tag_patt  (void*);
+extern int   Barray_tag_patt   (void*);
+extern int   Bsexp_tag_patt    (void*);
+extern int   Bboxed_patt       (void*);
+extern int   Bunboxed_patt     (void*);
+extern int   Bclosure_tag_patt (void*);
+extern void  Bmatch_failure    (void*, char*, int, int);
+
+/* The header of a bytecode file; all offsets are from the beginning of the
+   file, the sections follow the header, the code is the last one */
+# define BYTEFILE_MAGIC   0x424D414C /* "LAMB" */
+# define BYTEFILE_VERSION 3
+
+typedef struct {
+  int magic;                     /* BYTEFILE_MAGIC                                 */
+  int version;                   /* BYTEFILE_VERSION                               */
+  int checksum;                  /* Adler-32 of the sections preceding the code    */
+  int global_area_size;          /* The size (in words) of global area             */
+  int public_symbols_number;     /* The number of public symbols                   */
+  int public_offset;             /* The offset of the publics table                */
+  int stringtab_offset;          /* The offset of the string table                 */
+  int stringtab_size;            /* The size (in bytes) of the string table        */
+  int code_offset;               /* The offset of the bytecode                     */
+  int code_size;                 /* The size (in bytes) of the bytecode            */
+  int global_symbols_number;     /* The number of global symbols                   */
+  int global_symbols_offset;     /* The offset of the global symbols table         */
+  int units_number;              /* The number of units                            */
+  int units_offset;              /* The offset of the units table                  */
+  int constants_number;          /* The number of constant pool entries            */
+  int constants_offset;          /* The offset of the constant pool                */
+  int global_map_size;           /* The number of global map entries               */
+  int global_map_offset;         /* The offset of the global map                   */
+  int lines_size;                /* The size (in bytes) of the line table          */
+  int lines_offset;              /* The offset of the line table                   */
+} bytefile_header;
+
+/* Flags of global symbols */
+# define GLOBAL_PUBLIC   1
+# define GLOBAL_EXTERN   2
+
+/* The number of fields of a units table entry */
+# define UNIT_FIELDS     8
+
+/* The unpacked representation of bytecode file; the sections point into
+   the (read-only) mapping of the file.
+
+   The operands of instructions are LEB128-encoded numbers (signed for
+   constants, unsigned for the rest) except for code offsets, which are
+   32-bit integers. Strings are referred to by indices in the constant pool
+   of the unit and global variables --- by indices in the global map of the
+   unit, so the code of a unit does not depend on where its strings and
+   globals are placed. Line numbers are kept in a separate line table: for
+   each unit a sequence of (offset delta, line delta) pairs of LEB128
+   numbers starting from the beginning of the unit and line 0 */
+typedef struct {
+  char *string_ptr;              /* A pointer to the beginning of the string table */
+  int  *public_ptr;              /* A pointer to the beginning of publics table    */
+  int  *global_ptr;              /* A pointer to the global symbols table: (name,  */
+                                 /* index, flags) triples for public and imported  */
+                                 /* global variables                               */
+  int  *unit_ptr;                /* A pointer to the units table: (name, begin,    */
+                                 /* end, init, checksum, the beginnings of the     */
+                                 /* unit's constants, global map and line table)   */
+                                 /* for each compilation unit                      */
+  int  *constant_ptr;            /* A pointer to the constant pool: string indices */
+  int  *global_map_ptr;          /* A pointer to the global map: global area       */
+                                 /* indices                                        */
+  char *line_ptr;                /* A pointer to the line table                    */
+  char *code_ptr;                /* A pointer to the bytecode itself               */
+  int   code_size;               /* The size (in bytes) of the bytecode            */
+  int   stringtab_size;          /* The size (in bytes) of the string table        */
+  int   global_area_size;        /* The size (in words) of global area             */
+  int   public_symbols_number;   /* The number of public symbols                   */
+  int   global_symbols_number;   /* The number of global symbols                   */
+  int   units_number;            /* The number of units                            */
+  int   constants_number;        /* The number of constant pool entries            */
+  int   global_map_size;         /* The number of global map entries               */
+  int   lines_size;              /* The size (in bytes) of the line table          */
+  int  *stack_needs;             /* For each BEGIN offset: the number of stack     */
+                                 /* words a call needs above the locals (filled    */
+                                 /* by verification)                               */
+} bytefile;
+
+/* Accessors of a bytecode file (bytefile.c) */
+char* get_string           (bytefile *f, int pos);
+char* get_public_name      (bytefile *f, int i);
+int   get_public_offset    (bytefile *f, int i);
+int   find_public          (bytefile *f, char *name);
+char* get_global_name      (bytefile *f, int i);
+int   get_global_index     (bytefile *f, int i);
+int   get_global_flags     (bytefile *f, int i);
+char* get_unit_name        (bytefile *f, int u);
+int   get_unit_begin       (bytefile *f, int u);
+int   get_unit_end         (bytefile *f, int u);
+int   get_unit_init        (bytefile *f, int u);
+int   get_unit_checksum    (bytefile *f, int u);
+int   get_unit_constants   (bytefile *f, int u);
+int   get_unit_globals     (bytefile *f, int u);
+int   get_unit_lines       (bytefile *f, int u);
+int   count_unit_constants (bytefile *f, int u);
+int   count_unit_globals   (bytefile *f, int u);
+char* get_constant         (bytefile *f, int u, int i);
+int   get_global           (bytefile *f, int u, int i);
+int   unit_of              (bytefile *f, int pc);
+int   find_line            (bytefile *f, int u, int pc, int limit);
+
+/* Reading, checking and dumping of bytecode files (bytefile.c) */
+int          read_leb128 (char **ip, char *end, int sign, int *x);
+unsigned int adler32     (unsigned char *p, size_t n);
+bytefile*    read_file   (char *fname);
+void         disassemble (FILE *f, bytefile *bf);
+void         dump_file   (FILE *f, bytefile *bf);
+
+/* Reads a LEB128-encoded number of the code which is known to be
+   well-formed */
+static inline int leb128 (char **ip, int sign) {
+  int x = 0;
+
+  read_leb128 (ip, *ip + 5, sign, &x);
+
+  return x;
+}
+
+/* The operands of the instruction at ip of unit u of bf; FAIL reports the
+   opcode h-l */
+# define INT    (ip += sizeof (int), *(int*)(ip - sizeof (int)))
+# define UINT   leb128 (&ip, 0)
+# define SINT   leb128 (&ip, 1)
+# define BYTE   *ip++
+# define STRING get_constant (bf, u, UINT)
+# define FAIL   failure ("ERROR: invalid opcode %d-%d\n", h, l)
+/* Binary operators; each one has a plain instruction in the threaded code
+   and three fused ones: "LD; CONST; BINOP" (_LC), "LD; LD; BINOP" (_LL)
+   and "BINOP; CJMPz" (_JZ) */
+# define FOR_BINOPS(B, I)                                               \
+  B(ADD, I) B(SUB, I) B(MUL, I) B(DIV, I) B(MOD, I) B(LT, I) B(LE, I)   \
+  B(GT, I) B(GE, I) B(EQ, I) B(NE, I) B(AND, I) B(OR, I)
+
+# define BINOP_INSNS(x, I) I(x) I(x##_LC) I(x##_LL) I(x##_JZ)
+
+/* The instructions of the threaded code; each instruction is a handler
+   address followed by its (pre-decoded) operands */
+# define FOR_INSNS(I)                                                   \
+  FOR_BINOPS(BINOP_INSNS, I)                                            \
+  I(CONST) I(STRING) I(SEXP) I(STI) I(STA) I(JMP) I(END) I(DROP) I(DUP) \
+  I(SWAP) I(ELEM)                                                       \
+  I(LD_G) I(LD_L) I(LD_A) I(LD_C)                                       \
+  I(LDA_G) I(LDA_L) I(LDA_A) I(LDA_C)                                   \
+  I(ST_G) I(ST_L) I(ST_A) I(ST_C)                                       \
+  I(CJMPZ) I(CJMPNZ) I(BEGIN) I(CLOSURE) I(CALLC) I(CALL) I(TAG)        \
+  I(ARRAY) I(FAIL)                                                      \
+  I(PATT_STR) I(PATT_STRING) I(PATT_ARRAY) I(PATT_SEXP) I(PATT_BOXED)   \
+  I(PATT_UNBOXED) I(PATT_CLOSURE)                                       \
+  I(READ) I(WRITE) I(LENGTH) I(TOSTRING) I(BARRAY) I(EXTERN_CALL)       \
+  I(EXTERN_CLOSURE) I(CALL_LAZY) I(CLOSURE_LAZY)                        \
+  I(TAG_JNZ) I(ARRAY_JNZ) I(DUP_ELEM) I(DROP_JMP)                       \
+  I(ST_G_DROP) I(ST_L_DROP) I(ST_A_DROP) I(ST_C_DROP)                   \
+  I(COUNT) I(PROFILE) I(ENTER) I(LEAVE) I(HOT) I(NATIVE) I(STOP)
+
+# define INSN_ENUM(x) I_##x,
+
+enum { FOR_INSNS(INSN_ENUM) I_NUMBER };
+
+/* Gets a binary operator instruction (1 <= op <= 13) of a given kind (0 for
+   the plain one, 1 for _LC, 2 for _LL and 3 for _JZ) */
+# define BINOP_INSN(op, kind) (I_ADD + ((op)-1)*4 + (kind))
+
+/* The modes of running */
+# define RUN     0 /* plain run                                 */
+# define COUNT   1 /* count the executed instructions           */
+# define PROFILE 2 /* profile instructions and function calls   */
+# define JIT     3 /* compile hot functions into native code    */
+
+/* The size (in words) of the interpreter stack; the globals are placed at
+   its base */
+# define VM_STACK_SIZE (1 << 22)
+
+/* The size of a frame header: return address, caller's frame pointer,
+   caller's arguments pointer, current closure and the number of words to
+   drop from the caller's stack on return */
+# define FRAME 5
+
+/* The size (in words) of the area reserved for the threaded code; the
+   units are translated into it as they are loaded */
+# define VM_CODE_SIZE (1 << 24)
+
+/* The number of calls which makes a function hot in the JIT mode */
+# define JIT_THRESHOLD 100
+
+/* The state of the interpreter (byterun.c) */
+extern void     **code_begin, **code_end, **code_top;
+extern bytefile  *program;
+extern void     **handlers;
+extern int       *offsets;
+extern char      *loaded;
+extern int        run_mode;
+extern int        jit_threshold;
+extern size_t    *stack_end;
+extern size_t    *stack_top;
+/* The ways the control leaves an instruction */
+enum {V_NEXT, V_JUMP, V_BRANCH, V_RETURN, V_BEGIN, V_EOF};
+
+/* The properties of a decoded instruction */
+typedef struct {
+  int kind;     /* One of V_*                                               */
+  int pop;      /* The number of values taken from the stack                */
+  int push;     /* The number of values pushed onto the stack               */
+  int scratch;  /* The number of words used above the stack top             */
+  int target;   /* The jump target or -1                                    */
+  int callee;   /* The called (CALL) or enclosed (CLOSURE) function or -1   */
+  int a, l;     /* BEGIN: the numbers of arguments and locals; CALL: the    */
+                /* number of arguments; CLOSURE: the number of captured     */
+                /* values                                                   */
+  char *name;   /* The symbol of an extern call or closure or NULL          */
+} vinsn;
+
+/* The function being verified */
+typedef struct {
+  int nargs, nlocals, closure;
+  int captured;                  /* The number of captured values or -1 if */
+                                 /* the function is never enclosed         */
+} vfun;
+
+/* The verifier (verify.c) */
+char* decode (bytefile *bf, int u, char *ip, vinsn *v, vfun *fn);
+void  verify (bytefile *bf, int u);
+
+/* The interpreter (byterun.c) */
+void*  resolve        (char *name);
+void** load_unit      (int u);
+void** trampoline     (void **ip);
+size_t call_with_args (void *f, int n, size_t *args);
+void   interpret      (void **ip, size_t *stack, int nglobals, char *fname, void ***handlers);
+void   run            (bytefile *bf, char *fname, int mode);
+
+/* The JIT (jit.c) */
+extern size_t *jit_globals;
+extern char   *jit_fname;
+extern void** (*jit_enter) (void *a, size_t **sp, size_t **regs);
+
+void  jit_init    (void);
+void* jit_compile (int b);
+
+/* The public symbols of the files being linked: names, string indices of
+   the names and values (code offsets or global indices) in the linked file */
+typedef struct {
+  int    n;
+  char **names;
+  int   *strings;
+  int   *values;
+} symtab;
+
+/* The linker (link.c) */
+int  symtab_find (symtab *t, char *name);
+void symtab_add  (symtab *t, char *name, int string, int value);
+void link_files  (char *oname, int n, char *fnames[]);
+
+/* The translator into C (translate_c.c) */
+void translate_c (char *oname, char *fname);
+
+# endif
@@ -0,0 +1,633 @@
+/* Lama SM Bytecode baseline JIT */
+
+# include "byterun.h"
+
+/* Baseline JIT. In the JIT mode a function which has been called
+   jit_threshold times is compiled into x86 code, a template per
+   instruction. The native code works on the same stack and frames as the
+   threaded code: it keeps the stack pointer, the frame pointer and the
+   arguments pointer in %esi, %edi and %ebx, and the address of the stack
+   pointer of the interpreter (the end of the GC root region) in %ebp; the
+   stack pointer is stored there before each call of the runtime. Calls and
+   returns go through the threaded code: a callee is entered through its
+   threaded code (which for a compiled function is a NATIVE instruction),
+   and the return address of a call made by the native code is a piece of
+   threaded code which enters the native code back; when the threaded code
+   to go to is a NATIVE instruction, the native code jumps to its target
+   directly. A call of a function of a unit which is not loaded yet, and a
+   jump out of the function, continue in the threaded code until the
+   function returns */
+
+/* The size (in bytes) of the area reserved for the native code */
+# define JIT_CODE_SIZE (1 << 24)
+
+/* The size (in bytes) of the native stack frame: the outgoing arguments of
+   the calls of the runtime; keeps the stack 16-byte aligned */
+# define JIT_FRAME 44
+
+static unsigned char *jit_begin, *jit_end, *jit_top, *jit_p;
+static unsigned char *jit_exit, *jit_dispatch;
+size_t               *jit_globals;
+char                 *jit_fname;
+
+/* The entry of the native code: jumps to native code at a with the
+   interpreter's stack pointer variable sp and the frame and arguments
+   pointers regs[0] and regs[1]; updates them and returns the threaded code
+   to continue with when the native code leaves */
+void** (*jit_enter) (void *a, size_t **sp, size_t **regs);
+
+enum {EAX, ECX, EDX, EBX, ESP, EBP, ESI, EDI};
+
+/* Emits a byte, a word, a displacement of the jump to t */
+static void jb (int b) {
+  if (jit_p < jit_end) *jit_p = b;
+  jit_p++;
+}
+
+static void jw (int w) {
+  jb (w); jb (w >> 8); jb (w >> 16); jb (w >> 24);
+}
+
+static void jrel (void *t) {
+  jw ((unsigned char*) t - (jit_p + 4));
+}
+
+/* Emits a ModRM byte (with a SIB byte and a displacement if needed) of
+   register r and memory operand [b+d], of memory operand [a] and of
+   register operand m */
+static void jm (int r, int b, int d) {
+  int mod = d == 0 && b != EBP ? 0 : d >= -128 && d < 128 ? 1 : 2;
+  
+  jb ((mod << 6) | (r << 3) | b);
+  if (b == ESP) jb (0x24);
+  if (mod == 1) jb (d);
+  if (mod == 2) jw (d);
+}
+
+static void ja (int r, void *a) {
+  jb ((r << 3) | 5);
+  jw ((int) a);
+}
+
+static void jr (int r, int m) {
+  jb (0xC0 | (r << 3) | m);
+}
+
+/* Instructions: "op r, [b+d]", "mov [b+d], imm", "add/sub r, imm",
+   "push/pop r" of the interpreter stack */
+static void j_mem (int op, int r, int b, int d) {jb (op); jm (r, b, d);}
+static void j_imm (int b, int d, int x)         {jb (0xC7); jm (0, b, d); jw (x);}
+
+static void j_add (int r, int x) {
+  if (x >= -128 && x < 128) {jb (0x83); jr (0, r); jb (x);}
+  else {jb (0x81); jr (0, r); jw (x);}
+}
+
+static void j_push (int r) {j_mem (0x89, r, ESI, 0); j_add (ESI, 4);}
+static void j_pop  (int r) {j_add (ESI, -4); j_mem (0x8B, r, ESI, 0);}
+
+/* Emits a jump (cc < 0) or a conditional jump to native code t */
+static void j_jump (int cc, void *t) {
+  if (cc < 0) jb (0xE9); else {jb (0x0F); jb (0x80 | cc);}
+  jrel (t);
+}
+
+/* Emits a call of a C function f; the stack pointer is stored for the GC
+   first. The arguments are put into the native frame by j_arg (the k-th
+   value from the stack top) and j_arg_imm */
+static void j_arg     (int i, int k) {j_mem (0x8B, EAX, ESI, -4*k); j_mem (0x89, EAX, ESP, 4*i);}
+static void j_arg_imm (int i, int x) {j_imm (ESP, 4*i, x);}
+
+static void j_call (void *f) {
+  j_mem (0x89, ESI, EBP, 0);
+  jb (0xE8);
+  jrel (f);
+}
+
+/* Emits an access (op is 0x8B for a load, 0x89 for a store and 0x8D for
+   the address) of register r to variable i of kind d; the closure is
+   loaded into t */
+static void j_var (int op, int r, int d, int i, int t) {
+  switch (d) {
+  case 0: jb (op); ja (r, &jit_globals[i]); break;
+  case 1: j_mem (op, r, EDI, 4*i); break;
+  case 2: j_mem (op, r, EBX, 4*i); break;
+  case 3: j_mem (0x8B, t, EDI, -8); j_mem (op, r, t, 4*(i+1)); break;
+  }
+}
+
+/* Emits the computation of binary operator op (1 <= op <= 13) of %eax
+   and %ecx into %eax */
+static void j_binop (int op) {
+  static int cc [] = {0xC, 0xE, 0xF, 0xD, 0x4, 0x5};
+
+  if (op <= 5 || op >= 12) {
+    jb (0xD1); jr (7, EAX);                               /* sar eax, 1     */
+    jb (0xD1); jr (7, ECX);                               /* sar ecx, 1     */
+  }
+  
+  switch (op) {
+  case 1: jb (0x01); jr (ECX, EAX); break;                /* add eax, ecx   */
+  case 2: jb (0x29); jr (ECX, EAX); break;                /* sub eax, ecx   */
+  case 3: jb (0x0F); jb (0xAF); jr (EAX, ECX); break;     /* imul eax, ecx  */
+  case 4:
+  case 5:
+    jb (0x99);                                            /* cdq            */
+    jb (0xF7); jr (7, ECX);                               /* idiv ecx       */
+    if (op == 5) {jb (0x89); jr (EDX, EAX);}              /* mov eax, edx   */
+    break;
+  case 12:
+    jb (0x85); jr (EAX, EAX);                             /* test eax, eax  */
+    jb (0x0F); jb (0x95); jr (0, EAX);                    /* setne al       */
+    jb (0x85); jr (ECX, ECX);                             /* test ecx, ecx  */
+    jb (0x0F); jb (0x95); jr (0, ECX);                    /* setne cl       */
+    jb (0x20); jr (ECX, EAX);                             /* and al, cl     */
+    jb (0x0F); jb (0xB6); jr (EAX, EAX);                  /* movzx eax, al  */
+    break;
+  case 13:
+    jb (0x09); jr (ECX, EAX);                             /* or eax, ecx    */
+    jb (0x0F); jb (0x95); jr (0, EAX);                    /* setne al       */
+    jb (0x0F); jb (0xB6); jr (EAX, EAX);                  /* movzx eax, al  */
+    break;
+  default:
+    jb (0x39); jr (ECX, EAX);                             /* cmp eax, ecx   */
+    jb (0x0F); jb (0x90 | cc[op-6]); jr (0, EAX);         /* setcc al       */
+    jb (0x0F); jb (0xB6); jr (EAX, EAX);                  /* movzx eax, al  */
+  }
+
+  jb (0x8D); jb (0x44); jb (0x00); jb (0x01);             /* lea eax, [eax+eax+1] */
+}
+
+/* Emits a jump to the threaded code ip */
+static void j_leave (void *ip) {
+  jb (0xB8); jw ((int) ip);
+  j_jump (-1, jit_exit);
+}
+
+/* Makes a piece of threaded code which enters the native code at a */
+static void** jit_reentry (void *a) {
+  void **t = code_top;
+
+  if (code_top + 2 > code_end) {
+    failure ("ERROR: the threaded code area is exhausted\n");
+  }
+
+  t[0] = handlers[I_NATIVE];
+  t[1] = a;
+  code_top += 2;
+
+  return t;
+}
+
+/* Emits a call with n arguments of a bytecode function which entry is in
+   %eax */
+static void j_frame (int n) {
+  int r;
+
+  j_imm (ESI, 0, 0);
+  r = jit_p - 4 - jit_begin;
+  j_mem (0x89, EDI, ESI, 4);
+  j_mem (0x89, EBX, ESI, 8);
+  j_imm (ESI, 12, BOX (0));
+  j_imm (ESI, 16, BOX (n));
+  j_add (ESI, 4*FRAME);
+  j_jump (-1, jit_dispatch);
+  if (jit_p <= jit_end) *(void***) (jit_begin + r) = jit_reentry (jit_p);
+}
+
+/* The parts of the instructions which are not worth inlining; they are
+   the same as in the interpreter and return the new stack pointer */
+static size_t* jit_sexp (size_t *sp, int n, int tag) {
+  size_t x;
+  
+  memmove (sp-n+1, sp-n, n * sizeof (size_t));
+  sp[-n] = BOX (n+1);
+  sp[1]  = tag;
+  x = call_with_args (Bsexp, n+2, sp-n);
+  sp -= n;
+  *sp++ = x;
+
+  return sp;
+}
+
+static size_t* jit_barray (size_t *sp, int n) {
+  size_t x;
+  
+  memmove (sp-n+1, sp-n, n * sizeof (size_t));
+  sp[-n] = BOX (n);
+  x = call_with_args (Barray, n+1, sp-n);
+  sp -= n;
+  *sp++ = x;
+
+  return sp;
+}
+
+static size_t* jit_closure (size_t *sp, void **op, size_t *fp, size_t *args) {
+  int n = (int) op[1];
+  
+  sp[1] = (size_t) op[0];
+  sp[0] = BOX (n);
+  for (int i = 0; i<n; i++) {
+    int d = (int) op[2*i+2], j = (int) op[2*i+3];
+    sp[i+2] = d == 0 ? jit_globals[j] : d == 1 ? fp[j] : d == 2 ? args[j] : ((size_t*) fp[-2])[j+1];
+  }
+  *sp = call_with_args (Bclosure, n+2, sp);
+
+  return sp + 1;
+}
+
+/* Calls a closure with n arguments: calls a runtime function and returns
+   NULL, or pushes the frame of a call of a bytecode function (returning
+   into ret) and returns its entry */
+static void** jit_callc (size_t **spp, int n, void **ret, size_t *fp, size_t *args) {
+  size_t *sp = *spp, x = sp[-n-1];
+  
+  if (((void***) x)[0] >= code_begin && ((void***) x)[0] < code_end) {
+    sp[0] = (size_t) ret;
+    sp[1] = (size_t) fp;
+    sp[2] = (size_t) args;
+    sp[3] = x;
+    sp[4] = BOX (n+1);
+    *spp  = sp + FRAME;
+    return ((void***) x)[0];
+  }
+  
+  x = call_with_args (((void**) x)[0], n, sp-n);
+  sp -= n+1;
+  *sp++ = x;
+  *spp = sp;
+  
+  return NULL;
+}
+
+static void jit_overflow (void) {
+  failure ("stack overflow\n");
+}
+
+/* Makes the native code area and the sequences which enter the native
+   code, leave it and go to the threaded code in %eax */
+void jit_init (void) {
+  jit_begin = (unsigned char*) mmap (NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+  if (jit_begin == MAP_FAILED) {
+    failure ("%s\n", strerror (errno));
+  }
+
+  jit_end = jit_begin + JIT_CODE_SIZE;
+  jit_p   = jit_begin;
+
+  jit_enter = (void** (*) (void*, size_t**, size_t**)) jit_p;
+  jb (0x55); jb (0x53); jb (0x56); jb (0x57);         /* push ebp, ebx, esi, edi */
+  j_add (ESP, -JIT_FRAME);
+  j_mem (0x8B, EBP, ESP, JIT_FRAME + 24);
+  j_mem (0x8B, ECX, ESP, JIT_FRAME + 28);
+  j_mem (0x8B, ESI, EBP, 0);
+  j_mem (0x8B, EDI, ECX, 0);
+  j_mem (0x8B, EBX, ECX, 4);
+  j_mem (0xFF, 4, ESP, JIT_FRAME + 20);               /* jmp [a]                 */
+
+  jit_exit = jit_p;
+  j_mem (0x89, ESI, EBP, 0);
+  j_mem (0x8B, ECX, ESP, JIT_FRAME + 28);
+  j_mem (0x89, EDI, ECX, 0);
+  j_mem (0x89, EBX, ECX, 4);
+  j_add (ESP, JIT_FRAME);
+  jb (0x5F); jb (0x5E); jb (0x5B); jb (0x5D);         /* pop edi, esi, ebx, ebp  */
+  jb (0xC3);                                          /* ret                     */
+
+  jit_dispatch = jit_p;
+  jb (0x81); jm (7, EAX, 0); jw ((int) handlers[I_NATIVE]); /* cmp [eax], NATIVE    */
+  j_jump (0x5, jit_exit);
+  j_mem (0xFF, 4, EAX, 4);                            /* jmp [eax+4]             */
+
+  jit_top = jit_p;
+}
+
+/* Compiles the function starting at offset b of the program; returns the
+   entry of the native code or NULL if the native code area is exhausted */
+void* jit_compile (int b) {
+  
+# define OP(k)     ((int) tc[k])
+# define AT(pc)    at[(pc) - b]
+# define BRANCH(c) {jb (0xD1); jr (7, EAX); jb (0x85); jr (EAX, EAX); JUMP (c);}
+# define JUMP(c)   {j_jump (c, jit_p); fix[nfix].at = jit_p - 4; fix[nfix++].target = v.target;}
+  
+  static void *patt [] = {NULL, Bstring_tag_patt, Barray_tag_patt, Bsexp_tag_patt,
+                          Bboxed_patt, Bunboxed_patt, Bclosure_tag_patt};
+  bytefile *bf   = program;
+  char     *code = bf->code_ptr;
+  int       u    = unit_of (bf, b), end = b, nfix = 0;
+  unsigned char *entry = jit_top, **at;
+  struct {unsigned char *at; int target;} *fix;
+  vinsn     v;
+
+  /* The function spans up to the next one or to the end of the unit */
+  do end = decode (bf, u, code + end, &v, NULL) - code;
+  while (code[end] != 0x52 && code[end] != 0x53 && code[end] != (char) 0xFF);
+
+  at  = malloc ((end - b) * sizeof (unsigned char*));
+  fix = malloc ((end - b) * sizeof (*fix));
+
+  if (at == NULL || fix == NULL) {
+    failure ("*** FAILURE: unable to allocate memory.\n");
+  }
+
+  jit_p = entry;
+  
+  for (int pc = b, next; pc < end; pc = next) {
+    int    x  = code[pc] & 0xFF;
+    void **tc = &code_begin[offsets[pc]];
+
+    next     = decode (bf, u, code + pc, &v, NULL) - code;
+    AT (pc)  = jit_p;
+    
+    switch (x) {
+    case 0x01: case 0x02: case 0x03: case 0x04: case 0x05: case 0x06: case 0x07:
+    case 0x08: case 0x09: case 0x0A: case 0x0B: case 0x0C: case 0x0D:
+      j_pop (ECX);
+      j_mem (0x8B, EAX, ESI, -4);
+      j_binop (x);
+      j_mem (0x89, EAX, ESI, -4);
+      break;
+      
+    case 0x10: j_imm (ESI, 0, OP (1)); j_add (ESI, 4); break;
+      
+    case 0x11: j_arg_imm (0, OP (1)); j_call (Bstring); j_push (EAX); break;
+      
+    case 0x12:
+      j_mem (0x89, ESI, ESP, 0); j_arg_imm (1, OP (1)); j_arg_imm (2, OP (2));
+      j_call (jit_sexp);
+      jb (0x89); jr (EAX, ESI);
+      break;
+      
+    case 0x13:
+      j_pop (EAX);
+      j_mem (0x8B, ECX, ESI, -4);
+      j_mem (0x89, EAX, ECX, 0);
+      j_mem (0x89, EAX, ESI, -4);
+      break;
+      
+    case 0x14:
+      j_arg (0, 1); j_arg (1, 2); j_arg (2, 3);
+      j_call (Bsta);
+      j_add (ESI, -8);
+      j_mem (0x89, EAX, ESI, -4);
+      break;
+
+    case 0x15: JUMP (-1); break;
+      
+    case 0x16:
+    case 0x17:
+      j_mem (0x8B, EAX, ESI, -4);
+      j_mem (0x8D, ESI, EDI, -4*FRAME);
+      j_mem (0x8B, ECX, ESI, 16);
+      j_mem (0x8B, EDX, ESI, 0);
+      j_mem (0x8B, EDI, ESI, 4);
+      j_mem (0x8B, EBX, ESI, 8);
+      jb (0xD1); jr (7, ECX);                             /* sar ecx, 1    */
+      jb (0xC1); jr (4, ECX); jb (2);                     /* shl ecx, 2    */
+      jb (0x29); jr (ECX, ESI);                           /* sub esi, ecx  */
+      j_push (EAX);
+      jb (0x89); jr (EDX, EAX);                           /* mov eax, edx  */
+      j_jump (-1, jit_dispatch);
+      break;
+
+    case 0x18: j_add (ESI, -4); break;
+    case 0x19: j_mem (0x8B, EAX, ESI, -4); j_push (EAX); break;
+      
+    case 0x1A:
+      j_mem (0x8B, EAX, ESI, -4);
+      j_mem (0x8B, ECX, ESI, -8);
+      j_mem (0x89, ECX, ESI, -4);
+      j_mem (0x89, EAX, ESI, -8);
+      break;
+      
+    case 0x1B:
+      j_arg (0, 2); j_arg (1, 1);
+      j_call (Belem);
+      j_add (ESI, -4);
+      j_mem (0x89, EAX, ESI, -4);
+      break;
+
+    case 0x20: case 0x21: case 0x22: case 0x23:
+      j_var (0x8B, EAX, x & 3, OP (1), ECX);
+      j_push (EAX);
+      break;
+      
+    case 0x30: case 0x31: case 0x32: case 0x33:
+      j_var (0x8D, EAX, x & 3, OP (1), ECX);
+      j_push (EAX);
+      j_push (EAX);
+      break;
+      
+    case 0x40: case 0x41: case 0x42: case 0x43:
+      j_mem (0x8B, EAX, ESI, -4);
+      j_var (0x89, EAX, x & 3, OP (1), ECX);
+      break;
+
+    case 0x50: j_pop (EAX); BRANCH (0x4); break;
+    case 0x51: j_pop (EAX); BRANCH (0x5); break;
+      
+    case 0x52:
+    case 0x53:
+      tc += 3;
+      jb (0x89); jr (ESI, EDI);                           /* mov edi, esi  */
+      j_mem (0x8D, EBX, ESI, -4 * (FRAME + OP (1)));
+      j_mem (0x8D, EAX, ESI, 4 * (OP (2) + OP (3)));
+      jb (0x3B); ja (EAX, &stack_end);                    /* cmp eax, [stack_end] */
+      jb (0x72); jb (5);                                  /* jb +5         */
+      jb (0xE8); jrel (jit_overflow);
+      if (OP (2) <= 16) {
+        for (int i = 0; i < OP (2); i++) j_imm (ESI, 4*i, BOX (0));
+        j_add (ESI, 4 * OP (2));
+      }
+      else {
+        jb (0xB9); jw (OP (2));                           /* mov ecx, l    */
+        j_imm (ESI, 0, BOX (0));
+        j_add (ESI, 4);
+        jb (0x49);                                        /* dec ecx       */
+        jb (0x75); jb (-12);                              /* jnz -12       */
+      }
+      break;
+
+    case 0x54:
+      j_mem (0x89, ESI, ESP, 0); j_arg_imm (1, (int) &tc[1]);
+      j_mem (0x89, EDI, ESP, 8); j_mem (0x89, EBX, ESP, 12);
+      j_call (jit_closure);
+      jb (0x89); jr (EAX, ESI);
+      break;
+      
+    case 0x55: {
+      int r;
+      
+      j_mem (0x89, EBP, ESP, 0); j_arg_imm (1, OP (1)); j_arg_imm (2, 0);
+      r = jit_p - 4 - jit_begin;
+      j_mem (0x89, EDI, ESP, 12); j_mem (0x89, EBX, ESP, 16);
+      j_call (jit_callc);
+      j_mem (0x8B, ESI, EBP, 0);
+      jb (0x85); jr (EAX, EAX);                           /* test eax, eax */
+      j_jump (0x5, jit_dispatch);
+      if (jit_p <= jit_end) *(void***) (jit_begin + r) = jit_reentry (jit_p);
+      break;
+    }
+
+    case 0x56:
+    call:
+      if (tc[0] == handlers[I_CALL]) {jb (0xB8); jw (OP (1));}
+      else {
+        /* the call is made by the threaded code until it is patched */
+        jb (0xA1); jw ((int) &tc[0]);                     /* mov eax, [tc] */
+        jb (0x3D); jw ((int) handlers[I_CALL]);           /* cmp eax, CALL */
+        jb (0x74); jb (10);                               /* je +10        */
+        j_leave (tc);
+        jb (0xA1); jw ((int) &tc[1]);                     /* mov eax, [tc+1] */
+      }
+      j_frame (OP (2));
+      break;
+
+    case 0x57:
+      j_arg (0, 1); j_arg_imm (1, OP (1)); j_arg_imm (2, OP (2));
+      j_call (Btag);
+      j_mem (0x89, EAX, ESI, -4);
+      break;
+      
+    case 0x58:
+      j_arg (0, 1); j_arg_imm (1, OP (1));
+      j_call (Barray_patt);
+      j_mem (0x89, EAX, ESI, -4);
+      break;
+      
+    case 0x59:
+      j_arg (0, 1); j_arg_imm (1, (int) jit_fname); j_arg_imm (2, OP (1)); j_arg_imm (3, OP (2));
+      j_call (Bmatch_failure);
+      break;
+      
+    case 0x60:
+      j_arg (0, 2); j_arg (1, 1);
+      j_call (Bstring_patt);
+      j_add (ESI, -4);
+      j_mem (0x89, EAX, ESI, -4);
+      break;
+      
+    case 0x61: case 0x62: case 0x63: case 0x64: case 0x65: case 0x66:
+      j_arg (0, 1);
+      j_call (patt[x - 0x60]);
+      j_mem (0x89, EAX, ESI, -4);
+      break;
+
+    case 0x70: j_call (Lread); j_push (EAX); break;
+      
+    case 0x71:
+    case 0x72:
+    case 0x73:
+      j_arg (0, 1);
+      j_call (x == 0x71 ? (void*) Lwrite : x == 0x72 ? (void*) Llength : (void*) Lstring);
+      j_mem (0x89, EAX, ESI, -4);
+      break;
+
+    case 0x74:
+      j_mem (0x89, ESI, ESP, 0); j_arg_imm (1, OP (1));
+      j_call (jit_barray);
+      jb (0x89); jr (EAX, ESI);
+      break;
+
+    case 0x75:
+      if (tc[0] != handlers[I_EXTERN_CALL]) goto call;
+      j_arg_imm (0, OP (1)); j_arg_imm (1, OP (2));
+      j_mem (0x8D, EAX, ESI, -4 * OP (2)); j_mem (0x89, EAX, ESP, 8);
+      j_call (call_with_args);
+      j_add (ESI, -4 * OP (2));
+      j_push (EAX);
+      break;
+
+    case 0x76:
+      if (tc[0] == handlers[I_EXTERN_CLOSURE]) j_arg_imm (1, OP (1));
+      else {
+        /* the same for a closure */
+        jb (0xA1); jw ((int) &tc[0]);
+        jb (0x3D); jw ((int) handlers[I_EXTERN_CLOSURE]);
+        jb (0x74); jb (10);
+        j_leave (tc);
+        jb (0xA1); jw ((int) &tc[1]);
+        j_mem (0x89, EAX, ESP, 4);
+      }
+      j_arg_imm (0, BOX (0));
+      j_call (Bclosure);
+      j_push (EAX);
+      break;
+
+    case 0x80:
+      j_arg (0, 1); j_arg_imm (1, OP (1)); j_arg_imm (2, OP (2));
+      j_call (Btag);
+      BRANCH (0x5);
+      break;
+      
+    case 0x81:
+      j_arg (0, 1); j_arg_imm (1, OP (1));
+      j_call (Barray_patt);
+      BRANCH (0x5);
+      break;
+      
+    case 0x82:
+      j_arg (0, 1); j_arg_imm (1, OP (1));
+      j_call (Belem);
+      j_push (EAX);
+      break;
+      
+    case 0x83: j_add (ESI, -4); JUMP (-1); break;
+      
+    case 0x84:
+      j_var (0x8B, EAX, OP (1), OP (2), ECX);
+      jb (0xB9); jw (OP (3));                             /* mov ecx, y    */
+      j_binop (code[pc+1]);
+      j_push (EAX);
+      break;
+      
+    case 0x85:
+      j_var (0x8B, EAX, OP (1), OP (2), ECX);
+      j_var (0x8B, ECX, OP (3), OP (4), ECX);
+      j_binop (code[pc+1]);
+      j_push (EAX);
+      break;
+      
+    case 0x86:
+      j_pop (ECX);
+      j_pop (EAX);
+      j_binop (code[pc+1]);
+      BRANCH (0x4);
+      break;
+      
+    case 0x90: case 0x91: case 0x92: case 0x93:
+      j_pop (EAX);
+      j_var (0x89, EAX, x & 3, OP (1), ECX);
+      break;
+    }
+  }
+
+  /* The jumps out of the function continue in the threaded code */
+  for (int i = 0; i < nfix; i++) {
+    int t = fix[i].target;
+    
+    if (t >= b && t < end) t = AT (t) - (fix[i].at + 4);
+    else {
+      t = jit_p - (fix[i].at + 4);
+      j_leave (&code_begin[offsets[fix[i].target]]);
+    }
+
+    if (jit_p <= jit_end) *(int*) fix[i].at = t;
+  }
+
+  free (at);
+  free (fix);
+
+  if (jit_p > jit_end) return NULL;
+
+  jit_top = jit_p;
+
+  return entry;
+
+# undef JUMP
+# undef BRANCH
+# undef AT
+# undef OP
+}
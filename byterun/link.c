@@ -0,0 +1,189 @@
+/* Lama SM Bytecode linker */
+
+# include "byterun.h"
+
+/* Finds a value of a symbol by name; returns -1 if not found */
+int symtab_find (symtab *t, char *name) {
+  for (int i = 0; i < t->n; i++)
+    if (strcmp (t->names[i], name) == 0) return t->values[i];
+
+  return -1;
+}
+
+/* Adds a symbol */
+void symtab_add (symtab *t, char *name, int string, int value) {
+  if (symtab_find (t, name) >= 0) {
+    failure ("ERROR: duplicate definition of '%s'\n", name);
+  }
+
+  t->names   = (char**) realloc (t->names  , (t->n + 1) * sizeof (char*));
+  t->strings = (int*)   realloc (t->strings, (t->n + 1) * sizeof (int));
+  t->values  = (int*)   realloc (t->values , (t->n + 1) * sizeof (int));
+
+  if (t->names == NULL || t->strings == NULL || t->values == NULL) {
+    failure ("*** FAILURE: unable to allocate memory.\n");
+  }
+
+  t->names  [t->n] = name;
+  t->strings[t->n] = string;
+  t->values [t->n] = value;
+  t->n++;
+}
+
+/* Links bytecode files into one: concatenates their code, string tables,
+   constant pools, global maps, line tables and global areas. The code of
+   the units is kept as is: the constants are shifted to the linked string
+   table, the global maps --- to the linked global area, with the imported
+   global variables mapped to the public ones, and the calls of imported
+   functions are bound by their names when the units are loaded, so the
+   linked file is loaded lazily */
+void link_files (char *oname, int n, char *fnames[]) {
+  bytefile       **bf     = (bytefile**) malloc (n * sizeof (bytefile*));
+  int            **gmap   = (int**) malloc (n * sizeof (int*)),
+                  *cb     = (int*) malloc (n * sizeof (int)),
+                  *sb     = (int*) malloc (n * sizeof (int)),
+                  *gb     = (int*) malloc (n * sizeof (int)),
+                  *cnb    = (int*) malloc (n * sizeof (int)),
+                  *mb     = (int*) malloc (n * sizeof (int)),
+                  *lb     = (int*) malloc (n * sizeof (int)),
+                   code_size = 0, st_size = 0, globals = 0, units = 0,
+                   constants = 0, map_size = 0, lines_size = 0, size, k, i;
+  symtab           funs   = {0, NULL, NULL, NULL},
+                   vars   = {0, NULL, NULL, NULL};
+  bytefile_header *h;
+  char            *file, *meta, *lines, *st, *code;
+  int             *p, *cp, *mp;
+  FILE            *f;
+  
+  if (bf == NULL || gmap == NULL || cb == NULL || sb == NULL || gb == NULL || cnb == NULL || mb == NULL || lb == NULL) {
+    failure ("*** FAILURE: unable to allocate memory.\n");
+  }
+
+  for (k = 0; k < n; k++) {
+    bf[k] = read_file (fnames[k]);
+
+    for (i = 0; i < bf[k]->units_number; i++) verify (bf[k], i);
+
+    cb[k]       = code_size;
+    sb[k]       = st_size;
+    gb[k]       = globals;
+    cnb[k]      = constants;
+    mb[k]       = map_size;
+    lb[k]       = lines_size;
+    code_size  += bf[k]->code_size;
+    st_size    += bf[k]->stringtab_size;
+    globals    += bf[k]->global_area_size;
+    units      += bf[k]->units_number;
+    constants  += bf[k]->constants_number;
+    map_size   += bf[k]->global_map_size;
+    lines_size += bf[k]->lines_size;
+
+    for (i = 0; i < bf[k]->public_symbols_number; i++)
+      symtab_add (&funs, get_public_name (bf[k], i), bf[k]->public_ptr[i*2] + sb[k], get_public_offset (bf[k], i) + cb[k]);
+
+    for (i = 0; i < bf[k]->global_symbols_number; i++)
+      if (get_global_flags (bf[k], i) & GLOBAL_PUBLIC)
+        symtab_add (&vars, get_global_name (bf[k], i), bf[k]->global_ptr[i*3] + sb[k], get_global_index (bf[k], i) + gb[k]);
+  }
+
+  for (k = 0; k < n; k++) {
+    if ((gmap[k] = (int*) malloc ((bf[k]->global_area_size + 1) * sizeof (int))) == NULL) {
+      failure ("*** FAILURE: unable to allocate memory.\n");
+    }
+
+    for (i = 0; i < bf[k]->global_area_size; i++) gmap[k][i] = gb[k] + i;
+
+    for (i = 0; i < bf[k]->global_symbols_number; i++)
+      if (get_global_flags (bf[k], i) == GLOBAL_EXTERN) {
+        int t = symtab_find (&vars, get_global_name (bf[k], i));
+
+        if (t < 0) {
+          failure ("ERROR: undefined global variable '%s'\n", get_global_name (bf[k], i));
+        }
+        
+        gmap[k][get_global_index (bf[k], i)] = t;
+      }
+  }
+
+  size = sizeof (bytefile_header) + (funs.n * 2 + vars.n * 3 + units * UNIT_FIELDS + constants + map_size) * sizeof (int) + lines_size + st_size + code_size;
+  
+  if ((file = (char*) malloc (size)) == NULL) {
+    failure ("*** FAILURE: unable to allocate memory.\n");
+  }
+
+  h     = (bytefile_header*) file;
+  meta  = file + sizeof (bytefile_header);
+  code  = file + size - code_size;
+  st    = code - st_size;
+  lines = st - lines_size;
+  mp    = (int*) lines - map_size;
+  cp    = mp - constants;
+  p     = (int*) meta;
+  
+  for (i = 0; i < funs.n; i++) {*p++ = funs.strings[i]; *p++ = funs.values[i];}
+  for (i = 0; i < vars.n; i++) {*p++ = vars.strings[i]; *p++ = vars.values[i]; *p++ = GLOBAL_PUBLIC;}
+
+  for (k = 0; k < n; k++) {
+    memcpy (st    + sb[k], bf[k]->string_ptr, bf[k]->stringtab_size);
+    memcpy (lines + lb[k], bf[k]->line_ptr  , bf[k]->lines_size);
+    memcpy (code  + cb[k], bf[k]->code_ptr  , bf[k]->code_size);
+
+    for (i = 0; i < bf[k]->constants_number; i++) cp[cnb[k] + i] = bf[k]->constant_ptr[i] + sb[k];
+    for (i = 0; i < bf[k]->global_map_size; i++) mp[mb[k] + i] = gmap[k][bf[k]->global_map_ptr[i]];
+
+    for (i = 0; i < bf[k]->units_number; i++) {
+      int init = get_unit_init (bf[k], i);
+      
+      *p++ = bf[k]->unit_ptr[i*UNIT_FIELDS] + sb[k];
+      *p++ = get_unit_begin (bf[k], i) + cb[k];
+      *p++ = get_unit_end (bf[k], i) + cb[k];
+      *p++ = init < 0 ? -1 : init + cb[k];
+      *p++ = get_unit_checksum (bf[k], i);
+      *p++ = get_unit_constants (bf[k], i) + cnb[k];
+      *p++ = get_unit_globals (bf[k], i) + mb[k];
+      *p++ = get_unit_lines (bf[k], i) + lb[k];
+    }
+  }
+
+  h->magic                 = BYTEFILE_MAGIC;
+  h->version               = BYTEFILE_VERSION;
+  h->global_area_size      = globals;
+  h->public_symbols_number = funs.n;
+  h->public_offset         = sizeof (bytefile_header);
+  h->global_symbols_number = vars.n;
+  h->global_symbols_offset = h->public_offset + funs.n * 2 * sizeof (int);
+  h->units_number          = units;
+  h->units_offset          = h->global_symbols_offset + vars.n * 3 * sizeof (int);
+  h->constants_number      = constants;
+  h->constants_offset      = (char*) cp - file;
+  h->global_map_size       = map_size;
+  h->global_map_offset     = (char*) mp - file;
+  h->lines_size            = lines_size;
+  h->lines_offset          = lines - file;
+  h->stringtab_offset      = st - file;
+  h->stringtab_size        = st_size;
+  h->code_offset           = code - file;
+  h->code_size             = code_size;
+  h->checksum              = adler32 ((unsigned char*) meta, code - meta);
+  
+  if ((f = fopen (oname, "wb")) == NULL || fwrite (file, 1, size, f) != size || fclose (f) != 0) {
+    failure ("%s: %s\n", oname, strerror (errno));
+  }
+
+  /* The calls of imported functions are checked in the linked file; the
+     functions not defined in the bytecode must be defined in the runtime */
+  bf[0] = read_file (oname);
+  
+  for (i = 0; i < units; i++) {
+    char  *ip = bf[0]->code_ptr + get_unit_begin (bf[0], i);
+    vinsn  v;
+    
+    verify (bf[0], i);
+
+    do {
+      ip = decode (bf[0], i, ip, &v, NULL);
+      if (v.name != NULL && find_public (bf[0], v.name) < 0) resolve (v.name);
+    }
+    while (v.kind != V_EOF);
+  }
+}
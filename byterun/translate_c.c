@@ -0,0 +1,459 @@
+/* Lama SM Bytecode translator into C */
+
+# include "byterun.h"
+
+/* Translation into C. Each function (a BEGIN) becomes a C function
+   "word f_<offset> (word *args, int n, word closure)", and so does a
+   closure of a runtime function (an adapter x_<name>). The operand stack
+   of a function is mapped to C locals s0, s1, ... (its depth at each
+   instruction is known statically), while the globals, the arguments and
+   the locals live in a stack which is registered as a GC root region, as
+   in the interpreter: the frame of a function holds its closure, its
+   locals and the spill slots of its operand stack. Before a call which
+   may run the GC the live part of the operand stack is spilled and the
+   end of the root region is set; the values are reloaded after the call.
+   The units of a linked file are initialized on first call */
+
+static char *c_prelude =
+  "# include <stdint.h>\n"
+  "\n"
+  "typedef intptr_t word;\n"
+  "typedef word   (*code) (word*, int, word);\n"
+  "\n"
+  "# define UNBOX(x)   ((x) >> 1)\n"
+  "# define BOX(x)     ((((word) (x)) << 1) | 1)\n"
+  "# define ADD(x, y)  BOX (UNBOX (x) + UNBOX (y))\n"
+  "# define SUB(x, y)  BOX (UNBOX (x) - UNBOX (y))\n"
+  "# define MUL(x, y)  BOX (UNBOX (x) * UNBOX (y))\n"
+  "# define DIV(x, y)  BOX (UNBOX (x) / UNBOX (y))\n"
+  "# define MOD(x, y)  BOX (UNBOX (x) % UNBOX (y))\n"
+  "# define LT(x, y)   BOX ((x) <  (y))\n"
+  "# define LE(x, y)   BOX ((x) <= (y))\n"
+  "# define GT(x, y)   BOX ((x) >  (y))\n"
+  "# define GE(x, y)   BOX ((x) >= (y))\n"
+  "# define EQ(x, y)   BOX ((x) == (y))\n"
+  "# define NE(x, y)   BOX ((x) != (y))\n"
+  "# define AND(x, y)  BOX (UNBOX (x) != 0 && UNBOX (y) != 0)\n"
+  "# define OR(x, y)   BOX ((UNBOX (x) | UNBOX (y)) != 0)\n"
+  "\n"
+  "# define STACK_SIZE (1 << 22)\n"
+  "\n"
+  "void *__start_custom_data;\n"
+  "void *__stop_custom_data;\n"
+  "\n"
+  "extern void __gc_init        (void);\n"
+  "extern void push_root_region (void**, void***);\n"
+  "extern void set_args         (int, char*[]);\n"
+  "extern void failure          (char*, ...);\n"
+  "extern int  LtagHash         (char*);\n"
+  "extern word Lread (), Lwrite (), Llength (), Lstring (), Bstring (), Belem (), Bsta (),\n"
+  "            Barray (), Bsexp (), Bclosure (), Btag (), Barray_patt (), Bstring_patt (),\n"
+  "            Bstring_tag_patt (), Barray_tag_patt (), Bsexp_tag_patt (), Bboxed_patt (),\n"
+  "            Bunboxed_patt (), Bclosure_tag_patt (), Bmatch_failure ();\n"
+  "\n"
+  "static word stack [STACK_SIZE], *sp;\n"
+  "\n"
+  "/* Calls a runtime function f with n arguments a[0], ..., a[n-1] */\n"
+  "static word call_n (word (*f) (), int n, word *a) {\n"
+  "  switch (n) {\n"
+  "  case 0: return f ();\n"
+  "  case 1: return f (a[0]);\n"
+  "  case 2: return f (a[0], a[1]);\n"
+  "  case 3: return f (a[0], a[1], a[2]);\n"
+  "  case 4: return f (a[0], a[1], a[2], a[3]);\n"
+  "  case 5: return f (a[0], a[1], a[2], a[3], a[4]);\n"
+  "  case 6: return f (a[0], a[1], a[2], a[3], a[4], a[5]);\n"
+  "  case 7: return f (a[0], a[1], a[2], a[3], a[4], a[5], a[6]);\n"
+  "  case 8: return f (a[0], a[1], a[2], a[3], a[4], a[5], a[6], a[7]);\n"
+  "  }\n"
+  "\n"
+  "  failure (\"too many arguments of a runtime function\\n\");\n"
+  "  return 0;\n"
+  "}\n";
+
+/* Prints a C string literal */
+static void c_string (FILE *f, char *s) {
+  fputc ('"', f);
+  
+  for (; *s; s++)
+    if (*s == '"' || *s == '\\' || *s == '?') fprintf (f, "\\%c", *s);
+    else if (*s >= ' ' && *s < 127) fputc (*s, f);
+    else fprintf (f, "\\%03o", (unsigned char) *s);
+
+  fputc ('"', f);
+}
+
+/* Gets an index of a name in a table of names, adding it if needed */
+static int c_name (symtab *t, char *name) {
+  for (int i = 0; i < t->n; i++)
+    if (strcmp (t->names[i], name) == 0) return i;
+
+  symtab_add (t, name, 0, 0);
+  
+  return t->n - 1;
+}
+
+/* Gets a C lvalue of a variable of kind d of a unit */
+static char* c_var (bytefile *bf, int u, int d, int i) {
+  static char buf [4][32];
+  static int  k = 0;
+  char       *s = buf[k++ & 3];
+
+  switch (d) {
+  case 0: sprintf (s, "stack[%d]", get_global (bf, u, i)); break;
+  case 1: sprintf (s, "fp[%d]", i+1); break;
+  case 2: sprintf (s, "args[%d]", i); break;
+  case 3: sprintf (s, "((word*) fp[0])[%d]", i+1); break;
+  }
+
+  return s;
+}
+
+/* Translates a function of a unit spanning the code from b to end */
+static void c_function (FILE *f, bytefile *bf, int u, int b, int end, symtab *tags) {
+
+# define AT(a, pc)      a[(pc) - b]
+# define SUCC(t, d)     {if ((t) < b || (t) >= end) failure ("ERROR: a jump out of the function at 0x%.8x\n", pc); \
+                         if (AT (depth, t) < 0) {AT (depth, t) = d; work[nwork++] = t;}}
+# define SPILL(d)       {for (int k = 0; k < (d); k++) fprintf (f, "fp[%d] = s%d; ", base+k, k); \
+                         fprintf (f, "sp = fp + %d;\n  ", base + (d));}
+# define RELOAD(d)      {for (int k = 0; k < (d); k++) fprintf (f, " s%d = fp[%d];", k, base+k);}
+# define ARGS(d, n)     {for (int k = (d)-(n); k < (d); k++) fprintf (f, ", s%d", k);}
+# define LOAD(t)        if (unit_of (bf, t) != u) fprintf (f, "if (!loaded[%d]) load_%d ();\n  ", unit_of (bf, t), unit_of (bf, t))
+# define CALL(t, n)     {SPILL (d); LOAD (t); \
+                         fprintf (f, "s%d = f_%d (&fp[%d], %d, BOX (0));", d-(n), t, base+d-(n), n); RELOAD (d-(n));}
+  
+  static char *binops [] = {"ADD", "SUB", "MUL", "DIV", "MOD", "LT", "LE", "GT", "GE", "EQ", "NE", "AND", "OR"};
+  static char *patts  [] = {"Bstring_patt", "Bstring_tag_patt", "Barray_tag_patt", "Bsexp_tag_patt",
+                            "Bboxed_patt", "Bunboxed_patt", "Bclosure_tag_patt"};
+  char  *code   = bf->code_ptr, *ip;
+  int   *depth  = (int*) malloc ((end - b) * sizeof (int)),
+        *work   = (int*) malloc ((end - b) * sizeof (int)),
+         nwork  = 0, max = 0, nlocals, base;
+  char  *labels = (char*) calloc (end - b, 1);
+  vinsn  v;
+
+  if (depth == NULL || work == NULL || labels == NULL) {
+    failure ("*** FAILURE: unable to allocate memory.\n");
+  }
+
+  decode (bf, u, code + b, &v, NULL);
+  nlocals = v.l;
+  base    = nlocals + 1;
+  
+  /* The depths of the operand stack */
+  for (int pc = b; pc < end; pc++) AT (depth, pc) = -1;
+  AT (depth, b) = 0;
+  work[nwork++] = b;
+  
+  while (nwork > 0) {
+    int pc = work[--nwork], next = decode (bf, u, code + pc, &v, NULL) - code,
+        d  = AT (depth, pc) - v.pop + v.push;
+
+    if (AT (depth, pc) > max) max = AT (depth, pc);
+    if (d > max) max = d;
+
+    if (v.kind == V_NEXT || v.kind == V_BEGIN || v.kind == V_BRANCH) SUCC (next, d);
+    if (v.kind == V_JUMP || v.kind == V_BRANCH) {SUCC (v.target, d); AT (labels, v.target) = 1;}
+  }
+
+  for (int i = 0; i < bf->public_symbols_number; i++)
+    if (get_public_offset (bf, i) == b) fprintf (f, "/* %s */\n", get_public_name (bf, i));
+  
+  fprintf (f, "static word f_%d (word *args, int n, word c) {\n  word *fp = sp", b);
+  for (int k = 0; k < max; k++) fprintf (f, ", s%d", k);
+  fprintf (f, ";\n\n  if (fp + %d >= stack + STACK_SIZE) failure (\"stack overflow\\n\");\n", base + max);
+  fprintf (f, "  fp[0] = c;\n");
+  if (nlocals > 0) fprintf (f, "  for (int i = 1; i <= %d; i++) fp[i] = BOX (0);\n", nlocals);
+  
+  for (int pc = b, next; pc < end; pc = next) {
+    int  d = AT (depth, pc);
+    char x = code[pc], h = (x & 0xF0) >> 4, l = x & 0x0F;
+
+    next = decode (bf, u, code + pc, &v, NULL) - code;
+    ip   = code + pc + 1;
+    
+    if (d < 0) continue;
+    
+    if (AT (labels, pc)) fprintf (f, " L_%d:\n", pc);
+    fprintf (f, "  ");
+    
+    switch (h) {
+    case 0: fprintf (f, "s%d = %s (s%d, s%d);", d-2, binops[l-1], d-2, d-1); break;
+      
+    case 1:
+      switch (l) {
+      case  0: fprintf (f, "s%d = BOX (%d);", d, SINT); break;
+      case  1:
+        SPILL (d);
+        fprintf (f, "s%d = Bstring (", d); c_string (f, STRING); fprintf (f, ");");
+        RELOAD (d);
+        break;
+      case  2: {
+        int t = c_name (tags, STRING), n = UINT;
+        
+        SPILL (d);
+        fprintf (f, "s%d = Bsexp (BOX (%d)", d-n, n+1); ARGS (d, n); fprintf (f, ", tags[%d]);", t);
+        RELOAD (d-n);
+        break;
+      }
+      case  3: fprintf (f, "* (word*) s%d = s%d; s%d = s%d;", d-2, d-1, d-2, d-1); break;
+      case  4: fprintf (f, "s%d = Bsta (s%d, s%d, s%d);", d-3, d-1, d-2, d-3); break;
+      case  5: fprintf (f, "goto L_%d;", INT); break;
+      case  6:
+      case  7: fprintf (f, "sp = fp; return s%d;", d-1); break;
+      case  8: fprintf (f, ";"); break;
+      case  9: fprintf (f, "s%d = s%d;", d, d-1); break;
+      case 10: fprintf (f, "{word t = s%d; s%d = s%d; s%d = t;}", d-1, d-1, d-2, d-2); break;
+      case 11: fprintf (f, "s%d = Belem (s%d, s%d);", d-2, d-2, d-1); break;
+      }
+      break;
+
+    case 2: fprintf (f, "s%d = %s;", d, c_var (bf, u, l, UINT)); break;
+    case 3: fprintf (f, "s%d = s%d = (word) &%s;", d, d+1, c_var (bf, u, l, UINT)); break;
+    case 4: fprintf (f, "%s = s%d;", c_var (bf, u, l, UINT), d-1); break;
+      
+    case 5:
+      switch (l) {
+      case  0: fprintf (f, "if (UNBOX (s%d) == 0) goto L_%d;", d-1, INT); break;
+      case  1: fprintf (f, "if (UNBOX (s%d) != 0) goto L_%d;", d-1, INT); break;
+      case  2:
+      case  3: fprintf (f, ";"); break;
+      case  4: {
+        int t = INT, n = UINT;
+
+        SPILL (d);
+        fprintf (f, "s%d = Bclosure (BOX (%d), f_%d", d, n, t);
+        for (int i = 0; i < n; i++) {
+          int k = UINT;
+          fprintf (f, ", %s", c_var (bf, u, k & 3, k >> 2));
+        }
+        fprintf (f, ");");
+        RELOAD (d);
+        break;
+      }
+      case  5: {
+        int n = UINT;
+
+        SPILL (d);
+        fprintf (f, "s%d = ((code) * (void**) s%d) (&fp[%d], %d, s%d);", d-n-1, d-n-1, base+d-n, n, d-n-1);
+        RELOAD (d-n-1);
+        break;
+      }
+      case  6: {
+        int t = INT, n = UINT;
+        
+        CALL (t, n);
+        break;
+      }
+      case  7: {
+        int t = c_name (tags, STRING), n = UINT;
+
+        fprintf (f, "s%d = Btag (s%d, tags[%d], BOX (%d));", d-1, d-1, t, n);
+        break;
+      }
+      case  8: fprintf (f, "s%d = Barray_patt (s%d, BOX (%d));", d-1, d-1, UINT); break;
+      case  9: {
+        int line = UINT, col = UINT;
+        
+        fprintf (f, "Bmatch_failure (s%d, fname, BOX (%d), BOX (%d)); return 0;", d-1, line, col);
+        break;
+      }
+      }
+      break;
+
+    case 6:
+      if (l == 0) fprintf (f, "s%d = %s (s%d, s%d);", d-2, patts[l], d-2, d-1);
+      else fprintf (f, "s%d = %s (s%d);", d-1, patts[l], d-1);
+      break;
+
+    case 7:
+      switch (l) {
+      case  0: fprintf (f, "s%d = Lread ();", d); break;
+      case  1: fprintf (f, "s%d = Lwrite (s%d);", d-1, d-1); break;
+      case  2: fprintf (f, "s%d = Llength (s%d);", d-1, d-1); break;
+      case  3: SPILL (d); fprintf (f, "s%d = Lstring (s%d);", d-1, d-1); RELOAD (d-1); break;
+      case  4: {
+        int n = UINT;
+
+        SPILL (d);
+        fprintf (f, "s%d = Barray (BOX (%d)", d-n, n); ARGS (d, n); fprintf (f, ");");
+        RELOAD (d-n);
+        break;
+      }
+      case  5: {
+        char *g = STRING;
+        int   n = UINT, t = find_public (bf, g);
+
+        if (t >= 0) CALL (t, n)
+        else {
+          SPILL (d);
+          fprintf (f, "s%d = %s (", d-n, g);
+          for (int k = d-n; k < d; k++) fprintf (f, k > d-n ? ", s%d" : "s%d", k);
+          fprintf (f, ");");
+          RELOAD (d-n);
+        }
+        break;
+      }
+      case  6: {
+        char *g = STRING;
+        int   t = find_public (bf, g);
+
+        SPILL (d);
+        if (t >= 0) {LOAD (t); fprintf (f, "s%d = Bclosure (BOX (0), f_%d);", d, t);}
+        else fprintf (f, "s%d = Bclosure (BOX (0), x_%s);", d, g);
+        RELOAD (d);
+        break;
+      }
+      }
+      break;
+
+    case 8:
+      switch (l) {
+      case  0: {
+        int t = c_name (tags, STRING), n = UINT;
+        
+        fprintf (f, "if (UNBOX (Btag (s%d, tags[%d], BOX (%d)))) goto L_%d;", d-1, t, n, INT);
+        break;
+      }
+      case  1: {
+        int n = UINT;
+        
+        fprintf (f, "if (UNBOX (Barray_patt (s%d, BOX (%d)))) goto L_%d;", d-1, n, INT);
+        break;
+      }
+      case  2: fprintf (f, "s%d = Belem (s%d, BOX (%d));", d, d-1, SINT); break;
+      case  3: fprintf (f, "goto L_%d;", INT); break;
+      case  4: {
+        int op = BYTE, k = UINT, n = SINT;
+
+        fprintf (f, "s%d = %s (%s, BOX (%d));", d, binops[op-1], c_var (bf, u, k & 3, k >> 2), n);
+        break;
+      }
+      case  5: {
+        int op = BYTE, k = UINT, m = UINT;
+        char *x = c_var (bf, u, k & 3, k >> 2), *y = c_var (bf, u, m & 3, m >> 2);
+
+        fprintf (f, "s%d = %s (%s, %s);", d, binops[op-1], x, y);
+        break;
+      }
+      case  6: {
+        int op = BYTE;
+        
+        fprintf (f, "if (UNBOX (%s (s%d, s%d)) == 0) goto L_%d;", binops[op-1], d-2, d-1, INT);
+        break;
+      }
+      }
+      break;
+
+    case 9: fprintf (f, "%s = s%d;", c_var (bf, u, l, UINT), d-1); break;
+    }
+
+    fprintf (f, "\n");
+  }
+
+  fprintf (f, "}\n\n");
+  
+  free (depth);
+  free (work);
+  free (labels);
+
+# undef CALL
+# undef LOAD
+# undef ARGS
+# undef RELOAD
+# undef SPILL
+# undef SUCC
+# undef AT
+}
+
+/* Translates a bytecode file into a C program */
+void translate_c (char *oname, char *fname) {
+  bytefile *bf    = read_file (fname);
+  FILE     *f     = fopen (oname, "w");
+  symtab    tags  = {0, NULL, NULL, NULL},
+            names = {0, NULL, NULL, NULL};
+  char     *code  = bf->code_ptr;
+  int       entry = find_public (bf, "main");
+  vinsn     v;
+
+  if (f == NULL) {
+    failure ("%s\n", strerror (errno));
+  }
+  
+  if (entry < 0) {
+    failure ("ERROR: no main function in '%s'\n", fname);
+  }
+  
+  fprintf (f, "/* Generated by byterun -C from %s */\n\n%s\n", fname, c_prelude);
+  fprintf (f, "static char *fname = "); c_string (f, fname); fprintf (f, ";\n");
+  fprintf (f, "static char  loaded [%d];\n\n", bf->units_number);
+
+  /* The declarations of the functions, of the tags, of the runtime
+     functions called and of the adapters of their closures */
+  for (int u = 0; u < bf->units_number; u++) {
+    verify (bf, u);
+    
+    for (int pc = get_unit_begin (bf, u), next; pc < get_unit_end (bf, u); pc = next) {
+      char *ip = code + pc + 1, x = code[pc];
+      
+      next = decode (bf, u, code + pc, &v, NULL) - code;
+      
+      if (x == 0x52 || x == 0x53) fprintf (f, "static word f_%d (word*, int, word);\n", pc);
+      else if (x == 0x12 || x == 0x57 || x == (char) 0x80) c_name (&tags, STRING);
+      else if (v.name != NULL && find_public (bf, v.name) < 0) {
+        int k = c_name (&names, v.name);
+        names.values[k] |= x == 0x76 ? 2 : 1;
+      }
+    }
+  }
+
+  fprintf (f, "\nstatic int tags [%d];\n\n", tags.n > 0 ? tags.n : 1);
+  
+  for (int i = 0; i < names.n; i++) {
+    fprintf (f, "extern word %s ();\n", names.names[i]);
+    if (names.values[i] & 2) {
+      fprintf (f, "static word x_%s (word *args, int n, word c) {return call_n (%s, n, args);}\n",
+               names.names[i], names.names[i]);
+    }
+  }
+
+  /* The unit initializations */
+  for (int u = 0; u < bf->units_number; u++) {
+    fprintf (f, "\nstatic void load_%d (void) {\n  loaded[%d] = 1;\n", u, u);
+    if (get_unit_init (bf, u) >= 0) fprintf (f, "  f_%d (sp, 0, BOX (0));\n", get_unit_init (bf, u));
+    fprintf (f, "}\n");
+  }
+  fprintf (f, "\n");
+  
+  /* The functions */
+  for (int u = 0; u < bf->units_number; u++) {
+    int b = -1, e = get_unit_end (bf, u);
+    
+    for (int pc = get_unit_begin (bf, u); pc <= e; ) {
+      char x = pc < e ? code[pc] : (char) 0xFF;
+      
+      if (b >= 0 && (x == 0x52 || x == 0x53 || x == (char) 0xFF)) {
+        c_function (f, bf, u, b, pc, &tags);
+        b = -1;
+      }
+      
+      if (x == 0x52 || x == 0x53) b = pc;
+      if (pc == e) break;
+      
+      pc = decode (bf, u, code + pc, &v, NULL) - code;
+    }
+  }
+
+  fprintf (f, "int main (int argc, char *argv[]) {\n");
+  fprintf (f, "  __gc_init ();\n  set_args (argc, argv);\n\n");
+  fprintf (f, "  for (sp = stack; sp < stack + %d; sp++) *sp = BOX (0);\n", bf->global_area_size + 2);
+  fprintf (f, "  push_root_region ((void**) stack, (void***) &sp);\n\n");
+  for (int i = 0; i < tags.n; i++) {
+    fprintf (f, "  tags[%d] = LtagHash (", i); c_string (f, tags.names[i]); fprintf (f, ");\n");
+  }
+  fprintf (f, "  loaded[%d] = 1;\n", unit_of (bf, entry));
+  fprintf (f, "  f_%d (stack + %d, 2, BOX (0));\n\n  return 0;\n}\n", entry, bf->global_area_size);
+  
+  fclose (f);
+}
@@ -0,0 +1,346 @@
+/* Lama SM Bytecode verifier */
+
+# include "byterun.h"
+
+# define INVALID(msg) failure ("ERROR: invalid bytecode at 0x%.8x: %s\n", pc, msg)
+
+/* Checks a variable designation of a unit; the indices of the variables
+   other than globals are checked only when the enclosing function is
+   known */
+static void check_designation (bytefile *bf, int u, vfun *fn, int d, int i, int pc) {
+  if (d < 0 || d > 3) INVALID ("invalid designation");
+
+  if (d == 0 && (i < 0 || i >= count_unit_globals (bf, u))) INVALID ("variable out of range");
+  
+  if (fn == NULL) return;
+
+  if (i < 0 ||
+      (d == 1 && i >= fn->nlocals) ||
+      (d == 2 && i >= fn->nargs) ||
+      (d == 3 && (!fn->closure || (fn->captured >= 0 && i >= fn->captured)))) {
+    INVALID ("variable out of range");
+  }
+}
+
+/* Reads a LEB128-encoded operand of an instruction at pc */
+static int next_leb128 (char **ip, char *end, int sign, int pc) {
+  int x;
+
+  if (!read_leb128 (ip, end, sign, &x)) INVALID ("truncated instruction");
+
+  return x;
+}
+
+/* Decodes and checks an instruction of a unit at ip; returns the address
+   of the next one */
+char* decode (bytefile *bf, int u, char *ip, vinsn *v, vfun *fn) {
+
+# define NEXT_BYTE      (ip < end ? *ip++ : (INVALID ("truncated instruction"), 0))
+# define NEXT_INT       (ip + sizeof (int) > end ? (INVALID ("truncated instruction"), 0) : \
+                         (ip += sizeof (int), *(int*)(ip - sizeof (int))))
+# define NEXT_UINT      next_leb128 (&ip, end, 0, pc)
+# define NEXT_SINT      next_leb128 (&ip, end, 1, pc)
+# define NEXT_STRING(x) if ((x = NEXT_UINT) < 0 || x >= count_unit_constants (bf, u)) INVALID ("invalid constant index")
+# define NUMBER(x)      if ((x = NEXT_UINT) < 0 || x >= VM_STACK_SIZE) INVALID ("invalid operand")
+# define TARGET(x)      if ((x = NEXT_INT) < 0) INVALID ("invalid jump target")
+# define DESIGNATION(d) {int k = d, i = NEXT_UINT; check_designation (bf, u, fn, k, i, pc);}
+# define DESIGNATED     {int k = NEXT_UINT; check_designation (bf, u, fn, k & 3, (unsigned int) k >> 2, pc);}
+# define BINOP          {int op = NEXT_BYTE; if (op < 1 || op > 13) INVALID ("invalid binary operator");}
+# define EFFECT(p, q)   {v->pop = p; v->push = q;}
+  
+  char *end = bf->code_ptr + bf->code_size;
+  int   pc  = ip - bf->code_ptr, n;
+  char  x   = NEXT_BYTE,
+        h   = (x & 0xF0) >> 4,
+        l   = x & 0x0F;
+
+  memset (v, 0, sizeof (vinsn));
+  v->kind   = V_NEXT;
+  v->target = v->callee = -1;
+  
+  switch (h) {
+  case 15:
+    if (l != 15) INVALID ("invalid opcode");
+    v->kind = V_EOF;
+    break;
+
+  case 0:
+    if (l < 1 || l > 13) INVALID ("invalid binary operator");
+    EFFECT (2, 1);
+    break;
+
+  case 1:
+    switch (l) {
+    case  0: NEXT_SINT; EFFECT (0, 1); break;
+    case  1: NEXT_STRING (n); EFFECT (0, 1); break;
+    case  2: NEXT_STRING (n); NUMBER (n); EFFECT (n, 1); v->scratch = 2; break;
+    case  3: EFFECT (2, 1); break;
+    case  4: EFFECT (3, 1); break;
+    case  5: TARGET (v->target); v->kind = V_JUMP; break;
+    case  6:
+    case  7: EFFECT (1, 0); v->kind = V_RETURN; break;
+    case  8: EFFECT (1, 0); break;
+    case  9: EFFECT (1, 2); break;
+    case 10: EFFECT (2, 2); break;
+    case 11: EFFECT (2, 1); break;
+    default: INVALID ("invalid opcode");
+    }
+    break;
+
+  case 2:
+  case 3:
+  case 4:
+    DESIGNATION (l);
+    if (h == 2) EFFECT (0, 1) else if (h == 3) EFFECT (0, 2) else EFFECT (1, 1);
+    break;
+
+  case 5:
+    switch (l) {
+    case  0:
+    case  1: TARGET (v->target); EFFECT (1, 0); v->kind = V_BRANCH; break;
+    case  2:
+    case  3: NUMBER (v->a); NUMBER (v->l); v->kind = V_BEGIN; break;
+    case  4:
+      TARGET (v->callee);
+      NUMBER (v->a);
+      for (int i = 0; i < v->a; i++) DESIGNATED;
+      EFFECT (0, 1);
+      v->scratch = v->a + 2;
+      break;
+    case  5: NUMBER (n); EFFECT (n+1, 1); v->scratch = FRAME; break;
+    case  6: TARGET (v->callee); NUMBER (v->a); EFFECT (v->a, 1); v->scratch = FRAME; break;
+    case  7: NEXT_STRING (n); NEXT_UINT; EFFECT (1, 1); break;
+    case  8: NEXT_UINT; EFFECT (1, 1); break;
+    case  9: NEXT_UINT; NEXT_UINT; EFFECT (1, 0); v->kind = V_RETURN; break;
+    default: INVALID ("invalid opcode");
+    }
+    break;
+
+  case 6:
+    if (l > 6) INVALID ("invalid opcode");
+    if (l == 0) EFFECT (2, 1) else EFFECT (1, 1);
+    break;
+
+  case 7:
+    switch (l) {
+    case  0: EFFECT (0, 1); break;
+    case  1:
+    case  2:
+    case  3: EFFECT (1, 1); break;
+    case  4: NUMBER (n); EFFECT (n, 1); v->scratch = 1; break;
+    case  5: /* a call of a function of another unit or of the runtime */
+      NEXT_STRING (n);
+      v->name = get_constant (bf, u, n);
+      NUMBER (v->a);
+      EFFECT (v->a, 1);
+      v->scratch = FRAME;
+      break;
+    case  6: /* a closure of such a function; a lazy unit initialization */
+      NEXT_STRING (n);
+      v->name = get_constant (bf, u, n);
+      EFFECT (0, 1);
+      v->scratch = FRAME;
+      break;
+    default: INVALID ("invalid opcode");
+    }
+    break;
+
+  case 8:
+    switch (l) {
+    case  0: NEXT_STRING (n); NEXT_UINT; TARGET (v->target); EFFECT (1, 1); v->kind = V_BRANCH; break;
+    case  1: NEXT_UINT; TARGET (v->target); EFFECT (1, 1); v->kind = V_BRANCH; break;
+    case  2: NEXT_SINT; EFFECT (1, 2); break;
+    case  3: TARGET (v->target); EFFECT (1, 0); v->kind = V_JUMP; break;
+    case  4: BINOP; DESIGNATED; NEXT_SINT; EFFECT (0, 1); break;
+    case  5: BINOP; DESIGNATED; DESIGNATED; EFFECT (0, 1); break;
+    case  6: BINOP; TARGET (v->target); EFFECT (2, 0); v->kind = V_BRANCH; break;
+    default: INVALID ("invalid opcode");
+    }
+    break;
+
+  case 9:
+    DESIGNATION (l);
+    EFFECT (1, 0);
+    break;
+
+  default:
+    INVALID ("invalid opcode");
+  }
+
+  return ip;
+
+# undef EFFECT
+# undef BINOP
+# undef DESIGNATED
+# undef DESIGNATION
+# undef TARGET
+# undef NUMBER
+# undef NEXT_STRING
+# undef NEXT_SINT
+# undef NEXT_UINT
+# undef NEXT_INT
+# undef NEXT_BYTE
+}
+
+/* Verifies the code of a unit once before it is run, so the interpreter
+   does not need to check anything per instruction: the code matches its
+   checksum, the instructions and their operands are well-formed, constant
+   indices are within the constants of the unit, jump targets are
+   instruction starts within the same function, calls and closures refer
+   to functions (of other units --- by the names of their public
+   functions), the variables are in range and the stack depth is consistent
+   for each point of each function. Fills the maximal stack needs of the
+   functions in bf->stack_needs */
+void verify (bytefile *bf, int u) {
+  unsigned char *code   = (unsigned char*) bf->code_ptr;
+  int            begin  = get_unit_begin (bf, u),
+                 end    = get_unit_end (bf, u),
+                 size   = end - begin;
+  char          *starts = (char*) calloc (size + 1, 1);
+  int           *depth  = (int*) malloc ((size + 1) * sizeof (int)),
+                *owner  = (int*) malloc ((size + 1) * sizeof (int)),
+                *work   = (int*) malloc ((size + 1) * sizeof (int)),
+                *caps   = (int*) malloc ((size + 1) * sizeof (int)),
+                 pc, b, i, t;
+  char          *ip;
+  vinsn          v, w;
+
+  if (bf->stack_needs == NULL) bf->stack_needs = (int*) calloc (bf->code_size + 1, sizeof (int));
+  
+  if (starts == NULL || depth == NULL || owner == NULL || work == NULL || caps == NULL || bf->stack_needs == NULL) {
+    failure ("*** FAILURE: unable to allocate memory.\n");
+  }
+
+  if (adler32 (code + begin, size) != (unsigned int) get_unit_checksum (bf, u)) {
+    failure ("ERROR: checksum mismatch in unit '%s'\n", get_unit_name (bf, u));
+  }
+
+# define AT(a, pc)   a[(pc) - begin]
+# define IN_UNIT(t)  (t >= begin && t < end)
+# define IS_BEGIN(t) (IN_UNIT (t) && AT (starts, t) && (code[t] == 0x52 || code[t] == 0x53))
+  
+  /* Instruction boundaries and well-formedness */
+  pc = begin;
+  do {
+    if (pc >= end) INVALID ("unterminated bytecode");
+    AT (starts, pc) = 1;
+    pc = decode (bf, u, bf->code_ptr + pc, &v, NULL) - bf->code_ptr;
+  }
+  while (v.kind != V_EOF);
+
+  if (pc != end) INVALID ("trailing bytes after the end of bytecode");
+
+  /* Jump targets, calls and closures */
+  for (i = begin; i < end; i++) {
+    AT (owner, i) = -1;
+    AT (caps , i) = -1;
+  }
+
+  for (pc = begin; code[pc] != 0xFF; pc = ip - bf->code_ptr) {
+    ip = decode (bf, u, bf->code_ptr + pc, &v, NULL);
+
+    if (v.target >= 0 && (!IN_UNIT (v.target) || !AT (starts, v.target))) INVALID ("invalid jump target");
+
+    if (v.callee >= 0) {
+      if (!IS_BEGIN (v.callee)) INVALID ("invalid function address");
+      
+      if (code[pc] == 0x56) {
+        decode (bf, u, bf->code_ptr + v.callee, &w, NULL);
+        if (code[v.callee] != 0x52 || w.a != v.a) INVALID ("invalid call");
+      }
+      else if (AT (caps, v.callee) < 0 || AT (caps, v.callee) > v.a) AT (caps, v.callee) = v.a;
+    }
+
+    /* The public functions of other units are checked when their units
+       are loaded */
+    if (v.name != NULL && (t = find_public (bf, v.name)) >= 0) {
+      decode (bf, unit_of (bf, t), bf->code_ptr + t, &w, NULL);
+      if (code[t] != 0x52 || (code[pc] == 0x75 && w.a != v.a)) INVALID ("invalid call");
+    }
+  }
+
+  for (i = 0; i < bf->public_symbols_number; i++) {
+    pc = get_public_offset (bf, i);
+
+    if (!IN_UNIT (pc)) continue;
+    if (!IS_BEGIN (pc)) INVALID ("invalid public symbol");
+    decode (bf, u, bf->code_ptr + pc, &w, NULL);
+    if (strcmp (get_public_name (bf, i), "main") == 0 && (code[pc] != 0x52 || w.a != 2)) INVALID ("invalid main function");
+  }
+
+  /* Stack depths within functions */
+  for (b = begin; b < end; b++) {
+    int  top = 0, need = 0;
+    vfun fn;
+    
+    if (!IS_BEGIN (b)) continue;
+
+    decode (bf, u, bf->code_ptr + b, &v, NULL);
+    fn.nargs    = v.a;
+    fn.nlocals  = v.l;
+    fn.closure  = code[b] == 0x53;
+    fn.captured = AT (caps, b);
+
+    AT (depth, b) = 0;
+    AT (owner, b) = b;
+    work[top++] = b;
+
+    while (top > 0) {
+      int succ[2], k = 0, d;
+
+      pc = work[--top];
+      d  = AT (depth, pc);
+      ip = decode (bf, u, bf->code_ptr + pc, &v, &fn);
+
+      if (v.kind == V_EOF) INVALID ("control reaches the end of bytecode");
+      if (d < v.pop) INVALID ("stack underflow");
+      if (d + v.scratch > need) need = d + v.scratch;
+
+      d += v.push - v.pop;
+      if (d > need) need = d;
+
+      switch (v.kind) {
+      case V_NEXT:
+      case V_BEGIN:
+        succ[k++] = ip - bf->code_ptr;
+        break;
+
+      case V_BRANCH:
+        succ[k++] = ip - bf->code_ptr;
+        /* fallthrough */
+
+      case V_JUMP:
+        succ[k++] = v.target;
+        break;
+      }
+
+      for (i = 0; i < k; i++) {
+        int s = succ[i];
+        
+        if (IS_BEGIN (s)) INVALID ("control enters a function");
+        
+        if (AT (owner, s) < 0) {
+          AT (owner, s) = b;
+          AT (depth, s) = d;
+          work[top++] = s;
+        }
+        else if (AT (owner, s) != b) INVALID ("jump into another function");
+        else if (AT (depth, s) != d) INVALID ("inconsistent stack depth");
+      }
+    }
+
+    bf->stack_needs[b] = need;
+  }
+
+# undef IS_BEGIN
+# undef IN_UNIT
+# undef AT
+  
+  free (starts);
+  free (depth);
+  free (owner);
+  free (work);
+  free (caps);
+}
+
+# undef INVALID
@@ -55,5 +55,47 @@ F,kindOf;
 F,compareTags;
 F,flatCompare;
 F,tagHash;
+F,matchKey;
 F,uppercase;
 F,lowercase;
+F,hashMix;
+F,hashFragment;
+F,bitmapHas;
+F,bitmapIndex;
+F,bitmapSet;
+F,bitmapClear;
+F,arrayInsert;
+F,arrayRemove;
+F,makeVector;
+F,vectorPush;
+F,vectorPop;
+F,vectorTruncate;
+F,vectorReserve;
+F,vectorCapacity;
+F,vectorView;
+F,sortArray;
+F,sortList;
+F,arrayBlit;
+F,arrayFill;
+F,arraySub;
+F,arrayConcat;
+F,arrayReverse;
+F,arrayIndex;
+F,arraySum;
+F,arrayMin;
+F,arrayMax;
+F,makeByteBuffer;
+F,makeInt32Buffer;
+F,byteBufferOf;
+F,int32BufferOf;
+F,bufferArray;
+F,bufferString;
+F,bufferBlit;
+F,bufferFill;
+F,bufferSub;
+F,bufferSum;
+F,bufferMin;
+F,bufferMax;
+F,bufferReadInt;
+F,bufferWriteInt;
+F,freadBytes;
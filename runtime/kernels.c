@@ -0,0 +1,97 @@
+/* Kernels over whole arrays and buffers
+
+   The loops are plain C: runtime/Makefile compiles this file with
+   $(VECTOR_FLAGS) (-O3 -msse2 by default), which lets the compiler vectorize
+   them; with VECTOR_FLAGS empty they are compiled as scalar code */
+
+# include "runtime.h"
+
+int words_unboxed (word *a, int n) {
+  word acc = 1;
+  int  i;
+
+  for (i = 0; i < n; i++) acc &= a[i];
+
+  return acc & 1;
+}
+
+uintptr_t words_sum (word *a, int n) {
+  uintptr_t acc = 0;
+  int       i;
+
+  for (i = 0; i < n; i++) acc += (uintptr_t) a[i];
+
+  return acc;
+}
+
+word words_min (word *a, int n) {
+  word acc = a[0];
+  int  i;
+
+  for (i = 1; i < n; i++) acc = a[i] < acc ? a[i] : acc;
+
+  return acc;
+}
+
+word words_max (word *a, int n) {
+  word acc = a[0];
+  int  i;
+
+  for (i = 1; i < n; i++) acc = a[i] > acc ? a[i] : acc;
+
+  return acc;
+}
+
+// The same for the elements of int32 buffers
+int int32s_sum (int *a, int n) {
+  unsigned acc = 0;
+  int      i;
+
+  for (i = 0; i < n; i++) acc += (unsigned) a[i];
+
+  return acc;
+}
+
+int int32s_min (int *a, int n) {
+  int acc = a[0], i;
+
+  for (i = 1; i < n; i++) acc = a[i] < acc ? a[i] : acc;
+
+  return acc;
+}
+
+int int32s_max (int *a, int n) {
+  int acc = a[0], i;
+
+  for (i = 1; i < n; i++) acc = a[i] > acc ? a[i] : acc;
+
+  return acc;
+}
+
+// The same for the bytes of byte buffers
+int bytes_sum (unsigned char *a, int n) {
+  unsigned acc = 0;
+  int      i;
+
+  for (i = 0; i < n; i++) acc += a[i];
+
+  return acc;
+}
+
+int bytes_min (unsigned char *a, int n) {
+  unsigned char acc = a[0];
+  int           i;
+
+  for (i = 1; i < n; i++) acc = a[i] < acc ? a[i] : acc;
+
+  return acc;
+}
+
+int bytes_max (unsigned char *a, int n) {
+  unsigned char acc = a[0];
+  int           i;
+
+  for (i = 1; i < n; i++) acc = a[i] > acc ? a[i] : acc;
+
+  return acc;
+}
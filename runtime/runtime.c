@@ -56,19 +56,38 @@ void __post_gc_subst () {}
 # define SEXP_TAG    0x00000005
 # define CLOSURE_TAG 0x00000007 
 # define UNBOXED_TAG 0x00000009 // Not actually a tag; used to return from LkindOf
-
-# define LEN(x) ((x & 0xFFFFFFF8) >> 3)
-# define TAG(x)  (x & 0x00000007)
-
-# define TO_DATA(x) ((data*)((char*)(x)-sizeof(int)))
-# define TO_SEXP(x) ((sexp*)((char*)(x)-2*sizeof(int)))
+# define VECTOR_TAG  0x0000000B // Not actually a tag; growable vector handles (see KIND)
+# define BUFFER_TAG  0x0000000D // Not actually a tag; typed buffers (see KIND)
+
+# define LEN(x) ((unsigned) (((x) & ~(word) 7) >> 3))
+# define TAG(x) ((int) ((x) & 0x00000007))
+
+// The maximal length of an object: the header, built as "tag | (n << 3)"
+// of an int, has to stay non-negative on both targets
+# define MAX_LEN ((1 << 28) - 1)
+
+# define TO_DATA(x) ((data*)((char*)(x)-sizeof(word)))
+# define TO_SEXP(x) ((sexp*)((char*)(x)-2*sizeof(word)))
+
+/* Vectors and typed buffers are S-expressions with a negative constructor
+   tag, which LtagHash never gives; this keeps all the header tags odd, so
+   a header is never taken for a forward pointer. KIND gives the tag of an
+   object with VECTOR_TAG and BUFFER_TAG for them. The constructor tags are
+   tagged as in the debug runtime, so the heap walker can step over them */
+# define VECTOR_KIND  ((word) (-(1 << 3) | SEXP_TAG))
+# define BUFFER_BYTES ((word) (-(2 << 3) | SEXP_TAG))
+# define BUFFER_INT32 ((word) (-(3 << 3) | SEXP_TAG))
+
+# define KIND(d)                                                    \
+  (TAG((d)->tag) != SEXP_TAG || ((word*) (d))[-1] >= 0 ? TAG((d)->tag) : \
+   ((word*) (d))[-1] == VECTOR_KIND ? VECTOR_TAG : BUFFER_TAG)
 # ifdef DEBUG_PRINT // GET_SEXP_TAG is necessary for printing from space
 # define GET_SEXP_TAG(x) (LEN(x))
 #endif
 
-# define UNBOXED(x)  (((int) (x)) &  0x0001)
-# define UNBOX(x)    (((int) (x)) >> 1)
-# define BOX(x)      ((((int) (x)) << 1) | 0x0001)
+# define UNBOXED(x)  (((word) (x)) &  0x0001)
+# define UNBOX(x)    (((word) (x)) >> 1)
+# define BOX(x)      ((((word) (x)) << 1) | 0x0001)
 
 /* GC extra roots */
 # define MAX_EXTRA_ROOTS_NUMBER 32
@@ -124,6 +143,46 @@ void pop_extra_root (void ** p) {
 # endif
 }
 
+/* GC root regions: contiguous ranges of words owned by an embedder (e.g. the
+   stack of the bytecode interpreter); the live part of a region spans from
+   its beginning up to the word *end points to, and each of its words is
+   treated as a precise root. The embedder has to keep *end up to date
+   whenever the GC may run */
+# define MAX_ROOT_REGIONS_NUMBER 16
+typedef struct {
+  void **begin;
+  void ***end;
+} root_region;
+
+typedef struct {
+  int         current_free;
+  root_region regions[MAX_ROOT_REGIONS_NUMBER];
+} root_regions_pool;
+
+static root_regions_pool root_regions;
+
+void push_root_region (void **begin, void ***end) {
+  if (root_regions.current_free >= MAX_ROOT_REGIONS_NUMBER) {
+    perror ("ERROR: push_root_region: root_regions_pool overflow");
+    exit   (1);
+  }
+  root_regions.regions[root_regions.current_free].begin = begin;
+  root_regions.regions[root_regions.current_free].end   = end;
+  root_regions.current_free++;
+}
+
+void pop_root_region (void **begin) {
+  if (root_regions.current_free == 0) {
+    perror ("ERROR: pop_root_region: root_regions are empty");
+    exit   (1);
+  }
+  root_regions.current_free--;
+  if (root_regions.regions[root_regions.current_free].begin != begin) {
+    perror ("ERROR: pop_root_region: stack invariant violation");
+    exit   (1);
+  }
+}
+
 /* end */
 
 static void vfailure (char *s, va_list args) {
@@ -148,6 +207,14 @@ void Lassert (void *f, char *s, ...) {
   }
 }
 
+/* The type assertions of the builtins; the runtime for the programs, built
+   with lamac -unchecked, is compiled without them (LAMA_UNCHECKED) */
+# ifdef LAMA_UNCHECKED
+# define ASSERT_BOXED(memo, x)   do {} while (0)
+# define ASSERT_UNBOXED(memo, x) do {} while (0)
+# define ASSERT_STRING(memo, x)  do {} while (0)
+# define ASSERT_ARRAY(memo, x)   do {} while (0)
+# else
 # define ASSERT_BOXED(memo, x)               \
   do if (UNBOXED(x)) failure ("boxed value expected in %s\n", memo); while (0)
 # define ASSERT_UNBOXED(memo, x)             \
@@ -155,32 +222,93 @@ void Lassert (void *f, char *s, ...) {
 # define ASSERT_STRING(memo, x)              \
   do if (!UNBOXED(x) && TAG(TO_DATA(x)->tag) \
 	 != STRING_TAG) failure ("string value expected in %s\n", memo); while (0)
+# define ASSERT_ARRAY(memo, x)               \
+  do if (UNBOXED(x) || TAG(TO_DATA(x)->tag)  \
+	 != ARRAY_TAG) failure ("array value expected in %s\n", memo); while (0)
+# endif
 
 typedef struct {
-  int tag; 
+  word tag; 
   char contents[0];
 } data; 
 
 typedef struct {
-  int tag; 
+  word tag; 
   data contents; 
 } sexp;
 
+/* A growable vector is a handle, which refers to an array; the length of
+   the array is the size of the vector, and the array is followed by
+   (capacity - size) reserved words. The array itself can be passed around
+   as an ordinary value (see LvectorView); the GC copies the reserve along
+   with the array only when the latter is reached via the handle. The
+   handle is tagged as an S-expression of two words with VECTOR_KIND as its
+   constructor tag.
+*/
+typedef struct {
+  word   kind;
+  word   tag;
+  word   capacity;
+  word  *storage;
+} vector;
+
+# define TO_VECTOR(x)   ((vector*)((char*)(x)-2*sizeof(word)))
+# define VECTOR_SIZE(v) (LEN(TO_DATA((v)->storage)->tag))
+
+/* A typed buffer holds raw bytes or 32-bit integers, which are never
+   scanned by the GC; the length in the header is the number of bytes,
+   and the kind of elements (BUFFER_BYTES or BUFFER_INT32) is kept in the
+   word before the header, as the tag of an S-expression
+*/
+
+typedef struct {
+  word kind;
+  data contents;
+} buffer;
+
+# define TO_BUFFER(x)       ((buffer*)((char*)(x)-2*sizeof(word)))
+# define BUFFER_ELEM_SIZE(b) ((b)->kind == BUFFER_INT32 ? sizeof(int) : 1)
+# define BUFFER_LENGTH(b)   ((unsigned) (LEN((b)->contents.tag) / BUFFER_ELEM_SIZE(b)))
+
+// The entries which update vectors keep the check in the unchecked runtime
+// too: the fields of a handle written into another object would corrupt it
+# define CHECK_VECTOR(memo, x)               \
+  do if (UNBOXED(x) || KIND(TO_DATA(x))      \
+         != VECTOR_TAG) failure ("vector value expected in %s\n", memo); while (0)
+
+# ifdef LAMA_UNCHECKED
+# define ASSERT_BUFFER(memo, x) do {} while (0)
+# define ASSERT_VECTOR(memo, x) do {} while (0)
+# else
+# define ASSERT_BUFFER(memo, x)              \
+  do if (UNBOXED(x) || KIND(TO_DATA(x))      \
+         != BUFFER_TAG) failure ("typed buffer expected in %s\n", memo); while (0)
+
+# define ASSERT_VECTOR(memo, x) CHECK_VECTOR(memo, x)
+# endif
+
 extern void* alloc    (size_t);
-extern void* Bsexp    (int n, ...);
-extern int   LtagHash (char*);
+extern void* Bsexp    (word n, ...);
+extern void* LmakeVector (word capacity);
+extern void* LvectorGet  (void *v, word i);
+extern void* LvectorSet  (void *v, word i, void *x);
+extern void* LbufferGet  (void *b, word i);
+extern void* LbufferSet  (void *b, word i, void *x);
+extern void* LbufferSub  (void *b, word pos, word len);
+extern void* LmakeString (word length);
+extern word   LtagHash (char*);
 
 void *global_sysargs;
 
 // Gets a raw tag
-extern int LkindOf (void *p) {
+extern word LkindOf (void *p) {
   if (UNBOXED(p)) return UNBOXED_TAG;
   
-  return TAG(TO_DATA(p)->tag);
+  return KIND(TO_DATA(p));
 }
 
 // Compare sexprs tags
-extern int LcompareTags (void *p, void *q) {
+extern word LcompareTags (void *p, void *q) {
   data *pd, *qd;
   
   ASSERT_BOXED ("compareTags, 0", p);
@@ -189,7 +317,7 @@ extern int LcompareTags (void *p, void *q) {
   pd = TO_DATA(p);
   qd = TO_DATA(q);
 
-  if (TAG(pd->tag) == SEXP_TAG && TAG(qd->tag) == SEXP_TAG) {
+  if (KIND(pd) == SEXP_TAG && KIND(qd) == SEXP_TAG) {
     return
     #ifndef DEBUG_PRINT
       BOX((TO_SEXP(p)->tag) - (TO_SEXP(q)->tag));
@@ -220,7 +348,7 @@ void* Ls__Infix_58 (void *p, void *q) {
 }
 
 // Functional synonym for built-in operator "!!";
-int Ls__Infix_3333 (void *p, void *q) {
+word Ls__Infix_3333 (void *p, void *q) {
   ASSERT_UNBOXED("captured !!:1", p);
   ASSERT_UNBOXED("captured !!:2", q);
 
@@ -228,7 +356,7 @@ int Ls__Infix_3333 (void *p, void *q) {
 }
 
 // Functional synonym for built-in operator "&&";
-int Ls__Infix_3838 (void *p, void *q) {
+word Ls__Infix_3838 (void *p, void *q) {
   ASSERT_UNBOXED("captured &&:1", p);
   ASSERT_UNBOXED("captured &&:2", q);
 
@@ -236,12 +364,12 @@ int Ls__Infix_3838 (void *p, void *q) {
 }
 
 // Functional synonym for built-in operator "==";
-int Ls__Infix_6161 (void *p, void *q) {
+word Ls__Infix_6161 (void *p, void *q) {
   return BOX(p == q);
 }
 
 // Functional synonym for built-in operator "!=";
-int Ls__Infix_3361 (void *p, void *q) {
+word Ls__Infix_3361 (void *p, void *q) {
   ASSERT_UNBOXED("captured !=:1", p);
   ASSERT_UNBOXED("captured !=:2", q);
 
@@ -249,7 +377,7 @@ int Ls__Infix_3361 (void *p, void *q) {
 }
 
 // Functional synonym for built-in operator "<=";
-int Ls__Infix_6061 (void *p, void *q) {
+word Ls__Infix_6061 (void *p, void *q) {
   ASSERT_UNBOXED("captured <=:1", p);
   ASSERT_UNBOXED("captured <=:2", q);
 
@@ -257,7 +385,7 @@ int Ls__Infix_6061 (void *p, void *q) {
 }
 
 // Functional synonym for built-in operator "<";
-int Ls__Infix_60 (void *p, void *q) {
+word Ls__Infix_60 (void *p, void *q) {
   ASSERT_UNBOXED("captured <:1", p);
   ASSERT_UNBOXED("captured <:2", q);
 
@@ -265,7 +393,7 @@ int Ls__Infix_60 (void *p, void *q) {
 }
 
 // Functional synonym for built-in operator ">=";
-int Ls__Infix_6261 (void *p, void *q) {
+word Ls__Infix_6261 (void *p, void *q) {
   ASSERT_UNBOXED("captured >=:1", p);
   ASSERT_UNBOXED("captured >=:2", q);
 
@@ -273,7 +401,7 @@ int Ls__Infix_6261 (void *p, void *q) {
 }
 
 // Functional synonym for built-in operator ">";
-int Ls__Infix_62 (void *p, void *q) {
+word Ls__Infix_62 (void *p, void *q) {
   ASSERT_UNBOXED("captured >:1", p);
   ASSERT_UNBOXED("captured >:2", q);
 
@@ -281,7 +409,7 @@ int Ls__Infix_62 (void *p, void *q) {
 }
 
 // Functional synonym for built-in operator "+";
-int Ls__Infix_43 (void *p, void *q) {
+word Ls__Infix_43 (void *p, void *q) {
   ASSERT_UNBOXED("captured +:1", p);
   ASSERT_UNBOXED("captured +:2", q);
 
@@ -289,7 +417,7 @@ int Ls__Infix_43 (void *p, void *q) {
 }
 
 // Functional synonym for built-in operator "-";
-int Ls__Infix_45 (void *p, void *q) {
+word Ls__Infix_45 (void *p, void *q) {
   if (UNBOXED(p)) {
     ASSERT_UNBOXED("captured -:2", q);
     return BOX(UNBOX(p) - UNBOX(q));
@@ -300,7 +428,7 @@ int Ls__Infix_45 (void *p, void *q) {
 }
 
 // Functional synonym for built-in operator "*";
-int Ls__Infix_42 (void *p, void *q) {
+word Ls__Infix_42 (void *p, void *q) {
   ASSERT_UNBOXED("captured *:1", p);
   ASSERT_UNBOXED("captured *:2", q);
 
@@ -308,7 +436,7 @@ int Ls__Infix_42 (void *p, void *q) {
 }
 
 // Functional synonym for built-in operator "/";
-int Ls__Infix_47 (void *p, void *q) {
+word Ls__Infix_47 (void *p, void *q) {
   ASSERT_UNBOXED("captured /:1", p);
   ASSERT_UNBOXED("captured /:2", q);
 
@@ -316,19 +444,23 @@ int Ls__Infix_47 (void *p, void *q) {
 }
 
 // Functional synonym for built-in operator "%";
-int Ls__Infix_37 (void *p, void *q) {
+word Ls__Infix_37 (void *p, void *q) {
   ASSERT_UNBOXED("captured %:1", p);
   ASSERT_UNBOXED("captured %:2", q);
 
   return BOX(UNBOX(p) % UNBOX(q));
 }
 
-extern int Llength (void *p) {
+extern word Llength (void *p) {
   data *a = (data*) BOX (NULL);
   
   ASSERT_BOXED(".length", p);
   
   a = TO_DATA(p);
+
+  if (KIND(a) == VECTOR_TAG) return BOX(VECTOR_SIZE(TO_VECTOR(p)));
+  if (KIND(a) == BUFFER_TAG) return BOX(BUFFER_LENGTH(TO_BUFFER(p)));
+  
   return BOX(LEN(a->tag));
 }
 
@@ -336,7 +468,7 @@ static char* chars = "_abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ01234
 
 extern char* de_hash (int);
 
-extern int LtagHash (char *s) {
+extern word LtagHash (char *s) {
   char *p;
   int  h = 0, limit = 0;
                
@@ -361,6 +493,38 @@ extern int LtagHash (char *s) {
   return BOX(h);
 }
 
+// The dispatch key of a value for the compiled pattern matching (see
+// SM.compile): the tag hash for S-expressions, a hash of the contents
+// for strings and -1 for all other values; the compiler computes the
+// same keys for the patterns
+extern word LmatchKey (void *p) {
+  data     *a;
+  unsigned  h = 0;
+  int       i;
+
+  if (UNBOXED(p)) return BOX(-1);
+
+  a = TO_DATA(p);
+
+  switch (KIND(a)) {
+  case SEXP_TAG:
+#ifndef DEBUG_PRINT
+    return BOX(TO_SEXP(p)->tag);
+#else
+    return BOX(GET_SEXP_TAG(TO_SEXP(p)->tag));
+#endif
+
+  case STRING_TAG:
+    for (i = 0; i < LEN(a->tag); i++)
+      h = (h * 31 + (unsigned char) a->contents[i]) & 0x3FFFFFFF;
+
+    return BOX(h);
+
+  default:
+    return BOX(-1);
+  }
+}
+
 char* de_hash (int n) {
   //  static char *chars = (char*) BOX (NULL);
   static char buf[6] = {0,0,0,0,0,0};
@@ -453,16 +617,16 @@ int is_valid_heap_pointer (void *p);
 static void printValue (void *p) {
   data *a = (data*) BOX(NULL);
   int i   = BOX(0);
-  if (UNBOXED(p)) printStringBuf ("%d", UNBOX(p));
+  if (UNBOXED(p)) printStringBuf ("%ld", (long) UNBOX(p));
   else {
     if (! is_valid_heap_pointer(p)) {
-      printStringBuf ("0x%x", p);
+      printStringBuf ("%p", p);
       return;
     }
     
     a = TO_DATA(p);
 
-    switch (TAG(a->tag)) {      
+    switch (KIND(a)) {      
     case STRING_TAG:
       printStringBuf ("\"%s\"", a->contents);
       break;
@@ -470,8 +634,8 @@ static void printValue (void *p) {
     case CLOSURE_TAG:
       printStringBuf ("<closure ");
       for (i = 0; i < LEN(a->tag); i++) {
-	if (i) printValue ((void*)((int*) a->contents)[i]);
-	else printStringBuf ("0x%x", (void*)((int*) a->contents)[i]);
+	if (i) printValue ((void*)((word*) a->contents)[i]);
+	else printStringBuf ("%p", (void*)((word*) a->contents)[i]);
 	
 	if (i != LEN(a->tag) - 1) printStringBuf (", ");
       }
@@ -481,11 +645,27 @@ static void printValue (void *p) {
     case ARRAY_TAG:
       printStringBuf ("[");
       for (i = 0; i < LEN(a->tag); i++) {
-        printValue ((void*)((int*) a->contents)[i]);
+        printValue ((void*)((word*) a->contents)[i]);
 	if (i != LEN(a->tag) - 1) printStringBuf (", ");
       }
       printStringBuf ("]");
       break;
+
+    case VECTOR_TAG:
+      printValue (TO_VECTOR(p)->storage);
+      break;
+
+    case BUFFER_TAG: {
+      buffer *b = TO_BUFFER(p);
+      
+      printStringBuf (b->kind == BUFFER_INT32 ? "<int32 [" : "<bytes [");
+      for (i = 0; i < BUFFER_LENGTH(b); i++) {
+        printValue (LbufferGet (p, BOX(i)));
+	if (i != BUFFER_LENGTH(b) - 1) printStringBuf (", ");
+      }
+      printStringBuf ("]>");
+      break;
+    }
       
     case SEXP_TAG: {
 #ifndef DEBUG_PRINT
@@ -500,8 +680,8 @@ static void printValue (void *p) {
 	printStringBuf ("{");
 
 	while (LEN(a->tag)) {
-	  printValue ((void*)((int*) b->contents)[0]);
-	  b = (data*)((int*) b->contents)[1];
+	  printValue ((void*)((word*) b->contents)[0]);
+	  b = (data*)((word*) b->contents)[1];
 	  if (! UNBOXED(b)) {
 	    printStringBuf (", ");
 	    b = TO_DATA(b);
@@ -516,7 +696,7 @@ static void printValue (void *p) {
 	if (LEN(a->tag)) {
 	  printStringBuf (" (");
 	  for (i = 0; i < LEN(a->tag); i++) {
-	    printValue ((void*)((int*) a->contents)[i]);
+	    printValue ((void*)((word*) a->contents)[i]);
 	    if (i != LEN(a->tag) - 1) printStringBuf (", ");
 	  }
 	  printStringBuf (")");
@@ -539,7 +719,7 @@ static void stringcat (void *p) {
   else {
     a = TO_DATA(p);
 
-    switch (TAG(a->tag)) {      
+    switch (KIND(a)) {      
     case STRING_TAG:
       printStringBuf ("%s", a->contents);
       break;
@@ -554,8 +734,8 @@ static void stringcat (void *p) {
 	data *b = a;
 	
 	while (LEN(a->tag)) {
-	  stringcat ((void*)((int*) b->contents)[0]);
-	  b = (data*)((int*) b->contents)[1];
+	  stringcat ((void*)((word*) b->contents)[0]);
+	  b = (data*)((word*) b->contents)[1];
 	  if (! UNBOXED(b)) {
 	    b = TO_DATA(b);
 	  }
@@ -572,17 +752,17 @@ static void stringcat (void *p) {
   }
 }
 
-extern int Luppercase (void *v) {
+extern word Luppercase (void *v) {
   ASSERT_UNBOXED("Luppercase:1", v);
   return BOX(toupper ((int) UNBOX(v)));
 }
 
-extern int Llowercase (void *v) {
+extern word Llowercase (void *v) {
   ASSERT_UNBOXED("Llowercase:1", v);
   return BOX(tolower ((int) UNBOX(v)));
 }
 
-extern int LmatchSubString (char *subj, char *patt, int pos) {
+extern word LmatchSubString (char *subj, char *patt, word pos) {
   data *p = TO_DATA(patt), *s = TO_DATA(subj);
   int   n;
 
@@ -598,7 +778,7 @@ extern int LmatchSubString (char *subj, char *patt, int pos) {
   return BOX(strncmp (subj + UNBOX(pos), patt, n) == 0);
 }
 
-extern void* Lsubstring (void *subj, int p, int l) {
+extern void* Lsubstring (void *subj, word p, word l) {
   data *d = TO_DATA(subj);
   int pp = UNBOX (p), ll = UNBOX (l);
 
@@ -612,7 +792,7 @@ extern void* Lsubstring (void *subj, int p, int l) {
     __pre_gc ();
 
     push_extra_root (&subj);
-    r = (data*) alloc (ll + 1 + sizeof (int));
+    r = (data*) alloc (ll + 1 + sizeof(word));
     pop_extra_root (&subj);
 
     r->tag = STRING_TAG | (ll << 3);
@@ -633,16 +813,16 @@ extern struct re_pattern_buffer *Lregexp (char *regexp) {
 
   memset (b, 0, sizeof (regex_t));
   
-  int n = (int) re_compile_pattern (regexp, strlen (regexp), b);
+  const char *e = re_compile_pattern (regexp, strlen (regexp), b);
   
-  if (n != 0) {
-    failure ("%", strerror (n));
+  if (e != NULL) {
+    failure ("regexp: %s\n", e);
   };
 
   return b;
 }
 
-extern int LregexpMatch (struct re_pattern_buffer *b, char *s, int pos) {
+extern word LregexpMatch (struct re_pattern_buffer *b, char *s, word pos) {
   int res;
   
   ASSERT_BOXED("regexpMatch:1", b);
@@ -675,7 +855,7 @@ void *Lclone (void *p) {
   if (UNBOXED(p)) return p;
   else {
     data *a = TO_DATA(p);
-    int t   = TAG(a->tag), l = LEN(a->tag);
+    int t   = KIND(a), l = LEN(a->tag);
 
     push_extra_root (&p);
     switch (t) {
@@ -697,8 +877,8 @@ void *Lclone (void *p) {
       print_indent ();
       printf ("Lclone: closure or array &p=%p p=%p ebp=%p\n", &p, p, ebp); fflush (stdout);
 #endif
-      obj = (data*) alloc (sizeof(int) * (l+1));
-      memcpy (obj, TO_DATA(p), sizeof(int) * (l+1));
+      obj = (data*) alloc (sizeof(word) * (l+1));
+      memcpy (obj, TO_DATA(p), sizeof(word) * (l+1));
       res = (void*) (obj->contents);
       break;
       
@@ -706,10 +886,27 @@ void *Lclone (void *p) {
 #ifdef DEBUG_PRINT
       print_indent (); printf ("Lclone: sexp\n"); fflush (stdout);
 #endif
-      sobj = (sexp*) alloc (sizeof(int) * (l+2));
-      memcpy (sobj, TO_SEXP(p), sizeof(int) * (l+2));
+      sobj = (sexp*) alloc (sizeof(word) * (l+2));
+      memcpy (sobj, TO_SEXP(p), sizeof(word) * (l+2));
       res = (void*) sobj->contents.contents;
       break;
+
+    case BUFFER_TAG:
+#ifdef DEBUG_PRINT
+      print_indent (); printf ("Lclone: buffer\n"); fflush (stdout);
+#endif
+      res = LbufferSub (p, BOX(0), BOX(BUFFER_LENGTH(TO_BUFFER(p))));
+      break;
+
+    case VECTOR_TAG:
+#ifdef DEBUG_PRINT
+      print_indent (); printf ("Lclone: vector\n"); fflush (stdout);
+#endif
+      res = LmakeVector (BOX(VECTOR_SIZE(TO_VECTOR(p))));
+      l   = VECTOR_SIZE(TO_VECTOR(p));
+      memcpy (TO_VECTOR(res)->storage, TO_VECTOR(p)->storage, sizeof(word) * l);
+      TO_DATA(TO_VECTOR(res)->storage)->tag = ARRAY_TAG | (l << 3);
+      break;
        
     default:
       failure ("invalid tag %d in clone *****\n", t);
@@ -730,7 +927,7 @@ void *Lclone (void *p) {
 }
 
 # define HASH_DEPTH 3
-# define HASH_APPEND(acc, x) (((acc + (unsigned) x) << (WORD_SIZE / 2)) | ((acc + (unsigned) x) >> (WORD_SIZE / 2)))
+# define HASH_APPEND(acc, x) (((acc + (unsigned) (word) x) << (WORD_SIZE / 2)) | ((acc + (unsigned) (word) x) >> (WORD_SIZE / 2)))
 
 int inner_hash (int depth, unsigned acc, void *p) {
   if (depth > HASH_DEPTH) return acc;
@@ -738,7 +935,7 @@ int inner_hash (int depth, unsigned acc, void *p) {
   if (UNBOXED(p)) return HASH_APPEND(acc, UNBOX(p));
   else if (is_valid_heap_pointer (p)) {
     data *a = TO_DATA(p);
-    int t = TAG(a->tag), l = LEN(a->tag), i;
+    int t = KIND(a), l = LEN(a->tag), i;
 
     acc = HASH_APPEND(acc, t);
     acc = HASH_APPEND(acc, l);    
@@ -764,6 +961,19 @@ int inner_hash (int depth, unsigned acc, void *p) {
       i = 0;
       break;
 
+    case VECTOR_TAG:
+      return inner_hash (depth, acc, TO_VECTOR(p)->storage);
+
+    case BUFFER_TAG: {
+      unsigned char *q = (unsigned char*) a->contents;
+
+      acc = HASH_APPEND(acc, TO_BUFFER(p)->kind);
+      
+      for (i = 0; i < l; i++) acc = HASH_APPEND(acc, q[i]);
+
+      return acc;
+    }
+
     case SEXP_TAG: {
 #ifndef DEBUG_PRINT
       int ta = TO_SEXP(p)->tag;
@@ -793,134 +1003,1257 @@ extern void* LstringInt (char *b) {
   return (void*) BOX(n);
 }
 
-extern int Lhash (void *p) {
-  return BOX(0x3fffff & inner_hash (0, 0, p));
-}
+extern word Lhash (void *p) {
+  return BOX(0x3fffff & inner_hash (0, 0, p));
+}
+
+/* Helpers for hash array mapped tries (see Collection.lama); a trie node
+   is an array [bitmap, e_0, ..., e_k] with 16-way branching, since a full
+   bitmap has to fit into an unboxed value */
+# define HAMT_BITS 4
+# define HAMT_MASK 0x000F
+
+// Spreads the bits of a (possibly weak) hash value over 30 bits
+extern word LhashMix (void *h) {
+  unsigned x;
+
+  ASSERT_UNBOXED("hashMix:1", h);
+
+  x = (unsigned) UNBOX(h);
+  x = ((x >> 16) ^ x) * 0x45d9f3b;
+  x = ((x >> 16) ^ x) * 0x45d9f3b;
+  x =  (x >> 16) ^ x;
+
+  return BOX(x & 0x3FFFFFFF);
+}
+
+// Gets a 4-bit fragment of a hash for a given trie level
+extern word LhashFragment (void *h, void *level) {
+  ASSERT_UNBOXED("hashFragment:1", h);
+  ASSERT_UNBOXED("hashFragment:2", level);
+
+  return BOX((UNBOX(h) >> (HAMT_BITS * UNBOX(level))) & HAMT_MASK);
+}
+
+extern word LbitmapHas (void *bm, void *i) {
+  ASSERT_UNBOXED("bitmapHas:1", bm);
+  ASSERT_UNBOXED("bitmapHas:2", i);
+
+  return BOX((UNBOX(bm) >> UNBOX(i)) & 1);
+}
+
+// Gets the number of bits set below the i-th one
+extern word LbitmapIndex (void *bm, void *i) {
+  ASSERT_UNBOXED("bitmapIndex:1", bm);
+  ASSERT_UNBOXED("bitmapIndex:2", i);
+
+  return BOX(__builtin_popcount (UNBOX(bm) & ((1 << UNBOX(i)) - 1)));
+}
+
+extern word LbitmapSet (void *bm, void *i) {
+  ASSERT_UNBOXED("bitmapSet:1", bm);
+  ASSERT_UNBOXED("bitmapSet:2", i);
+
+  return BOX(UNBOX(bm) | (1 << UNBOX(i)));
+}
+
+extern word LbitmapClear (void *bm, void *i) {
+  ASSERT_UNBOXED("bitmapClear:1", bm);
+  ASSERT_UNBOXED("bitmapClear:2", i);
+
+  return BOX(UNBOX(bm) & ~(1 << UNBOX(i)));
+}
+
+extern word LflatCompare (void *p, void *q) {
+  if (UNBOXED(p)) {
+    if (UNBOXED(q)) {
+      return BOX (UNBOX(p) - UNBOX(q));
+    }
+    
+    return -1;
+  }
+  else if (~UNBOXED(q)) {
+    return BOX(p - q);
+  }
+  else BOX(1);
+}
+
+extern word Lcompare (void *p, void *q) {
+# define COMPARE_AND_RETURN(x,y) do if (x != y) return BOX(x - y); while (0)
+  
+  if (p == q) return BOX(0);
+ 
+  if (UNBOXED(p)) {
+    if (UNBOXED(q)) return BOX(UNBOX(p) - UNBOX(q));    
+    else return BOX(-1);
+  }
+  else if (UNBOXED(q)) return BOX(1);
+  else {
+    if (is_valid_heap_pointer (p)) {
+      if (is_valid_heap_pointer (q)) {
+        data *a = TO_DATA(p), *b = TO_DATA(q);
+        int ta = KIND(a), tb = KIND(b);
+        int la = LEN(a->tag), lb = LEN(b->tag);
+        int i;
+    
+        COMPARE_AND_RETURN (ta, tb);
+      
+        switch (ta) {
+        case STRING_TAG:
+          return BOX(strcmp (a->contents, b->contents));
+      
+        case CLOSURE_TAG:
+          COMPARE_AND_RETURN (((void**) a->contents)[0], ((void**) b->contents)[0]);
+          COMPARE_AND_RETURN (la, lb);
+          i = 1;
+          break;
+      
+        case ARRAY_TAG:
+          COMPARE_AND_RETURN (la, lb);
+          i = 0;
+          break;
+
+        case VECTOR_TAG:
+          return Lcompare (TO_VECTOR(p)->storage, TO_VECTOR(q)->storage);
+
+        case BUFFER_TAG: {
+          buffer *ba = TO_BUFFER(p), *bb = TO_BUFFER(q);
+
+          COMPARE_AND_RETURN (ba->kind, bb->kind);
+          COMPARE_AND_RETURN (la, lb);
+
+          if (ba->kind == BUFFER_BYTES) return BOX(memcmp (p, q, la));
+          
+          for (i = 0; i < la / sizeof(int); i++) {
+            int x = ((int*) p)[i], y = ((int*) q)[i];
+            
+            if (x != y) return BOX(x < y ? -1 : 1);
+          }
+
+          return BOX(0);
+        }
+
+        case SEXP_TAG: {
+#ifndef DEBUG_PRINT
+          int ta = TO_SEXP(p)->tag, tb = TO_SEXP(q)->tag;      
+#else
+          int ta = GET_SEXP_TAG(TO_SEXP(p)->tag), tb = GET_SEXP_TAG(TO_SEXP(q)->tag);
+#endif      
+          COMPARE_AND_RETURN (ta, tb);
+          COMPARE_AND_RETURN (la, lb);
+          i = 0;
+          break;
+        }
+
+        default:
+          failure ("invalid tag %d in compare *****\n", ta);
+        }
+
+        for (; i<la; i++) {
+          word c = Lcompare (((void**) a->contents)[i], ((void**) b->contents)[i]);
+          if (c != BOX(0)) return BOX(c);
+        }
+    
+        return BOX(0);
+      }
+      else return BOX(-1);
+    }
+    else if (is_valid_heap_pointer (q)) return BOX(1);
+    else return BOX (p - q);
+  }
+}
+
+extern void* Belem (void *p, word i) {
+  data *a = (data *)BOX(NULL);
+
+  ASSERT_BOXED(".elem:1", p);
+  ASSERT_UNBOXED(".elem:2", i);
+  
+  a = TO_DATA(p);
+  i = UNBOX(i);
+  
+  if (TAG(a->tag) == STRING_TAG) {
+    return (void*) BOX(a->contents[i]);
+  }
+
+  if (KIND(a) == VECTOR_TAG) {
+    return LvectorGet (p, BOX(i));
+  }
+
+  if (KIND(a) == BUFFER_TAG) {
+    return LbufferGet (p, BOX(i));
+  }
+  
+  return (void*) ((word*) a->contents)[i];
+}
+
+// Rejects the lengths of n elements of the given size which do not fit
+// in a header; checked before the allocation since the size overflows
+static void check_length (char *memo, int n, int size) {
+  if (n < 0) {
+    failure ("%s: negative length (%d)\n", memo, n);
+  }
+
+  if (n > MAX_LEN / size) {
+    failure ("%s: length is too large (%d)\n", memo, n);
+  }
+}
+
+extern void* LmakeArray (word length) {
+  data *r;
+  int n;
+
+  ASSERT_UNBOXED("makeArray:1", length);
+
+  n = UNBOX(length);
+
+  check_length ("makeArray", n, 1);
+  
+  __pre_gc ();
+
+  r = (data*) alloc (sizeof(word) * (n+1));
+
+  r->tag = ARRAY_TAG | (n << 3);
+
+  memset (r->contents, 0, n * sizeof(word));
+  
+  __post_gc ();
+
+  return r->contents;
+}
+
+// Returns a copy of array a with x inserted at position i
+extern void* LarrayInsert (void *a, word i, void *x) {
+  data *r;
+  int   n, k;
+
+  ASSERT_BOXED("arrayInsert:1", a);
+  ASSERT_UNBOXED("arrayInsert:2", i);
+
+  n = LEN(TO_DATA(a)->tag);
+  k = UNBOX(i);
+
+  if (k < 0 || k > n) {
+    failure ("arrayInsert: index out of bounds (index=%d, length=%d)\n", k, n);
+  }
+
+  __pre_gc ();
+
+  push_extra_root (&a);
+  push_extra_root (&x);
+  r = (data*) alloc (sizeof(word) * (n+2));
+  pop_extra_root (&x);
+  pop_extra_root (&a);
+
+  r->tag = ARRAY_TAG | ((n+1) << 3);
+
+  memcpy (r->contents, a, k * sizeof(word));
+  ((void**) r->contents)[k] = x;
+  memcpy ((word*) r->contents + k + 1, (word*) a + k, (n - k) * sizeof(word));
+
+  __post_gc ();
+
+  return r->contents;
+}
+
+// Returns a copy of array a without the element at position i
+extern void* LarrayRemove (void *a, word i) {
+  data *r;
+  int   n, k;
+
+  ASSERT_BOXED("arrayRemove:1", a);
+  ASSERT_UNBOXED("arrayRemove:2", i);
+
+  n = LEN(TO_DATA(a)->tag);
+  k = UNBOX(i);
+
+  if (k < 0 || k >= n) {
+    failure ("arrayRemove: index out of bounds (index=%d, length=%d)\n", k, n);
+  }
+
+  __pre_gc ();
+
+  push_extra_root (&a);
+  r = (data*) alloc (sizeof(word) * n);
+  pop_extra_root (&a);
+
+  r->tag = ARRAY_TAG | ((n-1) << 3);
+
+  memcpy (r->contents, a, k * sizeof(word));
+  memcpy ((word*) r->contents + k, (word*) a + k + 1, (n - k - 1) * sizeof(word));
+
+  __post_gc ();
+
+  return r->contents;
+}
+
+/* Growable vectors */
+
+# define VECTOR_MIN_CAPACITY 4
+
+// Creates an empty vector with a given reserved capacity
+extern void* LmakeVector (word capacity) {
+  vector *v;
+  data   *s;
+  int     n;
+
+  ASSERT_UNBOXED("makeVector:1", capacity);
+
+  n = UNBOX(capacity);
+
+  check_length ("makeVector", n, 1);
+  
+  if (n < VECTOR_MIN_CAPACITY) n = VECTOR_MIN_CAPACITY;
+  
+  __pre_gc ();
+
+  // The handle and the storage are allocated at once, so no collection can
+  // see the storage without the handle
+  v = (vector*) alloc (sizeof(vector) + sizeof(word) * (n+1));
+  s = (data*) (v + 1);
+
+  s->tag      = ARRAY_TAG;
+  v->kind     = VECTOR_KIND;
+  v->tag      = SEXP_TAG | (2 << 3);
+  v->capacity = n;
+  v->storage  = (word*) s->contents;
+  
+  __post_gc ();
+
+  return &v->capacity;
+}
+
+// Reallocates the storage of the vector *v to hold n elements
+static void vector_resize (void **v, void **x, int n) {
+  vector *p;
+  data   *s;
+  int     size;
+
+  check_length ("vector", n, 1);
+  
+  push_extra_root (v);
+  push_extra_root (x);
+  s = (data*) alloc (sizeof(word) * (n+1));
+  pop_extra_root (x);
+  pop_extra_root (v);
+
+  p    = TO_VECTOR(*v);
+  size = VECTOR_SIZE(p);
+  
+  s->tag = ARRAY_TAG | (size << 3);
+  memcpy (s->contents, p->storage, sizeof(word) * size);
+
+  p->capacity = n;
+  p->storage  = (word*) s->contents;
+}
+
+// Appends x to the end of vector v; returns v
+extern void* LvectorPush (void *v, void *x) {
+  vector *p;
+  int     n;
+
+  CHECK_VECTOR("vectorPush:1", v);
+
+  p = TO_VECTOR(v);
+  n = VECTOR_SIZE(p);
+
+  if (n == p->capacity) {
+    __pre_gc ();
+    vector_resize (&v, &x, n << 1);
+    __post_gc ();
+    p = TO_VECTOR(v);
+  }
+
+  p->storage[n] = (word) x;
+  TO_DATA(p->storage)->tag = ARRAY_TAG | ((n+1) << 3);
+
+  return v;
+}
+
+// Removes the last element of vector v and returns it
+extern void* LvectorPop (void *v) {
+  vector *p;
+  int     n;
+
+  CHECK_VECTOR("vectorPop:1", v);
+
+  p = TO_VECTOR(v);
+  n = VECTOR_SIZE(p);
+
+  if (n == 0) {
+    failure ("vectorPop: empty vector\n");
+  }
+
+  TO_DATA(p->storage)->tag = ARRAY_TAG | ((n-1) << 3);
+  
+  return (void*) p->storage[n-1];
+}
+
+extern void* LvectorGet (void *v, word i) {
+  vector *p;
+  int     k;
+
+  ASSERT_VECTOR("vectorGet:1", v);
+  ASSERT_UNBOXED("vectorGet:2", i);
+
+  p = TO_VECTOR(v);
+  k = UNBOX(i);
+
+  if (k < 0 || k >= VECTOR_SIZE(p)) {
+    failure ("vectorGet: index out of bounds (index=%d, size=%d)\n", k, VECTOR_SIZE(p));
+  }
+
+  return (void*) p->storage[k];
+}
+
+extern void* LvectorSet (void *v, word i, void *x) {
+  vector *p;
+  int     k;
+
+  CHECK_VECTOR("vectorSet:1", v);
+  ASSERT_UNBOXED("vectorSet:2", i);
+
+  p = TO_VECTOR(v);
+  k = UNBOX(i);
+
+  if (k < 0 || k >= VECTOR_SIZE(p)) {
+    failure ("vectorSet: index out of bounds (index=%d, size=%d)\n", k, VECTOR_SIZE(p));
+  }
+
+  p->storage[k] = (word) x;
+
+  return x;
+}
+
+// Shrinks vector v to the first n elements; the capacity is kept
+extern void* LvectorTruncate (void *v, word n) {
+  vector *p;
+  int     k;
+
+  CHECK_VECTOR("vectorTruncate:1", v);
+  ASSERT_UNBOXED("vectorTruncate:2", n);
+
+  p = TO_VECTOR(v);
+  k = UNBOX(n);
+
+  if (k < 0 || k > VECTOR_SIZE(p)) {
+    failure ("vectorTruncate: invalid size (size=%d, current size=%d)\n", k, VECTOR_SIZE(p));
+  }
+
+  TO_DATA(p->storage)->tag = ARRAY_TAG | (k << 3);
+
+  return v;
+}
+
+// Makes the capacity of vector v at least n
+extern void* LvectorReserve (void *v, word n) {
+  void *x = (void*) BOX(0);
+  int   k;
+
+  CHECK_VECTOR("vectorReserve:1", v);
+  ASSERT_UNBOXED("vectorReserve:2", n);
+
+  k = UNBOX(n);
+
+  if (k > TO_VECTOR(v)->capacity) {
+    __pre_gc ();
+    vector_resize (&v, &x, k);
+    __post_gc ();
+  }
+
+  return v;
+}
+
+extern word LvectorCapacity (void *v) {
+  ASSERT_VECTOR("vectorCapacity:1", v);
+
+  return BOX(TO_VECTOR(v)->capacity);
+}
+
+// Returns the elements of vector v as an array without copying; the array
+// reflects all the changes of v up to the next reallocation of its storage
+extern void* LvectorView (void *v) {
+  ASSERT_VECTOR("vectorView:1", v);
+  
+  return TO_VECTOR(v)->storage;
+}
+
+/* Bulk array operations */
+
+// The kernels over whole arrays are in kernels.c
+
+static void array_check_range (char *memo, void *a, int pos, int len) {
+  int n = LEN(TO_DATA(a)->tag);
+
+  if (pos < 0 || len < 0 || pos > n - len) {
+    failure ("%s: range out of bounds (position=%d, length=%d, array length=%d)\n", memo, pos, len, n);
+  }
+}
+
+// Copies len elements of array src starting from sp into array dst starting
+// from dp; the ranges may overlap. Returns dst
+extern void* LarrayBlit (void *src, word sp, void *dst, word dp, word len) {
+  ASSERT_ARRAY("arrayBlit:1", src);
+  ASSERT_UNBOXED("arrayBlit:2", sp);
+  ASSERT_ARRAY("arrayBlit:3", dst);
+  ASSERT_UNBOXED("arrayBlit:4", dp);
+  ASSERT_UNBOXED("arrayBlit:5", len);
+
+  array_check_range ("arrayBlit", src, UNBOX(sp), UNBOX(len));
+  array_check_range ("arrayBlit", dst, UNBOX(dp), UNBOX(len));
+
+  memmove ((word*) dst + UNBOX(dp), (word*) src + UNBOX(sp), sizeof(word) * UNBOX(len));
+
+  return dst;
+}
+
+// Sets len elements of array a starting from pos to x; returns a
+extern void* LarrayFill (void *a, word pos, word len, void *x) {
+  word *p;
+  int   i, n;
+
+  ASSERT_ARRAY("arrayFill:1", a);
+  ASSERT_UNBOXED("arrayFill:2", pos);
+  ASSERT_UNBOXED("arrayFill:3", len);
+
+  array_check_range ("arrayFill", a, UNBOX(pos), UNBOX(len));
+
+  p = (word*) a + UNBOX(pos);
+  n = UNBOX(len);
+
+  for (i = 0; i < n; i++) p[i] = (word) x;
+
+  return a;
+}
+
+// Returns a fresh array of len elements of array a starting from pos
+extern void* LarraySub (void *a, word pos, word len) {
+  data *r;
+  int   n;
+
+  ASSERT_ARRAY("arraySub:1", a);
+  ASSERT_UNBOXED("arraySub:2", pos);
+  ASSERT_UNBOXED("arraySub:3", len);
+
+  array_check_range ("arraySub", a, UNBOX(pos), UNBOX(len));
+
+  n = UNBOX(len);
+  
+  __pre_gc ();
+
+  push_extra_root (&a);
+  r = (data*) alloc (sizeof(word) * (n+1));
+  pop_extra_root (&a);
+
+  r->tag = ARRAY_TAG | (n << 3);
+  memcpy (r->contents, (word*) a + UNBOX(pos), sizeof(word) * n);
+
+  __post_gc ();
+
+  return r->contents;
+}
+
+// Returns a fresh array of the elements of a followed by the elements of b
+extern void* LarrayConcat (void *a, void *b) {
+  data *r;
+  int   la, lb;
+
+  ASSERT_ARRAY("arrayConcat:1", a);
+  ASSERT_ARRAY("arrayConcat:2", b);
+
+  la = LEN(TO_DATA(a)->tag);
+  lb = LEN(TO_DATA(b)->tag);
+
+  check_length ("arrayConcat", la + lb, 1);
+  
+  __pre_gc ();
+
+  push_extra_root (&a);
+  push_extra_root (&b);
+  r = (data*) alloc (sizeof(word) * (la+lb+1));
+  pop_extra_root (&b);
+  pop_extra_root (&a);
+
+  r->tag = ARRAY_TAG | ((la+lb) << 3);
+  memcpy (r->contents, a, sizeof(word) * la);
+  memcpy ((word*) r->contents + la, b, sizeof(word) * lb);
+
+  __post_gc ();
+
+  return r->contents;
+}
+
+// Reverses array a in place; returns a
+extern void* LarrayReverse (void *a) {
+  word *p;
+  int   i, j;
+
+  ASSERT_ARRAY("arrayReverse:1", a);
+
+  p = (word*) a;
+  
+  for (i = 0, j = LEN(TO_DATA(a)->tag) - 1; i < j; i++, j--) {
+    word x = p[i];
+
+    p[i] = p[j];
+    p[j] = x;
+  }
+
+  return a;
+}
+
+// Returns the index of the first element of array a, which is equal to x
+// w.r.t. "compare", or -1
+extern word LarrayIndex (void *a, void *x) {
+  word *p;
+  int   i, n;
+
+  ASSERT_ARRAY("arrayIndex:1", a);
+
+  p = (word*) a;
+  n = LEN(TO_DATA(a)->tag);
+
+  if (UNBOXED(x)) {
+    for (i = 0; i < n; i++) 
+      if (p[i] == (word) x) return BOX(i);
+  }
+  else {
+    for (i = 0; i < n; i++) 
+      if (Lcompare ((void*) p[i], x) == BOX(0)) return BOX(i);
+  }
+
+  return BOX(-1);
+}
+
+static void array_check_unboxed (char *memo, void *a) {
+  ASSERT_ARRAY(memo, a);
+  
+  if (! words_unboxed ((word*) a, LEN(TO_DATA(a)->tag))) {
+    failure ("array of unboxed values expected in %s\n", memo);
+  }
+}
+
+// The sum of an array of unboxed integers (modulo the word size)
+extern word LarraySum (void *a) {
+  int n;
+
+  array_check_unboxed ("arraySum", a);
+
+  n = LEN(TO_DATA(a)->tag);
+
+  // Each element is 2x+1, hence the sum of x is (sum - n) / 2
+  return BOX(((word) (words_sum ((word*) a, n) - (uintptr_t) n)) >> 1);
+}
+
+// The minimum of a non-empty array of unboxed integers
+extern word LarrayMin (void *a) {
+  array_check_unboxed ("arrayMin", a);
+
+  if (LEN(TO_DATA(a)->tag) == 0) failure ("arrayMin: empty array\n");
+  
+  // Boxing preserves the order
+  return words_min ((word*) a, LEN(TO_DATA(a)->tag));
+}
+
+// The maximum of a non-empty array of unboxed integers
+extern word LarrayMax (void *a) {
+  array_check_unboxed ("arrayMax", a);
+
+  if (LEN(TO_DATA(a)->tag) == 0) failure ("arrayMax: empty array\n");
+  
+  return words_max ((word*) a, LEN(TO_DATA(a)->tag));
+}
+
+/* Typed buffers */
+
+static void* buffer_make (int kind, int n) {
+  buffer *b;
+  int     size;
+
+  check_length ("typed buffer", n, kind == BUFFER_INT32 ? sizeof(int) : 1);
+
+  size = n * (kind == BUFFER_INT32 ? sizeof(int) : 1);
+
+  __pre_gc ();
+  
+  b = (buffer*) alloc (2 * sizeof(word) + size);
+
+  b->kind          = kind;
+  b->contents.tag  = SEXP_TAG | (size << 3);
+
+  memset (b->contents.contents, 0, size);
+  
+  __post_gc ();
+
+  return b->contents.contents;
+}
+
+// Creates a zero-filled buffer of n bytes
+extern void* LmakeByteBuffer (word n) {
+  ASSERT_UNBOXED("makeByteBuffer:1", n);
+
+  return buffer_make (BUFFER_BYTES, UNBOX(n));
+}
+
+// Creates a zero-filled buffer of n 32-bit integers
+extern void* LmakeInt32Buffer (word n) {
+  ASSERT_UNBOXED("makeInt32Buffer:1", n);
+
+  return buffer_make (BUFFER_INT32, UNBOX(n));
+}
+
+static void buffer_check_index (char *memo, buffer *b, int i) {
+  if (i < 0 || i >= BUFFER_LENGTH(b)) {
+    failure ("%s: index out of bounds (index=%d, length=%d)\n", memo, i, BUFFER_LENGTH(b));
+  }
+}
+
+static void buffer_check_range (char *memo, buffer *b, int pos, int len) {
+  int n = BUFFER_LENGTH(b);
+  
+  if (pos < 0 || len < 0 || pos > n - len) {
+    failure ("%s: range out of bounds (position=%d, length=%d, buffer length=%d)\n", memo, pos, len, n);
+  }
+}
+
+// Gets an element; int32 elements are truncated to 31 bits when boxed
+extern void* LbufferGet (void *b, word i) {
+  buffer *p;
+  
+  ASSERT_BUFFER("bufferGet:1", b);
+  ASSERT_UNBOXED("bufferGet:2", i);
+
+  p = TO_BUFFER(b);
+  buffer_check_index ("bufferGet", p, UNBOX(i));
+
+  if (p->kind == BUFFER_INT32) return (void*) BOX(((int*) b)[UNBOX(i)]);
+  
+  return (void*) BOX(((unsigned char*) b)[UNBOX(i)]);
+}
+
+extern void* LbufferSet (void *b, word i, void *x) {
+  buffer *p;
+  
+  ASSERT_BUFFER("bufferSet:1", b);
+  ASSERT_UNBOXED("bufferSet:2", i);
+  ASSERT_UNBOXED("bufferSet:3", x);
+
+  p = TO_BUFFER(b);
+  buffer_check_index ("bufferSet", p, UNBOX(i));
+
+  if (p->kind == BUFFER_INT32) ((int*) b)[UNBOX(i)] = UNBOX(x);
+  else ((unsigned char*) b)[UNBOX(i)] = (unsigned char) UNBOX(x);
+
+  return x;
+}
+
+// Creates a byte buffer from a string or an array of integers
+extern void* LbyteBufferOf (void *x) {
+  void *r;
+  int   n, i;
+
+  ASSERT_BOXED("byteBufferOf:1", x);
+
+  switch (KIND(TO_DATA(x))) {
+  case STRING_TAG:
+    n = LEN(TO_DATA(x)->tag);
+    push_extra_root (&x);
+    r = buffer_make (BUFFER_BYTES, n);
+    pop_extra_root (&x);
+    memcpy (r, x, n);
+    return r;
+
+  case ARRAY_TAG:
+    n = LEN(TO_DATA(x)->tag);
+    push_extra_root (&x);
+    r = buffer_make (BUFFER_BYTES, n);
+    pop_extra_root (&x);
+    for (i = 0; i < n; i++) ((unsigned char*) r)[i] = (unsigned char) UNBOX(((word*) x)[i]);
+    return r;
+
+  default:
+    failure ("string or array expected in byteBufferOf\n");
+  }
+
+  return NULL; // never happens
+}
+
+// Creates an int32 buffer from an array of integers
+extern void* Lint32BufferOf (void *a) {
+  void *r;
+  int   n, i;
+
+  ASSERT_ARRAY("int32BufferOf:1", a);
+
+  n = LEN(TO_DATA(a)->tag);
+  push_extra_root (&a);
+  r = buffer_make (BUFFER_INT32, n);
+  pop_extra_root (&a);
+  
+  for (i = 0; i < n; i++) ((int*) r)[i] = UNBOX(((word*) a)[i]);
+
+  return r;
+}
+
+// Creates an array of the (boxed) elements of buffer b
+extern void* LbufferArray (void *b) {
+  buffer *p;
+  data   *r;
+  int     n, i;
+
+  ASSERT_BUFFER("bufferArray:1", b);
+
+  n = BUFFER_LENGTH(TO_BUFFER(b));
+  
+  __pre_gc ();
+
+  push_extra_root (&b);
+  r = (data*) alloc (sizeof(word) * (n+1));
+  pop_extra_root (&b);
+
+  r->tag = ARRAY_TAG | (n << 3);
+  p      = TO_BUFFER(b);
+  
+  if (p->kind == BUFFER_INT32)
+    for (i = 0; i < n; i++) ((word*) r->contents)[i] = BOX(((int*) b)[i]);
+  else
+    for (i = 0; i < n; i++) ((word*) r->contents)[i] = BOX(((unsigned char*) b)[i]);
+
+  __post_gc ();
+
+  return r->contents;
+}
+
+// Creates a string of the bytes of byte buffer b (up to the first zero byte)
+extern void* LbufferString (void *b) {
+  void *r;
+  int   n;
+
+  ASSERT_BUFFER("bufferString:1", b);
+  
+  if (TO_BUFFER(b)->kind != BUFFER_BYTES) failure ("byte buffer expected in bufferString\n");
+
+  n = strnlen (b, LEN(TO_DATA(b)->tag));
+  push_extra_root (&b);
+  r = LmakeString (BOX(n));
+  pop_extra_root (&b);
+
+  memcpy (r, b, n);
+  ((char*) r)[n] = 0;
+
+  return r;
+}
+
+// Copies len elements of buffer src starting from sp into buffer dst
+// starting from dp; the buffers must be of the same kind. Returns dst
+extern void* LbufferBlit (void *src, word sp, void *dst, word dp, word len) {
+  int k;
+  
+  ASSERT_BUFFER("bufferBlit:1", src);
+  ASSERT_UNBOXED("bufferBlit:2", sp);
+  ASSERT_BUFFER("bufferBlit:3", dst);
+  ASSERT_UNBOXED("bufferBlit:4", dp);
+  ASSERT_UNBOXED("bufferBlit:5", len);
+
+  if (TO_BUFFER(src)->kind != TO_BUFFER(dst)->kind) {
+    failure ("bufferBlit: buffers of different kinds\n");
+  }
+  
+  buffer_check_range ("bufferBlit", TO_BUFFER(src), UNBOX(sp), UNBOX(len));
+  buffer_check_range ("bufferBlit", TO_BUFFER(dst), UNBOX(dp), UNBOX(len));
+
+  k = BUFFER_ELEM_SIZE(TO_BUFFER(src));
+  memmove ((char*) dst + k * UNBOX(dp), (char*) src + k * UNBOX(sp), k * UNBOX(len));
+
+  return dst;
+}
+
+// Sets len elements of buffer b starting from pos to x; returns b
+extern void* LbufferFill (void *b, word pos, word len, word x) {
+  buffer *p;
+  int     i, n;
+  
+  ASSERT_BUFFER("bufferFill:1", b);
+  ASSERT_UNBOXED("bufferFill:2", pos);
+  ASSERT_UNBOXED("bufferFill:3", len);
+  ASSERT_UNBOXED("bufferFill:4", x);
+
+  p = TO_BUFFER(b);
+  buffer_check_range ("bufferFill", p, UNBOX(pos), UNBOX(len));
+
+  n = UNBOX(len);
+  
+  if (p->kind == BUFFER_INT32)
+    for (i = 0; i < n; i++) ((int*) b)[UNBOX(pos) + i] = UNBOX(x);
+  else memset ((char*) b + UNBOX(pos), UNBOX(x), n);
+
+  return b;
+}
+
+// Returns a fresh buffer of len elements of buffer b starting from pos
+extern void* LbufferSub (void *b, word pos, word len) {
+  void *r;
+  int   k;
+  
+  ASSERT_BUFFER("bufferSub:1", b);
+  ASSERT_UNBOXED("bufferSub:2", pos);
+  ASSERT_UNBOXED("bufferSub:3", len);
+
+  buffer_check_range ("bufferSub", TO_BUFFER(b), UNBOX(pos), UNBOX(len));
+  
+  push_extra_root (&b);
+  r = buffer_make (TO_BUFFER(b)->kind, UNBOX(len));
+  pop_extra_root (&b);
+
+  k = BUFFER_ELEM_SIZE(TO_BUFFER(b));
+  memcpy (r, (char*) b + k * UNBOX(pos), k * UNBOX(len));
+
+  return r;
+}
+
+// The sum of the elements of buffer b (modulo 2^31)
+extern word LbufferSum (void *b) {
+  buffer *p;
+  
+  ASSERT_BUFFER("bufferSum:1", b);
+
+  p = TO_BUFFER(b);
+
+  if (p->kind == BUFFER_INT32) return BOX(int32s_sum ((int*) b, BUFFER_LENGTH(p)));
+
+  return BOX(bytes_sum ((unsigned char*) b, BUFFER_LENGTH(p)));
+}
+
+// The minimum of the elements of a non-empty buffer b
+extern word LbufferMin (void *b) {
+  buffer *p;
+  
+  ASSERT_BUFFER("bufferMin:1", b);
+
+  p = TO_BUFFER(b);
+
+  if (BUFFER_LENGTH(p) == 0) failure ("bufferMin: empty buffer\n");
+  
+  if (p->kind == BUFFER_INT32) return BOX(int32s_min ((int*) b, BUFFER_LENGTH(p)));
+
+  return BOX(bytes_min ((unsigned char*) b, BUFFER_LENGTH(p)));
+}
+
+// The maximum of the elements of a non-empty buffer b
+extern word LbufferMax (void *b) {
+  buffer *p;
+  
+  ASSERT_BUFFER("bufferMax:1", b);
+
+  p = TO_BUFFER(b);
+
+  if (BUFFER_LENGTH(p) == 0) failure ("bufferMax: empty buffer\n");
+  
+  if (p->kind == BUFFER_INT32) return BOX(int32s_max ((int*) b, BUFFER_LENGTH(p)));
+
+  return BOX(bytes_max ((unsigned char*) b, BUFFER_LENGTH(p)));
+}
+
+// Reads a little-endian integer of size bytes (1, 2 or 4) at byte offset
+// off of byte buffer b; signed is a boolean
+extern word LbufferReadInt (void *b, word off, word size, word sign) {
+  unsigned char *q;
+  unsigned       x = 0;
+  int            k, n, i;
+  
+  ASSERT_BUFFER("bufferReadInt:1", b);
+  ASSERT_UNBOXED("bufferReadInt:2", off);
+  ASSERT_UNBOXED("bufferReadInt:3", size);
+
+  if (TO_BUFFER(b)->kind != BUFFER_BYTES) failure ("byte buffer expected in bufferReadInt\n");
+
+  k = UNBOX(off);
+  n = UNBOX(size);
+
+  if (n != 1 && n != 2 && n != 4) failure ("bufferReadInt: invalid size %d\n", n);
+  
+  buffer_check_range ("bufferReadInt", TO_BUFFER(b), k, n);
+
+  q = (unsigned char*) b + k;
+
+  for (i = n-1; i >= 0; i--) x = (x << 8) | q[i];
+
+  if (UNBOX(sign) && n < 4 && (x >> (8*n - 1)) & 1) x |= ~0u << (8*n);
+
+  return BOX(x);
+}
+
+// Writes a little-endian integer of size bytes (1, 2 or 4) at byte offset
+// off of byte buffer b; returns b
+extern void* LbufferWriteInt (void *b, word off, word size, word x) {
+  unsigned char *q;
+  unsigned       v;
+  int            k, n, i;
+  
+  ASSERT_BUFFER("bufferWriteInt:1", b);
+  ASSERT_UNBOXED("bufferWriteInt:2", off);
+  ASSERT_UNBOXED("bufferWriteInt:3", size);
+  ASSERT_UNBOXED("bufferWriteInt:4", x);
+
+  if (TO_BUFFER(b)->kind != BUFFER_BYTES) failure ("byte buffer expected in bufferWriteInt\n");
+
+  k = UNBOX(off);
+  n = UNBOX(size);
+
+  if (n != 1 && n != 2 && n != 4) failure ("bufferWriteInt: invalid size %d\n", n);
+  
+  buffer_check_range ("bufferWriteInt", TO_BUFFER(b), k, n);
+
+  q = (unsigned char*) b + k;
+  v = (unsigned) UNBOX(x);
+
+  for (i = 0; i < n; i++, v >>= 8) q[i] = v & 0xFF;
+
+  return b;
+}
+
+/* Sorting */
+
+# define SORT_INSERTION_THRESHOLD 16
+# define SORT_RADIX_THRESHOLD     64
+
+typedef int (*sort_compare) (void*, void*);
+
+static int sort_compare_values (void *p, void *q) {
+  return UNBOX(Lcompare (p, q));
+}
+
+static int sort_compare_ints (void *p, void *q) {
+  return ((word) p > (word) q) - ((word) p < (word) q);
+}
+
+// Compares strings taking their lengths from headers
+static int sort_compare_strings (void *p, void *q) {
+  int lp = LEN(TO_DATA(p)->tag), lq = LEN(TO_DATA(q)->tag);
+  int c  = memcmp (p, q, lp < lq ? lp : lq);
+
+  return c ? c : lp - lq;
+}
+
+static void sort_insertion (void **a, int n, sort_compare cmp) {
+  int i, j;
+
+  for (i = 1; i < n; i++) {
+    void *x = a[i];
+
+    for (j = i; j > 0 && cmp (a[j-1], x) > 0; j--) a[j] = a[j-1];
+
+    a[j] = x;
+  }
+}
+
+static void sort_sift_down (void **a, int i, int n, sort_compare cmp) {
+  void *x = a[i];
+  int   j;
+
+  while ((j = 2*i + 1) < n) {
+    if (j + 1 < n && cmp (a[j], a[j+1]) < 0) j++;
+    if (cmp (x, a[j]) >= 0) break;
+    a[i] = a[j];
+    i    = j;
+  }
+
+  a[i] = x;
+}
+
+static void sort_heap (void **a, int n, sort_compare cmp) {
+  int i;
+
+  for (i = n/2 - 1; i >= 0; i--) sort_sift_down (a, i, n, cmp);
+
+  for (i = n - 1; i > 0; i--) {
+    void *x = a[0];
+
+    a[0] = a[i];
+    a[i] = x;
+    sort_sift_down (a, 0, i, cmp);
+  }
+}
+
+// Introsort: quicksort with median-of-three pivots, which falls back to
+// heapsort when the recursion gets too deep and to insertion sort for
+// short ranges
+static void sort_intro (void **a, int n, int depth, sort_compare cmp) {
+  while (n > SORT_INSERTION_THRESHOLD) {
+    void *pivot, *x;
+    int   i, j, m = n / 2;
+    
+    if (depth-- == 0) {
+      sort_heap (a, n, cmp);
+      return;
+    }
+
+    if (cmp (a[m]  , a[0]) < 0) {x = a[m]  ; a[m]   = a[0]; a[0] = x;}
+    if (cmp (a[n-1], a[0]) < 0) {x = a[n-1]; a[n-1] = a[0]; a[0] = x;}
+    if (cmp (a[n-1], a[m]) < 0) {x = a[n-1]; a[n-1] = a[m]; a[m] = x;}
+
+    pivot = a[m];
+    i     = 0;
+    j     = n - 1;
+
+    for (;;) {
+      while (cmp (a[i], pivot) < 0) i++;
+      while (cmp (pivot, a[j]) < 0) j--;
+      if (i >= j) break;
+      x    = a[i];
+      a[i] = a[j];
+      a[j] = x;
+      i++;
+      j--;
+    }
+
+    // Recurse into the smaller part, iterate over the larger one
+    if (j + 1 < n - j - 1) {
+      sort_intro (a, j + 1, depth, cmp);
+      a += j + 1;
+      n -= j + 1;
+    }
+    else {
+      sort_intro (a + j + 1, n - j - 1, depth, cmp);
+      n = j + 1;
+    }
+  }
+
+  sort_insertion (a, n, cmp);
+}
+
+// LSD radix sort of unboxed integers by bytes; the sign bit is flipped so
+// negative numbers come first
+static void sort_radix (word *a, int n) {
+  word      *b = (word*) malloc (sizeof(word) * n), *src = a, *dst = b, *t;
+  uintptr_t  sign = (uintptr_t) 1 << (WORD_BITS - 1);
+  unsigned   count[256];
+  int        shift, i;
+
+  if (b == NULL) failure ("sort: out of memory\n");
+
+  for (shift = 0; shift < WORD_BITS; shift += 8) {
+    unsigned sum = 0;
+
+    memset (count, 0, sizeof (count));
+
+    for (i = 0; i < n; i++) count[(((uintptr_t) src[i] ^ sign) >> shift) & 0xFF]++;
+
+    // Skip the pass when all the keys share the digit
+    if (count[(((uintptr_t) src[0] ^ sign) >> shift) & 0xFF] == n) continue;
+
+    for (i = 0; i < 256; i++) {
+      unsigned c = count[i];
 
-extern int LflatCompare (void *p, void *q) {
-  if (UNBOXED(p)) {
-    if (UNBOXED(q)) {
-      return BOX (UNBOX(p) - UNBOX(q));
+      count[i] = sum;
+      sum     += c;
     }
-    
-    return -1;
-  }
-  else if (~UNBOXED(q)) {
-    return BOX(p - q);
-  }
-  else BOX(1);
-}
 
-extern int Lcompare (void *p, void *q) {
-# define COMPARE_AND_RETURN(x,y) do if (x != y) return BOX(x - y); while (0)
-  
-  if (p == q) return BOX(0);
- 
-  if (UNBOXED(p)) {
-    if (UNBOXED(q)) return BOX(UNBOX(p) - UNBOX(q));    
-    else return BOX(-1);
+    for (i = 0; i < n; i++) dst[count[(((uintptr_t) src[i] ^ sign) >> shift) & 0xFF]++] = src[i];
+
+    t   = src;
+    src = dst;
+    dst = t;
   }
-  else if (UNBOXED(q)) return BOX(1);
-  else {
-    if (is_valid_heap_pointer (p)) {
-      if (is_valid_heap_pointer (q)) {
-        data *a = TO_DATA(p), *b = TO_DATA(q);
-        int ta = TAG(a->tag), tb = TAG(b->tag);
-        int la = LEN(a->tag), lb = LEN(b->tag);
-        int i;
-    
-        COMPARE_AND_RETURN (ta, tb);
-      
-        switch (ta) {
-        case STRING_TAG:
-          return BOX(strcmp (a->contents, b->contents));
-      
-        case CLOSURE_TAG:
-          COMPARE_AND_RETURN (((void**) a->contents)[0], ((void**) b->contents)[0]);
-          COMPARE_AND_RETURN (la, lb);
-          i = 1;
-          break;
-      
-        case ARRAY_TAG:
-          COMPARE_AND_RETURN (la, lb);
-          i = 0;
-          break;
 
-        case SEXP_TAG: {
-#ifndef DEBUG_PRINT
-          int ta = TO_SEXP(p)->tag, tb = TO_SEXP(q)->tag;      
-#else
-          int ta = GET_SEXP_TAG(TO_SEXP(p)->tag), tb = GET_SEXP_TAG(TO_SEXP(q)->tag);
-#endif      
-          COMPARE_AND_RETURN (ta, tb);
-          COMPARE_AND_RETURN (la, lb);
-          i = 0;
-          break;
-        }
+  if (src != a) memcpy (a, src, sizeof(word) * n);
 
-        default:
-          failure ("invalid tag %d in compare *****\n", ta);
-        }
+  free (b);
+}
 
-        for (; i<la; i++) {
-          int c = Lcompare (((void**) a->contents)[i], ((void**) b->contents)[i]);
-          if (c != BOX(0)) return BOX(c);
-        }
-    
-        return BOX(0);
-      }
-      else return BOX(-1);
+// Sorts n values; does not allocate in the heap
+static void sort_values (void **a, int n) {
+  int ints = 1, strings = 1, depth = 0, i;
+
+  for (i = 0; i < n && (ints || strings); i++) {
+    if (UNBOXED(a[i])) strings = 0;
+    else {
+      ints = 0;
+      if (! is_valid_heap_pointer (a[i]) || TAG(TO_DATA(a[i])->tag) != STRING_TAG) strings = 0;
     }
-    else if (is_valid_heap_pointer (q)) return BOX(1);
-    else return BOX (p - q);
   }
-}
 
-extern void* Belem (void *p, int i) {
-  data *a = (data *)BOX(NULL);
+  for (i = n; i > 1; i >>= 1) depth += 2;
 
-  ASSERT_BOXED(".elem:1", p);
-  ASSERT_UNBOXED(".elem:2", i);
-  
-  a = TO_DATA(p);
-  i = UNBOX(i);
-  
-  if (TAG(a->tag) == STRING_TAG) {
-    return (void*) BOX(a->contents[i]);
+  if (ints) {
+    if (n >= SORT_RADIX_THRESHOLD) sort_radix ((word*) a, n);
+    else sort_intro (a, n, depth, sort_compare_ints);
   }
+  else if (strings) sort_intro (a, n, depth, sort_compare_strings);
+  else sort_intro (a, n, depth, sort_compare_values);
+}
+
+// Sorts array a in place w.r.t. "compare"; returns a
+extern void* LsortArray (void *a) {
+  ASSERT_ARRAY("sortArray:1", a);
   
-  return (void*) ((int*) a->contents)[i];
+  sort_values ((void**) a, LEN(TO_DATA(a)->tag));
+
+  return a;
 }
 
-extern void* LmakeArray (int length) {
-  data *r;
-  int n;
+// Returns a sorted copy of list l
+extern void* LsortList (void *l) {
+  void **vs;
+  sexp  *r;
+  int    n, i, cons;
+  void  *p;
 
-  ASSERT_UNBOXED("makeArray:1", length);
+  for (n = 0, p = l; !UNBOXED(p); p = ((void**) p)[1]) n++;
+
+  if (n == 0) return l;
   
   __pre_gc ();
 
-  n = UNBOX(length);
-  r = (data*) alloc (sizeof(int) * (n+1));
+  push_extra_root (&l);
+  r = (sexp*) alloc (sizeof(word) * 4 * n);
+  pop_extra_root (&l);
 
-  r->tag = ARRAY_TAG | (n << 3);
+  // No allocations in the heap from now on, so the values can be kept
+  // outside it
+  vs = (void**) malloc (sizeof(void*) * n);
+
+  if (vs == NULL) failure ("sortList: out of memory\n");
+
+  for (i = 0, p = l; i < n; i++, p = ((void**) p)[1]) vs[i] = ((void**) p)[0];
 
-  memset (r->contents, 0, n * sizeof(int));
+  sort_values (vs, n);
+
+  cons = UNBOX(LtagHash ("cons"));
   
+  // The cells are laid out consecutively, four words each
+  for (i = n-1; i >= 0; i--) {
+    sexp *c = (sexp*) ((word*) r + 4*i);
+    
+#ifndef DEBUG_PRINT
+    c->tag = cons;
+#else
+    c->tag = SEXP_TAG | (cons << 3);
+#endif
+    c->contents.tag = SEXP_TAG | (2 << 3);
+    ((void**) c->contents.contents)[0] = vs[i];
+    ((void**) c->contents.contents)[1] = p;
+    p = c->contents.contents;
+  }
+
+  free (vs);
+
   __post_gc ();
 
-  return r->contents;
+  return p;
 }
 
-extern void* LmakeString (int length) {
+extern void* LmakeString (word length) {
   int   n = UNBOX(length);
   data *r;
 
   ASSERT_UNBOXED("makeString", length);
+
+  check_length ("makeString", n, 1);
   
   __pre_gc () ;
   
-  r = (data*) alloc (n + 1 + sizeof (int));
+  r = (data*) alloc (n + 1 + sizeof(word));
 
   r->tag = STRING_TAG | (n << 3);
 
@@ -997,78 +2330,75 @@ extern void* Lstring (void *p) {
   return s;
 }
 
-extern void* Bclosure (int bn, void *entry, ...) {
+// The variadic constructors below first copy their arguments into a local
+// root region: on x86-64 the arguments arrive in registers, hence neither
+// the stack scan nor the extra roots could update them when the GC runs
+extern void* Bclosure (word bn, void *entry, ...) {
   va_list args; 
-  int     i, ai;
-  register int * ebp asm ("ebp");
-  size_t  *argss;
+  int     i;
   data    *r; 
   int     n = UNBOX(bn);
+  word    vs[n + 1], *end = vs + n;
   
+  va_start(args, entry);
+  
+  for (i = 0; i<n; i++) {
+    vs[i] = va_arg(args, word);
+  }
+  
+  va_end(args);
+
   __pre_gc ();
 #ifdef DEBUG_PRINT
   indent++; print_indent ();
   printf ("Bclosure: create n = %d\n", n); fflush(stdout);
 #endif
-  argss = (ebp + 12);
-  for (i = 0; i<n; i++, argss++) {
-    push_extra_root ((void**)argss);
-  }
-
-  r = (data*) alloc (sizeof(int) * (n+2));
+  push_root_region ((void**) vs, (void***) &end);
+  r = (data*) alloc (sizeof(word) * (n+2));
+  pop_root_region ((void**) vs);
   
   r->tag = CLOSURE_TAG | ((n + 1) << 3);
   ((void**) r->contents)[0] = entry;
-  
-  va_start(args, entry);
-  
-  for (i = 0; i<n; i++) {
-    ai = va_arg(args, int);
-    ((int*)r->contents)[i+1] = ai;
-  }
-  
-  va_end(args);
+  memcpy ((word*) r->contents + 1, vs, sizeof(word) * n);
 
   __post_gc();
 
-  argss--;
-  for (i = 0; i<n; i++, argss--) {
-    pop_extra_root ((void**)argss);
-  }
-
 #ifdef DEBUG_PRINT
   print_indent ();
-  printf ("Bclosure: ends\n", n); fflush(stdout);
+  printf ("Bclosure: ends\n"); fflush(stdout);
   indent--;
 #endif
 
   return r->contents;
 }
 
-extern void* Barray (int bn, ...) {
+extern void* Barray (word bn, ...) {
   va_list args; 
-  int     i, ai; 
+  int     i; 
   data    *r; 
   int     n = UNBOX(bn);
+  word    vs[n + 1], *end = vs + n;
     
+  va_start(args, bn);
+  
+  for (i = 0; i<n; i++) {
+    vs[i] = va_arg(args, word);
+  }
+  
+  va_end(args);
+
   __pre_gc ();
   
 #ifdef DEBUG_PRINT
   indent++; print_indent ();
   printf ("Barray: create n = %d\n", n); fflush(stdout);
 #endif
-  r = (data*) alloc (sizeof(int) * (n+1));
+  push_root_region ((void**) vs, (void***) &end);
+  r = (data*) alloc (sizeof(word) * (n+1));
+  pop_root_region ((void**) vs);
 
   r->tag = ARRAY_TAG | (n << 3);
-  
-  va_start(args, bn);
-  
-  for (i = 0; i<n; i++) {
-    ai = va_arg(args, int);
-    ((int*)r->contents)[i] = ai;
-  }
-  
-  va_end(args);
+  memcpy (r->contents, vs, sizeof(word) * n);
 
   __post_gc();
 #ifdef DEBUG_PRINT
@@ -1077,37 +2407,38 @@ extern void* Barray (int bn, ...) {
   return r->contents;
 }
 
-extern void* Bsexp (int bn, ...) {
+extern void* Bsexp (word bn, ...) {
   va_list args; 
   int     i;    
-  int     ai;  
-  size_t *p;  
   sexp   *r;  
   data   *d;  
-  int n = UNBOX(bn); 
+  int     n = UNBOX(bn); 
+  word    vs[n], *end = vs + n - 1;
+
+  va_start(args, bn);
+  
+  for (i=0; i<n; i++) {
+    vs[i] = va_arg(args, word);
+  }
+
+  va_end(args);
 
   __pre_gc () ;
   
 #ifdef DEBUG_PRINT
   indent++; print_indent ();
-  printf("Bsexp: allocate %zu!\n",sizeof(int) * (n+1)); fflush (stdout);
+  printf("Bsexp: allocate %zu!\n",sizeof(word) * (n+1)); fflush (stdout);
 #endif
-  r = (sexp*) alloc (sizeof(int) * (n+1));
+  push_root_region ((void**) vs, (void***) &end);
+  r = (sexp*) alloc (sizeof(word) * (n+1));
+  pop_root_region ((void**) vs);
   d = &(r->contents);
-  r->tag = 0;
     
   d->tag = SEXP_TAG | ((n-1) << 3);
-  
-  va_start(args, bn);
-  
-  for (i=0; i<n-1; i++) {
-    ai = va_arg(args, int);
-    
-    p = (size_t*) ai;
-    ((int*)d->contents)[i] = ai;
-  }
+  memcpy (d->contents, vs, sizeof(word) * (n-1));
 
-  r->tag = UNBOX(va_arg(args, int));
+  // The last argument is the (boxed) hash of the constructor
+  r->tag = UNBOX(vs[n-1]);
 
 #ifdef DEBUG_PRINT
   r->tag = SEXP_TAG | ((r->tag) << 3);
@@ -1116,14 +2447,12 @@ extern void* Bsexp (int bn, ...) {
   indent--;
 #endif
 
-  va_end(args);
-
   __post_gc();
 
   return d->contents;
 }
 
-extern int Btag (void *d, int t, int n) {
+extern word Btag (void *d, word t, word n) {
   data *r; 
   
   if (UNBOXED(d)) return BOX(0);
@@ -1138,7 +2467,7 @@ extern int Btag (void *d, int t, int n) {
   }
 }
 
-extern int Barray_patt (void *d, int n) {
+extern word Barray_patt (void *d, word n) {
   data *r; 
   
   if (UNBOXED(d)) return BOX(0);
@@ -1148,7 +2477,7 @@ extern int Barray_patt (void *d, int n) {
   }
 }
 
-extern int Bstring_patt (void *x, void *y) {
+extern word Bstring_patt (void *x, void *y) {
   data *rx = (data *) BOX (NULL),
        *ry = (data *) BOX (NULL);
   
@@ -1164,45 +2493,47 @@ extern int Bstring_patt (void *x, void *y) {
   }
 }
 
-extern int Bclosure_tag_patt (void *x) {
+extern word Bclosure_tag_patt (void *x) {
   if (UNBOXED(x)) return BOX(0);
   
   return BOX(TAG(TO_DATA(x)->tag) == CLOSURE_TAG);
 }
 
-extern int Bboxed_patt (void *x) {
+extern word Bboxed_patt (void *x) {
   return BOX(UNBOXED(x) ? 0 : 1);
 }
 
-extern int Bunboxed_patt (void *x) {
+extern word Bunboxed_patt (void *x) {
   return BOX(UNBOXED(x) ? 1 : 0);
 }
 
-extern int Barray_tag_patt (void *x) {
+extern word Barray_tag_patt (void *x) {
   if (UNBOXED(x)) return BOX(0);
   
   return BOX(TAG(TO_DATA(x)->tag) == ARRAY_TAG);
 }
 
-extern int Bstring_tag_patt (void *x) {
+extern word Bstring_tag_patt (void *x) {
   if (UNBOXED(x)) return BOX(0);
   
   return BOX(TAG(TO_DATA(x)->tag) == STRING_TAG);
 }
 
-extern int Bsexp_tag_patt (void *x) {
+extern word Bsexp_tag_patt (void *x) {
   if (UNBOXED(x)) return BOX(0);
   
-  return BOX(TAG(TO_DATA(x)->tag) == SEXP_TAG);
+  return BOX(KIND(TO_DATA(x)) == SEXP_TAG);
 }
 
-extern void* Bsta (void *v, int i, void *x) {
+extern void* Bsta (void *v, word i, void *x) {
   if (UNBOXED(i)) {
     ASSERT_BOXED(".sta:3", x);
     //    ASSERT_UNBOXED(".sta:2", i);
   
     if (TAG(TO_DATA(x)->tag) == STRING_TAG)((char*) x)[UNBOX(i)] = (char) UNBOX(v);
-    else ((int*) x)[UNBOX(i)] = (int) v;
+    else if (KIND(TO_DATA(x)) == VECTOR_TAG) LvectorSet (x, i, v);
+    else if (KIND(TO_DATA(x)) == BUFFER_TAG) LbufferSet (x, i, v);
+    else ((word*) x)[UNBOX(i)] = (word) v;
 
     return v;
   }
@@ -1212,35 +2543,82 @@ extern void* Bsta (void *v, int i, void *x) {
   return v;
 }
 
-static void fix_unboxed (char *s, va_list va) {
-  size_t *p = (size_t*)va;
-  int i = 0;
-  
-  while (*s) {
-    if (*s == '%') {
-      size_t n = p [i];
-      if (UNBOXED (n)) {
-	p[i] = UNBOX(n);
-      }
-      i++;
+// Prints the arguments of a printf-like primitive into the string buffer;
+// the arguments are words, which are unboxed if needed, hence each
+// conversion is printed separately with integers widened to long
+static void vprintValuesBuf (char *fmt, va_list args) {
+  char spec[32];
+  int  k;
+  word x;
+
+  while (*fmt) {
+    if (*fmt != '%') {
+      char *q = strchr (fmt, '%');
+      int   n = q ? q - fmt : strlen (fmt);
+
+      printStringBuf ("%.*s", n, fmt);
+      fmt += n;
+      continue;
+    }
+
+    if (fmt[1] == '%') {
+      printStringBuf ("%%");
+      fmt += 2;
+      continue;
+    }
+
+    // Flags, width and precision are kept, length modifiers are dropped
+    spec[0] = *fmt++;
+
+    for (k = 1; *fmt && strchr ("-+ #0123456789.*", *fmt) && k < sizeof (spec) - 16; fmt++) {
+      if (*fmt == '*') k += sprintf (spec + k, "%d", (int) UNBOX(va_arg (args, word)));
+      else spec[k++] = *fmt;
     }
-    s++;
-  } 
+
+    while (*fmt && strchr ("hlLqjzt", *fmt)) fmt++;
+
+    if (*fmt == 0) break;
+
+    x = va_arg (args, word);
+
+    if (UNBOXED(x)) x = UNBOX(x);
+
+    switch (*fmt) {
+    case 'd': case 'i': case 'o': case 'u': case 'x': case 'X':
+      spec[k++] = 'l';
+      spec[k++] = *fmt++;
+      spec[k]   = 0;
+      printStringBuf (spec, (long) x);
+      break;
+
+    case 'c':
+      spec[k++] = *fmt++;
+      spec[k]   = 0;
+      printStringBuf (spec, (int) x);
+      break;
+
+    default:
+      spec[k++] = *fmt++;
+      spec[k]   = 0;
+      printStringBuf (spec, (void*) x);
+    }
+  }
 }
 
 extern void Lfailure (char *s, ...) {
   va_list args;
   
-  va_start    (args, s);
-  fix_unboxed (s, args);
-  vfailure    (s, args);
+  va_start        (args, s);
+  createStringBuf ();
+  vprintValuesBuf (s, args);
+  failure         ("%s", stringBuf.contents);
 }
 
-extern void Bmatch_failure (void *v, char *fname, int line, int col) {
+extern void Bmatch_failure (void *v, char *fname, word line, word col) {
   createStringBuf ();
   printValue (v);
-  failure ("match failure at %s:%d:%d, value '%s'\n",
-	   fname, UNBOX(line), UNBOX(col), stringBuf.contents);
+  failure ("match failure at %s:%ld:%ld, value '%s'\n",
+	   fname, (long) UNBOX(line), (long) UNBOX(col), stringBuf.contents);
 }
 
 extern void* /*Lstrcat*/ Li__Infix_4343 (void *a, void *b) {
@@ -1258,7 +2636,7 @@ extern void* /*Lstrcat*/ Li__Infix_4343 (void *a, void *b) {
 
   push_extra_root (&a);
   push_extra_root (&b);
-  d  = (data *) alloc (sizeof(int) + LEN(da->tag) + LEN(db->tag) + 1);
+  d  = (data *) alloc (sizeof(word) + LEN(da->tag) + LEN(db->tag) + 1);
   pop_extra_root (&b);
   pop_extra_root (&a);
 
@@ -1284,11 +2662,10 @@ extern void* Lsprintf (char * fmt, ...) {
   ASSERT_STRING("sprintf:1", fmt);
   
   va_start (args, fmt);
-  fix_unboxed (fmt, args);
   
   createStringBuf ();
 
-  vprintStringBuf (fmt, args);
+  vprintValuesBuf (fmt, args);
 
   __pre_gc ();
 
@@ -1308,7 +2685,7 @@ extern void* LgetEnv (char *var) {
   void *s;
   
   if (e == NULL)
-    return BOX(0);
+    return (void*) BOX(0);
 
   __pre_gc ();
 
@@ -1319,35 +2696,38 @@ extern void* LgetEnv (char *var) {
   return s;
 }
 
-extern int Lsystem (char *cmd) {
+extern word Lsystem (char *cmd) {
   return BOX (system (cmd));
 }
 
+static void vprintValues (FILE *f, char *s, va_list args) {
+  createStringBuf ();
+  vprintValuesBuf (s, args);
+  
+  if (fwrite (stringBuf.contents, 1, stringBuf.ptr, f) < stringBuf.ptr) {
+    failure ("fprintf (...): %s\n", strerror (errno));
+  }
+
+  deleteStringBuf ();
+}
+
 extern void Lfprintf (FILE *f, char *s, ...) {
-  va_list args = (va_list) BOX (NULL);
+  va_list args;
 
   ASSERT_BOXED("fprintf:1", f);
   ASSERT_STRING("fprintf:2", s);  
   
-  va_start    (args, s);
-  fix_unboxed (s, args);
-  
-  if (vfprintf (f, s, args) < 0) {
-    failure ("fprintf (...): %s\n", strerror (errno));
-  }
+  va_start     (args, s);
+  vprintValues (f, s, args);
 }
 
 extern void Lprintf (char *s, ...) {
-  va_list args = (va_list) BOX (NULL);
+  va_list args;
 
   ASSERT_STRING("printf:1", s);
 
-  va_start    (args, s);
-  fix_unboxed (s, args);
-  
-  if (vprintf (s, args) < 0) {
-    failure ("fprintf (...): %s\n", strerror (errno));
-  }
+  va_start     (args, s);
+  vprintValues (stdout, s, args);
 
   fflush (stdout);
 }
@@ -1414,6 +2794,30 @@ extern void* Lfread (char *fname) {
   failure ("fread (\"%s\"): %s\n", fname, strerror (errno));
 }
 
+extern void* LfreadBytes (char *fname) {
+  FILE *f;
+
+  ASSERT_STRING("freadBytes", fname);
+
+  f = fopen (fname, "rb");
+  
+  if (f) {
+    if (fseek (f, 0l, SEEK_END) >= 0) {
+      long size = ftell (f);
+      void *b   = LmakeByteBuffer (BOX(size));
+      
+      rewind (f);
+
+      if (fread (b, 1, size, f) == size) {
+	fclose (f);
+	return b;
+      }
+    }
+  }
+
+  failure ("freadBytes (\"%s\"): %s\n", fname, strerror (errno));
+}
+
 extern void Lfwrite (char *fname, char *contents) {
   FILE *f;
 
@@ -1440,9 +2844,9 @@ extern void* Lfexists (char *fname) {
 
   f = fopen (fname, "r");
   
-  if (f) return BOX(1);
+  if (f) return (void*) BOX(1);
 
-  return BOX(0);
+  return (void*) BOX(0);
 }
 
 extern void* Lfst (void *v) {
@@ -1462,35 +2866,35 @@ extern void* Ltl (void *v) {
 }
 
 /* Lread is an implementation of the "read" construct */
-extern int Lread () {
-  int result = BOX(0);
+extern word Lread () {
+  long result = BOX(0);
 
   printf ("> "); 
   fflush (stdout);
-  scanf  ("%d", &result);
+  scanf  ("%ld", &result);
 
   return BOX(result);
 }
 
 /* Lwrite is an implementation of the "write" construct */
-extern int Lwrite (int n) {
-  printf ("%d\n", UNBOX(n));
+extern word Lwrite (word n) {
+  printf ("%ld\n", (long) UNBOX(n));
   fflush (stdout);
 
   return 0;
 }
 
-extern int Lrandom (int n) {
+extern word Lrandom (word n) {
   ASSERT_UNBOXED("Lrandom, 0", n);
 
   if (UNBOX(n) <= 0) {
-    failure ("invalid range in random: %d\n", UNBOX(n));
+    failure ("invalid range in random: %ld\n", (long) UNBOX(n));
   }
   
   return BOX (random () % UNBOX(n));
 }
 
-extern int Ltime () {
+extern word Ltime () {
   struct timespec t;
   
   clock_gettime (CLOCK_MONOTONIC_RAW, &t);
@@ -1521,7 +2925,7 @@ extern void set_args (int argc, char *argv[]) {
     print_indent ();
     printf ("set_args: iteration %i %p %p ->\n", i, &p, p); fflush(stdout);
 #endif
-    ((int*)p) [i] = (int) Bstring (argv[i]);
+    ((word*)p) [i] = (word) Bstring (argv[i]);
 #ifdef DEBUG_PRINT
     print_indent ();
     printf ("set_args: iteration %i <- %p %p\n", i, &p, p); fflush(stdout);
@@ -1573,6 +2977,14 @@ extern void __gc_root_scan_stack ();
 
 //static size_t SPACE_SIZE = 16;
 static size_t SPACE_SIZE = 256 * 1024 * 1024;
+
+// On x86 the heap is kept in the lower 2GB of the address space; on x86-64
+// it can be mapped anywhere
+# ifdef __x86_64__
+# define SPACE_MAP_FLAGS (MAP_PRIVATE | MAP_ANONYMOUS)
+# else
+# define SPACE_MAP_FLAGS (MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT)
+# endif
 // static size_t SPACE_SIZE = 128;
 // static size_t SPACE_SIZE = 1024 * 1024;
 
@@ -1590,7 +3002,7 @@ static void init_to_space (int flag) {
   if (flag) SPACE_SIZE = SPACE_SIZE << 1;
   space_size     = SPACE_SIZE * sizeof(size_t);
   to_space.begin = mmap (NULL, space_size, PROT_READ | PROT_WRITE,
-			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
+			 SPACE_MAP_FLAGS, -1, 0);
   if (to_space.begin == MAP_FAILED) {
     perror ("EROOR: init_to_space: mmap failed\n");
     exit   (1);
@@ -1706,6 +3118,31 @@ static int extend_spaces (void) {
   return 0;
 }
 
+// Copies the storage of a vector along with its reserve; if the storage has
+// already been copied as an array the reserve is lost, and the capacity is
+// dropped to the size
+static size_t * gc_copy_vector_storage (size_t *obj, size_t *capacity) {
+  data   *d    = TO_DATA(obj);
+  size_t *copy = NULL;
+  int     n    = 0;
+
+  if (IS_FORWARD_PTR(d->tag)) {
+    copy      = (size_t*) d->tag;
+    *capacity = LEN(TO_DATA(copy)->tag);
+    return copy;
+  }
+
+  n       = LEN(d->tag);
+  copy    = current;
+  current += *capacity + 1;
+  *copy   = d->tag;
+  copy++;
+  d->tag  = (word) copy;
+  copy_elements (copy, obj, n);
+
+  return copy;
+}
+
 extern size_t * gc_copy (size_t *obj) {
   data   *d    = TO_DATA(obj);
   sexp   *s    = NULL;
@@ -1754,7 +3191,7 @@ extern size_t * gc_copy (size_t *obj) {
 #ifdef DEBUG_PRINT
   objj = d;
 #endif
-  switch (TAG(d->tag)) {
+  switch (KIND(d)) {
     case CLOSURE_TAG:
 #ifdef DEBUG_PRINT
       print_indent ();
@@ -1766,7 +3203,7 @@ extern size_t * gc_copy (size_t *obj) {
       current += i+1;
       *copy = d->tag;
       copy++;
-      d->tag = (int) copy;
+      d->tag = (word) copy;
       copy_elements (copy, obj, i);
       break;
     
@@ -1775,11 +3212,11 @@ extern size_t * gc_copy (size_t *obj) {
       print_indent ();
       printf ("gc_copy:array_tag; len =  %zu\n", LEN(d->tag)); fflush (stdout);
 #endif
-      current += ((LEN(d->tag) + 1) * sizeof (int) - 1) / sizeof (size_t) + 1;
+      current += ((LEN(d->tag) + 1) * sizeof(word) - 1) / sizeof (size_t) + 1;
       *copy = d->tag;
       copy++;
       i = LEN(d->tag);
-      d->tag = (int) copy;
+      d->tag = (word) copy;
       copy_elements (copy, obj, i);
       break;
 
@@ -1788,13 +3225,43 @@ extern size_t * gc_copy (size_t *obj) {
       print_indent ();
       printf ("gc_copy:string_tag; len = %d\n", LEN(d->tag) + 1); fflush (stdout);
 #endif
-      current += (LEN(d->tag) + sizeof(int)) / sizeof(size_t) + 1;
+      current += (LEN(d->tag) + sizeof(word)) / sizeof(size_t) + 1;
       *copy = d->tag;
       copy++;
-      d->tag = (int) copy;
+      d->tag = (word) copy;
       strcpy ((char*)&copy[0], (char*) obj);
       break;
 
+    case BUFFER_TAG:
+#ifdef DEBUG_PRINT
+      print_indent ();
+      printf ("gc_copy:buffer_tag; len = %d\n", LEN(d->tag)); fflush (stdout);
+#endif
+      i = LEN(d->tag);
+      current += 2 + (i + sizeof(size_t) - 1) / sizeof(size_t);
+      *copy = TO_BUFFER(obj)->kind;
+      copy++;
+      *copy = d->tag;
+      copy++;
+      d->tag = (word) copy;
+      memcpy (copy, obj, i);
+      break;
+
+    case VECTOR_TAG:
+#ifdef DEBUG_PRINT
+      print_indent ();
+      printf ("gc_copy:vector_tag; capacity = %d\n", TO_VECTOR(obj)->capacity); fflush (stdout);
+#endif
+      current += sizeof (vector) / sizeof (size_t);
+      *copy = TO_VECTOR(obj)->kind;
+      copy++;
+      *copy = d->tag;
+      copy++;
+      copy[0] = obj[0];
+      d->tag = (word) copy;
+      copy[1] = (size_t) gc_copy_vector_storage ((size_t*) obj[1], &copy[0]);
+      break;
+
   case SEXP_TAG  :
       s = TO_SEXP(obj);
 #ifdef DEBUG_PRINT
@@ -1813,7 +3280,7 @@ extern size_t * gc_copy (size_t *obj) {
       copy++;
       *copy = d->tag;
       copy++;
-      d->tag = (int) copy;
+      d->tag = (word) copy;
       copy_elements (copy, obj, i);
       break;
 
@@ -1871,13 +3338,36 @@ static inline void init_extra_roots (void) {
   extra_roots.current_free = 0;
 }
 
+static inline void init_root_regions (void) {
+  root_regions.current_free = 0;
+}
+
+static void gc_root_scan_regions (void) {
+  for (int i = 0; i < root_regions.current_free; i++) {
+    void **p   = root_regions.regions[i].begin,
+         **end = *root_regions.regions[i].end;
+    
+    for (; p < end; p++) gc_test_and_copy_root ((size_t**) p);
+  }
+}
+
+// The number of the heap allocations and of the allocated words; printed
+// at exit when LAMA_ALLOC_STATS is set
+static size_t alloc_objects = 0, alloc_words = 0;
+
+static void print_alloc_stats (void) {
+  fprintf (stderr, "allocations: %zu objects, %zu words\n", alloc_objects, alloc_words);
+}
+
 extern void __init (void) {
   size_t space_size = SPACE_SIZE * sizeof(size_t);
 
   srandom (time (NULL));
+
+  if (getenv ("LAMA_ALLOC_STATS")) atexit (print_alloc_stats);
   
   from_space.begin = mmap (NULL, space_size, PROT_READ | PROT_WRITE,
-    			   MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
+    			   SPACE_MAP_FLAGS, -1, 0);
   to_space.begin   = NULL;
   if (to_space.begin == MAP_FAILED) {
     perror ("EROOR: init_pool: mmap failed\n");
@@ -1890,6 +3380,7 @@ extern void __init (void) {
   to_space.end       = NULL;
   to_space.size      = 0;
   init_extra_roots ();
+  init_root_regions ();
 }
 
 static void* gc (size_t size) {
@@ -1912,6 +3403,7 @@ static void* gc (size_t size) {
   printf ("gc: data is scanned\n"); fflush (stdout);
 #endif
   __gc_root_scan_stack ();
+  gc_root_scan_regions ();
   for (int i = 0; i < extra_roots.current_free; i++) {
 #ifdef DEBUG_PRINT
     print_indent ();
@@ -1981,23 +3473,24 @@ static void printFromSpace (void) {
     printf ("data at %p", cur);
     d  = (data *) cur;
 
-    switch (TAG(d->tag)) {
+    switch (*cur == VECTOR_KIND ? VECTOR_TAG :
+            *cur == BUFFER_BYTES || *cur == BUFFER_INT32 ? BUFFER_TAG : TAG(d->tag)) {
 
     case STRING_TAG:
       printf ("(=>%p): STRING\n\t%s; len = %i %zu\n",
 	      d->contents, d->contents,
-	      LEN(d->tag), LEN(d->tag) + 1 + sizeof(int));
+	      LEN(d->tag), LEN(d->tag) + 1 + sizeof(word));
       fflush (stdout);
-      len = (LEN(d->tag) + sizeof(int)) / sizeof(size_t) + 1;
+      len = (LEN(d->tag) + sizeof(word)) / sizeof(size_t) + 1;
       break;
 
     case CLOSURE_TAG:
       printf ("(=>%p): CLOSURE\n\t", d->contents);
       len = LEN(d->tag);
       for (int i = 0; i < len; i++) {
-	int elem = ((int*)d->contents)[i];
-	if (UNBOXED(elem)) printf ("%d ", elem);
-	else printf ("%p ", elem);
+	word elem = ((word*)d->contents)[i];
+	if (UNBOXED(elem)) printf ("%ld ", (long) elem);
+	else printf ("%p ", (void*) elem);
       }
       len += 1;
       printf ("\n");
@@ -2008,9 +3501,9 @@ static void printFromSpace (void) {
       printf ("(=>%p): ARRAY\n\t", d->contents);
       len = LEN(d->tag);
       for (int i = 0; i < len; i++) {
-	int elem = ((int*)d->contents)[i];
-	if (UNBOXED(elem)) printf ("%d ", elem);
-	else printf ("%p ", elem);
+	word elem = ((word*)d->contents)[i];
+	if (UNBOXED(elem)) printf ("%ld ", (long) elem);
+	else printf ("%p ", (void*) elem);
       }
       len += 1;
       printf ("\n");
@@ -2025,15 +3518,32 @@ static void printFromSpace (void) {
       len = LEN(d->tag);
       tmp = (s->contents.contents);
       for (int i = 0; i < len; i++) {
-	int elem = ((int*)tmp)[i];
-	if (UNBOXED(elem)) printf ("%d ", UNBOX(elem));
-	else printf ("%p ", elem);
+	word elem = ((word*)tmp)[i];
+	if (UNBOXED(elem)) printf ("%ld ", (long) UNBOX(elem));
+	else printf ("%p ", (void*) elem);
       }
       len += 2;
       printf ("\n");
       fflush (stdout);
       break;
 
+    case BUFFER_TAG:
+      d = (data *) (cur + 1);
+      printf ("(=>%p): BUFFER\n\tkind = %s; len = %i",
+              d->contents, ((buffer*) cur)->kind == BUFFER_INT32 ? "int32" : "bytes", LEN(d->tag));
+      len = 2 + (LEN(d->tag) + sizeof(size_t) - 1) / sizeof(size_t);
+      printf ("\n");
+      fflush (stdout);
+      break;
+
+    case VECTOR_TAG:
+      printf ("(=>%p): VECTOR\n\tcapacity = %d, storage = %p",
+              &((vector*) cur)->capacity, ((vector*) cur)->capacity, ((vector*) cur)->storage);
+      len = sizeof (vector) / sizeof (size_t);
+      printf ("\n");
+      fflush (stdout);
+      break;
+
     case 0:
       printf ("\nprintFromSpace: end: %zu elements\n===================\n\n",
 	      elem_number);
@@ -2060,6 +3570,8 @@ static void printFromSpace (void) {
 extern void * alloc (size_t size) {
   void * p = (void*)BOX(NULL);
   size = (size - 1) / sizeof(size_t) + 1; // convert bytes to words
+  alloc_objects++;
+  alloc_words += size;
 #ifdef DEBUG_PRINT
   indent++; print_indent ();
   printf ("alloc: current: %p %zu words!", from_space.current, size);
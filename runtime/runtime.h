@@ -13,9 +13,28 @@
 # include <time.h>
 # include <limits.h>
 # include <ctype.h>
+# include <stdint.h>
 
 # define WORD_SIZE (CHAR_BIT * sizeof(int))
 
+/* A machine word: the size of a value and of an object header; the runtime
+   is built both for x86 (runtime.a) and x86-64 (runtime64.a) */
+typedef intptr_t word;
+
+# define WORD_BITS (CHAR_BIT * sizeof(word))
+
 void failure (char *s, ...);
 
+/* Kernels over whole arrays and buffers (kernels.c) */
+int       words_unboxed (word *a, int n);
+uintptr_t words_sum     (word *a, int n);
+word      words_min     (word *a, int n);
+word      words_max     (word *a, int n);
+int       int32s_sum    (int *a, int n);
+int       int32s_min    (int *a, int n);
+int       int32s_max    (int *a, int n);
+int       bytes_sum     (unsigned char *a, int n);
+int       bytes_min     (unsigned char *a, int n);
+int       bytes_max     (unsigned char *a, int n);
+
 # endif
@@ -13,14 +13,25 @@ class options args =
     "Options:\n" ^
     "  -c        --- compile into object file\n" ^
     "  -o <file> --- write executable into file <file>\n" ^
+    "  -m64      --- generate x86-64 code (the default is x86); links with runtime64.a; the\n" ^
+    "                direct calls of the runtime (C) functions are never tail calls there, nor\n" ^
+    "                are the calls made from main or from the initialization of a unit\n" ^
     "  -I <path> --- add <path> into unit search path list\n" ^
     "  -i        --- interpret on a source-level interpreter\n" ^
     "  -s        --- compile into stack machine code and interpret on the stack machine initerpreter\n" ^
+    "  -sr       --- the same on the reference (list-based, slow) stack machine interpreter\n" ^
     "  -dp       --- dump AST (the output will be written into .ast file)\n" ^
     "  -dsrc     --- dump pretty-printed source code\n" ^
     "  -ds       --- dump stack machine code (the output will be written into .sm file; has no\n" ^
     "                effect if -i option is specfied)\n" ^
+    "  -O<n>     --- optimize stack machine code: 0 --- do not optimize, 1 --- remove redundant\n" ^
+    "                code and jumps and allocate non-escaping tuples and closures on the machine\n" ^
+    "                stack (the default), 2 --- also fold constants and remove dead stores\n" ^
+    "  -unchecked --- link with the runtime without the type assertions in the builtins\n" ^
+    "                and drop the checks of the element accesses guarded by the patterns\n" ^
     "  -b        --- compile to a stack machine bytecode\n" ^    
+    "  -b0       --- compile to a stack machine bytecode without superinstructions\n" ^
+    "  -bc       --- compile a unit into a stack machine bytecode for linking (byterun -l)\n" ^
     "  -v        --- show version\n" ^
     "  -h        --- show this help\n"
   in
@@ -34,6 +45,12 @@ class options args =
     val mode    = ref (`Default : [`Default | `Eval | `SM | `Compile | `BC])
     val curdir  = Unix.getcwd ()
     val debug   = ref false
+    val super   = ref true
+    val bc_unit = ref false
+    val ref_sm  = ref false
+    val m64     = ref false
+    val opt     = ref 1
+    val unchecked = ref false
     (* Workaround until Ostap starts to memoize properly *)
     val const  = ref false
     (* end of the workaround *)
@@ -50,7 +67,10 @@ class options args =
             | "-o"  -> (match self#peek with None -> raise (Commandline_error "File name expected after '-o' specifier") | Some fname -> self#set_outfile fname)
             | "-I"  -> (match self#peek with None -> raise (Commandline_error "Path expected after '-I' specifier") | Some path -> self#add_include_path path)
             | "-s"  -> self#set_mode `SM
+            | "-sr" -> self#set_mode `SM; ref_sm := true
             | "-b"  -> self#set_mode `BC
+            | "-b0" -> self#set_mode `BC; super := false
+            | "-bc" -> self#set_mode `BC; bc_unit := true
             | "-i"  -> self#set_mode `Eval
             | "-ds" -> self#set_dump dump_sm
             | "-dsrc" -> self#set_dump dump_source
@@ -58,6 +78,11 @@ class options args =
             | "-h"  -> self#set_help
             | "-v"  -> self#set_version
             | "-g"  -> self#set_debug
+            | "-m64" -> m64 := true
+            | "-O0" -> opt := 0
+            | "-O1" -> opt := 1
+            | "-O2" -> opt := 2
+            | "-unchecked" -> unchecked := true
             | _ ->
                if opt.[0] = '-'
                then raise (Commandline_error (Printf.sprintf "Invalid command line specifier ('%s')" opt))
@@ -112,6 +137,7 @@ class options args =
     method topname =
       match !mode with
       | `Compile -> "init" ^ self#basename
+      | `BC when !bc_unit -> "init" ^ self#basename
       | _ -> "main"
     method dump_file ext contents =
       let name = self#basename in
@@ -133,9 +159,11 @@ class options args =
     method dump_source (ast: Language.Expr.t) =
       if (!dump land dump_source) > 0
       then Pprinter.pp Format.std_formatter ast;
-    method dump_SM sm  =
+    method dump_SM sm stats =
       if (!dump land dump_sm) > 0
-      then self#dump_file "sm" (SM.show_prg sm)
+      then
+        self#dump_file "sm"
+          (String.concat "" (List.map (fun (pass, n) -> Printf.sprintf "# %s: %d\n" pass n) stats) ^ SM.show_prg sm)
       else ()
     method greet =
       (match !outfile with
@@ -144,6 +172,12 @@ class options args =
       );
       if !version then Printf.printf "%s\n" Version.version;
       if !help    then Printf.printf "%s" help_string
+    method get_superinstructions = !super
+    method is_bytecode_unit = !bc_unit
+    method is_reference_sm = !ref_sm
+    method is_x86_64 = !m64
+    method get_opt_level = !opt
+    method is_unchecked = !unchecked
     method get_debug =
       if !debug then "" else "-g"
     method set_debug =
@@ -160,8 +194,9 @@ let main =
        cmd#dump_source (snd prog);
        (match cmd#get_mode with
         | `Default | `Compile ->
-           ignore @@ X86.build cmd prog
+           ignore @@ (if cmd#is_x86_64 then X86_64.build else X86.build) cmd prog
         | `BC ->
+           if cmd#is_bytecode_unit then cmd#dump_file "i" (Interface.gen prog);
            SM.ByteCode.compile cmd (SM.compile cmd prog)
         | _ ->
   	   let rec read acc =
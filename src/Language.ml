@@ -107,6 +107,28 @@ module Value =
     | Sexp (t, _) -> t
     | _ -> failwith "symbolic expression expected"
 
+    (* The hash of a tag; the same as LtagHash in the runtime *)
+    let tag_hash t =
+      let chars = "_abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789'" in
+      let h     = Stdlib.ref 0 in
+      for i = 0 to min (String.length t - 1) 4 do
+        h := (!h lsl 6) lor (String.index chars t.[i])
+      done;
+      !h
+
+    (* The hash of the contents of a string; the same as in LmatchKey *)
+    let string_hash s =
+      let h = Stdlib.ref 0 in
+      String.iter (fun c -> h := (!h * 31 + Char.code c) land 0x3FFFFFFF) s;
+      !h
+
+    (* The dispatch key of a value for the compiled pattern matching (LmatchKey
+       in the runtime) *)
+    let match_key = function
+    | Sexp (t, _) -> tag_hash t
+    | String s    -> string_hash (Bytes.to_string s)
+    | _           -> -1
+
     let update_string s i x = Bytes.set s i x; s
     let update_array  a i x = a.(i) <- x; a
 
@@ -167,6 +189,7 @@ module Builtin =
     | "length"     -> (st, i, o, (Value.of_int (match List.hd args with Value.Sexp (_, a) | Value.Array a -> Array.length a | Value.String s -> Bytes.length s))::vs)
     | ".array"     -> (st, i, o, (Value.of_array @@ Array.of_list args)::vs)
     | "string"     -> let [a] = args in (st, i, o, (Value.of_string @@ Value.string_val a)::vs)
+    | "matchKey"   -> (st, i, o, (Value.of_int @@ Value.match_key @@ List.hd args)::vs)
 
   end
 
@@ -1076,8 +1099,12 @@ module Definition =
 module Interface =
   struct
 
-    (* Generates an interface file. *)
-    let gen ((imps, ifxs), p) =
+    (* Generates an interface file; escapes are the masks of the arguments
+       of the public functions which do not escape (see SM.Escape), bodies
+       are the encoded bodies of the public functions to inline and depends
+       are the digests of the imported bodies the unit was compiled with
+       (see SM.Inline) *)
+    let gen ?(escapes=[]) ?(bodies=[]) ?(depends=[]) ((imps, ifxs), p) =
       let buf = Buffer.create 256 in
       let append str = Buffer.add_string buf str in
       List.iter (fun i -> append "I,"; append i; append ";\n") imps;
@@ -1103,6 +1130,9 @@ module Interface =
            (match loc with `At op -> append "T,"; append_op op | `After op -> append "A,"; append_op op | `Before op -> append "B,"; append_op op);
            append ";\n"
         ) ifxs;
+      List.iter (fun (name, mask) -> append "E,"; append name; append ",\""; append mask; append "\";\n") escapes;
+      List.iter (fun (name, body) -> append "B,"; append name; append ",\""; append body; append "\";\n") bodies;
+      List.iter (fun (name, digest) -> append "D,"; append name; append ",\""; append digest; append "\";\n") depends;
       Buffer.contents buf
 
     (* Read an interface file *)
@@ -1115,7 +1145,10 @@ module Interface =
               ass    : "L" {`Lefta} | "R" {`Righta} | "N" {`Nona};
               loc    : m:mode "," op:STRING {m op};
               mode   : "T" {fun x -> `At x} | "A" {fun x -> `After x} | "B" {fun x -> `Before x};
-              interface: (funspec | varspec | import | infix)*
+              escape : "E" "," i:IDENT "," m:STRING ";" {`Escape (i, m)};
+              body   : "B" "," i:IDENT "," b:STRING ";" {`Body (i, b)};
+              depend : "D" "," i:IDENT "," d:STRING ";" {`Depend (i, d)};
+              interface: (funspec | varspec | import | infix | escape | body | depend)*
             )
       in
       try
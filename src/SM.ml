@@ -81,6 +81,56 @@ module ByteCode =
             
       end
 
+    (* The file header: magic ("LAMB"), version, Adler-32 checksum of the
+       sections preceding the code, the size of the global area, the number
+       of public symbols and the offsets/sizes of the sections (publics,
+       string table, code, global symbols, units, constant pool, global
+       map, line table); all fields are native-endian 32-bit integers.
+
+       The global symbols are the public and imported global variables
+       (name, index, flags: 1 --- public, 2 --- imported); the units are
+       the compilation units making up the code (name, code begin, code end,
+       initialization function, Adler-32 checksum of the code range, the
+       beginnings of its constants, global map and line table). A compiled
+       file contains a single unit; "byterun -l" links several files into
+       one.
+
+       The operands of instructions are LEB128 numbers except for code
+       offsets, which are 32-bit integers; variables in CLOSURE and in the
+       superinstructions are encoded as one number (index * 4 + kind).
+       Strings are referred to by their indices in the constant pool (string
+       table offsets), global variables --- by their indices in the global
+       map (global area indices); so the linker does not need to touch the
+       code. LINE instructions are not emitted: the line table holds pairs
+       of LEB128 numbers (code offset delta, line delta). In the encodings
+       below n:u and n:s are unsigned and signed LEB128 numbers, s:c ---
+       constant pool indices, l:32 --- code offsets *)
+    let magic       = 0x424D414C
+    let version     = 3
+    let header_size = 80
+
+    let add_uleb128 b =
+      let rec add x =
+        if x < 128
+        then Buffer.add_char b (Char.chr x)
+        else (Buffer.add_char b (Char.chr (x land 127 lor 128)); add (x lsr 7))
+      in
+      add
+
+    let add_sleb128 b =
+      let rec add x =
+        let c = x land 127 and y = x asr 7 in
+        if (y = 0 && c land 64 = 0) || (y = -1 && c land 64 <> 0)
+        then Buffer.add_char b (Char.chr c)
+        else (Buffer.add_char b (Char.chr (c lor 128)); add y)
+      in
+      fun x -> add (Int32.to_int (Int32.of_int x))
+
+    let adler32 s =
+      let a = Stdlib.ref 1 and b = Stdlib.ref 0 in
+      String.iter (fun c -> a := (!a + Char.code c) mod 65521; b := (!b + !a) mod 65521) s;
+      (!b lsl 16) lor !a
+
     exception Found of int                     
                      
     let opnum =
@@ -132,18 +182,35 @@ module ByteCode =
       let globals            = Stdlib.ref M.empty                                                                  in
       let glob_count         = Stdlib.ref 0                                                                        in
       let fixups             = Stdlib.ref []                                                                       in
+      let consts             = Stdlib.ref M.empty                                                                  in
+      let const_count        = Stdlib.ref 0                                                                        in
+      let lines              = Stdlib.ref []                                                                       in
+      let externs            = List.fold_left (fun s -> function EXTERN e -> S.add e s | _ -> s) S.empty insns      in
       let add_lab   l        = lmap := M.add l (Buffer.length code) !lmap                                          in
       let add_public l       = pubs := S.add l !pubs                                                               in
       let add_import l       = imports := S.add l !imports                                                         in      
       let add_fixup l        = fixups := (Buffer.length code, l) :: !fixups                                        in      
-      let add_bytes          = List.iter (fun x -> Buffer.add_char     code @@ Char .chr                        x) in
-      let add_ints           = List.iter (fun x -> Buffer.add_int32_ne code @@ Int32.of_int                     x) in
-      let add_strings        = List.iter (fun x -> Buffer.add_int32_ne code @@ Int32.of_int @@ StringTab.add st x) in
+      let add_line  n        = lines := (Buffer.length code, n) :: !lines                                          in
+      let add_bytes          = List.iter (fun x -> Buffer.add_char code @@ Char .chr x)                           in
+      let add_ints           = List.iter (add_uleb128 code)                                                        in
+      let add_sints          = List.iter (add_sleb128 code)                                                        in
+      let add_labels         = List.iter (fun l -> add_fixup l; Buffer.add_int32_ne code 0l)                       in
+      let add_strings        =
+        List.iter (fun x ->
+            add_ints [try M.find x !consts
+                      with Not_found ->
+                        let i = !const_count in
+                        incr const_count;
+                        consts := M.add x i !consts;
+                        i
+              ]
+          )
+      in
       let add_designations n =
-        let b x =
+        let b x i =
           match n with
-            None   -> x
-          | Some b -> b * 16 + x
+            None   -> add_ints [i * 4 + x]
+          | Some b -> add_bytes [b * 16 + x]; add_ints [i]
         in
         List.iter (function
                    | Value.Global s ->
@@ -155,17 +222,17 @@ module ByteCode =
                           globals := M.add s i !globals;
                           i
                       in
-                      add_bytes [b 0]; add_ints [i]
-                   | Value.Local  n -> add_bytes [b 1]; add_ints    [n]
-                   | Value.Arg    n -> add_bytes [b 2]; add_ints    [n]
-                   | Value.Access n -> add_bytes [b 3]; add_ints    [n]
+                      b 0 i
+                   | Value.Local  n -> b 1 n
+                   | Value.Arg    n -> b 2 n
+                   | Value.Access n -> b 3 n
           )
       in
       let insn_code = function
       (* 0x0s                 *) | BINOP   s                   -> add_bytes [opnum s]
-      (* 0x10 n:32            *) | CONST   n                   -> add_bytes [1*16 + 0]; add_ints [n]
-      (* 0x11 s:32            *) | STRING  s                   -> add_bytes [1*16 + 1]; add_strings [s]
-      (* 0x12 s:32 n:32       *) | SEXP   (s, n)               -> add_bytes [1*16 + 2]; add_strings [s]; add_ints [n]
+      (* 0x10 n:s             *) | CONST   n                   -> add_bytes [1*16 + 0]; add_sints [n]
+      (* 0x11 s:c             *) | STRING  s                   -> add_bytes [1*16 + 1]; add_strings [s]
+      (* 0x12 s:c n:u         *) | SEXP   (s, n)               -> add_bytes [1*16 + 2]; add_strings [s]; add_ints [n]
       (* 0x13                 *) | STI                         -> add_bytes [1*16 + 3]
       (* 0x14                 *) | STA                         -> add_bytes [1*16 + 4]
                                                                
@@ -173,7 +240,7 @@ module ByteCode =
                                  | FLABEL  s                 
                                  | SLABEL  s                   -> add_lab s
                                                                
-      (* 0x15 l:32            *) | JMP     s                   -> add_bytes [1*16 + 5]; add_fixup s; add_ints [0]
+      (* 0x15 l:32            *) | JMP     s                   -> add_bytes [1*16 + 5]; add_labels [s]
       (* 0x16                 *) | END                         -> add_bytes [1*16 + 6]
       (* 0x17                 *) | RET                         -> add_bytes [1*16 + 7]
       (* 0x18                 *) | DROP                        -> add_bytes [1*16 + 8]
@@ -181,35 +248,56 @@ module ByteCode =
       (* 0x1a                 *) | SWAP                        -> add_bytes [1*16 + 10]
       (* 0x1b                 *) | ELEM                        -> add_bytes [1*16 + 11]
                                                                    
-      (* 0x2d n:32            *) | LD      d                   -> add_designations (Some 2) [d]
-      (* 0x3d n:32            *) | LDA     d                   -> add_designations (Some 3) [d]
-      (* 0x4d n:32            *) | ST      d                   -> add_designations (Some 4) [d]
+      (* 0x2d n:u             *) | LD      d                   -> add_designations (Some 2) [d]
+      (* 0x3d n:u             *) | LDA     d                   -> add_designations (Some 3) [d]
+      (* 0x4d n:u             *) | ST      d                   -> add_designations (Some 4) [d]
                                                                  
-      (* 0x50 l:32            *) | CJMP    ("z" , s)           -> add_bytes [5*16 + 0]; add_fixup s; add_ints [0]
-      (* 0x51 l:32            *) | CJMP    ("nz", s)           -> add_bytes [5*16 + 1]; add_fixup s; add_ints [0]
+      (* 0x50 l:32            *) | CJMP    ("z" , s)           -> add_bytes [5*16 + 0]; add_labels [s]
+      (* 0x51 l:32            *) | CJMP    ("nz", s)           -> add_bytes [5*16 + 1]; add_labels [s]
 
       (* 0x70                 *) | CALL ("Lread", _, _)        -> add_bytes [7*16 + 0]                                                                                          
       (* 0x71                 *) | CALL ("Lwrite", _, _)       -> add_bytes [7*16 + 1]
       (* 0x72                 *) | CALL ("Llength", _, _)      -> add_bytes [7*16 + 2]
       (* 0x73                 *) | CALL ("Lstring", _, _)      -> add_bytes [7*16 + 3]
-      (* 0x74                 *) | CALL (".array", n, _)       -> add_bytes [7*16 + 4]; add_ints [n]
+      (* 0x74 n:u             *) | CALL (".array", n, _)       -> add_bytes [7*16 + 4]; add_ints [n]
+      (* 0x75 s:c n:u         *) | CALL (f, n, _)
+                                     when S.mem f externs      -> add_bytes [7*16 + 5]; add_strings [f]; add_ints [n]
+      (* 0x76 s:c             *) | CLOSURE (f, [])
+                                     when S.mem f externs      -> add_bytes [7*16 + 6]; add_strings [f]
                                                                   
-      (* 0x52 n:32 n:32       *) | BEGIN   (_, a, l, [], _, _) -> add_bytes [5*16 + 2]; add_ints [a; l] (* with no closure *)
-      (* 0x53 n:32 n:32       *) | BEGIN   (_, a, l,  _, _, _) -> add_bytes [5*16 + 3]; add_ints [a; l] (* with a closure  *)
-      (* 0x54 l:32 n:32 d*:32 *) | CLOSURE (s, ds)             -> add_bytes [5*16 + 4]; add_fixup s; add_ints [0; List.length ds]; add_designations None ds
-      (* 0x55 n:32            *) | CALLC   (n, tail)           -> add_bytes [5*16 + 5]; add_ints [n]
-      (* 0x56 l:32 n:32       *) | CALL    (fn, n, tail)       -> add_bytes [5*16 + 6]; add_fixup fn; add_ints [0; n]
-      (* 0x57 s:32 n:32       *) | TAG     (s, n)              -> add_bytes [5*16 + 7]; add_strings [s]; add_ints [n]
-      (* 0x58 n:32            *) | ARRAY    n                  -> add_bytes [5*16 + 8]; add_ints [n]
-      (* 0x59 n:32 n:32       *) | FAIL    ((l, c), _)         -> add_bytes [5*16 + 9]; add_ints [l; c]
-      (* 0x5a n:32            *) | LINE     n                  -> add_bytes [5*16 + 10]; add_ints [n]
+      (* 0x52 n:u n:u         *) | BEGIN   (_, a, l, [], _, _) -> add_bytes [5*16 + 2]; add_ints [a; l] (* with no closure *)
+      (* 0x53 n:u n:u         *) | BEGIN   (_, a, l,  _, _, _) -> add_bytes [5*16 + 3]; add_ints [a; l] (* with a closure  *)
+      (* 0x54 l:32 n:u d*:u   *) | CLOSURE (s, ds)             -> add_bytes [5*16 + 4]; add_labels [s]; add_ints [List.length ds]; add_designations None ds
+      (* 0x55 n:u             *) | CALLC   (n, tail)           -> add_bytes [5*16 + 5]; add_ints [n]
+      (* 0x56 l:32 n:u        *) | CALL    (fn, n, tail)       -> add_bytes [5*16 + 6]; add_labels [fn]; add_ints [n]
+      (* 0x57 s:c n:u         *) | TAG     (s, n)              -> add_bytes [5*16 + 7]; add_strings [s]; add_ints [n]
+      (* 0x58 n:u             *) | ARRAY    n                  -> add_bytes [5*16 + 8]; add_ints [n]
+      (* 0x59 n:u n:u         *) | FAIL    ((l, c), _)         -> add_bytes [5*16 + 9]; add_ints [l; c]
+      (* line table           *) | LINE     n                  -> add_line n
       (* 0x6p                 *) | PATT     p                  -> add_bytes [6*16 + enum(patt) p]
 
                                  | EXTERN  s                   -> ()
                                  | PUBLIC  s                   -> add_public s
                                  | IMPORT  s                   -> add_import s
       in
-      List.iter insn_code insns;
+      (* Superinstructions for the hottest sequences; the fused instructions
+         never span a label. The candidates are the hottest opcode pairs on
+         the regression tests ("make -C regression profile") *)
+      let rec super_code = function
+      (* 0x80 s:c n:u l:32    *) | DUP :: TAG (s, n) :: CJMP ("nz", l) :: insns -> add_bytes [8*16 + 0]; add_strings [s]; add_ints [n]; add_labels [l]; super_code insns
+      (* 0x81 n:u l:32        *) | DUP :: ARRAY n :: CJMP ("nz", l) :: insns    -> add_bytes [8*16 + 1]; add_ints [n]; add_labels [l]; super_code insns
+      (* 0x82 n:s             *) | DUP :: CONST n :: ELEM :: insns              -> add_bytes [8*16 + 2]; add_sints [n]; super_code insns
+      (* 0x83 l:32            *) | DROP :: JMP l :: insns                       -> add_bytes [8*16 + 3]; add_labels [l]; super_code insns
+      (* 0x84 o d:u n:s       *) | LD d :: CONST n :: BINOP s :: insns          -> add_bytes [8*16 + 4; opnum s]; add_designations None [d]; add_sints [n]; super_code insns
+      (* 0x85 o d:u d:u       *) | LD d :: LD d' :: BINOP s :: insns            -> add_bytes [8*16 + 5; opnum s]; add_designations None [d; d']; super_code insns
+      (* 0x86 o l:32          *) | BINOP s :: CJMP ("z", l) :: insns            -> add_bytes [8*16 + 6; opnum s]; add_labels [l]; super_code insns
+      (* 0x9d n:u             *) | ST d :: DROP :: insns                        -> add_designations (Some 9) [d]; super_code insns
+                                 | insn :: insns                                -> insn_code insn; super_code insns
+                                 | []                                           -> ()
+      in
+      if cmd#get_superinstructions
+      then super_code insns
+      else List.iter insn_code insns;
       add_bytes [255];
       let code = Buffer.to_bytes code in
       List.iter
@@ -217,20 +305,74 @@ module ByteCode =
           Bytes.set_int32_ne code ofs (Int32.of_int @@ try M.find l !lmap with Not_found -> failwith (Printf.sprintf "ERROR: undefined label '%s'" l))
         )
         !fixups;
-      let pubs = List.map
-        (fun l ->
-          Int32.of_int @@ StringTab.add st l,
-          (Int32.of_int @@ try M.find l !lmap with Not_found -> failwith (Printf.sprintf "ERROR: undefined label '%s'" l))
-        ) @@ S.elements !pubs
+      let is_global l = String.length l > 7 && String.sub l 0 7 = "global_" in
+      let offset l = try M.find l !lmap with Not_found -> failwith (Printf.sprintf "ERROR: undefined label '%s'" l) in
+      let pubs = List.map (fun l -> StringTab.add st l, offset l) @@ List.filter (fun l -> not (is_global l)) @@ S.elements !pubs in
+      let globs =
+        M.fold
+          (fun x i acc ->
+            let g = "global_" ^ x in
+            match S.mem g !pubs, S.mem g externs with
+            | false, false -> acc
+            | p    , e     -> (StringTab.add st g, i, (if p then 1 else 0) lor (if e then 2 else 0)) :: acc
+          )
+          !globals []
       in
-      let st   = Buffer.to_bytes st.StringTab.buffer in
-      let file = Buffer.create 1024 in
-      Buffer.add_int32_ne file (Int32.of_int @@ Bytes.length st);
-      Buffer.add_int32_ne file (Int32.of_int @@ !glob_count);
-      Buffer.add_int32_ne file (Int32.of_int @@ List.length pubs);
-      List.iter (fun (n, o) -> Buffer.add_int32_ne file n; Buffer.add_int32_ne file o) pubs;
-      Buffer.add_bytes file st;
-      Buffer.add_bytes file code;
+      let units  = [StringTab.add st cmd#basename, 0, Bytes.length code, offset cmd#topname, adler32 (Bytes.to_string code), 0, 0, 0] in
+      let consts = List.map (fun (s, _) -> StringTab.add st s) @@ List.sort (fun (_, i) (_, j) -> compare i j) @@ M.bindings !consts in
+      let lines  =
+        let b = Buffer.create 1024 in
+        ignore @@
+          List.fold_left
+            (fun (o, l) (o', l') -> add_uleb128 b (o' - o); add_sleb128 b (l' - l); (o', l'))
+            (0, 0)
+            (List.rev !lines);
+        b
+      in
+      let st    = Buffer.to_bytes st.StringTab.buffer in
+      let meta  = Buffer.create 1024 in
+      let add_meta = List.iter (fun n -> Buffer.add_int32_ne meta (Int32.of_int n)) in
+      List.iter (fun (n, o) -> add_meta [n; o]) pubs;
+      List.iter (fun (n, i, f) -> add_meta [n; i; f]) globs;
+      List.iter (fun (n, b, e, i, c, k, g, l) -> add_meta [n; b; e; i; c; k; g; l]) units;
+      add_meta consts;
+      add_meta (List.init !glob_count (fun i -> i));
+      Buffer.add_buffer meta lines;
+      Buffer.add_bytes meta st;
+      let meta = Buffer.contents meta in
+      let pubs_ofs   = header_size in
+      let globs_ofs  = pubs_ofs   + 8  * List.length pubs in
+      let units_ofs  = globs_ofs  + 12 * List.length globs in
+      let consts_ofs = units_ofs  + 32 * List.length units in
+      let map_ofs    = consts_ofs + 4  * List.length consts in
+      let lines_ofs  = map_ofs    + 4  * !glob_count in
+      let st_ofs     = lines_ofs  + Buffer.length lines in
+      let code_ofs   = st_ofs + Bytes.length st in
+      let file = Buffer.create (code_ofs + Bytes.length code) in
+      List.iter (fun n -> Buffer.add_int32_ne file (Int32.of_int n))
+        [magic;
+         version;
+         adler32 meta;
+         !glob_count;
+         List.length pubs;
+         pubs_ofs;
+         st_ofs;
+         Bytes.length st;
+         code_ofs;
+         Bytes.length code;
+         List.length globs;
+         globs_ofs;
+         List.length units;
+         units_ofs;
+         List.length consts;
+         consts_ofs;
+         !glob_count;
+         map_ofs;
+         Buffer.length lines;
+         lines_ofs
+        ];
+      Buffer.add_string file meta;
+      Buffer.add_bytes  file code;
       let f = open_out_bin (Printf.sprintf "%s.bc" cmd#basename) in
       Buffer.output_buffer f file;
       close_out f
@@ -453,6 +595,216 @@ let run p i =
   in
   o 
 
+(* Array-based stack machine interpreter
+
+     val Fast.run : prg -> int list -> int list
+
+   The same as run, but the program is turned into an array first: jumps and calls are
+   resolved into code indices and global variables into indices in an array; the stack is
+   a growable array. The list-based interpreter above is kept as a reference
+*)
+module Fast =
+  struct
+
+    module H = Hashtbl.Make (struct type t = string let hash = Hashtbl.hash let equal = (=) end)
+
+    let run p i =
+      let code    = Array.of_list p in
+      let size    = Array.length code in
+      let labels  = H.create 1024 in
+      let globals = H.create 256 in
+      let index x =
+        match H.find_opt globals x with
+        | Some k -> k
+        | None   -> let k = H.length globals in H.add globals x k; k
+      in
+      Array.iteri (fun pc -> function LABEL l | FLABEL l -> H.replace labels l pc | _ -> ()) code;
+      (* The resolved operands: code indices of jumps and calls of labels, indices of global
+         variables *)
+      let operand = Array.make size (-1) in
+      let binop   = Array.make size (fun _ _ -> 0) in
+      Array.iteri
+        (fun pc -> function
+         | JMP l | CJMP (_, l) | CALL (l, _, _) -> (match H.find_opt labels l with Some t -> operand.(pc) <- t | None -> ())
+         | BINOP op                             -> binop.(pc) <- Expr.to_func op
+         | LD  (Value.Global x)
+         | LDA (Value.Global x)
+         | ST  (Value.Global x)                 -> operand.(pc) <- index x
+         | _                                    -> ()
+        )
+        code;
+      let glob    = Array.make (H.length globals) (Value.Empty : value) in
+      let defined = Array.make (H.length globals) false in
+      List.iter
+        (fun (x, v) -> match H.find_opt globals x with Some k -> glob.(k) <- v; defined.(k) <- true | None -> ())
+        (Builtin.bindings ());
+      let stack  = ref (Array.make 1024 (Value.Empty : value)) in
+      let sp     = ref 0 in
+      let input  = ref i in
+      let output = ref [] in
+      let push x =
+        if !sp = Array.length !stack then stack := Array.append !stack (Array.make !sp Value.Empty);
+        !stack.(!sp) <- x;
+        incr sp
+      in
+      let pop () = decr sp; !stack.(!sp) in
+      (* n top values, the topmost first *)
+      let take n =
+        let s = !stack in
+        let rec inner j acc = if j = !sp then acc else inner (j+1) (s.(j) :: acc) in
+        let l = inner (!sp - n) [] in
+        sp := !sp - n;
+        l
+      in
+      (* n top values, the topmost last *)
+      let take_array n = sp := !sp - n; Array.sub !stack !sp n in
+      let jump pc = if operand.(pc) < 0 then raise Not_found else operand.(pc) in
+      let load pc loc = function
+      | Value.Global x -> let k = operand.(pc) in if defined.(k) then glob.(k) else State.undefined x
+      | Value.Local  i -> loc.locals.(i)
+      | Value.Arg    i -> loc.args.(i)
+      | Value.Access i -> loc.closure.(i)
+      in
+      let update loc z = function
+      | Value.Global x -> let k = H.find globals x in glob.(k) <- z; defined.(k) <- true
+      | Value.Local  i -> loc.locals.(i) <- z
+      | Value.Arg    i -> loc.args.(i) <- z
+      | Value.Access i -> loc.closure.(i) <- z
+      in
+      let builtin f args =
+        match f with
+        | "Lwrite" | "write" -> output := Value.to_int (List.hd args) :: !output; push Value.Empty
+        | _ ->
+           let f = match f.[0] with 'L' -> String.sub f 1 (String.length f - 1) | _ -> f in
+           let (_, i, _, r) = Language.Builtin.eval (State.I, !input, [], []) (List.map Obj.magic @@ List.rev args) f in
+           input := i;
+           push (match r with [r] -> Obj.magic r | _ -> Value.Empty)
+      in
+      let rec eval pc loc cstack =
+        if pc < size then
+          match code.(pc) with
+          | IMPORT _ | PUBLIC _ | EXTERN _ | LINE _
+          | SLABEL _ | LABEL  _ | FLABEL _ -> eval (pc+1) loc cstack
+
+          | BINOP "==" -> let y = pop () in
+                          let x = pop () in
+                          push (match x, y with
+                                | Value.Int x, Value.Int y -> Value.of_int (if x = y then 1 else 0)
+                                | Value.Int _, _ | _, Value.Int _ -> Value.of_int 0
+                                | _ -> failwith (Printf.sprintf "unexpected operands in comparison: %s vs. %s\n" (show(value) x) (show(value) y))
+                               );
+                          eval (pc+1) loc cstack
+          | BINOP _    -> let y = pop () in
+                          let x = pop () in
+                          push (Value.of_int @@ binop.(pc) (Value.to_int x) (Value.to_int y));
+                          eval (pc+1) loc cstack
+          | CONST n     -> push (Value.of_int n); eval (pc+1) loc cstack
+          | STRING s    -> push (Value.of_string @@ Bytes.of_string s); eval (pc+1) loc cstack
+          | SEXP (s, n) -> let vs = take_array n in push (Value.Sexp (s, vs)); eval (pc+1) loc cstack
+          | ELEM        -> let j = Value.to_int @@ pop () in
+                           push (match pop () with
+                                 | Value.String   s  -> Value.of_int @@ Char.code (Bytes.get s j)
+                                 | Value.Array    a
+                                 | Value.Sexp (_, a) -> a.(j)
+                                );
+                           eval (pc+1) loc cstack
+
+          | LD  x -> push (load pc loc x); eval (pc+1) loc cstack
+          | LDA x -> push (Value.Var x); eval (pc+1) loc cstack
+          | ST  (Value.Global _) -> let k = operand.(pc) in
+                                    glob.(k) <- !stack.(!sp - 1);
+                                    defined.(k) <- true;
+                                    eval (pc+1) loc cstack
+          | ST  x -> update loc !stack.(!sp - 1) x; eval (pc+1) loc cstack
+          | STI   -> let z = pop () in
+                     let Value.Var r = pop () in
+                     update loc z r;
+                     push z;
+                     eval (pc+1) loc cstack
+          | STA   -> let z = pop () in
+                     (match pop () with
+                      | Value.Var r -> update loc z r
+                      | j           -> Value.update_elem (pop ()) (Value.to_int j) z
+                     );
+                     push z;
+                     eval (pc+1) loc cstack
+
+          | JMP  _      -> eval (jump pc) loc cstack
+          | CJMP (c, _) -> let x = Value.to_int @@ pop () in
+                           if (c = "z" && x = 0) || (c = "nz" && x <> 0) then eval (jump pc) loc cstack else eval (pc+1) loc cstack
+
+          | CLOSURE (name, dgs) -> let closure =
+                                     Array.of_list @@
+                                       List.map (
+                                           function
+                                           | Value.Arg    i -> loc.args.(i)
+                                           | Value.Local  i -> loc.locals.(i)
+                                           | Value.Access i -> loc.closure.(i)
+                                           | _              -> invalid_arg "wrong value in CLOSURE")
+                                         dgs
+                                   in
+                                   push (Value.Closure ([], name, closure));
+                                   eval (pc+1) loc cstack
+
+          | CALL (f, n, _) -> if operand.(pc) >= 0
+                              then eval operand.(pc) {args = take_array n; locals = [||]; closure = [||]} ((pc+1, loc) :: cstack)
+                              else (builtin f (take n); eval (pc+1) loc cstack)
+
+          | CALLC (n, _)   -> let args = take_array n in
+                              (match pop () with
+                               | Value.Builtin f ->
+                                  builtin f (List.rev @@ Array.to_list args);
+                                  eval (pc+1) loc cstack
+                               | Value.Closure (_, f, closure) ->
+                                  eval (H.find labels f) {args = args; locals = [||]; closure = closure} ((pc+1, loc) :: cstack)
+                               | f -> invalid_arg (Printf.sprintf "not a closure (or a builtin) in CALLC: %s" (show(value) f))
+                              )
+
+          | BEGIN (_, _, locals, _, _, _) -> eval (pc+1) {loc with locals = Array.make locals Value.Empty} cstack
+
+          | END | RET -> (match cstack with
+                          | (pc', loc') :: cstack' -> eval pc' loc' cstack'
+                          | []                     -> ()
+                         )
+
+          | DROP  -> decr sp; eval (pc+1) loc cstack
+          | DUP   -> push !stack.(!sp - 1); eval (pc+1) loc cstack
+          | SWAP  -> let s = !stack in
+                     let x = s.(!sp - 1) in
+                     s.(!sp - 1) <- s.(!sp - 2);
+                     s.(!sp - 2) <- x;
+                     eval (pc+1) loc cstack
+          | TAG (t, n)     -> let x = pop () in
+                              push (Value.of_int @@ match x with Value.Sexp (t', a) when t' = t && Array.length a = n -> 1 | _ -> 0);
+                              eval (pc+1) loc cstack
+          | ARRAY n        -> let x = pop () in
+                              push (Value.of_int @@ match x with Value.Array a when Array.length a = n -> 1 | _ -> 0);
+                              eval (pc+1) loc cstack
+          | PATT StrCmp    -> let x = pop () in
+                              let y = pop () in
+                              push (Value.of_int @@ match x, y with (Value.String xs, Value.String ys) when xs = ys -> 1 | _ -> 0);
+                              eval (pc+1) loc cstack
+          | PATT p         -> let x = pop () in
+                              push (Value.of_int @@
+                                      match p, x with
+                                      | Array  , Value.Array   _
+                                      | String , Value.String  _
+                                      | Sexp   , Value.Sexp    _
+                                      | UnBoxed, Value.Int     _
+                                      | Closure, Value.Closure _ -> 1
+                                      | Boxed  , Value.Int     _ -> 0
+                                      | Boxed  , _               -> 1
+                                      | _                        -> 0
+                                   );
+                              eval (pc+1) loc cstack
+          | FAIL (l, _)    -> raise (Failure (Printf.sprintf "matching value %s failure at %s" (show(value) !stack.(!sp - 1)) (show(Loc.t) l)))
+          | insn           -> invalid_arg (Printf.sprintf "unexpected instruction: %s" (show(insn) insn))
+      in
+      eval 0 {locals = [||]; args = [||]; closure = [||]} [];
+      List.rev !output
+
+  end
+
 (* Stack machine compiler
 
      val compile : Language.t -> prg
@@ -868,7 +1220,979 @@ object (self : 'self)
        | _                    -> self, []    
 end
   
+(* Liveness of the local variables and the arguments in the code of a function
+   (from BEGIN to END); used by the optimizer and by the register allocator of
+   the native code generator *)
+module Liveness =
+  struct
+
+    (* A set of variables *)
+    module D = Set.Make (struct type t = Value.designation let compare = Stdlib.compare end)
+
+    let is_var = function Value.Local _ | Value.Arg _ -> true | _ -> false
+
+    (* The variables used and defined by an instruction *)
+    let use_def = function
+    | LD x when is_var x -> D.singleton x, D.empty
+    | ST x when is_var x -> D.empty, D.singleton x
+    | CLOSURE (_, ds)    -> D.of_list (List.filter is_var ds), D.empty
+    | _                  -> D.empty, D.empty
+
+    (* The variables whose addresses are taken; their liveness is unknown *)
+    let addressed code =
+      Array.fold_left (fun s -> function LDA x when is_var x -> D.add x s | _ -> s) D.empty code
+
+    (* Returns the variables live before and after each instruction *)
+    let analyse code =
+      let n      = Array.length code in
+      let labels = Hashtbl.create 16 in
+      Array.iteri (fun i -> function LABEL l | FLABEL l | SLABEL l -> Hashtbl.replace labels l i | _ -> ()) code;
+      let succ i =
+        match code.(i) with
+        | JMP l       -> [Hashtbl.find labels l]
+        | CJMP (_, l) -> [i+1; Hashtbl.find labels l]
+        | RET         -> [n-1]
+        | END         -> []
+        | _           -> [i+1]
+      in
+      let ud       = Array.map use_def code in
+      let live_in  = Array.make n D.empty in
+      let live_out = Array.make n D.empty in
+      let rec iterate () =
+        let changed = Stdlib.ref false in
+        for i = n-1 downto 0 do
+          let out = List.fold_left (fun s j -> D.union s live_in.(j)) D.empty (succ i) in
+          let use, def = ud.(i) in
+          let inn = D.union use (D.diff out def) in
+          if not (D.equal inn live_in.(i) && D.equal out live_out.(i)) then changed := true;
+          live_in.(i)  <- inn;
+          live_out.(i) <- out
+        done;
+        if !changed then iterate ()
+      in
+      iterate ();
+      live_in, live_out
+
+  end
+
+(* Escape analysis: finds the tuples and the closures which never outlive the
+   frame of the function which creates them; the native code generators
+   allocate such objects in the frame instead of the heap
+
+   An object escapes when it is stored into a global, a captured variable, a
+   reference or another object, returned, or passed to a function which may
+   retain it. Each function gets a summary telling which of its arguments do
+   not escape; the summaries are computed for all the functions of a unit at
+   once and exported with the public functions in the interface files. A
+   site is allocated in the frame if its object does not escape, and the
+   object of its previous execution is dead there (it is neither kept in a
+   live variable nor on the stack), since all executions share the same
+   words of the frame.
+
+   The garbage collector sees such objects while scanning the stack: the
+   pointers to them are not the heap pointers and are skipped, while their
+   words are the roots.
+
+   Besides, the analysis finds the closure calls whose closures always come
+   from the same site; the native code generators call the functions of such
+   closures directly
+*)
+module Escape =
+  struct
+
+    (* The sources of the values: the allocation sites, the arguments and
+       all the others *)
+    type src = Site of int | Param of int | Other
+
+    module D = Set.Make (struct type t = src let compare = Stdlib.compare end)
+
+    (* A summary of a function: whether each of its arguments does not escape *)
+    type summary = bool array
+
+    (* The sites of a function, allocated in the frame, with their offsets
+       (in words), the number of words they occupy, and the closure calls
+       (by position) whose closures are always created by the same site,
+       with the functions they call *)
+    type t = {sites : (int * int) list; words : int; calls : (int * string) list}
+
+    (* The runtime primitives which do not retain their arguments; those
+       which walk the values (string, hash, compare) are not here, since they
+       take the objects outside the heap for opaque pointers *)
+    let primitives = ["Llength"; "Lclone"; "Lfst"; "Lsnd"; "Lhd"; "Ltl"; "LmatchKey"]
+
+    (* The number of words of an object, created by an instruction *)
+    let size = function
+    | CALL (".array", n, _) -> Some (n + 1)
+    | CLOSURE (_, ds)      -> Some (List.length ds + 2)
+    | _                    -> None
+
+    (* Splits a program into the functions (from BEGIN to END) *)
+    let functions prg =
+      let rec inner acc = function
+      | [] -> List.rev acc
+      | (BEGIN (f, _, _, _, _, _) as i) :: tl ->
+         let rec body acc = function
+         | END :: tl -> List.rev (END :: acc), tl
+         | i   :: tl -> body (i :: acc) tl
+         | []        -> List.rev acc, []
+         in
+         let code, tl = body [i] tl in
+         inner ((f, Array.of_list code) :: acc) tl
+      | _ :: tl -> inner acc tl
+      in
+      inner [] prg
+
+    (* Analyses a function with the given summaries of the callees; returns
+       the summary of the function and its sites which can be allocated in
+       the frame; the functions which take the addresses of variables are
+       not analysed *)
+    let analyse_function summaries code =
+      let nargs   = match code.(0) with BEGIN (_, nargs, _, _, _, _) -> nargs | _ -> 0 in
+      if Array.exists (function LDA _ -> true | _ -> false) code
+      then Array.make nargs false, {sites = []; words = 0; calls = []}
+      else
+      let n       = Array.length code in
+      let labels  = Hashtbl.create 16 in
+      Array.iteri (fun i -> function LABEL l | FLABEL l | SLABEL l -> Hashtbl.replace labels l i | _ -> ()) code;
+      let vars    = Hashtbl.create 16 in
+      for i = 0 to nargs - 1 do Hashtbl.replace vars (Value.Arg i) (D.singleton (Param i)) done;
+      let var x   = try Hashtbl.find vars x with Not_found -> D.empty in
+      let stacks  = Array.make n None in
+      let escaped = Stdlib.ref D.empty in
+      let changed = Stdlib.ref true in
+      let escape s =
+        if not (D.subset s !escaped) then (escaped := D.union s !escaped; changed := true)
+      in
+      let store x s =
+        match x with
+        | Value.Local _ | Value.Arg _ ->
+           if not (D.subset s (var x)) then (Hashtbl.replace vars x (D.union s (var x)); changed := true)
+        | _ -> escape s
+      in
+      let sites = D.filter (function Site _ -> true | _ -> false) in
+      let other = D.singleton Other in
+      let callee f k =
+        if List.mem f primitives then Some (Array.make k true) else M.find_opt f summaries
+      in
+      (* the function of a closure, if it is always created by the same site *)
+      let known c =
+        match D.elements c with
+        | [Site j] -> (match code.(j) with CLOSURE (f, _) -> Some f | _ -> None)
+        | _        -> None
+      in
+      let closure c =
+        match known c with Some f -> M.find_opt f summaries | None -> None
+      in
+      (* the arguments of a tail call outlive the frame *)
+      let pass tail summary args =
+        List.iteri
+          (fun i a ->
+            (match summary with Some s when i < Array.length s && s.(i) -> () | _ -> escape a);
+            if tail then escape (sites a)
+          )
+          args
+      in
+      let rec pop k st =
+        if k = 0 then [], st
+        else match st with
+             | x :: st -> let xs, st = pop (k-1) st in xs @ [x], st
+             | []      -> [], []
+      in
+      let step i st =
+        let next st = [i+1, st] in
+        match code.(i), st with
+        | (CONST _ | STRING _ | LDA _), _      -> next (other :: st)
+        | LD (Value.Local _ | Value.Arg _ as x), _ -> next (var x :: st)
+        | LD _, _                              -> next (other :: st)
+        | ST x, v :: _                         -> store x v; next st
+        | STI, v :: _ :: st                    -> escape v; next (v :: st)
+        | STA, v :: _ :: _ :: st               -> escape v; next (v :: st)
+        | (ELEM | BINOP _), _ :: _ :: st       -> next (other :: st)
+        | CALL (".array", k, _), _             ->
+           let args, st = pop k st in
+           List.iter escape args;
+           next (D.singleton (Site i) :: st)
+        | CLOSURE (_, ds), _                   ->
+           List.iter (fun d -> escape (var d)) ds;
+           next (D.singleton (Site i) :: st)
+        | SEXP (_, k), _                       ->
+           let args, st = pop k st in
+           List.iter escape args;
+           next (other :: st)
+        | CALL (f, k, tail), _                 ->
+           let args, st = pop k st in
+           pass tail (callee f k) args;
+           next (other :: st)
+        | CALLC (k, tail), _                   ->
+           (match pop k st with
+            | args, c :: st ->
+               if tail then escape (sites c);
+               pass tail (closure c) args;
+               next (other :: st)
+            | _ -> []
+           )
+        | DUP, v :: _                          -> next (v :: st)
+        | DROP, _ :: st                        -> next st
+        | SWAP, x :: y :: st                   -> next (y :: x :: st)
+        | PATT StrCmp, _ :: _ :: st            -> next (other :: st)
+        | (TAG _ | ARRAY _ | PATT _), _ :: st  -> next (other :: st)
+        | FAIL (_, false), _ :: st             -> next st
+        | JMP l, _                             -> [Hashtbl.find labels l, st]
+        | CJMP (_, l), _ :: st                 -> [i+1, st; Hashtbl.find labels l, st]
+        | (RET | END), v :: _                  -> escape v; []
+        | _                                    -> next st
+      in
+      let join i st =
+        match stacks.(i) with
+        | None     -> stacks.(i) <- Some st; changed := true
+        | Some st' ->
+           if List.length st = List.length st' && not (List.for_all2 D.subset st st')
+           then (stacks.(i) <- Some (List.map2 D.union st st'); changed := true)
+      in
+      stacks.(0) <- Some [];
+      while !changed do
+        changed := false;
+        Array.iteri
+          (fun i -> function
+           | Some st -> List.iter (fun (j, st) -> if j < n then join j st) (step i st)
+           | None    -> ()
+          )
+          stacks
+      done;
+      let live_in, _  = Liveness.analyse code in
+      let in_use i    =
+        let s = Site i in
+        (match stacks.(i) with Some st -> List.exists (D.mem s) st | None -> true) ||
+        Hashtbl.fold (fun x v acc -> acc || D.mem s v && Liveness.D.mem x live_in.(i)) vars false
+      in
+      let calls =
+        List.concat @@ Array.to_list @@
+        Array.mapi
+          (fun i insn ->
+            match insn, stacks.(i) with
+            | CALLC (k, _), Some st when List.length st > k ->
+               (match known (List.nth st k) with Some f -> [i, f] | None -> [])
+            | _ -> []
+          )
+          code
+      in
+      let sites, words =
+        Array.fold_left
+          (fun (acc, (i, w)) insn ->
+            match size insn with
+            | Some m when not (D.mem (Site i) !escaped || in_use i) -> (i, w) :: acc, (i+1, w+m)
+            | _ -> acc, (i+1, w)
+          )
+          ([], (0, 0))
+          code
+        |> fun (acc, (_, w)) -> List.rev acc, w
+      in
+      Array.init nargs (fun i -> not (D.mem (Param i) !escaped)), {sites = sites; words = words; calls = calls}
+
+    (* Analyses a program with the summaries of the imported functions; returns
+       the frame-allocated sites and the summaries of the functions *)
+    let analyse imported prg =
+      let fs = functions prg in
+      let rec iterate summaries =
+        let results   = List.map (fun (f, code) -> f, analyse_function summaries code) fs in
+        let summaries' = List.fold_left (fun m (f, (s, _)) -> M.add f s m) summaries results in
+        if List.for_all (fun (f, (s, _)) -> M.find f summaries = s) results
+        then List.fold_left (fun m (f, (_, r)) -> M.add f r m) M.empty results, summaries'
+        else iterate summaries'
+      in
+      iterate (List.fold_left (fun m (f, code) -> match code.(0) with BEGIN (_, nargs, _, _, _, _) -> M.add f (Array.make nargs true) m | _ -> m) imported fs)
+
+    (* Reads the summaries of the public functions of the imported units *)
+    let imported paths imports =
+      List.fold_left
+        (fun m import ->
+          List.fold_left
+            (fun m -> function
+             | `Escape (name, mask) ->
+                M.add (label name) (Array.of_list @@ List.map ((=) '1') @@ List.filter (fun c -> c = '0' || c = '1') @@ List.of_seq @@ String.to_seq mask) m
+             | _                    -> m
+            )
+            m
+            (snd (Interface.find import paths))
+        )
+        M.empty
+        imports
+
+    (* The summaries of the public functions for the interface file *)
+    let exports prg summaries =
+      List.fold_right
+        (fun insn acc ->
+          match insn with
+          | PUBLIC l when l.[0] = 'L' && M.mem l summaries ->
+             (String.sub l 1 (String.length l - 1),
+              String.concat "" @@ List.map (fun b -> if b then "1" else "0") @@ Array.to_list (M.find l summaries)
+             ) :: acc
+          | _ -> acc
+        )
+        prg
+        []
+
+  end
+
+(* Shapes of the values: finds the accesses with constant indices to the
+   elements of the values, whose tags and sizes are already checked by the
+   patterns (TAG or ARRAY with a conditional jump on the result); the native
+   code does them without the checks when compiled with -unchecked *)
+module Shape =
+  struct
+
+    (* A path: a value, pushed by an instruction, and the constant indices
+       of the elements taken from it *)
+    type path = int * int list
+
+    (* An abstract value: a constant, a path, the result of a check of the
+       size of a path, or anything else *)
+    type v = Const of int | Path of path | Test of path * int | Top
+
+    (* Analyses a function; returns the accesses to the elements of the
+       checked values (by position) with their indices *)
+    let analyse_function code =
+      let n       = Array.length code in
+      let labels  = Hashtbl.create 16 in
+      Array.iteri (fun i -> function LABEL l | FLABEL l | SLABEL l -> Hashtbl.replace labels l i | _ -> ()) code;
+      let states  = Array.make n None in
+      let changed = Stdlib.ref true in
+      let root    = function Path (j, _) | Test ((j, _), _) -> Some j | _ -> None in
+      (* the value pushed by the instruction i replaces the one it pushed before *)
+      let fresh i (st, facts) =
+        Path (i, []) :: List.map (fun v -> if root v = Some i then Top else v) st,
+        List.filter (fun ((j, _), _) -> j <> i) facts
+      in
+      (* the elements of the values can be changed *)
+      let clobber (st, facts) =
+        List.map (function Path (_, _ :: _) | Test ((_, _ :: _), _) -> Top | v -> v) st,
+        List.filter (fun ((_, p), _) -> p = []) facts
+      in
+      let rec drop k st = if k = 0 then st else match st with _ :: st -> drop (k-1) st | [] -> [] in
+      let step i ((st, facts) as s) =
+        let next s     = [i+1, s] in
+        let push k s   = next (fresh i (drop k (fst s), snd s)) in
+        match code.(i), st with
+        | CONST c, _                              -> next (Const c :: st, facts)
+        | (STRING _ | LD _ | LDA _ | CLOSURE _), _ -> push 0 s
+        | DUP, v :: _                             -> next (v :: st, facts)
+        | DROP, _ :: st                           -> next (st, facts)
+        | SWAP, x :: y :: st                      -> next (y :: x :: st, facts)
+        | ELEM, Const k :: Path (r, p) :: st      -> next (Path (r, p @ [k]) :: st, facts)
+        | (ELEM | BINOP _ | PATT StrCmp), _       -> push 2 s
+        | (TAG (_, k) | ARRAY k), Path p :: st    -> next (Test (p, k) :: st, facts)
+        | (TAG _ | ARRAY _ | PATT _), _           -> push 1 s
+        | SEXP (_, k), _                          -> push k s
+        | STI, v :: _ :: st                       -> next (clobber (v :: st, facts))
+        | STA, v :: _ :: _ :: st                  -> next (clobber (v :: st, facts))
+        | CALL (_, k, _), _                       -> push k (clobber s)
+        | CALLC (k, _), _                         -> push (k+1) (clobber s)
+        | FAIL (_, false), _ :: st                -> next (st, facts)
+        | CJMP (c, l), v :: st                    ->
+           let checked = match v with Test (p, k) -> (p, k) :: facts | _ -> facts in
+           let l       = Hashtbl.find labels l in
+           if c = "nz"
+           then [i+1, (st, facts); l, (st, checked)]
+           else [i+1, (st, checked); l, (st, facts)]
+        | JMP l, _                                -> [Hashtbl.find labels l, s]
+        | (RET | END), _                          -> []
+        | _                                       -> next s
+      in
+      let join i (st, facts) =
+        match states.(i) with
+        | None               -> states.(i) <- Some (st, facts); changed := true
+        | Some (st', facts') ->
+           if List.length st = List.length st'
+           then
+             let st''    = List.map2 (fun x y -> if x = y then x else Top) st st' in
+             let facts'' = List.filter (fun f -> List.mem f facts) facts' in
+             if st'' <> st' || List.length facts'' <> List.length facts'
+             then (states.(i) <- Some (st'', facts''); changed := true)
+      in
+      states.(0) <- Some ([], []);
+      while !changed do
+        changed := false;
+        Array.iteri
+          (fun i -> function
+           | Some s -> List.iter (fun (j, s) -> if j < n then join j s) (step i s)
+           | None   -> ()
+          )
+          states
+      done;
+      let size p facts = try List.assoc p facts with Not_found -> 0 in
+      List.concat @@ Array.to_list @@
+      Array.mapi
+        (fun i insn ->
+          match insn, states.(i) with
+          | ELEM, Some (Const k :: Path p :: _, facts) when k >= 0 && k < size p facts -> [i, k]
+          | CALL (("Lfst" | "Lhd"), 1, _), Some (Path p :: _, facts) when size p facts >= 1 -> [i, 0]
+          | CALL (("Lsnd" | "Ltl"), 1, _), Some (Path p :: _, facts) when size p facts >= 2 -> [i, 1]
+          | _ -> []
+        )
+        code
+
+    (* Analyses a program; returns the checked accesses of each function *)
+    let analyse prg =
+      List.fold_left (fun m (f, code) -> M.add f (analyse_function code) m) M.empty (Escape.functions prg)
+
+  end
+
+(* Stack machine code optimizer
+
+   The passes run in a pipeline between the compilation into the stack machine
+   code and the backends (the native code generators, the bytecode compiler and
+   the interpreters). The level selects the passes:
+
+     0 --- none;
+     1 --- peephole rewriting, jump threading and unreachable code removal (default);
+     2 --- the same plus constant propagation and folding and dead store elimination.
+
+   The pipeline is repeated while the passes find something to rewrite; the
+   number of rewrites of each pass is reported in -ds dumps
+*)
+module Opt =
+  struct
+
+    (* Applies a transformation to the code of each function (from BEGIN to END) *)
+    let per_function f prg =
+      let rec inner acc = function
+      | [] -> List.rev acc
+      | (BEGIN _ as i) :: tl ->
+         let rec body acc = function
+         | END :: tl -> List.rev (END :: acc), tl
+         | i   :: tl -> body (i :: acc) tl
+         | []        -> List.rev acc, []
+         in
+         let code, tl = body [i] tl in
+         inner (List.rev_append (f code) acc) tl
+      | i :: tl -> inner (i :: acc) tl
+      in
+      inner [] prg
+
+    (* The labels which are jumped to *)
+    let targets prg =
+      List.fold_left (fun s -> function JMP l | CJMP (_, l) -> M.add l () s | _ -> s) M.empty prg
+
+    (* Removes the sequences without effect *)
+    let peephole n prg =
+      let rec inner acc = function
+      | []                                        -> List.rev acc
+      | DUP  :: DROP :: tl
+      | SWAP :: SWAP :: tl
+      | (CONST _ | STRING _ | LD _) :: DROP :: tl -> incr n; inner acc tl
+      | ST x :: DROP :: LD y :: tl when x = y     -> incr n; inner acc (ST x :: tl)
+      | JMP l :: (LABEL l' as i) :: tl when l = l' -> incr n; inner acc (i :: tl)
+      | i :: tl                                   -> inner (i :: acc) tl
+      in
+      inner [] prg
+
+    (* Redirects the jumps to jumps to their final destinations *)
+    let thread n prg =
+      let dest = Hashtbl.create 64 in
+      let rec collect = function
+      | []                             -> ()
+      | (LABEL l | FLABEL l) :: tl     -> Hashtbl.replace dest l tl; collect tl
+      | _ :: tl                        -> collect tl
+      in
+      collect prg;
+      let rec final seen l =
+        let rec skip = function (LABEL _ | FLABEL _ | SLABEL _) :: tl -> skip tl | code -> code in
+        match skip (try Hashtbl.find dest l with Not_found -> []) with
+        | JMP l' :: _ when not (List.mem l' seen) -> final (l :: seen) l'
+        | _                                       -> l
+      in
+      let redirect l = let l' = final [] l in if l' <> l then incr n; l' in
+      List.map (function JMP l -> JMP (redirect l) | CJMP (c, l) -> CJMP (c, redirect l) | i -> i) prg
+
+    (* Removes the code after unconditional jumps up to the next label which is
+       jumped to, and the labels which are not jumped to at all; the scope labels
+       are kept *)
+    let unreachable n prg =
+      let targets = targets prg in
+      per_function
+        (fun code ->
+          let rec inner acc dead = function
+          | []                                                  -> List.rev acc
+          | LABEL l :: tl when not (M.mem l targets)            -> incr n; inner acc dead tl
+          | (LABEL _ | FLABEL _ | END as i) :: tl               -> inner (i :: acc) false tl
+          | (SLABEL _ | BEGIN _ as i) :: tl                     -> inner (i :: acc) dead tl
+          | _ :: tl when dead                                   -> incr n; inner acc dead tl
+          | (JMP _ as i) :: tl                                  -> inner (i :: acc) true tl
+          | i :: tl                                             -> inner (i :: acc) false tl
+          in
+          inner [] false code
+        )
+        prg
+
+    (* Folds the operators with constant operands and the conditional jumps on
+       constants; the results which do not fit into the native (31-bit) integers
+       are not folded *)
+    let fold n prg =
+      let fits x = x >= - (1 lsl 30) && x < 1 lsl 30 in
+      let eval op a b =
+        match op with
+        | "/" | "%" when b = 0 -> None
+        | _                    -> let r = Expr.to_func op a b in if fits r then Some r else None
+      in
+      let rec inner acc = function
+      | [] -> List.rev acc
+      | (CONST a :: CONST b :: BINOP op :: tl) as code ->
+         (match eval op a b with
+          | Some r ->
+             incr n;
+             (match acc with
+              | (CONST _ as c) :: acc -> inner acc (c :: CONST r :: tl)
+              | _                     -> inner acc (CONST r :: tl)
+             )
+          | None   -> inner (List.hd code :: acc) (List.tl code)
+         )
+      | CONST c :: CJMP (s, l) :: tl ->
+         incr n;
+         if (s = "z") = (c = 0) then inner (JMP l :: acc) tl else inner acc tl
+      | i :: tl -> inner (i :: acc) tl
+      in
+      inner [] prg
+
+    (* Replaces the loads of the variables, known to hold constants within a
+       basic block, with the constants *)
+    let propagate n prg =
+      per_function
+        (fun code ->
+          let addressed = Liveness.addressed (Array.of_list code) in
+          let rec inner acc known = function
+          | [] -> List.rev acc
+          | (LABEL _ | FLABEL _ as i) :: tl -> inner (i :: acc) [] tl
+          | (ST x as i) :: tl ->
+             let known = List.remove_assoc x known in
+             (match acc with
+              | CONST c :: _ when Liveness.is_var x && not (Liveness.D.mem x addressed) -> inner (i :: acc) ((x, c) :: known) tl
+              | _                                                                       -> inner (i :: acc) known tl
+             )
+          | (LD x as i) :: tl ->
+             (match List.assoc_opt x known with
+              | Some c -> incr n; inner (CONST c :: acc) known tl
+              | None   -> inner (i :: acc) known tl
+             )
+          | i :: tl -> inner (i :: acc) known tl
+          in
+          inner [] [] code
+        )
+        prg
+
+    (* Removes the stores into the variables which are not live after them *)
+    let dead_stores n prg =
+      per_function
+        (fun code ->
+          let code      = Array.of_list code in
+          let addressed = Liveness.addressed code in
+          let _, live   = Liveness.analyse code in
+          let acc       = Stdlib.ref [] in
+          Array.iteri
+            (fun i -> function
+             | ST x when Liveness.is_var x && not (Liveness.D.mem x addressed) && not (Liveness.D.mem x live.(i)) -> incr n
+             | insn -> acc := insn :: !acc
+            )
+            code;
+          List.rev !acc
+        )
+        prg
+
+    let passes level =
+      (if level >= 2
+       then ["constant propagation", propagate; "constant folding", fold; "dead store elimination", dead_stores]
+       else []) @
+      (if level >= 1
+       then ["peephole", peephole; "jump threading", thread; "unreachable code removal", unreachable]
+       else [])
+
+    (* Runs the pipeline; returns the optimized program and the numbers of
+       rewrites of each pass *)
+    let optimize level prg =
+      let passes = List.map (fun (name, pass) -> name, pass, Stdlib.ref 0) (passes level) in
+      let rec iterate round prg =
+        let total () = List.fold_left (fun s (_, _, n) -> s + !n) 0 passes in
+        let before   = total () in
+        let prg      = List.fold_left (fun prg (_, pass, n) -> pass n prg) prg passes in
+        if total () > before && round < 8 then iterate (round + 1) prg else prg
+      in
+      let prg = iterate 1 prg in
+      prg, List.map (fun (name, _, n) -> name, !n) passes
+
+  end
+
+(* Function inlining
+
+   The calls of the small functions (at most budget instructions) are replaced
+   with their bodies: the arguments are stored into the local variables of the
+   caller, reserved for the callee (the variables of the callee are renamed
+   into them), the labels are renamed, and the body leaves the result on the
+   stack. The recursive functions, the functions with closures and the ones
+   which take the addresses of variables or return early are not inlined.
+
+   The bodies of the small public functions are exported in the interface
+   files, so the calls of the imported functions are inlined, too; such a
+   body may refer only to the arguments and the locals, and call the
+   primitives, the runtime and the public functions of its unit. It may also
+   make closures of the lambdas of its unit (as returnST does), if their code
+   is portable as well: the lambdas are exported with the body, and the unit
+   which inlines it gets its own copies of them
+*)
+module Inline =
+  struct
+
+    (* The maximal size of an inlined body, in instructions *)
+    let budget = 16
+
+    (* A function body: the numbers of the arguments, the local variables
+       and the captured values, the code between BEGIN and END without the
+       scope labels and the line information, and the bodies of the imported
+       lambdas the code makes closures of (by the names of their copies) *)
+    type body = {nargs : int; nlocals : int; closure : int; code : insn list; lambdas : (string * body) list}
+
+    (* Extracts the bodies of the functions which can be inlined *)
+    let bodies prg =
+      List.fold_left
+        (fun m (f, code) ->
+          match Array.to_list code with
+          | BEGIN (_, nargs, nlocals, [], _, _) :: code ->
+             let code = List.filter (function SLABEL _ | LINE _ | END -> false | _ -> true) code in
+             let size = List.length (List.filter (function LABEL _ | FLABEL _ -> false | _ -> true) code) in
+             if size <= budget &&
+                not (List.exists (function RET | LDA _ -> true | CALL (g, _, _) -> g = f | _ -> false) code)
+             then M.add f {nargs = nargs; nlocals = nlocals; closure = 0; code = code; lambdas = []} m
+             else m
+          | _ -> m
+        )
+        M.empty
+        (Escape.functions prg)
+
+    (* Renames the body for the inlining with the given label suffix and the
+       first local variable *)
+    let rename suffix base b =
+      let d = function
+      | Value.Arg   i -> Value.Local (base + i)
+      | Value.Local i -> Value.Local (base + b.nargs + i)
+      | x             -> x
+      in
+      let l x = x ^ suffix in
+      List.map
+        (function
+         | LD x           -> LD (d x)
+         | ST x           -> ST (d x)
+         | CLOSURE (f, ds) -> CLOSURE (f, List.map d ds)
+         | LABEL  x       -> LABEL (l x)
+         | FLABEL x       -> FLABEL (l x)
+         | JMP x          -> JMP (l x)
+         | CJMP (c, x)    -> CJMP (c, l x)
+         | CALL (f, n, _) -> CALL (f, n, false)
+         | CALLC (n, _)   -> CALLC (n, false)
+         | i              -> i
+        )
+        b.code
+
+    (* The copy of an imported lambda with the given name: a function with
+       the labels renamed *)
+    let copy name b =
+      let l x = x ^ "_" ^ name in
+      [LABEL name; BEGIN (name, b.nargs, b.nlocals, List.init b.closure (fun i -> Value.Access i), [], [])] @
+      List.map
+        (function
+         | LABEL  x    -> LABEL (l x)
+         | FLABEL x    -> FLABEL (l x)
+         | JMP x       -> JMP (l x)
+         | CJMP (c, x) -> CJMP (c, l x)
+         | i           -> i
+        )
+        b.code @
+      [END]
+
+    (* Inlines the calls of the functions with the bodies (both local and
+       imported ones); returns the program and the number of the inlined calls *)
+    let inline imported prg =
+      let bodies = M.union (fun _ b _ -> Some b) (bodies prg) imported in
+      let count  = Stdlib.ref 0 in
+      let copies = Hashtbl.create 8 in
+      let rec inner acc = function
+      | [] -> List.rev acc
+      | BEGIN (f, nargs, nlocals, closure, args, scopes) :: tl ->
+         let rec body acc = function
+         | END :: tl -> List.rev acc, tl
+         | i   :: tl -> body (i :: acc) tl
+         | []        -> List.rev acc, []
+         in
+         let code, tl = body [] tl in
+         let blocks   = Hashtbl.create 8 in
+         let nlocals  = Stdlib.ref nlocals in
+         let code     =
+           List.concat @@
+           List.map
+             (function
+              | CALL (g, n, _) when g <> f && M.mem g bodies && (M.find g bodies).nargs = n ->
+                 let b    = M.find g bodies in
+                 let base =
+                   try Hashtbl.find blocks g
+                   with Not_found ->
+                     Hashtbl.add blocks g !nlocals;
+                     nlocals := !nlocals + b.nargs + b.nlocals;
+                     Hashtbl.find blocks g
+                 in
+                 incr count;
+                 List.iter (fun (g, l) -> Hashtbl.replace copies g l) b.lambdas;
+                 List.concat (List.init n (fun i -> [ST (Value.Local (base + n - 1 - i)); DROP])) @
+                 rename (Printf.sprintf "_inline%d" !count) base b
+              | i -> [i]
+             )
+             code
+         in
+         inner (List.rev_append (BEGIN (f, nargs, !nlocals, closure, args, scopes) :: code @ [END]) acc) tl
+      | i :: tl -> inner (i :: acc) tl
+      in
+      let prg = inner [] prg in
+      let copies = List.sort (fun (g, _) (g', _) -> compare g g') (Hashtbl.fold (fun g l acc -> (g, l) :: acc) copies []) in
+      prg @ List.concat (List.map (fun (g, l) -> copy g l) copies), !count
+
+    (* The encoding of the bodies in the interface files: the numbers of the
+       arguments and the locals followed by the instructions, separated by
+       spaces; the names are hex-encoded. The lambdas follow the instructions
+       with their names, the numbers of the captured values and their own
+       encodings, hex-encoded *)
+    let patts = [StrCmp; String; Array; Sexp; Boxed; UnBoxed; Closure]
+
+    let hex s = String.concat "" @@ List.map (fun c -> Printf.sprintf "%02x" (Char.code c)) @@ List.of_seq @@ String.to_seq s
+
+    let unhex s = String.init (String.length s / 2) (fun i -> Char.chr (int_of_string ("0x" ^ String.sub s (2*i) 2)))
+
+    let rec encode b =
+      let d = function
+      | Value.Arg    i -> Printf.sprintf "a%d" i
+      | Value.Local  i -> Printf.sprintf "l%d" i
+      | Value.Access i -> Printf.sprintf "e%d" i
+      | _              -> invalid_arg "must not happen"
+      in
+      let rec index x = function y :: tl -> if x = y then 0 else 1 + index x tl | [] -> invalid_arg "must not happen" in
+      String.concat " " @@
+      [string_of_int b.nargs; string_of_int b.nlocals] @
+      List.map
+        (function
+         | BINOP op       -> "b" ^ hex op
+         | CONST n        -> "c" ^ string_of_int n
+         | STRING s       -> "s" ^ hex s
+         | SEXP (t, n)    -> Printf.sprintf "x%s.%d" (hex t) n
+         | LD x           -> "L" ^ d x
+         | ST x           -> "S" ^ d x
+         | STI            -> "I"
+         | STA            -> "A"
+         | ELEM           -> "E"
+         | DROP           -> "D"
+         | DUP            -> "U"
+         | SWAP           -> "W"
+         | LABEL l        -> ":" ^ hex l
+         | FLABEL l       -> ";" ^ hex l
+         | JMP l          -> "J" ^ hex l
+         | CJMP (c, l)    -> Printf.sprintf "j%s.%s" c (hex l)
+         | CALL (f, n, _) -> Printf.sprintf "C%s.%d" (hex f) n
+         | CALLC (n, _)   -> "K" ^ string_of_int n
+         | TAG (t, n)     -> Printf.sprintf "T%s.%d" (hex t) n
+         | ARRAY n        -> "R" ^ string_of_int n
+         | PATT p         -> "P" ^ string_of_int (index p patts)
+         | RET            -> "r"
+         | CLOSURE (f, ds) -> Printf.sprintf "F%s.%s" (hex f) (String.concat "," (List.map d ds))
+         | _              -> invalid_arg "must not happen"
+        )
+        b.code @
+      List.map (fun (f, l) -> Printf.sprintf "Z%s.%d.%s" (hex f) l.closure (hex (encode l))) b.lambdas
+
+    (* Decodes a body; name gives the names of the copies of the lambdas *)
+    let rec decode name s =
+      match String.split_on_char ' ' s with
+      | nargs :: nlocals :: code ->
+         let d s =
+           let i = int_of_string (String.sub s 1 (String.length s - 1)) in
+           match s.[0] with 'a' -> Value.Arg i | 'e' -> Value.Access i | _ -> Value.Local i
+         in
+         let arg s  = String.sub s 1 (String.length s - 1) in
+         let pair s = match String.split_on_char '.' (arg s) with [x; n] -> x, n | _ -> invalid_arg "must not happen" in
+         let lambdas, code = List.partition (fun s -> s.[0] = 'Z') code in
+         let lambdas  =
+           List.map
+             (fun s ->
+               match String.split_on_char '.' (arg s) with
+               | [f; n; l] -> name (unhex f), {(decode name (unhex l)) with closure = int_of_string n}
+               | _         -> invalid_arg "must not happen"
+             )
+             lambdas
+         in
+         let code   =
+           List.map
+             (fun s ->
+               match s.[0] with
+               | 'b' -> BINOP (unhex (arg s))
+               | 'c' -> CONST (int_of_string (arg s))
+               | 's' -> STRING (unhex (arg s))
+               | 'x' -> let t, n = pair s in SEXP (unhex t, int_of_string n)
+               | 'L' -> LD (d (arg s))
+               | 'S' -> ST (d (arg s))
+               | 'I' -> STI
+               | 'A' -> STA
+               | 'E' -> ELEM
+               | 'D' -> DROP
+               | 'U' -> DUP
+               | 'W' -> SWAP
+               | ':' -> LABEL (unhex (arg s))
+               | ';' -> FLABEL (unhex (arg s))
+               | 'J' -> JMP (unhex (arg s))
+               | 'j' -> let c, l = pair s in CJMP (c, unhex l)
+               | 'C' -> let f, n = pair s in CALL (unhex f, int_of_string n, false)
+               | 'K' -> CALLC (int_of_string (arg s), false)
+               | 'T' -> let t, n = pair s in TAG (unhex t, int_of_string n)
+               | 'R' -> ARRAY (int_of_string (arg s))
+               | 'P' -> PATT (List.nth patts (int_of_string (arg s)))
+               | 'r' -> RET
+               | 'F' ->
+                  let f, ds = pair s in
+                  CLOSURE (name (unhex f), List.map d (List.filter ((<>) "") (String.split_on_char ',' ds)))
+               | _   -> invalid_arg "must not happen"
+             )
+             code
+         in
+         {nargs = int_of_string nargs; nlocals = int_of_string nlocals; closure = 0; code = code; lambdas = lambdas}
+      | _ -> invalid_arg "must not happen"
+
+    (* The encoded bodies of the public functions which can be inlined in
+       other units *)
+    let export paths prg =
+      let publics = List.fold_left (fun s -> function PUBLIC l -> l :: s | _ -> s) [] prg in
+      let std     =
+        List.fold_left (fun s -> function `Fun name -> label name :: s | _ -> s) [] (snd (Interface.find "Std" paths))
+      in
+      let functions = Escape.functions prg in
+      (* the code of a lambda may also refer to the captured values and
+         return early, but not make closures *)
+      let rec portable lambda =
+        List.for_all
+          (function
+           | LD (Value.Arg _ | Value.Local _) | ST (Value.Arg _ | Value.Local _) -> true
+           | LD (Value.Access _) | ST (Value.Access _) | RET -> lambda
+           | CLOSURE (g, ds) ->
+              not lambda &&
+              List.for_all (function Value.Arg _ | Value.Local _ -> true | _ -> false) ds &&
+              body g <> None
+           | LD _ | ST _ | LDA _ | FAIL _ | SLABEL _ | LINE _ | BEGIN _ | END
+           | PROTO _ | PPROTO _ | PCALLC _ | EXTERN _ | PUBLIC _ | IMPORT _ -> false
+           | CALL (f, _, _) -> f.[0] = '.' || List.mem f publics || List.mem f std
+           | _ -> true
+          )
+      and body g =
+        match List.assoc_opt g functions with
+        | Some code ->
+           (match Array.to_list code with
+            | BEGIN (_, nargs, nlocals, closure, _, _) :: code ->
+               let code = List.filter (function SLABEL _ | LINE _ | END -> false | _ -> true) code in
+               if portable true code
+               then Some {nargs = nargs; nlocals = nlocals; closure = List.length closure; code = code; lambdas = []}
+               else None
+            | _ -> None
+           )
+        | None -> None
+      in
+      let lambdas code =
+        List.fold_left
+          (fun acc -> function
+           | CLOSURE (g, _) when not (List.mem_assoc g acc) ->
+              (match body g with Some l -> acc @ [g, l] | None -> acc)
+           | _ -> acc
+          )
+          []
+          code
+      in
+      M.fold
+        (fun f b acc ->
+          if f.[0] = 'L' && List.mem f publics && portable false b.code
+          then (String.sub f 1 (String.length f - 1), encode {b with lambdas = lambdas b.code}) :: acc
+          else acc
+        )
+        (bodies prg)
+        []
+
+    (* Reads the bodies of the public functions of the imported units *)
+    let imported paths imports =
+      List.fold_left
+        (fun m import ->
+          List.fold_left
+            (fun m -> function
+             | `Body (name, b) ->
+                M.add (label name) (decode (fun g -> label (import ^ "_" ^ String.sub g 1 (String.length g - 1))) b) m
+             | _ -> m
+            )
+            m
+            (snd (Interface.find import paths))
+        )
+        M.empty
+        imports
+
+    (* The digest of the bodies in the interface of an imported unit *)
+    let digest paths import =
+      let bodies = List.fold_left (fun acc -> function `Body (name, b) -> (name ^ " " ^ b) :: acc | _ -> acc) [] (snd (Interface.find import paths)) in
+      match bodies with
+      | [] -> None
+      | _  -> Some (Digest.to_hex (Digest.string (String.concat "\n" (List.sort compare bodies))))
+
+    (* The digests of the bodies of the imported units the unit is compiled
+       with; recorded in its interface to detect the stale inlined code *)
+    let depends paths imports =
+      List.fold_left (fun acc import -> match digest paths import with Some d -> (import, d) :: acc | None -> acc) [] imports
+
+    (* Checks that every unit to link was compiled with the current bodies
+       of the units it imports: the code inlined from an outdated interface
+       would silently diverge from the linked one *)
+    let check paths imports =
+      let module S = Set.Make (String) in
+      let rec iterate s = function
+      | []              -> ()
+      | import::imports ->
+         if S.mem import s
+         then iterate s imports
+         else
+           let intfs = snd (Interface.find import paths) in
+           List.iter
+             (function
+              | `Depend (dep, d) when digest paths dep <> Some d ->
+                 report_error (Printf.sprintf "unit \"%s\" was compiled with an outdated interface of \"%s\" and must be recompiled" import dep)
+              | _ -> ()
+             )
+             intfs;
+           iterate
+             (S.add import s)
+             (List.fold_left (fun acc -> function `Import name -> name :: acc | _ -> acc) imports intfs)
+      in
+      iterate S.empty imports
+
+  end
+
 let compile cmd ((imports, infixes), p) =
+  (* The head of a pattern, on which a case can dispatch: an S-expression
+     constructor with its arity, a string or a constant *)
+  let rec head = function
+  | Pattern.Named  (_, p)  -> head p
+  | Pattern.Sexp   (t, ps) -> Some (`Sexp (t, List.length ps))
+  | Pattern.String  s      -> Some (`String s)
+  | Pattern.Const   c      -> Some (`Const c)
+  | _                      -> None
+  in
+  let the_head p = match head p with Some h -> h | None -> invalid_arg "must not happen" in
+  (* The dispatch key of a head; the same as LmatchKey computes for the values *)
+  let key = function
+  | `Sexp (t, _) -> Value.tag_hash t
+  | `String s    -> Value.string_hash s
+  | `Const  c    -> c
+  in
+  let rec irrefutable = function
+  | Pattern.Wildcard       -> true
+  | Pattern.Named  (_, p)  -> irrefutable p
+  | _                      -> false
+  in
+  (* The minimal number of distinct heads to compile a block of branches into a switch *)
+  let min_switch = 4 in
   let rec pattern env lfalse = function
   | Pattern.Wildcard        -> env, false, [DROP]
   | Pattern.Named   (_, p)  -> pattern env lfalse p
@@ -892,6 +2216,16 @@ let compile cmd ((imports, infixes), p) =
      let tag          = [DUP; TAG (t, List.length ps); CJMP ("nz", lhead); LABEL ldrop; DROP; JMP lfalse; LABEL lhead] in
      let code, env    = pattern_list lhead ldrop env ps in
      env, true, tag @ code @ [DROP]
+  (* The same for a pattern with a head, already checked; returns the code
+     for the failures of the subpatterns as well, which has to be put after
+     the branch *)
+  and known_pattern env lfalse = function
+  | Pattern.Named (_, p)  -> known_pattern env lfalse p
+  | Pattern.Sexp  (_, ps) when not (List.for_all irrefutable ps) ->
+     let ldrop, env = env#get_label in
+     let code , env = pattern_list ldrop ldrop env ps in
+     env, code @ [DROP], [LABEL ldrop; DROP; JMP lfalse]
+  | _                     -> env, [DROP], []
   and pattern_list lhead ldrop env ps =
     let _, env, code =
       List.fold_left
@@ -1053,33 +2387,150 @@ let compile cmd ((imports, infixes), p) =
   | Expr.Leave              -> env, false, []
                                  
   | Expr.Case (e, brs, loc, atr) ->
-     let n          = List.length brs - 1 in
      let lfail, env = env#get_label in
      let lexp , env = env#get_label in
-     let env  , fe  , se         = compile_expr false lexp env e in
-     let env  , _, _, code, fail =
+     let env  , fe  , se = compile_expr false lexp env e in
+     (* A branch; the value being matched is on the top of the stack on entry
+        and when the control goes to lfalse. When the head of the pattern is
+        already known to match, also returns the code for the failures of
+        the subpatterns *)
+     let branch env entry lfalse known (p, s) =
+       let env, lfalse', pcode, drops =
+         if known
+         then (let env, pcode, drops = known_pattern env lfalse p in env, drops <> [], pcode, drops)
+         else (let env, lfalse', pcode = pattern env lfalse p in env, lfalse', pcode, [])
+       in
+       let blab, env     = env#get_label in
+       let elab, env     = env#get_label in
+       let env           = env#push_scope blab elab in
+       let env, bindcode = bindings env p in
+       let env, _, scode = compile_expr tail l env s in
+       env#pop_scope, lfalse', [SLABEL blab] @ entry @ [DUP] @ pcode @ bindcode @ scode @ [JMP l; SLABEL elab], drops
+     in
+     (* A chain of branches; the failure of the last one goes to lnext *)
+     let chain env entry lnext known brs =
+       let n = List.length brs - 1 in
+       let env, _, _, code, drops, _ =
+         List.fold_left
+           (fun ((env, entry, i, code, drops, continue) as acc) br ->
+              if continue
+              then
+                let lfalse, env = if i = n then lnext, env else env#get_label in
+                let env, continue, bcode, bdrops = branch env entry lfalse known br in
+                env, [LABEL lfalse], i+1, code @ bcode, drops @ bdrops, continue
+              else acc
+           )
+           (env, entry, 0, [], [], true) brs
+       in
+       env, code @ drops
+     in
+     (* A switch over the branches with the heads of the same kind: the key of
+        the value is computed once and looked up with a binary search, then only
+        the branches with the heads of this key are tried. The heads are
+        mutually exclusive, thus the order of the branches is preserved *)
+     let switch env entry lnext brs =
+       let update k f d l =
+         if List.mem_assoc k l
+         then List.map (fun (k', v) -> k', if k' = k then f v else v) l
+         else l @ [k, f d]
+       in
+       let groups =
+         List.sort (fun (k, _) (k', _) -> compare k k') @@
+         List.fold_left
+           (fun groups ((p, _) as br) ->
+              let h = the_head p in
+              update (key h) (update h (fun brs -> brs @ [br]) []) [] groups
+           )
+           [] brs
+       in
+       let lmiss , env = env#get_label in
+       let env, labels = List.fold_left (fun (env, acc) (k, _) -> let lk, env = env#get_label in env, acc @ [k, lk]) (env, []) groups in
+       let rec search env ks =
+         if List.length ks <= 3
+         then env, List.concat (List.map (fun (k, lk) -> [DUP; CONST k; BINOP "=="; CJMP ("nz", lk)]) ks) @ [JMP lmiss]
+         else
+           let mid         = fst @@ List.nth ks (List.length ks / 2) in
+           let lo, hi      = List.partition (fun (k, _) -> k < mid) ks in
+           let lleft, env  = env#get_label in
+           let env, hicode = search env hi in
+           let env, locode = search env lo in
+           env, [DUP; CONST mid; BINOP "<"; CJMP ("nz", lleft)] @ hicode @ [LABEL lleft] @ locode
+       in
+       let env, scode = search env labels in
+       let dispatch =
+         match the_head (fst @@ List.hd brs) with
+         | `Const _ -> [DUP; PATT UnBoxed; CJMP ("z", lnext); DUP]
+         | _        -> [DUP; CALL ("LmatchKey", 1, false)]
+       in
+       let check lfalse = function
+       | `Sexp (t, n) -> [DUP; TAG (t, n); CJMP ("z", lfalse)]
+       | `String s    -> [DUP; STRING s; PATT StrCmp; CJMP ("z", lfalse)]
+       | `Const  _    -> []
+       in
+       (* The constructors with equal hashes are not told apart by the TAG
+          checks in all the backends, thus such groups are tried in order *)
+       let collide hs =
+         List.length (List.sort_uniq compare (List.concat (List.map (function (`Sexp (t, _), _) -> [t] | _ -> []) hs))) > 1
+       in
+       let env, gcode =
+         List.fold_left
+           (fun (env, code) ((k, hs), (_, lk)) ->
+              let env, gcode =
+                if collide hs
+                then chain env [LABEL lk; DROP] lnext false (List.filter (fun (p, _) -> key (the_head p) = k) brs)
+                else
+                  let n = List.length hs - 1 in
+                  let env, _, _, gcode =
+                    List.fold_left
+                      (fun (env, entry, i, code) (h, brs) ->
+                         let lcheck, env = if i = n then lnext, env else env#get_label in
+                         let env, bcode  = chain env [] lnext true brs in
+                         env, [LABEL lcheck], i+1, code @ entry @ check lcheck h @ bcode
+                      )
+                      (env, [LABEL lk; DROP], 0, []) hs
+                  in
+                  env, gcode
+              in
+              env, code @ gcode
+           )
+           (env, []) (List.combine groups labels)
+       in
+       env, entry @ dispatch @ scode @ [LABEL lmiss; DROP; JMP lnext] @ gcode
+     in
+     (* Splits the branches into switches and single branches *)
+     let rec units = function
+     | [] -> []
+     | ((p, _) :: _) as brs when head p <> None ->
+        let kind p = match head p with Some (`Const _) -> Some `Const | Some _ -> Some `Keyed | None -> None in
+        let rec block acc = function
+        | ((p', _) as br) :: brs when kind p' = kind p -> block (br :: acc) brs
+        | brs                                          -> List.rev acc, brs
+        in
+        let brs, rest = block [] brs in
+        (if List.length (List.sort_uniq compare (List.map (fun (p, _) -> the_head p) brs)) >= min_switch
+         then [`Switch brs]
+         else List.map (fun br -> `Branch br) brs) @ units rest
+     | br :: brs -> `Branch br :: units brs
+     in
+     let units = units brs in
+     let n     = List.length units - 1 in
+     let env, _, _, code, fail =
        List.fold_left
-         (fun ((env, lab, i, code, continue) as acc) (p, s) ->
-             if continue
-             then
-               let (lfalse, env), jmp =
-                 if i = n
-                 then (lfail, env), []
-                 else env#get_label, [JMP l]
-               in
-               let env, lfalse', pcode = pattern env lfalse p in
-               let blab, env           = env#get_label in
-               let elab, env           = env#get_label in               
-               let env                 = env#push_scope blab elab in
-               let env, bindcode       = bindings env p in
-               let env, l'     , scode = compile_expr tail l env s in
-               let env                 = env#pop_scope in
-               (env, Some lfalse, i+1, ((match lab with None -> [SLABEL blab] | Some l -> [SLABEL blab; LABEL l; DUP]) @ pcode @ bindcode @ scode @ jmp @ [SLABEL elab]) :: code, lfalse')
-             else acc
+         (fun ((env, entry, i, code, continue) as acc) u ->
+            if continue
+            then
+              let lnext, env = if i = n then lfail, env else env#get_label in
+              let env, continue, ucode =
+                match u with
+                | `Branch br  -> let env, lfalse', bcode, _ = branch env entry lnext false br in env, lfalse', bcode
+                | `Switch brs -> let env, scode = switch env entry lnext brs in env, true, scode
+              in
+              (env, [LABEL lnext], i+1, ucode :: code, continue)
+            else acc
          )
-         (env, None, 0, [], true) brs
+         (env, [], 0, [], true) units
      in
-     env, true, se @ (if fe then [LABEL lexp] else []) @ [DUP] @ (List.flatten @@ List.rev code) @ [JMP l] @ if fail then [LABEL lfail; FAIL (loc, atr != Expr.Void); JMP l] else []
+     env, true, se @ (if fe then [LABEL lexp] else []) @ (List.flatten @@ List.rev code) @ if fail then [LABEL lfail; FAIL (loc, atr != Expr.Void); JMP l] else []
   in
   let rec compile_fundef env ((name, args, stmt, st) as fd) =
     (* Printf.eprintf "Compile fundef: %s, state=%s\n" name (show(State.t) (show(Value.designation)) st);                *)
@@ -1145,5 +2596,11 @@ let compile cmd ((imports, infixes), p) =
    *)
   (*Printf.eprintf "Before fix:\n%s\n" (show_prg prg);  *)
   let prg = fix_closures env prg in
-  cmd#dump_SM prg;
+  let prg, inlined =
+    if cmd#get_opt_level > 0
+    then Inline.inline (Inline.imported cmd#get_include_paths imports) prg
+    else prg, 0
+  in
+  let prg, stats = Opt.optimize cmd#get_opt_level prg in
+  cmd#dump_SM prg (("inlining", inlined) :: stats);
   prg
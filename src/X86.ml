@@ -115,14 +115,157 @@ let show instr =
 (* Opening stack machine to use instructions without fully qualified names *)
 open SM
 
+(* Inline intrinsics: the fast paths of the runtime primitives for the words of
+   ws bytes. The sequences use eax and edx as scratch registers (hence the closure
+   has to be reloaded after them), leave the result in y, and jump to slow when
+   the runtime is needed (unboxed or unexpected values, strings, vectors and
+   buffers) *)
+module Intrinsic =
+  struct
+
+    (* Object tags, see runtime.c; vectors and typed buffers are S-expressions
+       with a negative constructor tag *)
+    let array_tag   = 3
+    let sexp_tag    = 5
+    let string_tag  = 1
+    let closure_tag = 7
+
+    (* Jumps to slow unless eax points to an array or an S-expression *)
+    let check_array_or_sexp ws slow =
+      let array = slow ^ "_array" in
+      [Binop ("test", L 1, eax);
+       CJmp  ("nz", slow);
+       Mov   (I (-ws, eax), edx);
+       Binop ("&&", L 7, edx);
+       Binop ("cmp", L array_tag, edx);
+       CJmp  ("e", array);
+       Binop ("cmp", L sexp_tag, edx);
+       CJmp  ("nz", slow);
+       Binop ("cmp", L 0, I (-2 * ws, eax));
+       CJmp  ("l", slow);
+       Label array
+      ]
+
+    (* Turns a boxed index in edx into a byte offset *)
+    let offset ws =
+      Dec edx :: List.init (if ws = 4 then 1 else 2) (fun _ -> Binop ("+", edx, edx))
+
+    (* Element i of the array or S-expression p *)
+    let elem ws p i y slow =
+      [Mov (p, eax)] @
+      check_array_or_sexp ws slow @
+      [Mov (i, edx); Binop ("test", L 1, edx); CJmp ("z", slow)] @
+      offset ws @
+      [Binop ("+", edx, eax); Mov (I (0, eax), eax); Mov (eax, y)]
+
+    (* Field k of the array or S-expression p (fst, snd, hd, tl) *)
+    let field ws k p y slow =
+      [Mov (p, eax)] @
+      check_array_or_sexp ws slow @
+      [Mov (I (ws * k, eax), eax); Mov (eax, y)]
+
+    (* Field k of p, which is known to be an array or an S-expression of more
+       than k elements *)
+    let checked_field ws k p y =
+      [Mov (p, eax); Mov (I (ws * k, eax), eax); Mov (eax, y)]
+
+    (* Stores v into element i of the array or S-expression x *)
+    let sta ws v i x y slow =
+      [Mov (x, eax)] @
+      check_array_or_sexp ws slow @
+      [Mov (i, edx); Binop ("test", L 1, edx); CJmp ("z", slow)] @
+      offset ws @
+      [Binop ("+", edx, eax); Mov (v, edx); Mov (edx, I (0, eax)); Mov (edx, y)]
+
+    (* The length of p unless it is a vector or a buffer *)
+    let length ws p y slow =
+      let fast = slow ^ "_fast" in
+      [Mov   (p, eax);
+       Binop ("test", L 1, eax);
+       CJmp  ("nz", slow);
+       Mov   (I (-ws, eax), edx);
+       Binop ("&&", L 7, edx);
+       Binop ("cmp", L sexp_tag, edx);
+       CJmp  ("nz", fast);
+       Binop ("cmp", L 0, I (-2 * ws, eax));
+       CJmp  ("l", slow);
+       Label fast;
+       Mov   (I (-ws, eax), eax);
+       Sar1  eax;
+       Sar1  eax;
+       Or1   eax;
+       Mov   (eax, y)
+      ]
+
+    (* The dispatch key of p (see LmatchKey) if it is an S-expression *)
+    let match_key ws p y slow =
+      [Mov   (p, eax);
+       Binop ("test", L 1, eax);
+       CJmp  ("nz", slow);
+       Mov   (I (-ws, eax), edx);
+       Binop ("&&", L 7, edx);
+       Binop ("cmp", L sexp_tag, edx);
+       CJmp  ("nz", slow);
+       Mov   (I (-2 * ws, eax), eax);
+       Binop ("test", eax, eax);
+       CJmp  ("s", slow);
+       Sal1  eax;
+       Or1   eax;
+       Mov   (eax, y)
+      ]
+
+    (* A pattern test of x with no slow path: the test sets al, the unboxed
+       values fail it *)
+    let patt x y test ldone =
+      [Mov   (x, edx);
+       Binop ("^", eax, eax);
+       Binop ("test", L 1, edx);
+       CJmp  ("nz", ldone)] @
+      test @
+      [Label ldone; Sal1 eax; Or1 eax; Mov (eax, y)]
+
+    let tag_patt ws tag x y ldone =
+      patt x y [Mov (I (-ws, edx), edx); Binop ("&&", L 7, edx); Binop ("cmp", L tag, edx); Set ("e", "%al")] ldone
+
+    (* An S-expression, but not a vector or a buffer *)
+    let sexp_tag_patt ws x y ldone =
+      patt x y
+        [Mov   (I (-ws, edx), eax);
+         Binop ("&&", L 7, eax);
+         Binop ("cmp", L sexp_tag, eax);
+         Mov   (L 0, eax);
+         CJmp  ("nz", ldone);
+         Binop ("cmp", L 0, I (-2 * ws, edx));
+         Set   ("ge", "%al")
+        ] ldone
+
+    (* An S-expression with the tag hash h and n subvalues *)
+    let sexp_patt ws h n x y ldone =
+      patt x y
+        [Binop ("cmp", L ((n lsl 3) lor sexp_tag), I (-ws, edx));
+         CJmp  ("nz", ldone);
+         Binop ("cmp", L h, I (-2 * ws, edx));
+         Set   ("e", "%al")
+        ] ldone
+
+    (* An array of n elements *)
+    let array_patt ws n x y ldone =
+      patt x y [Binop ("cmp", L ((n lsl 3) lor array_tag), I (-ws, edx)); Set ("e", "%al")] ldone
+
+    (* Boxed and unboxed tests *)
+    let boxed_patt x y   = [Mov (x, eax); Binop ("&&", L 1, eax); Binop ("^", L 1, eax); Sal1 eax; Or1 eax; Mov (eax, y)]
+    let unboxed_patt x y = [Mov (x, eax); Binop ("&&", L 1, eax); Sal1 eax; Or1 eax; Mov (eax, y)]
+
+  end
+
 (* Symbolic stack machine evaluator
 
      compile : env -> prg -> env * instr list
 
    Take an environment, a stack machine program, and returns a pair --- the updated environment and the list
-   of x86 instructions
+   of x86 instructions; cfuns are the runtime functions
 *)
-let compile cmd env imports code =
+let compile cmd env imports cfuns code =
   (* SM.print_prg code; *)
   flush stdout;
   let suffix = function
@@ -135,29 +278,67 @@ let compile cmd env imports code =
   | _    -> failwith "unknown operator"
   in
   let box n = (n lsl 1) lor 1 in 
+  let is_c f = f.[0] = 'B' || List.mem f cfuns in
   let rec compile' env scode =
     let on_stack = function S _ -> true | _ -> false in
     let mov x s = if on_stack x && on_stack s then [Mov (x, eax); Mov (eax, s)] else [Mov (x, s)]  in
+    (* Pops n arguments from the symbolic stack; the first goes first *)
+    let pop_args env n =
+      let rec inner env acc = function
+      | 0 -> env, acc
+      | n -> let x, env = env#pop in inner env (x::acc) (n-1)
+      in
+      inner env [] n
+    in
+    (* Leaves the frame for a tail call with the arguments args: they take the
+       places of the arguments of the current function. If there are more of
+       them, the return address is moved down into the frame being left; the
+       caller then gets the control back with a lower stack pointer and
+       restores it from its frame pointer (see restore). In this case the new
+       arguments are pushed first, since their places can overlap the values
+       themselves and the saved frame pointer *)
+    let tail_call env args =
+      let m = List.length args in
+      let d = m - env#nargs in
+      let c = if env#has_closure then 1 else 0 in
+      if d <= 0
+      then
+        List.concat (List.mapi (fun k x -> if x = env#mem_loc (Value.Arg k) then [] else mov x (env#mem_loc (Value.Arg k))) args) @
+        [Mov (ebp, esp); Pop ebp] @
+        (if env#has_closure then [Pop ebx] else [])
+      else
+        let dst j = I (word_size * (1 + c - d + j), ebp) in
+        List.rev_map (fun x -> Push x) args @
+        [Push (I (word_size * (1 + c), ebp)); Mov (I (0, ebp), ecx)] @
+        List.concat (List.init (m+1) (fun j -> [Mov (I (word_size * (m-j), esp), eax); Mov (eax, dst (m-j))])) @
+        [Lea (dst 0, esp); Mov (ecx, ebp)]
+    in
+    (* Restores the stack pointer after a call of a Lama function (which can
+       make a tail call with more arguments); k words were pushed before the
+       arguments *)
+    let restore env k =
+      Lea (M (Printf.sprintf "-%d-%s(%%ebp)" (word_size * k) env#lsize), esp)
+    in
+    (* A call can be a tail one unless it is made from main or from the
+       initialization of a unit, which return into C code; a call with more
+       arguments than the current function has needs a Lama callee (a closure
+       with an unknown function can only be created by Lama code or be a C
+       function, which sees the usual frame) *)
+    let can_tail env n f =
+      env#fname <> "main" && env#fname <> cmd#topname &&
+      (n <= env#nargs || match f with Some f -> not (is_c f) | None -> true)
+    in
     let callc env n tail =
-      let tail = tail && env#nargs = n in 
-      if tail
+      if tail && can_tail env n env#known_callee
       then (
-        let rec push_args env acc = function
-        | 0 -> env, acc
-        | n -> let x, env = env#pop in
-               if x = env#loc (Value.Arg (n-1))
-               then push_args env acc (n-1)
-               else push_args env ((mov x (env#loc (Value.Arg (n-1)))) @ acc) (n-1)
-        in
-        let env    , pushs = push_args env [] n in
-        let closure, env   = env#pop in
-        let y      , env   = env#allocate in
-        env, pushs @ [Mov (closure, edx);
-                      Mov (I(0, edx), eax);
-                      Mov (ebp, esp);
-                      Pop (ebp)] @
-                      (if env#has_closure then [Pop ebx] else []) @
-                      [Jmp "*%eax"] (* UGLY!!! *)
+        let env    , args = pop_args env n in
+        let closure, env  = env#pop in
+        let y      , env  = env#allocate in
+        env, [Mov (closure, edx)] @ tail_call env args @
+             (match env#known_callee with
+              | Some f -> [Jmp f]
+              | None   -> [Mov (I(0, edx), eax); Jmp "*%eax"] (* UGLY!!! *)
+             )
       )
       else (
         let pushr, popr =
@@ -165,41 +346,40 @@ let compile cmd env imports code =
         in
         let pushr, popr = env#save_closure @ pushr, env#rest_closure @ popr in
         let env, code =
-          let rec push_args env acc = function
-          | 0 -> env, acc
-          | n -> let x, env = env#pop in
-                 push_args env ((Push x)::acc) (n-1)
-          in
-          let env, pushs   = push_args env [] n in
-          let pushs        = List.rev pushs     in
+          let env, args    = pop_args env n    in
+          let pushs        = List.rev_map (fun x -> Push x) args in
           let closure, env = env#pop            in
           let call_closure =
-            if on_stack closure
-            then [Mov (closure, edx); Mov (edx, eax); CallI eax]
-            else [Mov (closure, edx); CallI closure]
+            match env#known_callee with
+            | Some f -> [Mov (closure, edx); Call f]
+            | None   ->
+               if on_stack closure
+               then [Mov (closure, edx); Mov (edx, eax); CallI eax]
+               else [Mov (closure, edx); CallI closure]
           in
-          env, pushr @ pushs @ call_closure @ [Binop ("+", L (word_size * List.length pushs), esp)] @ (List.rev popr) 
+          env, pushr @ pushs @ call_closure @ [restore env (List.length pushr)] @ (List.rev popr) 
         in
         let y, env = env#allocate in env, code @ [Mov (eax, y)]
       )
     in
     let call env f n tail =
-      let tail = tail && env#nargs = n && f.[0] <> '.' in 
       let f =
         match f.[0] with '.' -> "B" ^ String.sub f 1 (String.length f - 1) | _ -> f
       in
-      if tail
+      (* the arguments in the order of the C calling convention; the builtins
+         are never called in tail positions *)
+      let c_order args =
+        match f with
+        | "Barray" -> L (box n) :: args
+        | "Bsexp"  -> L (box n) :: args
+        | "Bsta"   -> List.rev args
+        | _        -> args
+      in
+      if tail && f.[0] <> 'B' && can_tail env n (Some f)
       then (
-        let rec push_args env acc = function
-        | 0 -> env, acc
-        | n -> let x, env = env#pop in
-               if x = env#loc (Value.Arg (n-1))
-               then push_args env acc (n-1)
-               else push_args env ((mov x (env#loc (Value.Arg (n-1)))) @ acc) (n-1)
-        in
-        let env, pushs = push_args env [] n in
+        let env, args = pop_args env n in
         let y, env = env#allocate in
-        env, pushs @ [Mov (ebp, esp); Pop (ebp)] @ (if env#has_closure then [Pop ebx] else []) @ [Jmp f]
+        env, tail_call env args @ [Jmp f]
       )
       else (
         let pushr, popr =
@@ -207,24 +387,56 @@ let compile cmd env imports code =
         in      
         let pushr, popr = env#save_closure @ pushr, env#rest_closure @ popr in
         let env, code =
-          let rec push_args env acc = function
-            | 0 -> env, acc
-            | n -> let x, env = env#pop in
-                   push_args env ((Push x)::acc) (n-1)
+          let env, args = pop_args env n in
+          let pushs     = List.rev_map (fun x -> Push x) (c_order args) in
+          let cleanup   =
+            if f.[0] = 'B'
+            then Binop ("+", L (word_size * List.length pushs), esp)
+            else restore env (List.length pushr)
           in
-          let env, pushs = push_args env [] n in
-          let pushs      =
-            match f with
-            | "Barray" -> List.rev @@ (Push (L (box n))) :: pushs
-            | "Bsexp"  -> List.rev @@ (Push (L (box n))) :: pushs
-            | "Bsta"   -> pushs
-            | _        -> List.rev pushs
-          in
-          env, pushr @ pushs @ [Call f; Binop ("+", L (word_size * List.length pushs), esp)] @ (List.rev popr) 
+          env, pushr @ pushs @ [Call f; cleanup] @ (List.rev popr) 
         in
         let y, env = env#allocate in env, code @ [Mov (eax, y)]
       )
     in
+    (* A call of the primitive f with n arguments with an inline fast path; the
+       call itself is moved to the slow paths of the function *)
+    let inline env f n fast =
+      let env', code  = call env f n false in
+      let y           = env'#peek in
+      let lslow, env' = env'#fresh_label in
+      let ldone, env' = env'#fresh_label in
+      env'#add_slow_path ([Label lslow] @ env#reload_closure @ code @ [Jmp ldone]),
+      fast y lslow @ [Label ldone] @ env#reload_closure
+    in
+    (* An access to element k of a value, whose tag and size are already
+       checked by a pattern (see SM.Shape); the access takes n operands *)
+    let checked env n k =
+      let env, args = pop_args env n in
+      let y, env    = env#allocate in
+      env, Intrinsic.checked_field word_size k (List.hd args) y
+    in
+    (* A fully inline pattern test *)
+    let patt env fast =
+      let x, env = env#pop in
+      let y, env = env#allocate in
+      let l, env = env#fresh_label in
+      env, fast x y l @ env#reload_closure
+    in
+    (* An object with the tag and the words, allocated in the frame at the
+       position base: the header is at the lowest address *)
+    let in_frame env base tag words =
+      let m      = List.length words in
+      let slot w = S (base + m - w) in
+      let fill   =
+        List.concat @@
+        List.mapi (fun i x -> match x with R _ | L _ -> [Mov (x, slot (i+1))] | _ -> [Mov (x, eax); Mov (eax, slot (i+1))]) words
+      in
+      let y, env = env#allocate in
+      env,
+      [Mov (L ((m lsl 3) lor tag), slot 0)] @ fill @
+      (match y with R _ -> [Lea (slot 1, y)] | _ -> [Lea (slot 1, eax); Mov (eax, y)])
+    in
     match scode with
     | [] -> env, []
     | instr :: scode' ->
@@ -243,6 +455,10 @@ let compile cmd env imports code =
           | EXTERN name -> env#register_extern name, []
           | IMPORT name -> env, []
                          
+          | CLOSURE (name, closure) when env#frame_object <> None ->
+             let Some base = env#frame_object in
+             in_frame env base Intrinsic.closure_tag (M ("$" ^ name) :: List.map env#loc closure)
+
           | CLOSURE (name, closure) ->
              let pushr, popr =
                List.split @@ List.map (fun r -> (Push r, Pop r)) (env#live_registers 0)
@@ -281,22 +497,24 @@ let compile cmd env imports code =
 	  | LD x ->
              let s, env' = (env#variable x)#allocate in
              env',
-	     (match s with
-	      | S _ | M _ -> [Mov (env'#loc x, eax); Mov (eax, s)]
-	      | _         -> [Mov (env'#loc x, s)]
+	     (match s, env'#loc x with
+	      | (S _ | M _), (S _ | M _ | I _ | C) -> [Mov (env'#loc x, eax); Mov (eax, s)]
+	      | _                                  -> [Mov (env'#loc x, s)]
 	     )
 
           | ST x ->
 	     let env' = env#variable x in
              let s    = env'#peek      in
              env',
-             (match s with
-              | S _ | M _ -> [Mov (s, eax); Mov (eax, env'#loc x)]
-              | _         -> [Mov (s, env'#loc x)]
+             (match s, env'#loc x with
+              | (S _ | M _), (S _ | M _ | I _ | C) -> [Mov (s, eax); Mov (eax, env'#loc x)]
+              | _                                  -> [Mov (s, env'#loc x)]
 	     )
 
           | STA ->
-             call env ".sta" 3 false
+             let v, env' = env#pop in
+             let i, x    = env'#peek2 in
+             inline env ".sta" 3 (Intrinsic.sta word_size v i x)
 
 	  | STI ->
              let v, x, env' = env#pop2 in
@@ -466,7 +684,8 @@ let compile cmd env imports code =
                   (if f = cmd#topname
                    then List.map (fun i -> Call ("init" ^ i)) (List.filter (fun i -> i <> "Std") imports)
                    else []
-                  )    
+                  ) @
+                  env#var_init
 
           | END ->
              let x, env = env#pop in
@@ -484,6 +703,9 @@ let compile cmd env imports code =
 	        Meta "\t.cfi_def_cfa\t4, 4";
                 Ret;
                 Meta "\t.cfi_endproc";
+               ] @
+               env#slow_paths @
+               [
                 Meta (Printf.sprintf "\t.set\t%s,\t%d" env#lsize (env#allocated * word_size));
                 Meta (Printf.sprintf "\t.set\t%s,\t%d" env#allocated_size env#allocated);
                 Meta (Printf.sprintf "\t.size %s, .-%s" name name);
@@ -493,8 +715,28 @@ let compile cmd env imports code =
              let x = env#peek in
              env, [Mov (x, eax); Jmp env#epilogue]
 
-          | ELEM              -> call env ".elem" 2 false
-                               
+          | (ELEM | CALL (("Lfst" | "Lhd" | "Lsnd" | "Ltl"), 1, _)) when cmd#is_unchecked && env#checked_access <> None ->
+             let Some k = env#checked_access in
+             checked env (match instr with ELEM -> 2 | _ -> 1) k
+
+          | ELEM ->
+             let i, p = env#peek2 in
+             inline env ".elem" 2 (Intrinsic.elem word_size p i)
+
+          | CALL (("Lfst" | "Lhd") as f, 1, _) -> inline env f 1 (Intrinsic.field word_size 0 env#peek)
+          | CALL (("Lsnd" | "Ltl") as f, 1, _) -> inline env f 1 (Intrinsic.field word_size 1 env#peek)
+          | CALL ("Llength", 1, _)             -> inline env "Llength" 1 (Intrinsic.length word_size env#peek)
+          | CALL ("LmatchKey", 1, _)           -> inline env "LmatchKey" 1 (Intrinsic.match_key word_size env#peek)
+
+          | CALL (".array", n, _) when env#frame_object <> None ->
+             let Some base = env#frame_object in
+             let rec pop env acc = function
+             | 0 -> env, acc
+             | k -> let x, env = env#pop in pop env (x :: acc) (k-1)
+             in
+             let env, xs = pop env [] n in
+             in_frame env base Intrinsic.array_tag xs
+
           | CALL (f, n, tail) -> call env f n tail
                          
           | CALLC (n, tail) -> callc env n tail
@@ -516,29 +758,18 @@ let compile cmd env imports code =
              let x, y = env#peek2 in
              env, [Push x; Push y; Pop x; Pop y]
 
-          | TAG (t, n) ->
-             let s1, env = env#allocate in
-             let s2, env = env#allocate in
-             let env, code = call env ".tag" 3 false in
-             env, [Mov (L (box (env#hash t)), s1); Mov (L (box n), s2)] @ code
-
-          | ARRAY n ->
-             let s, env    = env#allocate in
-             let env, code = call env ".array_patt" 2 false in
-             env, [Mov (L (box n), s)] @ code
-
-          | PATT StrCmp -> call env ".string_patt" 2 false
-
-          | PATT patt ->
-             call env 
-               (match patt with
-                | Boxed   -> ".boxed_patt"
-                | UnBoxed -> ".unboxed_patt"
-                | Array   -> ".array_tag_patt"
-                | String  -> ".string_tag_patt"
-                | Sexp    -> ".sexp_tag_patt"
-                | Closure -> ".closure_tag_patt"
-               ) 1 false
+          | TAG (t, n)   -> patt env (Intrinsic.sexp_patt word_size (env#hash t) n)
+
+          | ARRAY n      -> patt env (Intrinsic.array_patt word_size n)
+
+          | PATT StrCmp  -> call env ".string_patt" 2 false
+
+          | PATT Boxed   -> patt env (fun x y _ -> Intrinsic.boxed_patt x y)
+          | PATT UnBoxed -> patt env (fun x y _ -> Intrinsic.unboxed_patt x y)
+          | PATT Array   -> patt env (Intrinsic.tag_patt word_size Intrinsic.array_tag)
+          | PATT String  -> patt env (Intrinsic.tag_patt word_size Intrinsic.string_tag)
+          | PATT Sexp    -> patt env (Intrinsic.sexp_tag_patt word_size)
+          | PATT Closure -> patt env (Intrinsic.tag_patt word_size Intrinsic.closure_tag)
           | LINE (line) ->
              env#gen_line line
              
@@ -550,7 +781,7 @@ let compile cmd env imports code =
           | i ->
              invalid_arg (Printf.sprintf "invalid SM insn: %s\n" (GT.show(insn) i))
         in
-        let env'', code'' = compile' env' scode' in
+        let env'', code'' = compile' env'#tick scode' in
 	env'', [Meta (Printf.sprintf "# %s / % s" (GT.show(SM.insn) instr) stack)] @ code' @ code''
   in
   compile' env code
@@ -561,11 +792,92 @@ module S = Set.Make (String)
 (* A map indexed by strings *)
 module M = Map.Make (String)
 
-(* Environment implementation *)
-class env prg =
+(* Linear-scan register allocation for the local variables and the arguments
+   of functions
+
+   A variable is given a register for the whole interval from the first to the
+   last position where it is live (see SM.Liveness), the variables whose
+   addresses are taken (LDA) always stay in memory
+*)
+module RegAlloc =
+  struct
+
+    module D = Liveness.D
+
+    (* The result of the analysis for a function: the variables, live at the
+       entry and after each instruction (BEGIN is at the position 0), and the
+       live intervals of the variables which can be kept in registers *)
+    type t = {entry : D.t; live : D.t array; intervals : (Value.designation * int * int) list}
+
+    let analyse_function code =
+      let live_in, live = Liveness.analyse code in
+      let addressed     = Liveness.addressed code in
+      let bounds        = Hashtbl.create 16 in
+      Array.iteri
+        (fun i insn ->
+          D.iter
+            (fun x ->
+              if not (D.mem x addressed)
+              then
+                let b, e = try Hashtbl.find bounds x with Not_found -> i, i in
+                Hashtbl.replace bounds x (min b i, max e i)
+            )
+            (D.union live_in.(i) (snd (Liveness.use_def insn)))
+        ) code;
+      {entry     = live_in.(0);
+       live      = live;
+       intervals = Hashtbl.fold (fun x (b, e) acc -> (x, b, e) :: acc) bounds []
+      }
+
+    (* Splits a program into functions and analyses each of them *)
+    let analyse prg =
+      let rec inner acc = function
+      | []                                 -> acc
+      | (BEGIN (f, _, _, _, _, _) as i) :: tl ->
+         let rec body acc = function
+         | END :: tl -> List.rev (END :: acc), tl
+         | i   :: tl -> body (i :: acc) tl
+         | []        -> List.rev acc, []
+         in
+         let code, tl = body [i] tl in
+         inner (M.add f (analyse_function (Array.of_list code)) acc) tl
+      | _ :: tl                            -> inner acc tl
+      in
+      inner M.empty prg
+
+    (* Linear scan: assigns the registers from the pool to the intervals; when
+       the registers are exhausted the interval which ends last is spilled *)
+    let scan pool intervals =
+      let intervals = List.sort (fun (_, b, _) (_, b', _) -> Pervasives.compare b b') intervals in
+      let by_end = List.sort (fun (_, e, _) (_, e', _) -> Pervasives.compare e e') in
+      let _, _, result =
+        List.fold_left
+          (fun (active, free, result) (x, b, e) ->
+            let expired, active = List.partition (fun (e', _, _) -> e' < b) active in
+            let free = List.map (fun (_, _, r) -> r) expired @ free in
+            match free with
+            | r :: free -> by_end ((e, x, r) :: active), free, (x, r) :: result
+            | []        ->
+               match List.rev active with
+               | (e', x', r) :: rest when e' > e ->
+                  by_end ((e, x, r) :: rest), [], (x, r) :: List.remove_assoc x' result
+               | _ -> active, [], result
+          )
+          ([], pool, [])
+          intervals
+      in
+      result
+
+  end
+
+(* Environment implementation; frame gives the sites of each function which
+   are allocated in its frame (see SM.Escape) *)
+class env frame prg =
   let chars          = "_abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789'" in
   let make_assoc l i = List.combine l (List.init (List.length l) (fun x -> x + i)) in
   let rec assoc  x   = function [] -> raise Not_found | l :: ls -> try List.assoc x l with Not_found -> assoc x ls in
+  let analyses       = RegAlloc.analyse prg in
+  let shapes         = SM.Shape.analyse prg in
   object (self)
     inherit SM.indexer prg
     val globals         = S.empty (* a set of global variables         *)
@@ -585,7 +897,16 @@ class env prg =
     val publics         = S.empty
     val externs         = S.empty
     val nlabels         = 0
+    val slow_paths      = ([] : instr list list) (* out-of-line code of the function *)
     val first_line      = true
+    val pc              = 0       (* the position in the current function  *)
+    val var_regs        = []      (* the registers of the variables        *)
+    val live            = [||]    (* the variables live after instructions *)
+    val entry           = RegAlloc.D.empty
+    val objects         = []      (* the sites allocated in the frame      *)
+    val calls           = []      (* the closure calls of known functions  *)
+    val nlocals         = 0       (* number of local variables             *)
+    val checked         = []      (* the accesses to checked elements      *)
                         
     method publics = S.elements publics
                    
@@ -652,8 +973,12 @@ class env prg =
     method has_stack l = (*Printf.printf "Retrieving stack for %s\n" l;*)
       M.mem l stackmap
 
-    (* gets a name for a global variable *)
+    (* gets a location of a variable *)
     method loc x =
+      try List.assoc x var_regs with Not_found -> self#mem_loc x
+
+    (* gets a memory location of a variable *)
+    method mem_loc x =
       match x with
       | Value.Global name -> M ("global_" ^ name)
       | Value.Fun    name -> M ("$" ^ name)
@@ -664,10 +989,13 @@ class env prg =
     (* allocates a fresh position on a symbolic stack *)
     method allocate =
       let x, n =
+        (* the registers of the variables are reserved *)
+        let regs = List.filter (fun r -> not (List.mem r self#used_var_regs)) (List.init num_of_regs (fun n -> R n)) in
+        let next n = List.find_opt (function R m -> m > n | _ -> false) regs in
         let rec allocate' = function
         | []                            -> ebx          , 0
         | (S n)::_                      -> S (n+1)      , n+2
-        | (R n)::_ when n < num_of_regs -> R (n+1)      , stack_slots
+        | (R n)::_                      -> (match next n with Some r -> r, stack_slots | None -> S static_size, static_size+1)
         | _                             -> S static_size, static_size+1
         in
         allocate' stack
@@ -746,7 +1074,44 @@ class env prg =
                      
     (* enters a function *)
     method enter f nargs nlocals has_closure =
-      {< nargs = nargs; static_size = nlocals; stack_slots = nlocals; stack = []; fname = f; has_closure = has_closure; first_line = true >}
+      let a = M.find f analyses in
+      let o = try M.find f frame with Not_found -> {Escape.sites = []; Escape.words = 0; Escape.calls = []} in
+      let size = nlocals + o.Escape.words in
+      {< nargs = nargs; static_size = size; stack_slots = size; stack = []; fname = f; has_closure = has_closure; first_line = true; slow_paths = [];
+         pc = 0; var_regs = RegAlloc.scan self#var_pool a.RegAlloc.intervals; live = a.RegAlloc.live; entry = a.RegAlloc.entry;
+         objects = o.Escape.sites; calls = o.Escape.calls; nlocals = nlocals;
+         checked = (try M.find f shapes with Not_found -> []) >}
+
+    (* the position in the frame of the object, created by the current
+       instruction, if it is allocated in the frame; the objects are placed
+       right after the local variables *)
+    method frame_object =
+      try Some (nlocals + List.assoc pc objects) with Not_found -> None
+
+    (* the function called by the current instruction (a closure call), if it
+       is known *)
+    method known_callee =
+      try Some (List.assoc pc calls) with Not_found -> None
+
+    (* the index of the element, taken by the current instruction, if the
+       tag and the size of the value are already checked *)
+    method checked_access =
+      try Some (List.assoc pc checked) with Not_found -> None
+
+    (* advances to the next instruction *)
+    method tick = {< pc = pc + 1 >}
+
+    (* the registers for the variables; taken from the top of the symbolic stack registers *)
+    method var_pool = [edi; esi]
+
+    (* the registers, allocated to the variables in the current function *)
+    method used_var_regs = List.filter (fun r -> List.exists (fun (_, r') -> r = r') var_regs) self#var_pool
+
+    (* loads the variables, live at the entry of the function, into their registers *)
+    method var_init =
+      List.map
+        (fun (x, r) -> match x with Value.Arg _ -> Mov (self#mem_loc x, r) | _ -> Mov (L 1, r))
+        (List.filter (fun (x, _) -> RegAlloc.D.mem x entry) var_regs)
 
     (* returns a label for the epilogue *)
     method epilogue = Printf.sprintf "L%s_epilogue" fname
@@ -754,14 +1119,29 @@ class env prg =
     (* returns a name for local size meta-symbol *)
     method lsize = Printf.sprintf "L%s_SIZE" fname
                     
-    (* returns a list of live registers *)
+    (* returns a list of live registers: those of the symbolic stack below the
+       given depth and those of the variables, live after the current instruction *)
     method live_registers depth =
       let rec inner d acc = function
       | []             -> acc
       | (R _ as r)::tl -> inner (d+1) (if d >= depth then (r::acc) else acc) tl
       | _::tl          -> inner (d+1) acc tl
       in
-      inner 0 [] stack
+      let vars =
+        if pc < Array.length live
+        then List.sort_uniq compare @@ List.map snd @@ List.filter (fun (x, _) -> RegAlloc.D.mem x live.(pc)) var_regs
+        else []
+      in
+      vars @ inner 0 [] stack
+
+    (* gets a fresh local label *)
+    method fresh_label = Printf.sprintf ".L%d" nlabels, {< nlabels = nlabels + 1 >}
+
+    (* adds an out-of-line slow path to the current function *)
+    method add_slow_path code = {< slow_paths = code :: slow_paths >}
+
+    (* the slow paths of the current function, placed after its epilogue *)
+    method slow_paths = List.concat (List.rev slow_paths)
 
     (* generate a line number information for current function *)
     method gen_line line =
@@ -777,11 +1157,21 @@ class env prg =
   end
 
 (* Generates an assembler text for a program: first compiles the program into
-   the stack code, then generates x86 assember code, then prints the assembler file
+   the stack code, then generates x86 assember code, then prints the assembler file;
+   also returns the interface file with the escape summaries and the bodies of the
+   public functions
 *)
 let genasm cmd prog =
   let sm        = SM.compile cmd prog in
-  let env, code = compile cmd (new env sm) (fst (fst prog)) sm in
+  let frame, summaries =
+    SM.Escape.analyse (SM.Escape.imported cmd#get_include_paths (fst (fst prog))) sm
+  in
+  let frame     = if cmd#get_opt_level > 0 then frame else M.empty in
+  let cfuns     =
+    let _, intfs = Interface.find "Std" cmd#get_include_paths in
+    List.fold_left (fun s -> function `Fun name -> ("L" ^ name) :: s | _ -> s) [] intfs
+  in
+  let env, code = compile cmd (new env frame sm) (fst (fst prog)) cfuns sm in
   let globals =
     List.map (fun s -> Meta (Printf.sprintf "\t.globl\t%s" s)) env#publics
   in
@@ -806,7 +1196,9 @@ let genasm cmd prog =
       data @
       [Meta "\t.text"; Label ".Ltext"; Meta "\t.stabs \"data:t1=r1;0;4294967295;\",128,0,0,0"] @          
       code);
-  Buffer.contents asm
+  Buffer.contents asm,
+  Interface.gen ~escapes:(SM.Escape.exports sm summaries) ~bodies:(SM.Inline.export cmd#get_include_paths sm)
+    ~depends:(if cmd#get_opt_level > 0 then SM.Inline.depends cmd#get_include_paths (fst (fst prog)) else []) prog
 
 let get_std_path () =
   match Sys.getenv_opt "LAMA" with
@@ -833,15 +1225,17 @@ let build cmd prog =
     in
     iterate [] (S.add "Std" S.empty) imports
   in
-  cmd#dump_file "s" (genasm cmd prog);
-  cmd#dump_file "i" (Interface.gen prog);
+  let asm, intf = genasm cmd prog in
+  cmd#dump_file "s" asm;
+  cmd#dump_file "i" intf;
   let inc  = get_std_path () in
   match cmd#get_mode with
   | `Default ->
+     SM.Inline.check cmd#get_include_paths (fst @@ fst prog);
      let objs = find_objects (fst @@ fst prog) cmd#get_include_paths in
      let buf  = Buffer.create 255 in
      List.iter (fun o -> Buffer.add_string buf o; Buffer.add_string buf " ") objs;
-     let gcc_cmdline = Printf.sprintf "gcc %s -m32 %s %s.s %s %s/runtime.a" cmd#get_debug cmd#get_output_option cmd#basename (Buffer.contents buf) inc in
+     let gcc_cmdline = Printf.sprintf "gcc %s -m32 %s %s.s %s %s/%s" cmd#get_debug cmd#get_output_option cmd#basename (Buffer.contents buf) inc (if cmd#is_unchecked then "runtime_unchecked.a" else "runtime.a") in
      Sys.command gcc_cmdline
   | `Compile ->
      Sys.command (Printf.sprintf "gcc %s -m32 -c %s.s" cmd#get_debug cmd#basename)
@@ -0,0 +1,770 @@
+open GT
+open Language
+open SM
+open X86
+
+(* X86-64 codegeneration interface; the operands, the instructions and the
+   symbolic stack are those of X86, the words are twice as wide, and the
+   runtime is called according to the System V calling convention *)
+
+(* The registers; the first eight have the same indices as in X86, the rest
+   are used to extend the symbolic stack *)
+let regs = [|"%rbx"; "%rcx"; "%rsi"; "%rdi"; "%rax"; "%rdx"; "%rbp"; "%rsp"; "%r8"; "%r9"; "%r10"; "%r11"|]
+
+(* The registers of the symbolic stack in the order of allocation *)
+let stack_regs = [R 0; R 1; R 2; R 3; R 8; R 9; R 10; R 11]
+
+(* We need to know the word size to calculate offsets correctly *)
+let word_size = 8;;
+
+(* For convenience we define the following synonyms for the registers: *)
+let rbx = ebx
+let rcx = ecx
+let rsi = esi
+let rdi = edi
+let rax = eax
+let rdx = edx
+let rbp = ebp
+let rsp = esp
+let r8  = R 8
+let r9  = R 9
+
+(* The registers to pass the first arguments of C functions *)
+let arg_regs = [rdi; rsi; rdx; rcx; r8; r9]
+
+(* Checks if an immediate operand fits into a sign-extended 32-bit field *)
+let is_imm32 i = i >= -0x80000000 && i <= 0x7FFFFFFF
+
+(* Instruction printer *)
+let stack_offset i =
+  if i >= 0
+  then (i+1) * word_size
+  else 16 + (-i-1) * word_size
+
+let show instr =
+  let rec opnd = function
+  | R i      -> regs.(i)
+  | C        -> "8(%rbp)"
+  | S i      -> if i >= 0
+                then Printf.sprintf "-%d(%%rbp)" (stack_offset i)
+                else Printf.sprintf "%d(%%rbp)"  (stack_offset i)
+  | M x      -> x
+  | L i      -> Printf.sprintf "$%d" i
+  | I (0, x) -> Printf.sprintf "(%s)" (opnd x)
+  | I (n, x) -> Printf.sprintf "%d(%s)" n (opnd x)
+  in
+  let binop = function
+  | "+"    -> "addq"
+  | "-"    -> "subq"
+  | "*"    -> "imulq"
+  | "&&"   -> "andq"
+  | "!!"   -> "orq"
+  | "^"    -> "xorq"
+  | "cmp"  -> "cmpq"
+  | "test" -> "testq"
+  | _      -> failwith "unknown binary operator"
+  in
+  match instr with
+  | Cltd               -> "\tcqto"
+  | Set   (suf, s)     -> Printf.sprintf "\tset%s\t%s"       suf s
+  | IDiv   s1          -> Printf.sprintf "\tidivq\t%s"       (opnd s1)
+  | Binop (op, s1, s2) -> Printf.sprintf "\t%s\t%s,\t%s"     (binop op) (opnd s1) (opnd s2)
+  | Mov   (L i, (R _ as s2)) when not (is_imm32 i)
+                       -> Printf.sprintf "\tmovabsq\t$%d,\t%s" i (opnd s2)
+  | Mov   (s1, s2)     -> Printf.sprintf "\tmovq\t%s,\t%s"   (opnd s1) (opnd s2)
+  | Lea   (x,  y)      -> Printf.sprintf "\tleaq\t%s,\t%s"   (opnd x) (opnd y)
+  | Push   s           -> Printf.sprintf "\tpushq\t%s"       (opnd s)
+  | Pop    s           -> Printf.sprintf "\tpopq\t%s"        (opnd s)
+  | Ret                -> "\tret"
+  | Call   p           -> Printf.sprintf "\tcall\t%s" p
+  | CallI  o           -> Printf.sprintf "\tcall\t*(%s)" (opnd o)
+  | Label  l           -> Printf.sprintf "%s:\n" l
+  | Jmp    l           -> Printf.sprintf "\tjmp\t%s" l
+  | CJmp  (s , l)      -> Printf.sprintf "\tj%s\t%s" s l
+  | Meta   s           -> Printf.sprintf "%s\n" s
+  | Dec    s           -> Printf.sprintf "\tdecq\t%s" (opnd s)
+  | Or1    s           -> Printf.sprintf "\torq\t$0x0001,\t%s" (opnd s)
+  | Sal1   s           -> Printf.sprintf "\tsalq\t%s" (opnd s)
+  | Sar1   s           -> Printf.sprintf "\tsarq\t%s" (opnd s)
+  | Repmovsl           -> Printf.sprintf "\trep movsq\t"
+
+(* Calls a C function f with arguments args (the first argument goes first)
+
+   The arguments are spilled to the stack first, since they can reside in the
+   argument registers; then the stack is aligned to 16 bytes, the arguments
+   are reloaded into the registers and into the aligned stack area, and the
+   original stack pointer is restored after the call. The spilled arguments
+   stay on the stack during the call, thus they are seen by the garbage collector
+*)
+let ccall f args =
+  let n      = List.length args in
+  let nregs  = List.length arg_regs in
+  let nstack = max 0 (n - nregs) in
+  let pad    = nstack land 1 in
+  List.rev_map (fun x -> Push x) args @
+  [Mov (rsp, rax); Binop ("&&", L (-16), rsp); Push rax; Push rax] @
+  (if pad = 1 then [Push (L 0)] else []) @
+  List.rev (List.init nstack (fun i -> Push (I (word_size * (nregs + i), rax)))) @
+  List.mapi (fun i r -> Mov (I (word_size * i, rax), r)) (List.init (min n nregs) (List.nth arg_regs)) @
+  [Binop ("^", rax, rax);
+   Call f;
+   Mov (I (word_size * (nstack + pad), rsp), rsp);
+   Binop ("+", L (word_size * n), rsp)]
+
+(* A stub to use a C function f as a closure: the stub takes the arguments on
+   the stack as a Lama function does, and passes up to six of them to f *)
+let stub f = ".Lstub_" ^ f
+
+let gen_stub f =
+  [Label (stub f); Push rbp; Mov (rsp, rbp)] @
+  ccall f (List.init (List.length arg_regs) (fun i -> I (16 + word_size * i, rbp))) @
+  [Mov (rbp, rsp); Pop rbp; Ret]
+
+(* A set of strings *)
+module S = Set.Make (String)
+
+(* Symbolic stack machine evaluator
+
+     compile : env -> prg -> env * instr list
+
+   Take an environment, a stack machine program, and returns a pair --- the updated environment and the list
+   of x86-64 instructions; cfuns is the set of the runtime functions
+*)
+let compile cmd env imports cfuns code =
+  flush stdout;
+  let suffix = function
+  | "<"  -> "l"
+  | "<=" -> "le"
+  | "==" -> "e"
+  | "!=" -> "ne"
+  | ">=" -> "ge"
+  | ">"  -> "g"
+  | _    -> failwith "unknown operator"
+  in
+  let box n = (n lsl 1) lor 1 in
+  let is_c f = f.[0] = 'B' || S.mem f cfuns in
+  let rec compile' env scode =
+    let on_stack = function S _ -> true | _ -> false in
+    let mov x s = if on_stack x && on_stack s then [Mov (x, eax); Mov (eax, s)] else [Mov (x, s)]  in
+    let ret = if env#fname = "main" then Meta "\tret\t$16" else Ret in
+    (* the function of a closure call, if it is known and not a C function *)
+    let known env =
+      match env#known_callee with Some f when not (is_c f) -> Some f | _ -> None
+    in
+    (* Pops n arguments from the symbolic stack; the first goes first *)
+    let pop_args env n =
+      let rec inner env acc = function
+      | 0 -> env, acc
+      | n -> let x, env = env#pop in inner env (x::acc) (n-1)
+      in
+      inner env [] n
+    in
+    (* Leaves the frame for a tail call with the arguments args, as in X86 *)
+    let tail_call env args =
+      let m = List.length args in
+      let d = m - env#nargs in
+      let c = if env#has_closure then 1 else 0 in
+      if d <= 0
+      then
+        List.concat (List.mapi (fun k x -> if x = env#mem_loc (Value.Arg k) then [] else mov x (env#mem_loc (Value.Arg k))) args) @
+        [Mov (ebp, esp); Pop ebp] @
+        (if env#has_closure then [Pop ebx] else [])
+      else
+        let dst j = I (word_size * (1 + c - d + j), ebp) in
+        List.rev_map (fun x -> Push x) args @
+        [Push (I (word_size * (1 + c), ebp)); Mov (I (0, ebp), ecx)] @
+        List.concat (List.init (m+1) (fun j -> [Mov (I (word_size * (m-j), esp), eax); Mov (eax, dst (m-j))])) @
+        [Lea (dst 0, esp); Mov (ecx, ebp)]
+    in
+    (* Restores the stack pointer after a call of a Lama function; k words
+       were pushed before the arguments *)
+    let restore env k =
+      Lea (M (Printf.sprintf "-%d-%s(%%rbp)" (word_size * k) env#lsize), esp)
+    in
+    (* A call can be a tail one unless it is made from main or from the
+       initialization of a unit; with more arguments than the current function
+       has it needs a Lama callee, as in X86 *)
+    let can_tail env n f =
+      env#fname <> "main" && env#fname <> cmd#topname &&
+      (n <= env#nargs || match f with Some f -> not (is_c f) | None -> true)
+    in
+    let callc env n tail =
+      let tail = tail && can_tail env n env#known_callee in
+      if tail
+      then (
+        let env    , args = pop_args env n in
+        let closure, env  = env#pop in
+        let y      , env  = env#allocate in
+        env, [Mov (closure, edx)] @ tail_call env args @
+             (match known env with
+              | Some f -> [Jmp f]
+              | None   -> [Mov (I(0, edx), eax); Jmp "*%rax"]
+             )
+      )
+      else (
+        let pushr, popr =
+          List.split @@ List.map (fun r -> (Push r, Pop r)) (env#live_registers n)
+        in
+        let pushr, popr = env#save_closure @ pushr, env#rest_closure @ popr in
+        let env, code =
+          let env, args    = pop_args env n    in
+          let pushs        = List.rev_map (fun x -> Push x) args in
+          let closure, env = env#pop            in
+          let call_closure =
+            match known env with
+            | Some f -> [Mov (closure, edx); Call f]
+            | None   ->
+               if on_stack closure
+               then [Mov (closure, edx); Mov (edx, eax); CallI eax]
+               else [Mov (closure, edx); CallI closure]
+          in
+          env, pushr @ pushs @ call_closure @ [restore env (List.length pushr)] @ (List.rev popr)
+        in
+        let y, env = env#allocate in env, code @ [Mov (eax, y)]
+      )
+    in
+    let call env f n tail =
+      let f =
+        match f.[0] with '.' -> "B" ^ String.sub f 1 (String.length f - 1) | _ -> f
+      in
+      (* the C functions get the arguments in the registers, thus only the
+         calls of Lama functions can be tail ones *)
+      let tail = tail && not (is_c f) && can_tail env n (Some f) in
+      if tail
+      then (
+        let env, args = pop_args env n in
+        let y, env = env#allocate in
+        env, tail_call env args @ [Jmp f]
+      )
+      else (
+        let pushr, popr =
+          List.split @@ List.map (fun r -> (Push r, Pop r)) (env#live_registers n)
+        in
+        let pushr, popr = env#save_closure @ pushr, env#rest_closure @ popr in
+        let env, code =
+          let env, args = pop_args env n in
+          env,
+          if is_c f
+          then
+            let args =
+              match f with
+              | "Barray" -> L (box n) :: args
+              | "Bsexp"  -> L (box n) :: args
+              | "Bsta"   -> List.rev args
+              | _        -> args
+            in
+            pushr @ ccall f args @ (List.rev popr)
+          else
+            pushr @ List.rev_map (fun x -> Push x) args @ [Call f; restore env (List.length pushr)] @ (List.rev popr)
+        in
+        let y, env = env#allocate in env, code @ [Mov (eax, y)]
+      )
+    in
+    (* A call of the primitive f with n arguments with an inline fast path; the
+       call itself is moved to the slow paths of the function *)
+    let inline env f n fast =
+      let env', code  = call env f n false in
+      let y           = env'#peek in
+      let lslow, env' = env'#fresh_label in
+      let ldone, env' = env'#fresh_label in
+      env'#add_slow_path ([Label lslow] @ env#reload_closure @ code @ [Jmp ldone]),
+      fast y lslow @ [Label ldone] @ env#reload_closure
+    in
+    (* An access to element k of a value, whose tag and size are already
+       checked by a pattern (see SM.Shape); the access takes n operands *)
+    let checked env n k =
+      let env, args = pop_args env n in
+      let y, env    = env#allocate in
+      env, Intrinsic.checked_field word_size k (List.hd args) y
+    in
+    (* A fully inline pattern test *)
+    let patt env fast =
+      let x, env = env#pop in
+      let y, env = env#allocate in
+      let l, env = env#fresh_label in
+      env, fast x y l @ env#reload_closure
+    in
+    (* An object with the tag and the words, allocated in the frame at the
+       position base: the header is at the lowest address *)
+    let in_frame env base tag words =
+      let m      = List.length words in
+      let slot w = S (base + m - w) in
+      let fill   =
+        List.concat @@
+        List.mapi (fun i x -> match x with R _ | L _ -> [Mov (x, slot (i+1))] | _ -> [Mov (x, eax); Mov (eax, slot (i+1))]) words
+      in
+      let y, env = env#allocate in
+      env,
+      [Mov (L ((m lsl 3) lor tag), slot 0)] @ fill @
+      (match y with R _ -> [Lea (slot 1, y)] | _ -> [Lea (slot 1, eax); Mov (eax, y)])
+    in
+    match scode with
+    | [] -> env, []
+    | instr :: scode' ->
+        let stack = "" in
+        let env', code' =
+          if env#is_barrier
+          then match instr with
+               | LABEL  s -> if env#has_stack s then (env#drop_barrier)#retrieve_stack s, [Label s] else env#drop_stack, []
+               | FLABEL s -> env#drop_barrier, [Label s]
+               | SLABEL s -> env, [Label s]
+               | _        -> env, []
+          else
+          match instr with
+          | PUBLIC name -> env#register_public name, []
+          | EXTERN name -> env#register_extern name, []
+          | IMPORT name -> env, []
+
+          | CLOSURE (name, closure) when env#frame_object <> None ->
+             let Some base = env#frame_object in
+             let code = M ("$" ^ if is_c name then stub name else name) in
+             in_frame env base Intrinsic.closure_tag (code :: List.map env#loc closure)
+
+          | CLOSURE (name, closure) ->
+             let pushr, popr =
+               List.split @@ List.map (fun r -> (Push r, Pop r)) (env#live_registers 0)
+             in
+             let code = M ("$" ^ if is_c name then stub name else name) in
+             let s, env = env#allocate in
+             (env,
+              pushr @
+              ccall "Bclosure" (L (box (List.length closure)) :: code :: List.map env#loc closure) @
+              [Mov (eax, s)] @
+              List.rev popr @ env#reload_closure)
+
+  	  | CONST n ->
+             let s, env' = env#allocate in
+             (env',
+              match s with
+              | R _ -> [Mov (L (box n), s)]
+              | _   -> if is_imm32 (box n) then [Mov (L (box n), s)] else [Mov (L (box n), eax); Mov (eax, s)]
+             )
+
+          | STRING s ->
+             let s, env = env#string s in
+             let l, env = env#allocate in
+             let env, call = call env ".string" 1 false in
+             (env, Mov (M ("$" ^ s), l) :: call)
+
+          | LDA x ->
+             let s,  env' = (env #variable x)#allocate in
+             let s', env''= env'#allocate in
+             env'',
+             [Lea (env'#loc x, eax); Mov (eax, s); Mov (eax, s')]
+
+	  | LD x ->
+             let s, env' = (env#variable x)#allocate in
+             env',
+	     (match s, env'#loc x with
+	      | (S _ | M _), (S _ | M _ | I _ | C) -> [Mov (env'#loc x, eax); Mov (eax, s)]
+	      | _                                  -> [Mov (env'#loc x, s)]
+	     )
+
+          | ST x ->
+	     let env' = env#variable x in
+             let s    = env'#peek      in
+             env',
+             (match s, env'#loc x with
+              | (S _ | M _), (S _ | M _ | I _ | C) -> [Mov (s, eax); Mov (eax, env'#loc x)]
+              | _                                  -> [Mov (s, env'#loc x)]
+	     )
+
+          | STA ->
+             let v, env' = env#pop in
+             let i, x    = env'#peek2 in
+             inline env ".sta" 3 (Intrinsic.sta word_size v i x)
+
+	  | STI ->
+             let v, x, env' = env#pop2 in
+             env'#push x,
+             (match x with
+              | S _ | M _ -> [Mov (v, edx); Mov (x, eax); Mov (edx, I (0, eax)); Mov (edx, x)] @ env#reload_closure
+              | _         -> [Mov (v, eax); Mov (eax, I (0, x)); Mov (eax, x)]
+             )
+
+          | BINOP op ->
+	     let x, y, env' = env#pop2 in
+             env'#push y,
+             (match op with
+	      | "/" ->
+                 [Mov (y, eax);
+                  Sar1 eax;
+                  Cltd;
+                  Sar1 x; (*!!!*)
+                  IDiv x;
+                  Sal1 eax;
+                  Or1 eax;
+                  Mov (eax, y)
+                 ] @ env#reload_closure
+              | "%" ->
+                 [Mov (y, eax);
+                  Sar1 eax;
+                  Cltd;
+                  Sar1 x; (*!!!*)
+                  IDiv x;
+                  Sal1 edx;
+                  Or1  edx;
+                  Mov (edx, y)
+                 ] @ env#reload_closure
+              | "<" | "<=" | "==" | "!=" | ">=" | ">" ->
+                 (match x with
+                  | M _ | S _ ->
+                     [Binop ("^", eax, eax);
+                      Mov   (x, edx);
+                      Binop ("cmp", edx, y);
+                      Set   (suffix op, "%al");
+                      Sal1   eax;
+                      Or1    eax;
+                      Mov   (eax, y)
+                     ] @ env#reload_closure
+                  | _ ->
+                     [Binop ("^"  , eax, eax);
+                      Binop ("cmp", x, y);
+                      Set   (suffix op, "%al");
+                      Sal1   eax;
+                      Or1    eax;
+                      Mov   (eax, y)
+                     ]
+                 )
+              | "*" ->
+                 if on_stack y
+                 then [Dec y; Mov (x, eax); Sar1 eax; Binop (op, y, eax); Or1 eax; Mov (eax, y)]
+                 else [Dec y; Mov (x, eax); Sar1 eax; Binop (op, eax, y); Or1 y]
+	      | "&&" ->
+		 [Dec    x; (*!!!*)
+                  Mov   (x, eax);
+		  Binop (op, x, eax);
+		  Mov   (L 0, eax);
+		  Set   ("ne", "%al");
+
+                  Dec    y; (*!!!*)
+		  Mov   (y, edx);
+		  Binop (op, y, edx);
+		  Mov   (L 0, edx);
+		  Set   ("ne", "%dl");
+
+                  Binop (op, edx, eax);
+		  Set   ("ne", "%al");
+                  Sal1  eax;
+                  Or1   eax;
+		  Mov   (eax, y)
+                 ] @ env#reload_closure
+	      | "!!" ->
+		 [Mov   (y, eax);
+                  Sar1  eax;
+                  Sar1  x; (*!!!*)
+		  Binop (op, x, eax);
+                  Mov   (L 0, eax);
+		  Set   ("ne", "%al");
+                  Sal1  eax;
+                  Or1   eax;
+		  Mov   (eax, y)
+                 ]
+	      | "+" ->
+                 if on_stack x && on_stack y
+                 then [Mov   (x, eax); Dec eax; Binop ("+", eax, y)]
+                 else [Binop (op, x, y); Dec y]
+              | "-" ->
+                 if on_stack x && on_stack y
+                 then [Mov   (x, eax); Binop (op, eax, y); Or1 y]
+                 else [Binop (op, x, y); Or1 y]
+             )
+
+          | LABEL  s
+          | FLABEL s
+          | SLABEL s    -> env, [Label s]
+
+	  | JMP   l     -> (env#set_stack l)#set_barrier, [Jmp l]
+
+          | CJMP (s, l) ->
+              let x, env = env#pop in
+              env#set_stack l, [Sar1 x; (*!!!*) Binop ("cmp", L 0, x); CJmp  (s, l)]
+
+          | BEGIN (f, nargs, nlocals, closure, args, scopes) ->
+             let rec stabs_scope scope =
+               let names =
+                 List.map
+                   (fun (name, index) ->
+                     Meta (Printf.sprintf "\t.stabs \"%s:1\",128,0,0,-%d" name (stack_offset index))
+                   )
+                   scope.names
+               in
+               names @
+               (if names = [] then [] else [Meta (Printf.sprintf "\t.stabn 192,0,0,%s-%s" scope.blab f)]) @
+               (List.flatten @@ List.map stabs_scope scope.subs) @
+               (if names = [] then [] else [Meta (Printf.sprintf "\t.stabn 224,0,0,%s-%s" scope.elab f)])
+             in
+             let name =
+               if f.[0] = 'L' then String.sub f 1 (String.length f - 1) else f
+             in
+             env#assert_empty_stack;
+             let has_closure = closure <> [] in
+             let env         = env#enter f nargs nlocals has_closure in
+             let ret         = if f = "main" then Meta "\tret\t$16" else Ret in
+             let frame       = 16 + (if has_closure then 8 else 0) + (if f = "main" then 16 else 0) in
+             env, [Meta (Printf.sprintf "\t.type %s, @function" name)] @
+                  (if f = "main"
+                   then []
+                   else
+                     [Meta (Printf.sprintf "\t.stabs \"%s:F1\",36,0,0,%s" name f)] @
+                     (List.mapi (fun i a -> Meta (Printf.sprintf "\t.stabs \"%s:p1\",160,0,0,%d" a ((i*word_size) + 16))) args)  @
+                     (List.flatten @@ List.map stabs_scope scopes)
+                  )
+                  @
+                  [Meta "\t.cfi_startproc"] @
+                  (* main gets argc and argv in registers; they are moved to the stack to
+                     become its arguments *)
+                  (if f = "main" then [Pop eax; Push rsi; Push rdi; Push eax] else []) @
+                  (if has_closure then [Push edx] else []) @
+                  (if f = cmd#topname
+                   then
+                     [Mov   (M "_init", eax);
+                      Binop ("test", eax, eax);
+                      CJmp  ("z", "_continue");
+                      ret;
+                      Label "_continue";
+                      Mov (L 1, M "_init");
+                     ]
+                   else []
+                  ) @
+                  [Push ebp;
+                   Meta (Printf.sprintf "\t.cfi_def_cfa_offset\t%d" frame);
+                   Meta (Printf.sprintf "\t.cfi_offset 6, -%d" frame);
+                   Mov (esp, ebp);
+                   Meta "\t.cfi_def_cfa_register\t6";
+                   Binop ("-", M ("$" ^ env#lsize), esp);
+                   Mov (esp, edi);
+	           Mov (M "$filler", esi);
+	           Mov (M ("$" ^ (env#allocated_size)), ecx);
+	           Repmovsl
+                  ] @
+                  (if f = "main"
+                   then ccall "__gc_init" [] @ ccall "set_args" [I (16, rbp); I (24, rbp)]
+                   else []
+                  ) @
+                  (if f = cmd#topname
+                   then List.map (fun i -> Call ("init" ^ i)) (List.filter (fun i -> i <> "Std") imports)
+                   else []
+                  ) @
+                  env#var_init
+
+          | END ->
+             let x, env = env#pop in
+             env#assert_empty_stack;
+             let name = env#fname in
+             env#leave, [
+                 Mov (x, eax); (*!!*)
+                 Label env#epilogue;
+                 Mov (ebp, esp);
+                 Pop ebp;
+               ] @
+               env#rest_closure @
+               (if name = "main" then [Binop ("^", eax, eax)] else []) @
+               [Meta "\t.cfi_restore\t6";
+	        Meta (Printf.sprintf "\t.cfi_def_cfa\t7, %d" (if name = "main" then 24 else 8));
+                ret;
+                Meta "\t.cfi_endproc";
+               ] @
+               env#slow_paths @
+               [
+                Meta (Printf.sprintf "\t.set\t%s,\t%d" env#lsize (env#allocated * word_size));
+                Meta (Printf.sprintf "\t.set\t%s,\t%d" env#allocated_size env#allocated);
+                Meta (Printf.sprintf "\t.size %s, .-%s" name name);
+               ]
+
+          | RET ->
+             let x = env#peek in
+             env, [Mov (x, eax); Jmp env#epilogue]
+
+          | (ELEM | CALL (("Lfst" | "Lhd" | "Lsnd" | "Ltl"), 1, _)) when cmd#is_unchecked && env#checked_access <> None ->
+             let Some k = env#checked_access in
+             checked env (match instr with ELEM -> 2 | _ -> 1) k
+
+          | ELEM ->
+             let i, p = env#peek2 in
+             inline env ".elem" 2 (Intrinsic.elem word_size p i)
+
+          | CALL (("Lfst" | "Lhd") as f, 1, _) -> inline env f 1 (Intrinsic.field word_size 0 env#peek)
+          | CALL (("Lsnd" | "Ltl") as f, 1, _) -> inline env f 1 (Intrinsic.field word_size 1 env#peek)
+          | CALL ("Llength", 1, _)             -> inline env "Llength" 1 (Intrinsic.length word_size env#peek)
+          | CALL ("LmatchKey", 1, _)           -> inline env "LmatchKey" 1 (Intrinsic.match_key word_size env#peek)
+
+          | CALL (".array", n, _) when env#frame_object <> None ->
+             let Some base = env#frame_object in
+             let rec pop env acc = function
+             | 0 -> env, acc
+             | k -> let x, env = env#pop in pop env (x :: acc) (k-1)
+             in
+             let env, xs = pop env [] n in
+             in_frame env base Intrinsic.array_tag xs
+
+          | CALL (f, n, tail) -> call env f n tail
+
+          | CALLC (n, tail) -> callc env n tail
+
+          | SEXP (t, n) ->
+             let s, env = env#allocate in
+             let env, code = call env ".sexp" (n+1) false in
+             env, [Mov (L (box (env#hash t)), s)] @ code
+
+          | DROP ->
+             snd env#pop, []
+
+          | DUP  ->
+             let x      = env#peek in
+             let s, env = env#allocate in
+             env, mov x s
+
+          | SWAP ->
+             let x, y = env#peek2 in
+             env, [Push x; Push y; Pop x; Pop y]
+
+          | TAG (t, n)   -> patt env (Intrinsic.sexp_patt word_size (env#hash t) n)
+
+          | ARRAY n      -> patt env (Intrinsic.array_patt word_size n)
+
+          | PATT StrCmp  -> call env ".string_patt" 2 false
+
+          | PATT Boxed   -> patt env (fun x y _ -> Intrinsic.boxed_patt x y)
+          | PATT UnBoxed -> patt env (fun x y _ -> Intrinsic.unboxed_patt x y)
+          | PATT Array   -> patt env (Intrinsic.tag_patt word_size Intrinsic.array_tag)
+          | PATT String  -> patt env (Intrinsic.tag_patt word_size Intrinsic.string_tag)
+          | PATT Sexp    -> patt env (Intrinsic.sexp_tag_patt word_size)
+          | PATT Closure -> patt env (Intrinsic.tag_patt word_size Intrinsic.closure_tag)
+          | LINE (line) ->
+             env#gen_line line
+
+          | FAIL ((line, col), value) ->
+             let v, env = if value then env#peek, env else env#pop in
+             let s, env = env#string cmd#get_infile in
+             env, ccall "Bmatch_failure" [v; M ("$" ^ s); L (box line); L (box col)]
+
+          | i ->
+             invalid_arg (Printf.sprintf "invalid SM insn: %s\n" (GT.show(insn) i))
+        in
+        let env'', code'' = compile' env'#tick scode' in
+	env'', [Meta (Printf.sprintf "# %s / % s" (GT.show(SM.insn) instr) stack)] @ code' @ code''
+  in
+  compile' env code
+
+(* Environment implementation: the symbolic stack is extended with r8-r11, and
+   the closure entries are word-sized *)
+class env frame prg =
+  object (self)
+    inherit X86.env frame prg as super
+
+    method mem_loc x =
+      match x with
+      | Value.Access i -> I (word_size * (i+1), edx)
+      | _              -> super#mem_loc x
+
+    (* the variables get r8-r11, the symbolic stack keeps the rest *)
+    method var_pool = [R 11; R 10; R 9; R 8]
+
+    (* allocates a fresh position on a symbolic stack *)
+    method allocate =
+      let x, n =
+        let rec next r = function
+        | r' :: (r'' :: _ as tl) -> if r = r' then Some r'' else next r tl
+        | _                      -> None
+        in
+        let regs = List.filter (fun r -> not (List.mem r self#used_var_regs)) stack_regs in
+        let rec allocate' = function
+        | []          -> List.hd regs, 0
+        | (S n)::_    -> S (n+1), n+2
+        | (R _ as r)::_ when next r regs <> None ->
+           (match next r regs with Some r' -> r' | None -> assert false), stack_slots
+        | _           -> S static_size, static_size+1
+        in
+        allocate' stack
+      in
+      x, {< stack_slots = max n stack_slots; stack = x::stack >}
+
+  end
+
+(* Generates an assembler text for a program: first compiles the program into
+   the stack code, then generates x86-64 assember code, then prints the assembler file;
+   also returns the interface file with the escape summaries and the bodies of the
+   public functions
+*)
+let genasm cmd prog =
+  let sm        = SM.compile cmd prog in
+  let cfuns     =
+    let _, intfs = Interface.find "Std" cmd#get_include_paths in
+    List.fold_left (fun s -> function `Fun name -> S.add ("L" ^ name) s | _ -> s) S.empty intfs
+  in
+  let frame, summaries =
+    SM.Escape.analyse (SM.Escape.imported cmd#get_include_paths (fst (fst prog))) sm
+  in
+  let frame     = if cmd#get_opt_level > 0 then frame else M.empty in
+  let env, code = compile cmd (new env frame sm) (fst (fst prog)) cfuns sm in
+  let stubs     =
+    List.fold_left (fun s -> function CLOSURE (f, _) when S.mem f cfuns -> S.add f s | _ -> s) S.empty sm
+  in
+  let globals =
+    List.map (fun s -> Meta (Printf.sprintf "\t.globl\t%s" s)) env#publics
+  in
+  let data = [Meta "\t.data"] @
+             (List.map (fun (s, v) -> Meta (Printf.sprintf "%s:\t.string\t\"%s\"" v s)) env#strings) @
+             [Meta "\t.balign\t8";
+              Meta "_init:\t.quad 0";
+              Meta "\t.section custom_data,\"aw\",@progbits";
+              Meta "\t.balign\t8";
+              Meta (Printf.sprintf "filler:\t.fill\t%d, 8, 1" env#max_locals_size)] @
+              (List.concat @@
+                 List.map
+                   (fun s -> [Meta (Printf.sprintf "\t.stabs \"%s:S1\",40,0,0,%s" (String.sub s (String.length "global_") (String.length s - String.length "global_")) s);
+                              Meta (Printf.sprintf "%s:\t.quad\t1" s)])
+                   env#globals
+              )
+  in
+  let asm = Buffer.create 1024 in
+  List.iter
+    (fun i -> Buffer.add_string asm (Printf.sprintf "%s\n" @@ show i))
+    ([Meta (Printf.sprintf "\t.file \"%s\"" cmd#get_absolute_infile);
+      Meta (Printf.sprintf "\t.stabs \"%s\",100,0,0,.Ltext" cmd#get_absolute_infile)] @
+      globals @
+      data @
+      [Meta "\t.text"; Label ".Ltext"; Meta "\t.stabs \"data:t1=r1;0;4294967295;\",128,0,0,0"] @
+      code @
+      (List.concat @@ List.map gen_stub (S.elements stubs)) @
+      [Meta "\t.section .note.GNU-stack,\"\",@progbits"]);
+  Buffer.contents asm,
+  Interface.gen ~escapes:(SM.Escape.exports sm summaries) ~bodies:(SM.Inline.export cmd#get_include_paths sm)
+    ~depends:(if cmd#get_opt_level > 0 then SM.Inline.depends cmd#get_include_paths (fst (fst prog)) else []) prog
+
+(* Builds a program: generates the assembler file and compiles it with the gcc toolchain;
+   the 64-bit objects of the units are named <unit>64.o *)
+let build cmd prog =
+  let find_objects imports paths =
+    let rec iterate acc s = function
+    | []              -> acc
+    | import::imports ->
+       if S.mem import s
+       then iterate acc s imports
+       else
+         let path, intfs = Interface.find import paths in
+         iterate
+           ((Filename.concat path (import ^ "64.o")) :: acc)
+           (S.add import s)
+           ((List.map (function `Import name -> name | _ -> invalid_arg "must not happen") @@
+             List.filter (function `Import _ -> true | _ -> false) intfs) @
+             imports)
+    in
+    iterate [] (S.add "Std" S.empty) imports
+  in
+  let asm, intf = genasm cmd prog in
+  cmd#dump_file "s" asm;
+  cmd#dump_file "i" intf;
+  let inc  = get_std_path () in
+  match cmd#get_mode with
+  | `Default ->
+     SM.Inline.check cmd#get_include_paths (fst @@ fst prog);
+     let objs = find_objects (fst @@ fst prog) cmd#get_include_paths in
+     let buf  = Buffer.create 255 in
+     List.iter (fun o -> Buffer.add_string buf o; Buffer.add_string buf " ") objs;
+     let gcc_cmdline = Printf.sprintf "gcc %s -m64 -no-pie %s %s.s %s %s/%s" cmd#get_debug cmd#get_output_option cmd#basename (Buffer.contents buf) inc (if cmd#is_unchecked then "runtime64_unchecked.a" else "runtime64.a") in
+     Sys.command gcc_cmdline
+  | `Compile ->
+     Sys.command (Printf.sprintf "gcc %s -m64 -c %s.s -o %s64.o" cmd#get_debug cmd#basename cmd#basename)
+  | _ -> invalid_arg "must not happen"